@@ -0,0 +1,129 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "cachecodec.h"
+
+#include <QtCore/QCborStreamWriter>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+Q_DECLARE_METATYPE(const Quotient::CacheCodec*)
+
+class CacheCodecTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void roundTrip_data();
+    void roundTrip();
+    void uncompressedData();
+    void wrongParameters();
+
+private:
+    //! Synthetic rooms to train the dictionary on
+    static constexpr auto RoomCount = 100;
+    static constexpr auto MembersPerRoom = 30;
+
+    QList<QByteArray> rooms;
+    const CacheCodec* trainedCodec = nullptr;
+
+    static QByteArray makeRoom(int roomNumber);
+    static void addCodecRows();
+};
+
+QByteArray CacheCodecTest::makeRoom(int roomNumber)
+{
+    QJsonArray state;
+    for (int i = 0; i < MembersPerRoom; ++i) {
+        // Spread users across rooms so that member lists differ
+        const auto userId =
+            QStringLiteral("@user%1:example.org").arg(roomNumber * 7 + i);
+        const auto avatarUrl =
+            QStringLiteral("mxc://example.org/avatar%1").arg(i);
+        state.append(QJsonObject {
+            { "type"_ls, "m.room.member"_ls },
+            { "event_id"_ls,
+              QStringLiteral("$member%1_%2").arg(roomNumber).arg(i) },
+            { "sender"_ls, userId },
+            { "state_key"_ls, userId },
+            { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + i },
+            { "unsigned"_ls, QJsonObject { { "age"_ls, 1234 + i } } },
+            { "content"_ls,
+              QJsonObject {
+                  { "membership"_ls, i % 5 == 0 ? "leave"_ls : "join"_ls },
+                  { "displayname"_ls, QStringLiteral("User %1").arg(i) },
+                  { "avatar_url"_ls, avatarUrl } } } });
+    }
+    const QJsonObject room {
+        { "state"_ls, QJsonObject { { "events"_ls, state } } },
+        { "summary"_ls,
+          QJsonObject { { "m.joined_member_count"_ls, MembersPerRoom } } }
+    };
+    return QJsonDocument(room).toJson(QJsonDocument::Compact);
+}
+
+void CacheCodecTest::initTestCase()
+{
+    rooms.reserve(RoomCount);
+    for (int i = 0; i < RoomCount; ++i)
+        rooms.push_back(makeRoom(i));
+    trainedCodec = CacheCodec::registerCodec(std::make_unique<DictionaryCodec>(
+        CacheCodec::FirstCustomId,
+        DictionaryCodec::train(rooms)));
+    QVERIFY(trainedCodec != nullptr);
+}
+
+void CacheCodecTest::addCodecRows()
+{
+    QTest::addColumn<const CacheCodec*>("codec");
+    QTest::newRow("uncompressed") << static_cast<const CacheCodec*>(nullptr);
+    QTest::newRow("zlib") << CacheCodec::zlib();
+    QTest::newRow("dictionary") << CacheCodec::dictionary();
+    QTest::newRow("trained dictionary")
+        << CacheCodec::find(CacheCodec::FirstCustomId);
+}
+
+void CacheCodecTest::roundTrip_data() { addCodecRows(); }
+
+void CacheCodecTest::roundTrip()
+{
+    QFETCH(const CacheCodec*, codec);
+    auto data = rooms.front();
+    // The escape byte of DictionaryCodec must survive, too
+    data.append(QByteArray("\xff\xff\x01", 3));
+    const auto packed = CacheCodec::pack(data, codec);
+    QCOMPARE(CacheCodec::isPacked(packed), codec != nullptr);
+    QCOMPARE(CacheCodec::unpack(packed), data);
+
+    QByteArray cbor;
+    QCborStreamWriter writer(&cbor);
+    writer.startMap(1);
+    writer.append("membership"_ls);
+    writer.append(QByteArray("\xff\x00\xff", 3));
+    writer.endMap();
+    QCOMPARE(CacheCodec::unpack(CacheCodec::pack(cbor, codec)), cbor);
+}
+
+void CacheCodecTest::uncompressedData()
+{
+    // Caches saved without compression load as they are
+    const auto& data = rooms.front();
+    QVERIFY(!CacheCodec::isPacked(data));
+    QCOMPARE(CacheCodec::unpack(data), data);
+}
+
+void CacheCodecTest::wrongParameters()
+{
+    const DictionaryCodec otherCodec(CacheCodec::FirstCustomId,
+                                     { "m.room.member", "displayname" });
+    const auto packed = CacheCodec::pack(rooms.front(), &otherCodec);
+    QVERIFY(CacheCodec::isPacked(packed));
+    // The registered codec with this id has a different dictionary
+    QVERIFY(CacheCodec::unpack(packed).isNull());
+}
+
+QTEST_GUILESS_MAIN(CacheCodecTest)
+#include "cachecodectest.moc"
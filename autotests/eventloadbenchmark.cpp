@@ -0,0 +1,68 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "eventmix.h"
+
+#include "events/reactionevent.h"
+#include "events/receiptevent.h"
+#include "events/redactionevent.h"
+#include "events/roommemberevent.h"
+#include "events/roommessageevent.h"
+#include "events/simplestateevents.h"
+#include "events/typingevent.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class EventLoadBenchmark : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void loadEvents_data();
+    void loadEvents();
+    void restoreReleasedJson();
+
+private:
+    QVector<QJsonObject> events;
+};
+
+void EventLoadBenchmark::initTestCase() { events = makeEventMix(); }
+
+void EventLoadBenchmark::loadEvents_data()
+{
+    QTest::addColumn<bool>("useIndex");
+    QTest::newRow("tree walk") << false;
+    QTest::newRow("hash lookup") << true;
+}
+
+void EventLoadBenchmark::loadEvents()
+{
+    QFETCH(bool, useIndex);
+    const auto& metaType = RoomEvent::BaseMetaType;
+    QBENCHMARK {
+        for (const auto& json : events) {
+            const auto type = json[TypeKeyL].toString();
+            const auto event = useIndex
+                                   ? metaType.loadFrom(json, type)
+                                   : metaType.loadFromByTreeWalk(json, type);
+            Q_UNUSED(event)
+        }
+    }
+}
+
+void EventLoadBenchmark::restoreReleasedJson()
+{
+    RoomEvents loaded;
+    for (const auto& json : events)
+        loaded.push_back(loadEvent<RoomEvent>(json));
+    QBENCHMARK {
+        for (const auto& e : loaded) {
+            e->releaseJson();
+            Q_UNUSED(e->contentJson())
+        }
+    }
+}
+
+QTEST_APPLESS_MAIN(EventLoadBenchmark)
+#include "eventloadbenchmark.moc"
@@ -0,0 +1,104 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "eventmix.h"
+
+#include "events/reactionevent.h"
+#include "events/receiptevent.h"
+#include "events/redactionevent.h"
+#include "events/roommemberevent.h"
+#include "events/roommessageevent.h"
+#include "events/simplestateevents.h"
+#include "events/typingevent.h"
+
+#include <QtTest/QtTest>
+
+#include <thread>
+
+using namespace Quotient;
+
+class EventLoadTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void sameTypesAsTreeWalk();
+    void releaseJson();
+    void concurrentRestore();
+
+private:
+    QVector<QJsonObject> events;
+};
+
+void EventLoadTest::initTestCase() { events = makeEventMix(); }
+
+void EventLoadTest::sameTypesAsTreeWalk()
+{
+    for (const auto& json : events) {
+        const auto type = json[TypeKeyL].toString();
+        const auto hashed = Event::BaseMetaType.loadFrom(json, type);
+        const auto walked = Event::BaseMetaType.loadFromByTreeWalk(json, type);
+        QVERIFY(hashed && walked);
+        QCOMPARE(hashed->metaType().className, walked->metaType().className);
+
+        const auto hashedRoomEvent =
+            RoomEvent::BaseMetaType.loadFrom(json, type);
+        const auto walkedRoomEvent =
+            RoomEvent::BaseMetaType.loadFromByTreeWalk(json, type);
+        QCOMPARE(bool(hashedRoomEvent), bool(walkedRoomEvent));
+        if (hashedRoomEvent)
+            QCOMPARE(hashedRoomEvent->metaType().className,
+                     walkedRoomEvent->metaType().className);
+    }
+}
+
+void EventLoadTest::releaseJson()
+{
+    for (const auto& json : events) {
+        const auto event = loadEvent<RoomEvent>(json);
+        const auto id = event->id();
+        event->releaseJson();
+        QVERIFY(event->isJsonReleased());
+        QCOMPARE(event->id(), id); // Decoded fields stay in place
+        QCOMPARE(event->fullJson(), json);
+        QVERIFY(!event->isJsonReleased());
+        // The compact form goes away with the tree rebuilt...
+        QVERIFY(event->releasedJson().isEmpty());
+        // ...and comes back on the next release
+        event->releaseJson();
+        QCOMPARE(QJsonDocument::fromJson(event->releasedJson()).object(),
+                 json);
+    }
+    // Edits go to the tree and discard the stale compact copy
+    const auto event = loadEvent<RoomEvent>(events.front());
+    event->releaseJson();
+    event->setRoomId(QStringLiteral("!edited:example.org"));
+    event->releaseJson();
+    QCOMPARE(event->fullJson()[RoomIdKeyL].toString(),
+             QStringLiteral("!edited:example.org"));
+}
+
+void EventLoadTest::concurrentRestore()
+{
+    RoomEvents loaded;
+    for (const auto& json : events) {
+        loaded.push_back(loadEvent<RoomEvent>(json));
+        loaded.back()->releaseJson();
+    }
+    // Several threads rebuild and read the same events at once
+    std::vector<std::thread> threads;
+    std::atomic<int> mismatches = 0;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([this, &loaded, &mismatches] {
+            for (size_t i = 0; i < loaded.size(); ++i)
+                if (loaded[i]->fullJson() != events[int(i)])
+                    ++mismatches;
+        });
+    for (auto& t : threads)
+        t.join();
+    QCOMPARE(mismatches.load(), 0);
+    for (const auto& e : loaded)
+        QVERIFY(!e->isJsonReleased() && e->releasedJson().isEmpty());
+}
+
+QTEST_APPLESS_MAIN(EventLoadTest)
+#include "eventloadtest.moc"
@@ -0,0 +1,64 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <events/event.h>
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QVector>
+
+//! A mix of event types roughly following what comes in /sync
+inline QVector<QJsonObject> makeEventMix()
+{
+    using namespace Quotient;
+    // A plain integer literal of this size is ambiguous for QJsonValue
+    static constexpr auto BaseTimestamp = Q_INT64_C(1600000000000);
+    const auto makeJson = [](const QString& type, const QJsonObject& content,
+                             const QString& stateKey = {}, int n = 0) {
+        QJsonObject json { { TypeKey, type },
+                           { ContentKey, content },
+                           { EventIdKey, QStringLiteral("$event%1").arg(n) },
+                           { SenderKey, QStringLiteral("@user%1:example.org")
+                                            .arg(n % 50) },
+                           { "origin_server_ts"_ls, BaseTimestamp + n } };
+        if (!stateKey.isNull())
+            json.insert(StateKeyKey, stateKey);
+        return json;
+    };
+    QVector<QJsonObject> events;
+    for (int i = 0; i < 1000; ++i) {
+        const auto userId = QStringLiteral("@user%1:example.org").arg(i % 50);
+        events << makeJson("m.room.message"_ls,
+                           { { "msgtype"_ls, "m.text"_ls },
+                             { "body"_ls, "Hello"_ls } },
+                           {}, i);
+        if (i % 2 == 0)
+            events << makeJson("m.room.member"_ls,
+                               { { "membership"_ls, "join"_ls } }, userId, i);
+        if (i % 5 == 0)
+            events << makeJson("m.reaction"_ls,
+                               { { "m.relates_to"_ls,
+                                   QJsonObject {
+                                       { "rel_type"_ls, "m.annotation"_ls },
+                                       { "event_id"_ls, "$event0"_ls },
+                                       { "key"_ls, "+1"_ls } } } },
+                               {}, i);
+        if (i % 10 == 0) {
+            events << makeJson("m.typing"_ls,
+                               { { "user_ids"_ls, QJsonArray() } });
+            events << makeJson("m.receipt"_ls, {});
+            events << makeJson("m.room.redaction"_ls, {}, {}, i);
+            events << makeJson("m.room.topic"_ls,
+                               { { "topic"_ls, "Topic"_ls } },
+                               QStringLiteral(""), i);
+        }
+        if (i % 20 == 0) {
+            // Unknown types, including a state one
+            events << makeJson("org.example.custom"_ls, {}, {}, i);
+            events << makeJson("org.example.custom.state"_ls, {},
+                               QStringLiteral(""), i);
+        }
+    }
+    return events;
+}
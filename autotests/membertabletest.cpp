@@ -0,0 +1,113 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "membertable.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class MemberTableTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void insertAndReplace();
+    void remove();
+    void namesakes();
+    void powerLevels();
+
+private:
+    StringPool pool;
+
+    MemberTable::Member makeMember(const QString& userId,
+                                   const QString& displayName,
+                                   Membership membership = Membership::Join)
+    {
+        return { pool.intern(userId), displayName, {}, 0, membership };
+    }
+};
+
+void MemberTableTest::insertAndReplace()
+{
+    MemberTable table;
+    QVERIFY(!table.insert(makeMember("@alice:example.org"_ls, "Alice"_ls)));
+    QVERIFY(!table.insert(makeMember("@bob:example.org"_ls, "Bob"_ls,
+                                     Membership::Invite)));
+    QVERIFY(table.size() == 2);
+    QVERIFY(table.count(Membership::Join) == 1);
+    QVERIFY(table.count(Membership::Invite) == 1);
+
+    const auto replaced = table.insert(
+        makeMember("@bob:example.org"_ls, "Bob"_ls, Membership::Join));
+    QVERIFY(replaced.has_value());
+    QCOMPARE(replaced->membership, Membership::Invite);
+    QVERIFY(table.size() == 2);
+    QVERIFY(table.count(Membership::Join) == 2);
+    QVERIFY(table.count(Membership::Invite) == 0);
+
+    const auto* bob = table.find(pool.find("@bob:example.org"_ls));
+    QVERIFY(bob != nullptr);
+    QCOMPARE(bob->displayName, "Bob"_ls);
+    QCOMPARE(bob->membership, Membership::Join);
+    QVERIFY(table.find(pool.intern("@carol:example.org"_ls)) == nullptr);
+}
+
+void MemberTableTest::remove()
+{
+    MemberTable table;
+    for (int i = 0; i < 5; ++i)
+        table.insert(makeMember(QStringLiteral("@user%1:example.org").arg(i),
+                                QStringLiteral("User %1").arg(i)));
+    // Removing a row from the middle moves the last one in its place
+    table.remove(pool.find("@user1:example.org"_ls));
+    QVERIFY(table.size() == 4);
+    QVERIFY(table.find(pool.find("@user1:example.org"_ls)) == nullptr);
+    for (const auto i : { 0, 2, 3, 4 }) {
+        const auto userId = QStringLiteral("@user%1:example.org").arg(i);
+        const auto* member = table.find(pool.find(userId));
+        QVERIFY(member != nullptr);
+        QCOMPARE(member->userId.toString(), userId);
+    }
+    QVERIFY(table.count(Membership::Join) == 4);
+
+    table.remove(pool.intern("@stranger:example.org"_ls));
+    QVERIFY(table.size() == 4);
+    table.clear();
+    QVERIFY(table.empty());
+    QVERIFY(table.count(Membership::Join) == 0);
+}
+
+void MemberTableTest::namesakes()
+{
+    MemberTable table;
+    table.insert(makeMember("@alice1:example.org"_ls, "Alice"_ls));
+    table.insert(makeMember("@alice2:example.org"_ls, "Alice"_ls));
+    table.insert(
+        makeMember("@alice3:example.org"_ls, "Alice"_ls, Membership::Leave));
+    QVERIFY(table.joinedNamesakes("Alice"_ls).size() == 2);
+
+    // Renaming and leaving take the member out of the namesakes
+    table.insert(makeMember("@alice2:example.org"_ls, "Alicia"_ls));
+    QVERIFY(table.joinedNamesakes("Alice"_ls).size() == 1);
+    QVERIFY(table.joinedNamesakes("Alicia"_ls).size() == 1);
+    table.insert(
+        makeMember("@alice1:example.org"_ls, "Alice"_ls, Membership::Ban));
+    QVERIFY(table.joinedNamesakes("Alice"_ls).isEmpty());
+    // Same name, same membership: still indexed exactly once
+    table.insert(makeMember("@alice2:example.org"_ls, "Alicia"_ls));
+    QVERIFY(table.joinedNamesakes("Alicia"_ls).size() == 1);
+}
+
+void MemberTableTest::powerLevels()
+{
+    MemberTable table;
+    table.insert(makeMember("@admin:example.org"_ls, "Admin"_ls));
+    table.insert(makeMember("@user:example.org"_ls, "User"_ls));
+    table.updatePowerLevels([](const QString& userId) {
+        return userId.startsWith("@admin"_ls) ? 100 : 0;
+    });
+    QCOMPARE(table.find(pool.find("@admin:example.org"_ls))->powerLevel, 100);
+    QCOMPARE(table.find(pool.find("@user:example.org"_ls))->powerLevel, 0);
+}
+
+QTEST_GUILESS_MAIN(MemberTableTest)
+#include "membertabletest.moc"
@@ -0,0 +1,165 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <connection.h>
+
+#include <QtCore/QHash>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QPointer>
+#include <QtCore/QUrl>
+#include <QtCore/QUrlQuery>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <QtTest/QSignalSpy>
+
+#include <functional>
+#include <optional>
+
+//! \brief A stand-in homeserver for tests
+//!
+//! Listens on localhost and answers HTTP requests with JSON made by handlers
+//! registered for endpoints. Requests to endpoints without a handler get
+//! M_UNRECOGNIZED, except /account/whoami that returns the user id passed
+//! to the constructor, so that Connection::assumeIdentity() works against
+//! this server. Every request is answered on its own TCP connection.
+class MockHomeserver : public QTcpServer {
+public:
+    struct Request {
+        QByteArray method;
+        QString path;
+        QUrlQuery query;
+        QJsonObject body;
+        QPointer<QTcpSocket> socket;
+    };
+    struct Reply {
+        int status = 200;
+        QJsonObject body {};
+    };
+    //! \brief A handler of requests to a given endpoint
+    //!
+    //! Returning std::nullopt leaves the request hanging, as a long-poll
+    //! would; it can be answered later with reply().
+    using Handler = std::function<std::optional<Reply>(const Request&)>;
+
+    explicit MockHomeserver(QString userId) : userId(std::move(userId))
+    {
+        connect(this, &QTcpServer::newConnection, this, [this] {
+            while (auto* socket = nextPendingConnection())
+                accept(socket);
+        });
+        listen(QHostAddress::LocalHost);
+    }
+
+    QUrl url() const
+    {
+        return QUrl(QStringLiteral("http://127.0.0.1:%1").arg(serverPort()));
+    }
+
+    //! \brief Make a connection logged in to this server
+    //!
+    //! The connection uses the user id passed to the constructor.
+    //! \return the connection, or nullptr if logging in has failed
+    Quotient::Connection* logIn() const
+    {
+        auto* c = new Quotient::Connection(url());
+        QSignalSpy connectedSpy(c, &Quotient::Connection::connected);
+        c->assumeIdentity(userId, QStringLiteral("token"),
+                          QStringLiteral("DEVICE"));
+        if (!connectedSpy.wait()) {
+            delete c;
+            return nullptr;
+        }
+        return c;
+    }
+
+    //! Handle requests with paths ending with \p endpoint
+    void on(const QString& endpoint, Handler handler)
+    {
+        handlers.insert(endpoint, std::move(handler));
+    }
+
+    static void reply(QTcpSocket* socket, const Reply& r)
+    {
+        if (!socket || socket->state() != QAbstractSocket::ConnectedState)
+            return;
+        const auto body =
+            QJsonDocument(r.body).toJson(QJsonDocument::Compact);
+        socket->setProperty(RepliedProperty, true);
+        socket->write("HTTP/1.1 " + QByteArray::number(r.status)
+                      + " Mock\r\nContent-Type: application/json"
+                        "\r\nContent-Length: "
+                      + QByteArray::number(body.size())
+                      + "\r\nConnection: close\r\n\r\n" + body);
+        socket->disconnectFromHost();
+    }
+
+    //! The paths of requests received so far, in the order of arrival
+    QStringList requestedPaths;
+    //! The number of requests the client dropped before getting the reply
+    int droppedRequests = 0;
+
+private:
+    static constexpr auto ReceivedProperty = "mockReceived";
+    static constexpr auto RepliedProperty = "mockReplied";
+
+    QString userId;
+    QHash<QString, Handler> handlers;
+    QHash<QTcpSocket*, QByteArray> buffers;
+
+    void accept(QTcpSocket* socket)
+    {
+        connect(socket, &QTcpSocket::readyRead, this,
+                [this, socket] { read(socket); });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket] {
+            if (socket->property(ReceivedProperty).toBool()
+                && !socket->property(RepliedProperty).toBool())
+                ++droppedRequests;
+            buffers.remove(socket);
+            socket->deleteLater();
+        });
+    }
+
+    void read(QTcpSocket* socket)
+    {
+        auto& buffer = buffers[socket];
+        buffer += socket->readAll();
+        const auto headerEnd = buffer.indexOf("\r\n\r\n");
+        if (headerEnd < 0)
+            return;
+        const auto headerLines = buffer.left(headerEnd).split('\n');
+        qsizetype contentLength = 0;
+        for (const auto& line : headerLines)
+            if (line.toLower().startsWith("content-length:"))
+                contentLength = line.mid(15).trimmed().toLongLong();
+        if (buffer.size() < headerEnd + 4 + contentLength)
+            return; // Wait for the rest of the body
+
+        const auto requestLine = headerLines.front().trimmed().split(' ');
+        const QUrl target(QString::fromLatin1(requestLine.value(1)));
+        const Request request {
+            requestLine.value(0), target.path(), QUrlQuery(target),
+            QJsonDocument::fromJson(buffer.mid(headerEnd + 4, contentLength))
+                .object(),
+            socket
+        };
+        buffers.remove(socket);
+        socket->setProperty(ReceivedProperty, true);
+        requestedPaths << request.path;
+        for (auto it = handlers.cbegin(); it != handlers.cend(); ++it)
+            if (request.path.endsWith(it.key())) {
+                if (const auto r = it.value()(request))
+                    reply(socket, *r);
+                return;
+            }
+        if (request.path.endsWith(QStringLiteral("/account/whoami")))
+            reply(socket, { 200, QJsonObject { { QStringLiteral("user_id"),
+                                                 userId } } });
+        else
+            reply(socket, { 404, QJsonObject { { QStringLiteral("errcode"),
+                                                 QStringLiteral(
+                                                     "M_UNRECOGNIZED") } } });
+    }
+};
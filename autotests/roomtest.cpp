@@ -0,0 +1,547 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "mockhomeserver.h"
+
+#include "connection.h"
+#include "converters.h"
+#include "room.h"
+#include "syncdata.h"
+#include "timelinestore.h"
+
+#include "events/roommemberevent.h"
+#include "events/roommessageevent.h"
+
+#include <QtCore/QCborStreamReader>
+#include <QtCore/QCborStreamWriter>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class RoomTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void cleanupTestCase();
+    void releasedJson();
+    void cacheSnapshotCbor();
+    void evictionCutPoint();
+    void evictionKeepsMarkers();
+    void evictionKeepsState();
+    void stateIndex();
+    void fillGap();
+    void fillGapAfterInsert();
+    void evictionThenLimitedSync();
+
+private:
+    static constexpr auto LocalUserId = "@me:example.org"_ls;
+    static constexpr auto OtherUserId = "@other:example.org"_ls;
+
+    Connection* connection = nullptr;
+    int eventCounter = 0;
+
+    QJsonObject makeMessage(const QString& body,
+                            const QString& sender = OtherUserId);
+    QJsonObject makeMember(const QString& userId,
+                           const QString& membership = "join"_ls);
+    QJsonObject makeTopic(const QString& topic);
+    QJsonArray makeMessages(int count);
+    static QStringList timelineIds(const Room& room);
+    static QStringList ids(std::initializer_list<QJsonArray> batches);
+    static SyncRoomData makeSyncData(const QString& roomId,
+                                     const QJsonArray& timeline,
+                                     const QString& prevBatch = {},
+                                     bool limited = false);
+};
+
+QJsonObject RoomTest::makeMessage(const QString& body, const QString& sender)
+{
+    const auto n = ++eventCounter;
+    return { { TypeKey, RoomMessageEvent::TypeId },
+             { EventIdKey, QStringLiteral("$event%1").arg(n) },
+             { SenderKey, sender },
+             { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + n },
+             { ContentKey, QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                         { "body"_ls, body } } } };
+}
+
+QJsonObject RoomTest::makeMember(const QString& userId,
+                                 const QString& membership)
+{
+    const auto n = ++eventCounter;
+    return { { TypeKey, "m.room.member"_ls },
+             { EventIdKey, QStringLiteral("$event%1").arg(n) },
+             { SenderKey, userId },
+             { StateKeyKey, userId },
+             { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + n },
+             { ContentKey, QJsonObject { { "membership"_ls, membership } } } };
+}
+
+QJsonObject RoomTest::makeTopic(const QString& topic)
+{
+    const auto n = ++eventCounter;
+    return { { TypeKey, "m.room.topic"_ls },
+             { EventIdKey, QStringLiteral("$event%1").arg(n) },
+             { SenderKey, OtherUserId },
+             { StateKeyKey, QString() },
+             { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + n },
+             { ContentKey, QJsonObject { { "topic"_ls, topic } } } };
+}
+
+QJsonArray RoomTest::makeMessages(int count)
+{
+    QJsonArray result;
+    for (int i = 0; i < count; ++i)
+        result.append(makeMessage(QStringLiteral("Message %1").arg(i)));
+    return result;
+}
+
+SyncRoomData RoomTest::makeSyncData(const QString& roomId,
+                                    const QJsonArray& timeline,
+                                    const QString& prevBatch, bool limited)
+{
+    return { roomId, JoinState::Join,
+             QJsonObject { { "timeline"_ls,
+                             QJsonObject { { "events"_ls, timeline },
+                                           { "prev_batch"_ls, prevBatch },
+                                           { "limited"_ls, limited } } } } };
+}
+
+void RoomTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+    connection = Connection::makeMockConnection(LocalUserId);
+}
+
+void RoomTest::cleanupTestCase() { delete connection; }
+
+void RoomTest::releasedJson()
+{
+    connection->setCompactEventStorage(true);
+    Room room(connection, "!compact:example.org"_ls, JoinState::Join);
+    room.updateData(makeSyncData(room.id(),
+                                 { makeMember(OtherUserId),
+                                   makeMessage("Hello"_ls),
+                                   makeMessage("Again"_ls) }));
+    room.updateData(makeSyncData(room.id(), { makeMessage("More"_ls) }));
+    QVERIFY(room.messageEvents().size() == 4);
+    // Processing the events must have happened before releasing their JSON,
+    // and nothing after that should have rebuilt it
+    QVERIFY(room.unreadStats().notableCount == 3);
+    for (const auto& ti : room.messageEvents())
+        QVERIFY2(ti->isJsonReleased(), qPrintable(ti->id()));
+
+    // Saving the room to the cache doesn't rebuild the JSON either
+    const auto cacheJson = room.cacheSnapshot().toJson();
+    QVERIFY(room.messageEvents().front()->isJsonReleased());
+    const auto stateJson =
+        cacheJson["state"_ls].toObject()["events"_ls].toArray();
+    QVERIFY(stateJson.size() == 1);
+    QCOMPARE(stateJson.first()[StateKeyKeyL].toString(), OtherUserId);
+
+    // Reading the event brings the JSON back
+    const auto* msg =
+        eventCast<const RoomMessageEvent>(room.messageEvents().back().get());
+    QVERIFY(msg != nullptr);
+    QCOMPARE(msg->msgtype(), RoomMessageEvent::MsgType::Text);
+    QVERIFY(msg->isJsonReleased());
+    QCOMPARE(msg->plainBody(), "More"_ls);
+    QVERIFY(!msg->isJsonReleased());
+    connection->setCompactEventStorage(false);
+}
+
+void RoomTest::cacheSnapshotCbor()
+{
+    Room room(connection, "!cbor:example.org"_ls, JoinState::Join);
+    // Make some state events released and some not
+    connection->setCompactEventStorage(true);
+    room.updateData(makeSyncData(room.id(),
+                                 { makeMember(OtherUserId),
+                                   makeMember("@third:example.org"_ls),
+                                   makeMessage("Hello"_ls) }));
+    connection->setCompactEventStorage(false);
+    room.updateData(makeSyncData(
+        room.id(), { makeMember("@fourth:example.org"_ls, "invite"_ls) }));
+    const auto snapshot = room.cacheSnapshot();
+    QVERIFY(!snapshot.stateEvents.empty());
+    QVERIFY(!snapshot.releasedStateEvents.empty());
+
+    // Streaming the snapshot gives the same data as building its JSON
+    QByteArray cbor;
+    {
+        QCborStreamWriter writer(&cbor);
+        snapshot.writeCbor(writer);
+    }
+    QCborStreamReader reader(cbor);
+    const auto json = readCborAsJson(reader).toObject();
+    QVERIFY(reader.lastError() == QCborError::NoError);
+    QCOMPARE(json, snapshot.toJson());
+    QVERIFY(json["state"_ls]["events"_ls].toArray().size() == 3);
+}
+
+static QString eventId(const QJsonValue& eventJson)
+{
+    return eventJson[EventIdKeyL].toString();
+}
+
+void RoomTest::evictionCutPoint()
+{
+    // Without a limit on timelines, no tokens are collected inside them,
+    // and nothing can be evicted
+    connection->setTimelineEventLimit(0);
+    Room unlimitedRoom(connection, "!unlimited:example.org"_ls,
+                       JoinState::Join);
+    unlimitedRoom.updateData(
+        makeSyncData(unlimitedRoom.id(), makeMessages(10), "p1"_ls));
+    unlimitedRoom.updateData(
+        makeSyncData(unlimitedRoom.id(), makeMessages(10), "p2"_ls));
+    QCOMPARE(unlimitedRoom.evictOldestEvents(1), 0);
+    QCOMPARE(unlimitedRoom.timelineSize(), 20);
+
+    connection->setTimelineEventLimit(1'000'000);
+    Room room(connection, "!evict:example.org"_ls, JoinState::Join);
+    const auto batch2 = makeMessages(10);
+    room.updateData(makeSyncData(room.id(), makeMessages(10), "p1"_ls));
+    room.updateData(makeSyncData(room.id(), batch2, "p2"_ls));
+    room.updateData(makeSyncData(room.id(), makeMessages(10), "p3"_ls));
+    const auto oldestIndex = room.messageEvents().front().index();
+
+    QSignalSpy evictedSpy(&room, &Room::evictedMessages);
+    // The newest token that keeps 15 events is the one before batch 2
+    QCOMPARE(room.evictOldestEvents(15), 10);
+    QCOMPARE(room.timelineSize(), 20);
+    QCOMPARE(room.messageEvents().front()->id(), eventId(batch2.first()));
+    QCOMPARE(evictedSpy.size(), 1);
+    QVERIFY(evictedSpy.front().at(0).toInt() == oldestIndex);
+    QVERIFY(evictedSpy.front().at(1).toInt() == oldestIndex + 9);
+    // There's no token between batch 2 and the newest 15 events
+    QCOMPARE(room.evictOldestEvents(15), 0);
+    QCOMPARE(room.timelineSize(), 20);
+    connection->setTimelineEventLimit(0);
+}
+
+void RoomTest::evictionKeepsMarkers()
+{
+    connection->setTimelineEventLimit(1'000'000);
+    Room room(connection, "!markers:example.org"_ls, JoinState::Join);
+    const auto batch2 = makeMessages(10);
+    room.updateData(makeSyncData(room.id(), makeMessages(10), "p1"_ls));
+    room.updateData(makeSyncData(room.id(), batch2, "p2"_ls));
+    room.updateData(makeSyncData(room.id(), makeMessages(10), "p3"_ls));
+    const auto fullyReadId = eventId(batch2[5]);
+    const QJsonObject fullyRead {
+        { TypeKey, "m.fully_read"_ls },
+        { ContentKey, QJsonObject { { EventIdKey, fullyReadId } } }
+    };
+    const QJsonObject accountData {
+        { "events"_ls, QJsonArray { fullyRead } }
+    };
+    room.updateData({ room.id(), JoinState::Join,
+                      QJsonObject { { "account_data"_ls, accountData } } });
+    QVERIFY(room.fullyReadMarker() != room.historyEdge());
+    QCOMPARE((*room.fullyReadMarker())->id(), fullyReadId);
+
+    // Only the events before the batch with the marker can go
+    QCOMPARE(room.evictOldestEvents(1), 10);
+    QCOMPARE(room.messageEvents().front()->id(), eventId(batch2.first()));
+    QVERIFY(room.fullyReadMarker() != room.historyEdge());
+    QCOMPARE((*room.fullyReadMarker())->id(), fullyReadId);
+    QCOMPARE(room.evictOldestEvents(1), 0);
+    connection->setTimelineEventLimit(0);
+}
+
+void RoomTest::evictionKeepsState()
+{
+    connection->setTimelineEventLimit(1'000'000);
+    Room room(connection, "!state:example.org"_ls, JoinState::Join);
+    const auto member = makeMember(OtherUserId);
+    auto batch1 = makeMessages(5);
+    batch1.prepend(makeTopic("First"_ls));
+    batch1.prepend(member);
+    auto batch2 = makeMessages(5);
+    batch2.prepend(makeTopic("Second"_ls));
+    room.updateData(makeSyncData(room.id(), batch1, "p1"_ls));
+    room.updateData(makeSyncData(room.id(), batch2, "p2"_ls));
+    QCOMPARE(room.evictOldestEvents(1), 7);
+    QVERIFY(room.findInTimeline(eventId(member)) == room.historyEdge());
+
+    // The evicted member event is still the current state...
+    const auto* memberEvent =
+        room.currentState().get<RoomMemberEvent>(OtherUserId);
+    QVERIFY(memberEvent != nullptr);
+    QCOMPARE(memberEvent->id(), eventId(member));
+    QVERIFY(memberEvent->membership() == Membership::Join);
+    // ...while the evicted topic has been replaced before
+    QCOMPARE(room.topic(), "Second"_ls);
+    // The cache keeps the evicted member event along with the rest
+    const auto stateJson =
+        room.cacheSnapshot().toJson()["state"_ls]["events"_ls].toArray();
+    QVERIFY(std::any_of(stateJson.begin(), stateJson.end(),
+                        [&member](const QJsonValue& v) {
+                            return eventId(v) == eventId(member);
+                        }));
+    connection->setTimelineEventLimit(0);
+}
+
+//! Check that the by-type index of \p state matches its events
+static bool stateIndexInSync(const RoomStateView& state)
+{
+    QHash<QString, QMap<QString, const StateEvent*>> expected;
+    const auto& events = state.events();
+    for (auto it = events.cbegin(); it != events.cend(); ++it)
+        expected[it.key().first].insert(it.key().second, it.value());
+    for (auto it = expected.cbegin(); it != expected.cend(); ++it)
+        if (state.eventsOfType(it.key())
+                != QVector<const StateEvent*>(it->cbegin(), it->cend())
+            || state.countOfType(it.key()) != it->size())
+            return false;
+    return true;
+}
+
+void RoomTest::stateIndex()
+{
+    static constexpr auto ThirdUserId = "@third:example.org"_ls;
+    connection->setTimelineEventLimit(1'000'000);
+    Room room(connection, "!stateindex:example.org"_ls, JoinState::Join);
+    const auto topic = makeTopic("Topic"_ls);
+    auto batch1 = makeMessages(3);
+    batch1.prepend(topic);
+    batch1.prepend(makeMember(ThirdUserId));
+    batch1.prepend(makeMember(OtherUserId));
+    room.updateData(makeSyncData(room.id(), batch1, "p1"_ls));
+    {
+        const auto state = room.currentState();
+        QVERIFY(stateIndexInSync(state));
+        QStringList memberIds;
+        for (const auto* e : state.eventsOfType<RoomMemberEvent>())
+            memberIds << e->userId();
+        QCOMPARE(memberIds, (QStringList { OtherUserId, ThirdUserId }));
+    }
+
+    // A new state event replaces the old one in the index
+    const auto leave = makeMember(OtherUserId, "leave"_ls);
+    room.updateData(makeSyncData(room.id(), { leave }, "p2"_ls));
+    {
+        const auto state = room.currentState();
+        QVERIFY(stateIndexInSync(state));
+        QVERIFY(state.countOfType(RoomMemberEvent::TypeId) == 2);
+        const auto* otherMember =
+            *state.eventsOfType<RoomMemberEvent>().begin();
+        QCOMPARE(otherMember->id(), eventId(leave));
+        QVERIFY(otherMember->membership() == Membership::Leave);
+    }
+
+    // The redacted event object replaces the original one
+    const auto n = ++eventCounter;
+    const QJsonObject redaction {
+        { TypeKey, "m.room.redaction"_ls },
+        { EventIdKey, QStringLiteral("$event%1").arg(n) },
+        { SenderKey, OtherUserId },
+        { "redacts"_ls, eventId(topic) },
+        { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + n },
+        { ContentKey, QJsonObject { { "redacts"_ls, eventId(topic) } } }
+    };
+    room.updateData(makeSyncData(room.id(), { redaction }, "p3"_ls));
+    {
+        const auto state = room.currentState();
+        QVERIFY(stateIndexInSync(state));
+        const auto topics = state.eventsOfType("m.room.topic"_ls);
+        QVERIFY(topics.size() == 1);
+        QCOMPARE(topics.front()->id(), eventId(topic));
+        QVERIFY(topics.front()->isRedacted());
+        QVERIFY(room.topic().isEmpty());
+    }
+
+    // Evicted state events stay in the index, still pointing to live objects
+    room.updateData(makeSyncData(room.id(), makeMessages(5), "p4"_ls));
+    QVERIFY(room.evictOldestEvents(1) > 0);
+    QVERIFY(room.findInTimeline(eventId(topic)) == room.historyEdge());
+    {
+        const auto state = room.currentState();
+        QVERIFY(stateIndexInSync(state));
+        std::vector<std::pair<QString, Membership>> members;
+        for (const auto* e : state.eventsOfType<RoomMemberEvent>())
+            members.emplace_back(e->userId(), e->membership());
+        QVERIFY((members
+                 == std::vector<std::pair<QString, Membership>> {
+                     { OtherUserId, Membership::Leave },
+                     { ThirdUserId, Membership::Join } }));
+    }
+    connection->setTimelineEventLimit(0);
+}
+
+QStringList RoomTest::timelineIds(const Room& room)
+{
+    QStringList result;
+    for (const auto& ti : room.messageEvents())
+        result << ti->id();
+    return result;
+}
+
+QStringList RoomTest::ids(std::initializer_list<QJsonArray> batches)
+{
+    QStringList result;
+    for (const auto& batch : batches)
+        for (const auto& e : batch)
+            result << eventId(e);
+    return result;
+}
+
+static MockHomeserver::Reply messagesReply(const QString& from,
+                                           const QString& to,
+                                           const QJsonArray& chunk)
+{
+    return { 200, QJsonObject { { "start"_ls, from },
+                                { "end"_ls, to },
+                                { "chunk"_ls, chunk } } };
+}
+
+void RoomTest::fillGap()
+{
+    MockHomeserver server(LocalUserId);
+    const auto batchA = makeMessages(5);
+    const auto missing = makeMessages(4);
+    const auto batchB = makeMessages(5);
+    server.on("/messages"_ls, [&](const MockHomeserver::Request& request)
+                                  -> std::optional<MockHomeserver::Reply> {
+        const auto from = request.query.queryItemValue("from"_ls);
+        if (from == "pB"_ls)
+            return messagesReply(from, "pM"_ls, { missing[3], missing[2] });
+        // The last page reaches the events before the gap
+        return messagesReply(from, "pA"_ls,
+                             { missing[1], missing[0], batchA[4] });
+    });
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    Room room(c.get(), "!gaps:example.org"_ls, JoinState::Join);
+    room.updateData(makeSyncData(room.id(), batchA, "pA"_ls));
+    room.updateData(makeSyncData(room.id(), batchB, "pB"_ls, true));
+    const auto frontIndex = room.messageEvents().front().index();
+    const auto gapIndex = room.findInTimeline(eventId(batchB[0]))->index();
+    QCOMPARE(room.timelineGaps(), QVector<TimelineItem::index_t> { gapIndex });
+
+    QSignalSpy insertSpy(&room, &Room::aboutToInsertMessages);
+    room.fillGap(gapIndex, 2);
+    QTRY_COMPARE(insertSpy.size(), 1);
+    QVERIFY(insertSpy.front().front().toInt() == gapIndex);
+    const QJsonArray twoMissing { missing[2], missing[3] };
+    QCOMPARE(timelineIds(room), ids({ batchA, twoMissing, batchB }));
+    // The events at and after the gap keep their indices, those before it
+    // are moved down
+    QVERIFY(room.findInTimeline(eventId(batchB[0]))->index() == gapIndex);
+    QVERIFY(room.messageEvents().front().index() == frontIndex - 2);
+    QVERIFY(room.findInTimeline(eventId(missing[2]))->index() == gapIndex - 2);
+    // The rest of the gap is before the inserted events
+    QCOMPARE(room.timelineGaps(),
+             QVector<TimelineItem::index_t> { gapIndex - 2 });
+
+    room.fillGap(gapIndex - 2, 3);
+    QTRY_COMPARE(insertSpy.size(), 2);
+    QCOMPARE(timelineIds(room), ids({ batchA, missing, batchB }));
+    QVERIFY(room.messageEvents().front().index() == frontIndex - 4);
+    QVERIFY(room.timelineGaps().isEmpty());
+}
+
+void RoomTest::fillGapAfterInsert()
+{
+    MockHomeserver server(LocalUserId);
+    // Events are made in the order of their timestamps
+    const auto batchA = makeMessages(3);
+    const auto missing = makeMessages(2);
+    const auto batchB = makeMessages(3);
+    const auto context = QJsonArray { makeMessage("Context"_ls) };
+    const auto batchC = makeMessages(3);
+    QPointer<QTcpSocket> pendingFill;
+    server.on("/messages"_ls, [&pendingFill](
+                                  const MockHomeserver::Request& request)
+                                  -> std::optional<MockHomeserver::Reply> {
+        pendingFill = request.socket;
+        return std::nullopt;
+    });
+    server.on("/context/"_ls + eventId(context[0]),
+              [&context](const MockHomeserver::Request&)
+                  -> std::optional<MockHomeserver::Reply> {
+                  return MockHomeserver::Reply {
+                      200, QJsonObject { { "start"_ls, "pX0"_ls },
+                                         { "end"_ls, "pX1"_ls },
+                                         { "event"_ls, context[0] },
+                                         { "events_before"_ls, QJsonArray() },
+                                         { "events_after"_ls, QJsonArray() } }
+                  };
+              });
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    Room room(c.get(), "!gaps:example.org"_ls, JoinState::Join);
+    room.updateData(makeSyncData(room.id(), batchA, "pA"_ls));
+    room.updateData(makeSyncData(room.id(), batchB, "pB"_ls, true));
+    room.updateData(makeSyncData(room.id(), batchC, "pC"_ls, true));
+    const auto gapIndex = room.findInTimeline(eventId(batchB[0]))->index();
+    QVERIFY(room.timelineGaps().size() == 2);
+
+    room.fillGap(gapIndex, 2);
+    QTRY_VERIFY(pendingFill);
+    // The context goes into the later gap, moving the gap being filled down
+    QSignalSpy contextSpy(&room, &Room::eventContextLoaded);
+    room.loadEventContext(eventId(context[0]));
+    QTRY_COMPARE(contextSpy.size(), 1);
+    QCOMPARE(timelineIds(room), ids({ batchA, batchB, context, batchC }));
+    QVERIFY(room.findInTimeline(eventId(batchB[0]))->index() == gapIndex - 1);
+    QVERIFY(room.timelineGaps().size() == 3);
+
+    // The filling events still go before the event after the gap
+    MockHomeserver::reply(pendingFill, messagesReply("pB"_ls, "pM"_ls,
+                                                     { missing[1],
+                                                       missing[0] }));
+    QTRY_COMPARE(timelineIds(room),
+                 ids({ batchA, missing, batchB, context, batchC }));
+    QVERIFY(room.findInTimeline(eventId(batchB[0]))->index() == gapIndex - 1);
+    QVERIFY(room.findInTimeline(eventId(missing[0]))->index()
+            == gapIndex - 3);
+    QVERIFY(room.timelineGaps().size() == 3);
+}
+
+void RoomTest::evictionThenLimitedSync()
+{
+    MockHomeserver server(LocalUserId);
+    QStringList requestedFrom;
+    const auto batch1 = makeMessages(5);
+    const auto batch2 = makeMessages(5);
+    const auto batch3 = makeMessages(5);
+    const auto batch4 = makeMessages(3);
+    server.on("/messages"_ls, [&](const MockHomeserver::Request& request)
+                                  -> std::optional<MockHomeserver::Reply> {
+        const auto from = request.query.queryItemValue("from"_ls);
+        requestedFrom.push_back(from);
+        return messagesReply(from, "p1"_ls,
+                             { batch2[2], batch2[1], batch2[0] });
+    });
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    c->stateCacheDir().removeRecursively();
+    c->setStoreTimelines(true);
+    c->setTimelineEventLimit(1'000'000);
+    auto* store = c->timelineStore();
+    QVERIFY(store);
+    Room room(c.get(), "!evictstore:example.org"_ls, JoinState::Join);
+    room.updateData(makeSyncData(room.id(), batch1, "p1"_ls));
+    room.updateData(makeSyncData(room.id(), batch2, "p2"_ls));
+    room.updateData(makeSyncData(room.id(), batch3, "p3"_ls));
+    QTRY_VERIFY(store->contains(room.id(), eventId(batch3[4])));
+
+    // The stored events can be evicted past the token before batch 2...
+    QCOMPARE(room.evictOldestEvents(7), 8);
+    QCOMPARE(room.messageEvents().front()->id(), eventId(batch2[3]));
+    // ...but once a gap makes the store start over, the history is loaded
+    // from the server from that token rather than the one before batch 1
+    room.updateData(makeSyncData(room.id(), batch4, "p4"_ls, true));
+    QTRY_VERIFY(!store->contains(room.id(), eventId(batch2[3])));
+    room.getPreviousContent(3);
+    QTRY_COMPARE(room.messageEvents().front()->id(), eventId(batch2[0]));
+    QCOMPARE(requestedFrom, QStringList { "p2"_ls });
+    QCOMPARE(timelineIds(room), ids({ batch2, batch3, batch4 }));
+    c->setTimelineEventLimit(0);
+    c->stateCacheDir().removeRecursively();
+}
+
+QTEST_GUILESS_MAIN(RoomTest)
+#include "roomtest.moc"
@@ -0,0 +1,332 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "mockhomeserver.h"
+
+#include "room.h"
+#include "slidingsync.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class SlidingSyncTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void requestBody();
+    void syncWindow();
+    void moveRoomToTop();
+    void extendWindow();
+    void convertRoomData();
+    void initialAndLeftRooms();
+    void runAgainstServer();
+    void unknownPos();
+
+private:
+    static constexpr auto UserId = "@me:example.org"_ls;
+
+    static QJsonObject memberEvent(const QString& userId,
+                                   const QString& membership)
+    {
+        return {
+            { "type"_ls, "m.room.member"_ls },
+            { "event_id"_ls, QStringLiteral("$%1-%2").arg(membership, userId) },
+            { "sender"_ls, userId },
+            { "state_key"_ls, userId },
+            { "origin_server_ts"_ls, Q_INT64_C(1600000000000) },
+            { "content"_ls, QJsonObject { { "membership"_ls, membership } } }
+        };
+    }
+    static QJsonObject roomTimeline(const QJsonArray& events,
+                                    bool initial = false)
+    {
+        return { { "timeline"_ls, events }, { "initial"_ls, initial } };
+    }
+    static QJsonObject listResponse(int count, const QJsonArray& ops)
+    {
+        return { { "pos"_ls, "1"_ls },
+                 { "lists"_ls,
+                   QJsonObject { { "all"_ls, QJsonObject { { "count"_ls, count },
+                                                           { "ops"_ls, ops } } } } } };
+    }
+    static QJsonArray roomIds(int from, int to)
+    {
+        QJsonArray ids;
+        for (int i = from; i <= to; ++i)
+            ids.append(QStringLiteral("!room%1:example.org").arg(i));
+        return ids;
+    }
+};
+
+void SlidingSyncTest::requestBody()
+{
+    SlidingSync ss(nullptr);
+    ss.setWindowSize(5);
+    ss.subscribeToRoom(QStringLiteral("!subscribed:example.org"));
+    const auto body = ss.requestBody();
+    const auto list = body["lists"_ls]["all"_ls].toObject();
+    QCOMPARE(list["ranges"_ls].toArray(),
+             (QJsonArray { QJsonArray { 0, 4 } }));
+    QCOMPARE(list["timeline_limit"_ls].toInt(), SlidingSync::DefaultTimelineLimit);
+    QVERIFY(body["room_subscriptions"_ls].toObject().contains(
+        "!subscribed:example.org"_ls));
+}
+
+void SlidingSyncTest::syncWindow()
+{
+    SlidingSync ss(nullptr);
+    ss.setWindowSize(5);
+    QSignalSpy spy(&ss, &SlidingSync::roomListChanged);
+    // The server knows about 5000 rooms but only sends the window
+    ss.processResponse(listResponse(
+        5000, { QJsonObject { { "op"_ls, "SYNC"_ls },
+                              { "range"_ls, QJsonArray { 0, 4 } },
+                              { "room_ids"_ls, roomIds(0, 4) } } }));
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(ss.totalRoomCount(), 5000);
+    QVERIFY(ss.roomIds().size() == 5);
+    QCOMPARE(ss.roomIds().front(), QStringLiteral("!room0:example.org"));
+    QCOMPARE(ss.roomIds().back(), QStringLiteral("!room4:example.org"));
+}
+
+void SlidingSyncTest::moveRoomToTop()
+{
+    SlidingSync ss(nullptr);
+    ss.setWindowSize(5);
+    ss.processResponse(listResponse(
+        5000, { QJsonObject { { "op"_ls, "SYNC"_ls },
+                              { "range"_ls, QJsonArray { 0, 4 } },
+                              { "room_ids"_ls, roomIds(0, 4) } } }));
+    // A new message in room 3 moves it to the top
+    ss.processResponse(listResponse(
+        5000, { QJsonObject { { "op"_ls, "DELETE"_ls }, { "index"_ls, 3 } },
+                QJsonObject { { "op"_ls, "INSERT"_ls },
+                              { "index"_ls, 0 },
+                              { "room_id"_ls, "!room3:example.org"_ls } } }));
+    const QStringList expected { QStringLiteral("!room3:example.org"),
+                                 QStringLiteral("!room0:example.org"),
+                                 QStringLiteral("!room1:example.org"),
+                                 QStringLiteral("!room2:example.org"),
+                                 QStringLiteral("!room4:example.org") };
+    QCOMPARE(ss.roomIds(), expected);
+    // A room from outside the window pushes the last one out
+    ss.processResponse(listResponse(
+        5000, { QJsonObject { { "op"_ls, "DELETE"_ls }, { "index"_ls, 4000 } },
+                QJsonObject { { "op"_ls, "INSERT"_ls },
+                              { "index"_ls, 0 },
+                              { "room_id"_ls, "!room4000:example.org"_ls } } }));
+    QVERIFY(ss.roomIds().size() == 5);
+    QCOMPARE(ss.roomIds().front(), QStringLiteral("!room4000:example.org"));
+    QCOMPARE(ss.roomIds().back(), QStringLiteral("!room2:example.org"));
+}
+
+void SlidingSyncTest::extendWindow()
+{
+    SlidingSync ss(nullptr);
+    ss.setWindowSize(5);
+    ss.processResponse(listResponse(
+        5000, { QJsonObject { { "op"_ls, "SYNC"_ls },
+                              { "range"_ls, QJsonArray { 0, 4 } },
+                              { "room_ids"_ls, roomIds(0, 4) } } }));
+    ss.extendWindow(5);
+    QCOMPARE(ss.windowSize(), 10);
+    QCOMPARE(ss.requestBody()["lists"_ls]["all"_ls]["ranges"_ls].toArray(),
+             (QJsonArray { QJsonArray { 0, 9 } }));
+    ss.processResponse(listResponse(
+        5000, { QJsonObject { { "op"_ls, "SYNC"_ls },
+                              { "range"_ls, QJsonArray { 5, 9 } },
+                              { "room_ids"_ls, roomIds(5, 9) } } }));
+    QVERIFY(ss.roomIds().size() == 10);
+    QCOMPARE(ss.roomIds().at(9), QStringLiteral("!room9:example.org"));
+}
+
+void SlidingSyncTest::convertRoomData()
+{
+    const QJsonObject member {
+        { "type"_ls, "m.room.member"_ls },
+        { "event_id"_ls, "$member"_ls },
+        { "sender"_ls, "@alice:example.org"_ls },
+        { "state_key"_ls, "@alice:example.org"_ls },
+        { "origin_server_ts"_ls, Q_INT64_C(1600000000000) },
+        { "content"_ls, QJsonObject { { "membership"_ls, "join"_ls } } }
+    };
+    const QJsonObject message {
+        { "type"_ls, "m.room.message"_ls },
+        { "event_id"_ls, "$message"_ls },
+        { "sender"_ls, "@alice:example.org"_ls },
+        { "origin_server_ts"_ls, Q_INT64_C(1600000000001) },
+        { "content"_ls, QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                      { "body"_ls, "Hi"_ls } } }
+    };
+    const auto rd = SlidingSync::roomDataFromJson(
+        QStringLiteral("!room:example.org"),
+        { { "required_state"_ls, QJsonArray { member } },
+          { "timeline"_ls, QJsonArray { message } },
+          { "limited"_ls, true },
+          { "prev_batch"_ls, "t1"_ls },
+          { "notification_count"_ls, 3 },
+          { "highlight_count"_ls, 1 },
+          { "joined_count"_ls, 2 } });
+    QCOMPARE(rd.joinState, JoinState::Join);
+    QCOMPARE(rd.state.size(), size_t(1));
+    QCOMPARE(rd.timeline.size(), size_t(1));
+    QCOMPARE(rd.timeline.front()->id(), QStringLiteral("$message"));
+    QVERIFY(rd.timelineLimited);
+    QCOMPARE(rd.timelinePrevBatch, QStringLiteral("t1"));
+    QCOMPARE(rd.unreadCount.value_or(0), 3);
+    QCOMPARE(rd.highlightCount.value_or(0), 1);
+    QCOMPARE(rd.summary.joinedMemberCount.value_or(0), 2);
+
+    const auto invite = SlidingSync::roomDataFromJson(
+        QStringLiteral("!invite:example.org"),
+        { { "invite_state"_ls, QJsonArray { member } } });
+    QCOMPARE(invite.joinState, JoinState::Invite);
+    QCOMPARE(invite.state.size(), size_t(1));
+}
+
+void SlidingSyncTest::initialAndLeftRooms()
+{
+    const auto roomId = QStringLiteral("!room:example.org");
+    const QJsonArray joined { memberEvent(UserId, "join"_ls) };
+    // An initial view of the room may not connect to the known timeline
+    QVERIFY(SlidingSync::roomDataFromJson(roomId, roomTimeline(joined, true))
+                .timelineLimited);
+    QVERIFY(!SlidingSync::roomDataFromJson(roomId, { { "timeline"_ls, joined },
+                                                     { "initial"_ls, true },
+                                                     { "limited"_ls, false } })
+                 .timelineLimited);
+    QVERIFY(!SlidingSync::roomDataFromJson(roomId, roomTimeline(joined))
+                 .timelineLimited);
+
+    const QJsonArray left { memberEvent(UserId, "join"_ls),
+                            memberEvent(UserId, "leave"_ls) };
+    QCOMPARE(SlidingSync::roomDataFromJson(roomId, { { "timeline"_ls, left } },
+                                           UserId)
+                 .joinState,
+             JoinState::Leave);
+    QCOMPARE(SlidingSync::roomDataFromJson(
+                 roomId, { { "required_state"_ls,
+                             QJsonArray { memberEvent(UserId, "ban"_ls) } } },
+                 UserId)
+                 .joinState,
+             JoinState::Leave);
+    // Someone else leaving doesn't make the room left
+    QCOMPARE(SlidingSync::roomDataFromJson(
+                 roomId,
+                 { { "timeline"_ls,
+                     QJsonArray { memberEvent("@other:example.org"_ls,
+                                              "leave"_ls) } } },
+                 UserId)
+                 .joinState,
+             JoinState::Join);
+}
+
+void SlidingSyncTest::runAgainstServer()
+{
+    MockHomeserver server(UserId);
+    const auto roomId = QStringLiteral("!room0:example.org");
+    QVector<MockHomeserver::Request> requests;
+    server.on("/org.matrix.msc3575/sync"_ls,
+              [&requests, &roomId](const MockHomeserver::Request& request)
+                  -> std::optional<MockHomeserver::Reply> {
+                  requests.push_back(request);
+                  if (request.query.hasQueryItem("pos"_ls))
+                      return std::nullopt; // Long-poll, answered by the test
+                  // Start of the session: the room list and the room
+                  auto response = listResponse(
+                      1, { QJsonObject { { "op"_ls, "SYNC"_ls },
+                                         { "range"_ls, QJsonArray { 0, 0 } },
+                                         { "room_ids"_ls,
+                                           QJsonArray { roomId } } } });
+                  const QJsonArray events { memberEvent(UserId, "join"_ls) };
+                  const auto roomJson = roomTimeline(events, true);
+                  response.insert("rooms"_ls,
+                                  QJsonObject { { roomId, roomJson } });
+                  return MockHomeserver::Reply { 200, response };
+              });
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    SlidingSync ss(c.get());
+    ss.setWindowSize(1);
+    QSignalSpy syncedSpy(&ss, &SlidingSync::synced);
+    ss.start(5000);
+    QVERIFY(ss.isRunning());
+
+    QVERIFY(syncedSpy.wait());
+    QCOMPARE(ss.roomIds(), QStringList { roomId });
+    QTRY_VERIFY(c->room(roomId) != nullptr);
+    // The loop goes on with a long-poll from the returned position
+    QTRY_COMPARE(requests.size(), 2);
+    QCOMPARE(requests[1].query.queryItemValue("pos"_ls), "1"_ls);
+    QCOMPARE(requests[1].query.queryItemValue("timeout"_ls), "5000"_ls);
+
+    // Changing the window abandons the long-poll and resends the request
+    ss.setWindowSize(2);
+    QTRY_COMPARE(requests.size(), 3);
+    QTRY_COMPARE(server.droppedRequests, 1);
+    QCOMPARE(requests[2].query.queryItemValue("pos"_ls), "1"_ls);
+    QCOMPARE(requests[2].body["lists"_ls]["all"_ls]["ranges"_ls].toArray(),
+             (QJsonArray { QJsonArray { 0, 1 } }));
+
+    // The room is left in the next response
+    const QJsonArray leave { memberEvent(UserId, "leave"_ls) };
+    MockHomeserver::reply(
+        requests[2].socket,
+        { 200, { { "pos"_ls, "2"_ls },
+                 { "rooms"_ls,
+                   QJsonObject { { roomId, roomTimeline(leave) } } } } });
+    QVERIFY(syncedSpy.wait());
+    QTRY_VERIFY(c->room(roomId, JoinState::Leave) != nullptr);
+    QCOMPARE(c->room(roomId, JoinState::Leave)->joinState(), JoinState::Leave);
+    QTRY_COMPARE(requests.size(), 4);
+    QCOMPARE(requests[3].query.queryItemValue("pos"_ls), "2"_ls);
+
+    ss.stop();
+    QVERIFY(!ss.isRunning());
+    QTRY_COMPARE(server.droppedRequests, 2);
+    QVERIFY(requests.size() == 4); // No new requests after stopping
+}
+
+void SlidingSyncTest::unknownPos()
+{
+    MockHomeserver server(UserId);
+    QStringList positions;
+    const auto startResponse = listResponse(
+        1, { QJsonObject { { "op"_ls, "SYNC"_ls },
+                           { "range"_ls, QJsonArray { 0, 0 } },
+                           { "room_ids"_ls, roomIds(0, 0) } } });
+    server.on("/org.matrix.msc3575/sync"_ls,
+              [&positions, &startResponse](
+                  const MockHomeserver::Request& request)
+                  -> std::optional<MockHomeserver::Reply> {
+                  const auto pos = request.query.queryItemValue("pos"_ls);
+                  positions << pos;
+                  if (pos.isEmpty())
+                      return MockHomeserver::Reply { 200, startResponse };
+                  // The first position expires; the next one long-polls
+                  if (positions.count(pos) == 1)
+                      return MockHomeserver::Reply {
+                          400, { { "errcode"_ls, "M_UNKNOWN_POS"_ls } }
+                      };
+                  return std::nullopt;
+              });
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    SlidingSync ss(c.get());
+    ss.setWindowSize(1);
+    QSignalSpy errorSpy(&ss, &SlidingSync::syncError);
+    QSignalSpy listSpy(&ss, &SlidingSync::roomListChanged);
+    ss.start(5000);
+
+    // The session starts over instead of stopping, and resumes the loop
+    QTRY_COMPARE(positions, (QStringList { {}, "1"_ls, {}, "1"_ls }));
+    QVERIFY(ss.isRunning());
+    QVERIFY(errorSpy.isEmpty());
+    QCOMPARE(ss.roomIds(), QStringList { roomIds(0, 0)[0].toString() });
+    // Filled, emptied on the reset and filled again
+    QCOMPARE(listSpy.size(), 3);
+    ss.stop();
+}
+
+QTEST_GUILESS_MAIN(SlidingSyncTest)
+#include "slidingsynctest.moc"
@@ -0,0 +1,84 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "startuptrace.h"
+
+#include <QtCore/QJsonArray>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+using namespace std::chrono_literals;
+
+class StartupTraceTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void mergeRecords();
+    void finish();
+    void toJson();
+};
+
+void StartupTraceTest::mergeRecords()
+{
+    const auto t0 = StartupTrace::clock::now();
+    StartupTrace trace;
+    trace.record(StartupTrace::CacheIndexRead, t0, 1, t0 + 5ms);
+    // Two rooms parsed in parallel, then one more
+    trace.record(StartupTrace::RoomCacheParse, t0 + 5ms, 1, t0 + 7ms);
+    trace.record(StartupTrace::RoomCacheParse, t0 + 5ms, 1, t0 + 8ms);
+    trace.record(StartupTrace::RoomCacheParse, t0 + 10ms, 1, t0 + 11ms);
+    trace.record(StartupTrace::KeychainLoad, t0 - 2ms, 1, t0);
+
+    const auto phases = trace.phases();
+    QVERIFY(phases.size() == 3);
+    QCOMPARE(phases[0].id, StartupTrace::KeychainLoad);
+    QVERIFY(phases[0].start.count() == 0);
+    QCOMPARE(phases[1].id, StartupTrace::CacheIndexRead);
+    QVERIFY(phases[1].start.count() == 2000);
+    const auto& parse = phases[2];
+    QCOMPARE(parse.id, StartupTrace::RoomCacheParse);
+    QVERIFY(parse.start.count() == 7000);
+    QVERIFY(parse.end.count() == 13000);
+    QVERIFY(parse.busy.count() == 6000);
+    QVERIFY(parse.count == 3);
+    QVERIFY(trace.duration().count() == 13000);
+}
+
+void StartupTraceTest::finish()
+{
+    const auto t0 = StartupTrace::clock::now();
+    StartupTrace trace;
+    trace.record(StartupTrace::FirstSyncRequest, t0, 1, t0 + 100ms);
+    trace.finish();
+    QVERIFY(trace.isFinished());
+    trace.record(StartupTrace::RoomUpdate, t0 + 200ms, 1, t0 + 300ms);
+    QVERIFY(trace.phases().size() == 1);
+
+    trace.reset();
+    QVERIFY(!trace.isFinished());
+    QVERIFY(trace.phases().empty());
+    QVERIFY(trace.duration().count() == 0);
+}
+
+void StartupTraceTest::toJson()
+{
+    const auto t0 = StartupTrace::clock::now();
+    StartupTrace trace;
+    trace.record(StartupTrace::E2eeSessionLoad, t0, 42, t0 + 1500us);
+    trace.finish();
+
+    const auto json = trace.toJson();
+    QCOMPARE(json["finished"_ls].toBool(), true);
+    QCOMPARE(json["duration_ms"_ls].toDouble(), 1.5);
+    QVERIFY(json["started_at"_ls].toDouble() > 0);
+    const auto phasesJson = json["phases"_ls].toArray();
+    QVERIFY(phasesJson.size() == 1);
+    const auto phase = phasesJson.first().toObject();
+    QCOMPARE(phase["name"_ls].toString(), QStringLiteral("e2ee_session_load"));
+    QCOMPARE(phase["start_ms"_ls].toDouble(), 0.0);
+    QCOMPARE(phase["end_ms"_ls].toDouble(), 1.5);
+    QCOMPARE(phase["busy_ms"_ls].toDouble(), 1.5);
+    QCOMPARE(phase["count"_ls].toInt(), 42);
+}
+
+QTEST_GUILESS_MAIN(StartupTraceTest)
+#include "startuptracetest.moc"
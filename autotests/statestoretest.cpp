@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "statestore.h"
+#include "syncdata.h"
+
+#include <QtCore/QJsonDocument>
+#include <QtCore/QTemporaryDir>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class StateStoreTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void init();
+    void putAndLoad();
+    void replaceInPlace();
+    void growAndCompact();
+    void reopen_data();
+    void reopen();
+    void brokenRecord();
+    void staleRecord();
+
+private:
+    QTemporaryDir dir;
+    QString storeFileName;
+
+    static QJsonObject roomJson(int bodySize)
+    {
+        return { { "summary"_ls,
+                   QJsonObject { { "m.joined_member_count"_ls, 2 } } },
+                 { "body"_ls, QString(bodySize, QLatin1Char('x')) } };
+    }
+    static QByteArray dump(const QJsonObject& json)
+    {
+        return QJsonDocument(json).toJson(QJsonDocument::Compact);
+    }
+};
+
+void StateStoreTest::init()
+{
+    QVERIFY(dir.isValid());
+    storeFileName = dir.filePath(
+        QStringLiteral("%1_%2.qss")
+            .arg(QLatin1String(QTest::currentTestFunction()),
+                 QLatin1String(QTest::currentDataTag())));
+}
+
+void StateStoreTest::putAndLoad()
+{
+    StateStore store;
+    QVERIFY(store.open(storeFileName));
+    const auto roomId = QStringLiteral("!room:example.org");
+    QVERIFY(!store.contains(roomId));
+    QCOMPARE(store.version(roomId), quint64(0));
+    QVERIFY(store.loadJson(roomId).isEmpty());
+
+    QVERIFY(store.put(roomId, dump(roomJson(10))));
+    QVERIFY(store.contains(roomId));
+    QCOMPARE(store.version(roomId), quint64(1));
+    QCOMPARE(store.loadJson(roomId), roomJson(10));
+
+    QVERIFY(store.remove(roomId));
+    QVERIFY(!store.contains(roomId));
+    QVERIFY(store.loadJson(roomId).isEmpty());
+}
+
+void StateStoreTest::replaceInPlace()
+{
+    StateStore store;
+    QVERIFY(store.open(storeFileName));
+    const auto roomId = QStringLiteral("!room:example.org");
+    QVERIFY(store.put(roomId, dump(roomJson(100))));
+    const auto sizeBefore = store.fileSize();
+    // Slightly larger data still fits the slot
+    QVERIFY(store.put(roomId, dump(roomJson(110))));
+    QCOMPARE(store.fileSize(), sizeBefore);
+    QCOMPARE(store.wastedBytes(), qint64(0));
+    QCOMPARE(store.version(roomId), quint64(2));
+    QCOMPARE(store.loadJson(roomId), roomJson(110));
+}
+
+void StateStoreTest::growAndCompact()
+{
+    StateStore store;
+    QVERIFY(store.open(storeFileName));
+    const auto roomId = QStringLiteral("!room:example.org");
+    const auto otherRoomId = QStringLiteral("!other:example.org");
+    QVERIFY(store.put(roomId, dump(roomJson(100))));
+    QVERIFY(store.put(otherRoomId, dump(roomJson(100))));
+    // Too large for the slot: the record is moved to the end of the file
+    QVERIFY(store.put(roomId, dump(roomJson(1000))));
+    QVERIFY(store.wastedBytes() > 0);
+    QCOMPARE(store.version(roomId), quint64(2));
+    QCOMPARE(store.loadJson(roomId), roomJson(1000));
+
+    const auto sizeBefore = store.fileSize();
+    QVERIFY(store.compact());
+    QCOMPARE(store.wastedBytes(), qint64(0));
+    QVERIFY(store.fileSize() < sizeBefore);
+    QCOMPARE(store.version(roomId), quint64(2));
+    QCOMPARE(store.loadJson(roomId), roomJson(1000));
+    QCOMPARE(store.loadJson(otherRoomId), roomJson(100));
+}
+
+void StateStoreTest::reopen_data()
+{
+    QTest::addColumn<bool>("withIndex");
+    QTest::newRow("with index") << true;
+    QTest::newRow("scanning") << false;
+}
+
+void StateStoreTest::reopen()
+{
+    QFETCH(bool, withIndex);
+    const auto roomId = QStringLiteral("!room:example.org");
+    const auto otherRoomId = QStringLiteral("!other:example.org");
+    {
+        StateStore store;
+        QVERIFY(store.open(storeFileName));
+        QVERIFY(store.put(roomId, dump(roomJson(100))));
+        QVERIFY(store.put(otherRoomId, dump(roomJson(100))));
+        QVERIFY(store.put(roomId, dump(roomJson(1000))));
+        if (withIndex)
+            QVERIFY(store.commit());
+    }
+    StateStore store;
+    QVERIFY(store.open(storeFileName));
+    QVERIFY(store.roomIds().size() == 2);
+    QCOMPARE(store.version(roomId), quint64(2));
+    QCOMPARE(store.loadJson(roomId), roomJson(1000));
+    QCOMPARE(store.loadJson(otherRoomId), roomJson(100));
+    QVERIFY(store.wastedBytes() > 0);
+}
+
+void StateStoreTest::brokenRecord()
+{
+    const auto roomId = QStringLiteral("!room:example.org");
+    const auto otherRoomId = QStringLiteral("!other:example.org");
+    {
+        StateStore store;
+        QVERIFY(store.open(storeFileName));
+        QVERIFY(store.put(roomId, dump(roomJson(100))));
+        QVERIFY(store.put(otherRoomId, dump(roomJson(100))));
+    }
+    // Damage the state of the first room, as a torn write would
+    QFile file { storeFileName };
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    const auto contents = file.readAll();
+    const auto pos = contents.indexOf("xxxxxxxxxx");
+    QVERIFY(pos > 0 && pos < contents.indexOf(otherRoomId.toUtf8()));
+    QVERIFY(file.seek(pos));
+    QVERIFY(file.write("yyyy") == 4);
+    file.close();
+
+    StateStore store;
+    QVERIFY(store.open(storeFileName));
+    QVERIFY(store.contains(roomId));
+    QVERIFY(store.loadJson(roomId).isEmpty());
+    QCOMPARE(store.loadJson(otherRoomId), roomJson(100));
+}
+
+void StateStoreTest::staleRecord()
+{
+    const auto roomId = QStringLiteral("!room:example.org");
+    StateStore store;
+    QVERIFY(store.open(storeFileName));
+    QVERIFY(store.put(roomId, dump(roomJson(10))));
+    // The cache index has been saved after a newer state of the room that
+    // didn't make it to the store
+    const SyncRoomData indexEntry(
+        roomId, JoinState::Join,
+        QJsonObject { { StateStore::VersionKey, 2 } });
+    QCOMPARE(indexEntry.cachedStateVersion, quint64(2));
+    QVERIFY(!SyncData::loadCachedRoom(dir.path(), roomId, JoinState::Join,
+                                      &store, indexEntry.cachedStateVersion));
+
+    QVERIFY(store.put(roomId, dump(roomJson(10))));
+    const auto roomData =
+        SyncData::loadCachedRoom(dir.path(), roomId, JoinState::Join, &store,
+                                 indexEntry.cachedStateVersion);
+    QVERIFY(roomData.has_value());
+    QVERIFY(roomData->summary.joinedMemberCount == 2);
+}
+
+QTEST_GUILESS_MAIN(StateStoreTest)
+#include "statestoretest.moc"
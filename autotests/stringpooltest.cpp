@@ -0,0 +1,79 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "stringpool.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+// Build ids at runtime so that equal ones don't share data upfront
+static QString makeId(const char* name)
+{
+    return QStringLiteral("@%1:example.org").arg(QLatin1String(name));
+}
+
+class StringPoolTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void intern();
+    void find();
+    void collect();
+};
+
+void StringPoolTest::intern()
+{
+    StringPool pool;
+    const auto id1 = pool.intern(makeId("alice"));
+    const auto id2 = pool.intern(makeId("alice"));
+    const auto other = pool.intern("@bob:example.org"_ls);
+    QVERIFY(id1 == id2);
+    QVERIFY(id1 != other);
+    QCOMPARE(qHash(id1), qHash(id2));
+    QVERIFY(id1.toString().constData() == id2.toString().constData());
+    QCOMPARE(id1.toString(), "@alice:example.org"_ls);
+    QVERIFY(pool.size() == 2);
+
+    QVERIFY(pool.intern({}).isNull());
+    QVERIFY(pool.intern(""_ls).isNull());
+    QVERIFY(pool.size() == 2);
+}
+
+void StringPoolTest::find()
+{
+    StringPool pool;
+    const auto id = pool.intern("@alice:example.org"_ls);
+    QVERIFY(pool.find(makeId("alice")) == id);
+    QVERIFY(pool.find("@bob:example.org"_ls).isNull());
+    QVERIFY(pool.size() == 1); // find() doesn't add anything
+}
+
+void StringPoolTest::collect()
+{
+    StringPool pool;
+    auto kept = pool.intern(makeId("alice"));
+    QString keptCopy;
+    {
+        const auto copied = pool.intern(makeId("bob"));
+        keptCopy = copied.toString();
+        pool.intern(makeId("carol"));
+    }
+    QVERIFY(pool.size() == 3);
+    // Only Carol's id is not referenced outside the pool
+    QVERIFY(pool.collect() == 1);
+    QVERIFY(pool.size() == 2);
+    QVERIFY(pool.find("@carol:example.org"_ls).isNull());
+    QVERIFY(pool.find("@alice:example.org"_ls) == kept);
+    QVERIFY(!pool.find("@bob:example.org"_ls).isNull());
+
+    kept = {};
+    keptCopy.clear();
+    QVERIFY(pool.collect() == 2);
+    QVERIFY(pool.size() == 0);
+    // A string interned anew after collection is equal to itself again
+    const auto reinterned = pool.intern("@alice:example.org"_ls);
+    QVERIFY(reinterned == pool.find("@alice:example.org"_ls));
+}
+
+QTEST_GUILESS_MAIN(StringPoolTest)
+#include "stringpooltest.moc"
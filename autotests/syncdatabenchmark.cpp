@@ -0,0 +1,342 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "cachecodec.h"
+#include "connection.h"
+#include "room.h"
+#include "syncdata.h"
+
+#include <QtCore/QCborStreamReader>
+#include <QtCore/QCborStreamWriter>
+#include <QtCore/QCborValue>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QThreadPool>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+Q_DECLARE_METATYPE(const Quotient::CacheCodec*)
+
+class SyncDataBenchmark : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void parseSyncResponse_data();
+    void parseSyncResponse();
+    void parallelSpeedup();
+    void loadCache_data();
+    void loadCache();
+    void readCbor_data();
+    void readCbor();
+    void writeCbor_data();
+    void writeCbor();
+    void writeRoomCache_data();
+    void writeRoomCache();
+    void loadPackedCache_data();
+    void loadPackedCache();
+
+private:
+    static constexpr auto RoomCount = 3000;
+    static constexpr auto EventsPerRoom = 50;
+
+    QTemporaryDir cacheDir;
+    QJsonObject syncResponse;
+    QByteArray syncResponseCbor;
+
+    static QJsonObject makeRoom(int roomNumber);
+    //! A room with the state only, as saved to the cache
+    static QByteArray makeCachedRoom(int roomNumber);
+};
+
+QJsonObject SyncDataBenchmark::makeRoom(int roomNumber)
+{
+    const auto roomId = QStringLiteral("!room%1:example.org").arg(roomNumber);
+    QJsonArray state;
+    QJsonArray timeline;
+    for (int i = 0; i < EventsPerRoom; ++i) {
+        const auto userId = QStringLiteral("@user%1:example.org").arg(i);
+        state.append(QJsonObject {
+            { "type"_ls, "m.room.member"_ls },
+            { "event_id"_ls, QStringLiteral("$member%1_%2").arg(roomNumber).arg(i) },
+            { "sender"_ls, userId },
+            { "state_key"_ls, userId },
+            { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + i },
+            { "content"_ls, QJsonObject { { "membership"_ls, "join"_ls },
+                                          { "displayname"_ls, userId } } } });
+        timeline.append(QJsonObject {
+            { "type"_ls, "m.room.message"_ls },
+            { "event_id"_ls, QStringLiteral("$msg%1_%2").arg(roomNumber).arg(i) },
+            { "sender"_ls, userId },
+            { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + i },
+            { "content"_ls, QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                          { "body"_ls, roomId } } } });
+    }
+    return { { "state"_ls, QJsonObject { { "events"_ls, state } } },
+             { "timeline"_ls, QJsonObject { { "events"_ls, timeline } } } };
+}
+
+QByteArray SyncDataBenchmark::makeCachedRoom(int roomNumber)
+{
+    static constexpr auto MembersPerRoom = 30;
+    QJsonArray state;
+    for (int i = 0; i < MembersPerRoom; ++i) {
+        // Spread users across rooms so that member lists differ
+        const auto userId =
+            QStringLiteral("@user%1:example.org").arg(roomNumber * 7 + i);
+        const auto avatarUrl =
+            QStringLiteral("mxc://example.org/avatar%1").arg(i);
+        state.append(QJsonObject {
+            { "type"_ls, "m.room.member"_ls },
+            { "event_id"_ls,
+              QStringLiteral("$member%1_%2").arg(roomNumber).arg(i) },
+            { "sender"_ls, userId },
+            { "state_key"_ls, userId },
+            { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + i },
+            { "unsigned"_ls, QJsonObject { { "age"_ls, 1234 + i } } },
+            { "content"_ls,
+              QJsonObject {
+                  { "membership"_ls, i % 5 == 0 ? "leave"_ls : "join"_ls },
+                  { "displayname"_ls, QStringLiteral("User %1").arg(i) },
+                  { "avatar_url"_ls, avatarUrl } } } });
+    }
+    const QJsonObject room {
+        { "state"_ls, QJsonObject { { "events"_ls, state } } },
+        { "summary"_ls,
+          QJsonObject { { "m.joined_member_count"_ls, MembersPerRoom } } }
+    };
+    return QJsonDocument(room).toJson(QJsonDocument::Compact);
+}
+
+void SyncDataBenchmark::initTestCase()
+{
+    QVERIFY(cacheDir.isValid());
+    QJsonObject inlineRooms;
+    QJsonObject cachedRooms;
+    for (int i = 0; i < RoomCount; ++i) {
+        const auto roomId = QStringLiteral("!room%1:example.org").arg(i);
+        const auto roomJson = makeRoom(i);
+        inlineRooms.insert(roomId, roomJson);
+        cachedRooms.insert(roomId, QJsonValue::Null);
+
+        QFile roomFile { cacheDir.filePath(SyncData::fileNameForRoom(roomId)) };
+        QVERIFY(roomFile.open(QFile::WriteOnly));
+        roomFile.write(QJsonDocument(roomJson).toJson(QJsonDocument::Compact));
+    }
+    syncResponse = { { "next_batch"_ls, "s1"_ls },
+                     { "rooms"_ls, QJsonObject { { "join"_ls, inlineRooms } } } };
+    syncResponseCbor = QCborValue::fromJsonValue(syncResponse).toCbor();
+
+    QFile stateFile { cacheDir.filePath(QStringLiteral("state.json")) };
+    QVERIFY(stateFile.open(QFile::WriteOnly));
+    stateFile.write(
+        QJsonDocument(
+            QJsonObject {
+                { "cache_version"_ls,
+                  QJsonObject { { "major"_ls, SyncData::MajorCacheVersion } } },
+                { "next_batch"_ls, "s1"_ls },
+                { "rooms"_ls, QJsonObject { { "join"_ls, cachedRooms } } } })
+            .toJson(QJsonDocument::Compact));
+}
+
+void SyncDataBenchmark::parseSyncResponse_data()
+{
+    QTest::addColumn<bool>("parallel");
+    QTest::newRow("sequential") << false;
+    QTest::newRow("parallel") << true;
+}
+
+void SyncDataBenchmark::parseSyncResponse()
+{
+    QFETCH(bool, parallel);
+    QBENCHMARK {
+        SyncData data;
+        if (parallel)
+            data.setThreadPool(QThreadPool::globalInstance());
+        data.parseJson(syncResponse);
+        QCOMPARE(data.takeRoomData().size(), size_t(RoomCount));
+    }
+}
+
+void SyncDataBenchmark::parallelSpeedup()
+{
+    // Take the best of a few runs to filter out warm-up and scheduling noise
+    const auto bestParseTime = [this](QThreadPool* pool) {
+        qint64 best = std::numeric_limits<qint64>::max();
+        for (int i = 0; i < 3; ++i) {
+            QElapsedTimer et;
+            et.start();
+            SyncData data;
+            data.setThreadPool(pool);
+            data.parseJson(syncResponse);
+            best = std::min(best, et.nsecsElapsed());
+            if (data.takeRoomData().size() != size_t(RoomCount))
+                return qint64(-1);
+        }
+        return best;
+    };
+    const auto sequential = bestParseTime(nullptr);
+    const auto parallel = bestParseTime(QThreadPool::globalInstance());
+    QVERIFY(sequential > 0 && parallel > 0);
+    qInfo().nospace() << "Parsing " << RoomCount << " rooms: "
+                      << sequential / 1000000 << " ms sequentially, "
+                      << parallel / 1000000 << " ms with "
+                      << QThreadPool::globalInstance()->maxThreadCount()
+                      << " threads; speedup "
+                      << double(sequential) / double(parallel);
+}
+
+void SyncDataBenchmark::loadCache_data() { parseSyncResponse_data(); }
+
+void SyncDataBenchmark::loadCache()
+{
+    QFETCH(bool, parallel);
+    QBENCHMARK {
+        SyncData data { cacheDir.filePath(QStringLiteral("state.json")),
+                        parallel ? QThreadPool::globalInstance() : nullptr };
+        QVERIFY(data.unresolvedRooms().isEmpty());
+        QCOMPARE(data.takeRoomData().size(), size_t(RoomCount));
+    }
+}
+
+void SyncDataBenchmark::readCbor_data()
+{
+    QTest::addColumn<bool>("streaming");
+    QTest::newRow("QCborValue") << false;
+    QTest::newRow("streaming") << true;
+}
+
+void SyncDataBenchmark::readCbor()
+{
+    QFETCH(bool, streaming);
+    QJsonObject json;
+    QBENCHMARK {
+        if (streaming) {
+            QCborStreamReader reader(syncResponseCbor);
+            json = readCborAsJson(reader).toObject();
+        } else
+            json = QCborValue::fromCbor(syncResponseCbor).toJsonValue().toObject();
+    }
+    QCOMPARE(json, syncResponse);
+}
+
+void SyncDataBenchmark::writeCbor_data() { readCbor_data(); }
+
+void SyncDataBenchmark::writeCbor()
+{
+    QFETCH(bool, streaming);
+    QByteArray data;
+    QBENCHMARK {
+        if (streaming) {
+            data.clear();
+            QCborStreamWriter writer(&data);
+            writeJsonAsCbor(writer, syncResponse);
+        } else
+            data = QCborValue::fromJsonValue(syncResponse).toCbor();
+    }
+    QCOMPARE(QCborValue::fromCbor(data).toJsonValue().toObject(), syncResponse);
+}
+
+void SyncDataBenchmark::writeRoomCache_data()
+{
+    QTest::addColumn<bool>("streaming");
+    QTest::newRow("toJson+writeJsonAsCbor") << false;
+    QTest::newRow("writeCbor") << true;
+}
+
+void SyncDataBenchmark::writeRoomCache()
+{
+    static constexpr auto MemberCount = 20000;
+    QFETCH(bool, streaming);
+    const std::unique_ptr<Connection> connection {
+        Connection::makeMockConnection("@me:example.org"_ls)
+    };
+    // Released state events are where writeCbor() saves the most, parsing
+    // them one at a time instead of all at once
+    connection->setCompactEventStorage(true);
+    Room room(connection.get(), "!large:example.org"_ls, JoinState::Join);
+    QJsonArray members;
+    for (int i = 0; i < MemberCount; ++i) {
+        const auto userId = QStringLiteral("@user%1:example.org").arg(i);
+        members.append(QJsonObject {
+            { "type"_ls, "m.room.member"_ls },
+            { "event_id"_ls, QStringLiteral("$member%1").arg(i) },
+            { "sender"_ls, userId },
+            { "state_key"_ls, userId },
+            { "origin_server_ts"_ls, Q_INT64_C(1600000000000) + i },
+            { "content"_ls, QJsonObject { { "membership"_ls, "join"_ls },
+                                          { "displayname"_ls, userId } } } });
+    }
+    room.updateData(
+        { room.id(), JoinState::Join,
+          QJsonObject { { "timeline"_ls,
+                          QJsonObject { { "events"_ls, members } } } } });
+    const auto snapshot = room.cacheSnapshot();
+
+    QByteArray data;
+    QBENCHMARK {
+        data.clear();
+        QCborStreamWriter writer(&data);
+        if (streaming)
+            snapshot.writeCbor(writer);
+        else
+            writeJsonAsCbor(writer, snapshot.toJson());
+    }
+    qInfo().nospace() << "Room cache of " << MemberCount << " members: "
+                      << data.size() << " bytes";
+}
+
+void SyncDataBenchmark::loadPackedCache_data()
+{
+    QTest::addColumn<const CacheCodec*>("codec");
+    QTest::newRow("uncompressed") << static_cast<const CacheCodec*>(nullptr);
+    QTest::newRow("zlib") << CacheCodec::zlib();
+    QTest::newRow("dictionary") << CacheCodec::dictionary();
+}
+
+void SyncDataBenchmark::loadPackedCache()
+{
+    // About as many rooms as in a large account
+    static constexpr auto PackedRoomCount = 5000;
+    QFETCH(const CacheCodec*, codec);
+    const QDir dir { cacheDir.filePath(
+        QString::fromLatin1(QTest::currentDataTag())) };
+    QVERIFY(dir.mkpath("."_ls));
+    QJsonObject cachedRooms;
+    qint64 rawSize = 0;
+    qint64 packedSize = 0;
+    for (int i = 0; i < PackedRoomCount; ++i) {
+        const auto roomId = QStringLiteral("!packed%1:example.org").arg(i);
+        cachedRooms.insert(roomId, QJsonValue::Null);
+        const auto room = makeCachedRoom(i);
+        const auto packed = CacheCodec::pack(room, codec);
+        rawSize += room.size();
+        packedSize += packed.size();
+        QFile roomFile { dir.filePath(SyncData::fileNameForRoom(roomId)) };
+        QVERIFY(roomFile.open(QFile::WriteOnly));
+        roomFile.write(packed);
+    }
+    const auto stateFileName = dir.filePath(QStringLiteral("state.json"));
+    QFile stateFile { stateFileName };
+    QVERIFY(stateFile.open(QFile::WriteOnly));
+    stateFile.write(
+        QJsonDocument(
+            QJsonObject {
+                { "cache_version"_ls,
+                  QJsonObject { { "major"_ls, SyncData::MajorCacheVersion } } },
+                { "next_batch"_ls, "s1"_ls },
+                { "rooms"_ls, QJsonObject { { "join"_ls, cachedRooms } } } })
+            .toJson(QJsonDocument::Compact));
+    stateFile.close();
+    qInfo().nospace() << PackedRoomCount << " rooms: " << packedSize / 1024
+                      << " KiB on disk, " << packedSize * 100 / rawSize
+                      << "% of the uncompressed size";
+
+    QBENCHMARK {
+        SyncData data { stateFileName };
+        QVERIFY(data.unresolvedRooms().isEmpty());
+        QCOMPARE(data.takeRoomData().size(), size_t(PackedRoomCount));
+    }
+}
+
+QTEST_GUILESS_MAIN(SyncDataBenchmark)
+#include "syncdatabenchmark.moc"
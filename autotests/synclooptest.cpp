@@ -0,0 +1,293 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "mockhomeserver.h"
+
+#include "connection.h"
+#include "room.h"
+#include "slidingsync.h"
+#include "syncdata.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class SyncLoopTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void pipelinedOrdering();
+    void pipelinedBacklog();
+    void roomRecovery();
+    void saveWithBacklog();
+    void lazyRoomRecovery();
+
+private:
+    static constexpr auto UserId = "@me:example.org"_ls;
+    static constexpr auto RoomId = "!room:example.org"_ls;
+
+    static QJsonObject makeBatch(int number, int eventCount);
+    static QStringList eventIds(int batchCount, int eventCount);
+    static QStringList timelineIds(const Room* room);
+    //! A cache for \p c that lists RoomId without having its state
+    static bool writeBrokenCache(const Connection& c);
+    //! Serve \p batchCount batches, then hang as a long-poll with no news
+    static void serveBatches(MockHomeserver& server, int batchCount,
+                             int eventCount, QStringList& sinceTokens);
+};
+
+void SyncLoopTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+QJsonObject SyncLoopTest::makeBatch(int number, int eventCount)
+{
+    QJsonArray events;
+    for (int e = 1; e <= eventCount; ++e) {
+        const auto id = QStringLiteral("$%1-%2").arg(number).arg(e);
+        events.append(QJsonObject {
+            { TypeKey, "m.room.message"_ls },
+            { EventIdKey, id },
+            { SenderKey, "@other:example.org"_ls },
+            { "origin_server_ts"_ls,
+              Q_INT64_C(1600000000000) + number * 100 + e },
+            { ContentKey, QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                        { "body"_ls, id } } } });
+    }
+    const QJsonObject roomJson {
+        { "timeline"_ls, QJsonObject { { "events"_ls, events } } }
+    };
+    return { { "next_batch"_ls, QStringLiteral("s%1").arg(number) },
+             { "rooms"_ls,
+               QJsonObject { { "join"_ls,
+                               QJsonObject { { RoomId, roomJson } } } } } };
+}
+
+QStringList SyncLoopTest::eventIds(int batchCount, int eventCount)
+{
+    QStringList result;
+    for (int b = 1; b <= batchCount; ++b)
+        for (int e = 1; e <= eventCount; ++e)
+            result << QStringLiteral("$%1-%2").arg(b).arg(e);
+    return result;
+}
+
+QStringList SyncLoopTest::timelineIds(const Room* room)
+{
+    QStringList result;
+    if (room)
+        for (const auto& ti : room->messageEvents())
+            result << ti->id();
+    return result;
+}
+
+bool SyncLoopTest::writeBrokenCache(const Connection& c)
+{
+    auto cacheDir = c.stateCacheDir();
+    cacheDir.removeRecursively();
+    if (!cacheDir.mkpath("."_ls))
+        return false;
+    QFile stateFile(cacheDir.filePath("state.json"_ls));
+    const QJsonObject stateJson {
+        { "cache_version"_ls,
+          QJsonObject { { "major"_ls, SyncData::MajorCacheVersion } } },
+        { "next_batch"_ls, "s1"_ls },
+        { "rooms"_ls,
+          QJsonObject { { "join"_ls,
+                          QJsonObject { { RoomId, QJsonObject {} } } } } }
+    };
+    return stateFile.open(QIODevice::WriteOnly)
+           && stateFile.write(QJsonDocument(stateJson).toJson()) >= 0;
+}
+
+void SyncLoopTest::serveBatches(MockHomeserver& server, int batchCount,
+                                int eventCount, QStringList& sinceTokens)
+{
+    server.on("/sync"_ls, [batchCount, eventCount, &sinceTokens](
+                              const MockHomeserver::Request& request)
+                              -> std::optional<MockHomeserver::Reply> {
+        const auto since = request.query.queryItemValue("since"_ls);
+        sinceTokens << since;
+        const auto served = since.isEmpty() ? 0 : since.mid(1).toInt();
+        if (served == batchCount)
+            return std::nullopt;
+        return MockHomeserver::Reply { 200,
+                                       makeBatch(served + 1, eventCount) };
+    });
+}
+
+void SyncLoopTest::pipelinedOrdering()
+{
+    static constexpr auto BatchCount = 4;
+    static constexpr auto EventCount = 3;
+    MockHomeserver server(UserId);
+    QStringList sinceTokens;
+    serveBatches(server, BatchCount, EventCount, sinceTokens);
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    c->setPipelinedSync(true);
+
+    int batchesDone = 0;
+    bool nextSyncAlwaysAhead = true;
+    connect(c.get(), &Connection::syncDone, this, [&] {
+        ++batchesDone;
+        // The next request must have been sent before processing the batch
+        nextSyncAlwaysAhead &= c->syncJob() != nullptr;
+    });
+    c->syncLoop(0);
+
+    QTRY_COMPARE(sinceTokens.size(), BatchCount + 1);
+    QCOMPARE(sinceTokens,
+             (QStringList { {}, "s1"_ls, "s2"_ls, "s3"_ls, "s4"_ls }));
+    QCOMPARE(batchesDone, BatchCount);
+    QVERIFY(nextSyncAlwaysAhead);
+    // Batches arriving ahead of processing are still applied in order
+    QTRY_COMPARE(timelineIds(c->room(RoomId)),
+                 eventIds(BatchCount, EventCount));
+    c->stopSync();
+}
+
+void SyncLoopTest::pipelinedBacklog()
+{
+    static constexpr auto BatchCount = 3;
+    static constexpr auto EventCount = 3;
+    MockHomeserver server(UserId);
+    QStringList sinceTokens;
+    serveBatches(server, BatchCount, EventCount, sinceTokens);
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    c->setPipelinedSync(true);
+    // Every batch exceeds the limit on its own
+    c->setSyncBacklogEventLimit(EventCount - 1);
+
+    QSignalSpy throttledSpy(c.get(), &Connection::syncThrottledChanged);
+    bool noSyncOverBacklog = true;
+    connect(c.get(), &Connection::syncDone, this, [&] {
+        // The request sent ahead of the batch must be taken back
+        // if the batch has pushed the backlog over the limit
+        if (c->roomUpdateScheduler()->pendingEvents()
+            > c->syncBacklogEventLimit())
+            noSyncOverBacklog &= c->syncJob() == nullptr;
+    });
+    c->syncLoop(0);
+
+    QTRY_COMPARE(timelineIds(c->room(RoomId)),
+                 eventIds(BatchCount, EventCount));
+    QVERIFY(noSyncOverBacklog);
+    // The loop has paused and resumed after each batch
+    QVERIFY(throttledSpy.size() >= 2 * BatchCount);
+    QTRY_VERIFY(!c->isSyncThrottled());
+    // Requests taken back are repeated with the same token, never skipped
+    QTRY_COMPARE(sinceTokens.last(), QStringLiteral("s%1").arg(BatchCount));
+    for (int i = 1; i < sinceTokens.size(); ++i)
+        QVERIFY(sinceTokens[i - 1].mid(1).toInt()
+                <= sinceTokens[i].mid(1).toInt());
+    c->stopSync();
+}
+
+void SyncLoopTest::roomRecovery()
+{
+    // A user of its own, so that other cases don't leave a cache for it
+    MockHomeserver server("@recovering:example.org"_ls);
+    int recoveryAttempts = 0;
+    server.on("/sync"_ls, [&recoveryAttempts](
+                              const MockHomeserver::Request& request)
+                              -> std::optional<MockHomeserver::Reply> {
+        const auto since = request.query.queryItemValue("since"_ls);
+        if (since.isEmpty()) {
+            // Only the recovery sync goes without a token; fail it once
+            if (++recoveryAttempts == 1)
+                return MockHomeserver::Reply {
+                    400, QJsonObject { { "errcode"_ls, "M_UNKNOWN"_ls } }
+                };
+            return MockHomeserver::Reply { 200, makeBatch(1, 2) };
+        }
+        if (since == "s1"_ls)
+            return MockHomeserver::Reply { 200, makeBatch(2, 2) };
+        return std::nullopt;
+    });
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+
+    QVERIFY(writeBrokenCache(*c));
+    c->loadState();
+    c->syncLoop(0);
+    // The loop data for the room arriving before and between the attempts
+    // is held, then goes after the recovered data
+    QTRY_COMPARE_WITH_TIMEOUT(timelineIds(c->room(RoomId)),
+                              eventIds(2, 2), 10000);
+    QCOMPARE(recoveryAttempts, 2);
+    c->stopSync();
+    c->stateCacheDir().removeRecursively();
+}
+
+void SyncLoopTest::saveWithBacklog()
+{
+    MockHomeserver server("@saving:example.org"_ls);
+    QStringList sinceTokens;
+    serveBatches(server, 1, 3, sinceTokens);
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    auto cacheDir = c->stateCacheDir();
+    cacheDir.removeRecursively();
+    c->setPipelinedSync(true);
+
+    bool queuedBeforeSave = false;
+    QStringList savedTimeline;
+    connect(c.get(), &Connection::syncDone, this, [&] {
+        if (!savedTimeline.isEmpty())
+            return;
+        // The batch is only queued by now, and the next request is in flight
+        queuedBeforeSave = c->roomUpdateScheduler()->queueDepth() > 0
+                           && c->syncJob() != nullptr;
+        c->saveState();
+        savedTimeline = timelineIds(c->room(RoomId));
+    });
+    c->syncLoop(0);
+    QTRY_VERIFY(!savedTimeline.isEmpty());
+    QVERIFY(queuedBeforeSave);
+    // The rooms saved are up to date with the token saved along with them
+    QCOMPARE(savedTimeline, eventIds(1, 3));
+    const auto statePath = cacheDir.filePath("state.json"_ls);
+    QTRY_COMPARE(SyncData::loadCacheIndex(statePath).nextBatch(), "s1"_ls);
+    c->stopSync();
+    cacheDir.removeRecursively();
+}
+
+void SyncLoopTest::lazyRoomRecovery()
+{
+    MockHomeserver server("@lazyrecovering:example.org"_ls);
+    server.on("/sync"_ls, [](const MockHomeserver::Request& request)
+                              -> std::optional<MockHomeserver::Reply> {
+        // Only the recovery sync is expected here
+        if (request.query.queryItemValue("since"_ls).isEmpty())
+            return MockHomeserver::Reply { 200, makeBatch(1, 2) };
+        return std::nullopt;
+    });
+    const std::unique_ptr<Connection> c { server.logIn() };
+    QVERIFY(c);
+    QVERIFY(writeBrokenCache(*c));
+    c->setLazyRoomLoading(true);
+    c->loadState();
+    QVERIFY(c->room(RoomId) && !c->room(RoomId)->isFullyLoaded());
+
+    // New data for the room arrives before the background loader gets to it,
+    // so it's loaded on the spot; the cache turns out broken. Sliding sync
+    // feeds room data synchronously, unlike SyncJob
+    SlidingSync ss(c.get());
+    const auto batch = makeBatch(2, 2)["rooms"_ls]["join"_ls][RoomId];
+    ss.processResponse(
+        { { "pos"_ls, "1"_ls },
+          { "rooms"_ls,
+            QJsonObject { { RoomId,
+                            QJsonObject { { "timeline"_ls,
+                                            batch["timeline"_ls]["events"_ls]
+                                                .toArray() } } } } } });
+    // The new data waits for the recovered state and goes after it
+    QTRY_COMPARE(timelineIds(c->room(RoomId)), eventIds(2, 2));
+    c->stateCacheDir().removeRecursively();
+}
+
+QTEST_GUILESS_MAIN(SyncLoopTest)
+#include "synclooptest.moc"
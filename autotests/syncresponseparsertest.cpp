@@ -0,0 +1,99 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "jobs/syncresponseparser.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class SyncResponseParserTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void chunkedFeed_data();
+    void chunkedFeed();
+    void truncated();
+    void trailingGarbage();
+
+private:
+    std::vector<SyncRoomData> rooms;
+    SyncResponseParser parser { [this](SyncRoomData&& roomData) {
+        rooms.push_back(std::move(roomData));
+    } };
+
+    QJsonObject parse(const QByteArray& response, int chunkSize)
+    {
+        rooms.clear();
+        parser.reset();
+        for (int i = 0; i < response.size(); i += chunkSize)
+            parser.feed(response.mid(i, chunkSize));
+        return parser.finish();
+    }
+};
+
+// Strings in the room data have brackets, quotes and escapes in them
+// to check that the splitter doesn't take them for structure
+static const auto Response = QByteArrayLiteral(
+    R"({"next_batch":"s72_4","account_data":{"events":[]},)"
+    R"("rooms":{"join":{"!a:example.org":{"timeline":{"events":[)"
+    R"({"type":"m.room.message","event_id":"$1","sender":"@u:example.org",)"
+    R"("origin_server_ts":1600000000000,"content":{"msgtype":"m.text",)"
+    R"("body":"}]{[ \"quoted\" \\"}}],"limited":false}},)"
+    R"("!b\"c:example.org":{"timeline":{"events":[]}}},)"
+    R"("invite":{"!d:example.org":{"invite_state":{"events":[]}}},)"
+    R"("leave":{}},"to_device":{"events":[]}})");
+
+void SyncResponseParserTest::chunkedFeed_data()
+{
+    QTest::addColumn<int>("chunkSize");
+    for (const auto chunkSize : { 1, 2, 3, 7, 64, int(Response.size()) })
+        QTest::addRow("%d", chunkSize) << chunkSize;
+}
+
+void SyncResponseParserTest::chunkedFeed()
+{
+    QFETCH(int, chunkSize);
+    const auto residual = parse(Response, chunkSize);
+    QVERIFY2(parser.errorString().isEmpty(), qPrintable(parser.errorString()));
+
+    QVERIFY(rooms.size() == 3);
+    QVERIFY(parser.roomCount() == 3);
+    QCOMPARE(rooms[0].roomId, "!a:example.org"_ls);
+    QCOMPARE(rooms[0].joinState, JoinState::Join);
+    QVERIFY(rooms[0].timeline.size() == 1);
+    QVERIFY(rooms[0].jsonSize > 0);
+    QCOMPARE(rooms[1].roomId, QStringLiteral("!b\"c:example.org"));
+    QCOMPARE(rooms[1].joinState, JoinState::Join);
+    QCOMPARE(rooms[2].roomId, "!d:example.org"_ls);
+    QCOMPARE(rooms[2].joinState, JoinState::Invite);
+
+    // Everything but the rooms stays in the residual JSON
+    QCOMPARE(residual["next_batch"_ls].toString(), "s72_4"_ls);
+    QVERIFY(residual.contains("account_data"_ls));
+    QVERIFY(residual.contains("to_device"_ls));
+    const auto roomsJson = residual["rooms"_ls].toObject();
+    QVERIFY(roomsJson["join"_ls].toObject().isEmpty());
+    QVERIFY(roomsJson["invite"_ls].toObject().isEmpty());
+}
+
+void SyncResponseParserTest::truncated()
+{
+    // Cutting the response anywhere must be reported, whether the cut falls
+    // inside a room, a string or the residual JSON
+    for (int size = 1; size < Response.size(); ++size) {
+        parse(Response.left(size), 5);
+        QVERIFY2(!parser.errorString().isEmpty(),
+                 qPrintable(QStringLiteral("No error at size %1").arg(size)));
+    }
+}
+
+void SyncResponseParserTest::trailingGarbage()
+{
+    parse(Response + " \n", 16);
+    QVERIFY(parser.errorString().isEmpty());
+    parse(Response + "{}", 16);
+    QVERIFY(!parser.errorString().isEmpty());
+}
+
+QTEST_GUILESS_MAIN(SyncResponseParserTest)
+#include "syncresponseparsertest.moc"
@@ -0,0 +1,211 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "timelinestore.h"
+
+#include <QtCore/QTemporaryDir>
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class TimelineStoreTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void init();
+    void appendAndPage();
+    void discontinuity();
+    void reopen();
+    void brokenTail();
+    void retention();
+    void compaction();
+
+private:
+    QTemporaryDir dir;
+    QString storePath;
+    const QString roomId = QStringLiteral("!room:example.org");
+
+    static QJsonObject event(int n)
+    {
+        return { { "type"_ls, "m.room.message"_ls },
+                 { "event_id"_ls, QStringLiteral("$%1:example.org").arg(n) },
+                 { "content"_ls,
+                   QJsonObject { { "msgtype"_ls, "m.text"_ls },
+                                 { "body"_ls, QString::number(n) } } } };
+    }
+    //! Events from \p from to \p to, in the given order
+    static QVector<QJsonObject> events(int from, int to)
+    {
+        QVector<QJsonObject> result;
+        for (auto n = from; n != to; n += from < to ? 1 : -1)
+            result.push_back(event(n));
+        result.push_back(event(to));
+        return result;
+    }
+    static QString eventId(int n) { return event(n)["event_id"_ls].toString(); }
+};
+
+void TimelineStoreTest::init()
+{
+    QVERIFY(dir.isValid());
+    storePath = dir.filePath(QLatin1String(QTest::currentTestFunction()));
+}
+
+void TimelineStoreTest::appendAndPage()
+{
+    TimelineStore store;
+    QVERIFY(store.open(storePath));
+    QVERIFY(store.appendNewer(roomId, {}, events(10, 19),
+                              QStringLiteral("t10")));
+    QVERIFY(store.appendNewer(roomId, eventId(19), events(20, 29), {}));
+    QVERIFY(store.appendOlder(roomId, eventId(10), events(9, 0), none));
+    QVERIFY(store.size(roomId) == 30);
+    QCOMPARE(store.oldestEventId(roomId), eventId(0));
+    QCOMPARE(store.newestEventId(roomId), eventId(29));
+    QVERIFY(!store.olderToken(roomId));
+
+    auto page = store.loadBefore(roomId, {}, 10);
+    QCOMPARE(page.events, events(29, 20));
+    QVERIFY(!page.reachedOldest);
+    page = store.loadBefore(roomId, eventId(5), 10);
+    QCOMPARE(page.events, events(4, 0));
+    QVERIFY(page.reachedOldest);
+
+    // Historical events not adjacent to the stored ones are not accepted
+    QVERIFY(!store.appendOlder(roomId, eventId(5), events(40, 45), {}));
+    QVERIFY(store.size(roomId) == 30);
+}
+
+void TimelineStoreTest::discontinuity()
+{
+    TimelineStore store;
+    QVERIFY(store.open(storePath));
+    QVERIFY(store.appendNewer(roomId, {}, events(0, 9), {}));
+    QVERIFY(store.appendNewer(roomId, eventId(5), events(20, 29),
+                              QStringLiteral("t20")));
+    QVERIFY(store.size(roomId) == 10);
+    QCOMPARE(store.oldestEventId(roomId), eventId(20));
+    QVERIFY(!store.contains(roomId, eventId(9)));
+    const Omittable<QString> expectedToken = QStringLiteral("t20");
+    QCOMPARE(store.olderToken(roomId), expectedToken);
+}
+
+void TimelineStoreTest::reopen()
+{
+    auto redacted = event(15);
+    redacted.remove("content"_ls);
+    {
+        TimelineStore store;
+        QVERIFY(store.open(storePath));
+        QVERIFY(store.appendNewer(roomId, {}, events(10, 19), {}));
+        QVERIFY(store.appendOlder(roomId, eventId(10), events(9, 5),
+                                  QStringLiteral("t5")));
+        QVERIFY(store.replaceEvent(roomId, redacted));
+    }
+    TimelineStore store;
+    QVERIFY(store.open(storePath));
+    QVERIFY(store.size(roomId) == 15);
+    QCOMPARE(store.oldestEventId(roomId), eventId(5));
+    const Omittable<QString> expectedToken = QStringLiteral("t5");
+    QCOMPARE(store.olderToken(roomId), expectedToken);
+    QCOMPARE(store.loadEvent(roomId, eventId(15)), redacted);
+    QCOMPARE(store.loadEvent(roomId, eventId(16)), event(16));
+}
+
+void TimelineStoreTest::brokenTail()
+{
+    QString fileName;
+    {
+        TimelineStore store;
+        QVERIFY(store.open(storePath));
+        QVERIFY(store.appendNewer(roomId, {}, events(0, 9), {}));
+        QVERIFY(store.appendNewer(roomId, eventId(9), events(10, 11), {}));
+        fileName = QDir(storePath).entryInfoList(QDir::Files)
+                       .value(0).absoluteFilePath();
+    }
+    // Cut the last record in the middle, as a crash during a write would
+    QFile file { fileName };
+    QVERIFY(file.resize(file.size() - 10));
+
+    TimelineStore store;
+    QVERIFY(store.open(storePath));
+    QVERIFY(store.size(roomId) == 11);
+    QCOMPARE(store.newestEventId(roomId), eventId(10));
+    // New events still go after the last good one
+    QVERIFY(store.appendNewer(roomId, eventId(10), events(11, 12), {}));
+    QCOMPARE(store.loadBefore(roomId, {}, 3).events, events(12, 10));
+}
+
+void TimelineStoreTest::retention()
+{
+    TimelineStore store;
+    QVERIFY(store.open(storePath));
+    store.setMaxEventsPerRoom(15);
+    QVERIFY(store.appendNewer(roomId, {}, events(0, 9), QStringLiteral("t0")));
+    QVERIFY(store.appendNewer(roomId, eventId(9), events(10, 14),
+                              QStringLiteral("t10")));
+    QVERIFY(store.size(roomId) == 15);
+    // Over the limit, the log is cut at the oldest batch start that keeps
+    // no more than 15 events
+    QVERIFY(store.appendNewer(roomId, eventId(14), events(15, 19),
+                              QStringLiteral("t15")));
+    QVERIFY(store.size(roomId) == 10);
+    QCOMPARE(store.oldestEventId(roomId), eventId(10));
+    Omittable<QString> expectedToken = QStringLiteral("t10");
+    QCOMPARE(store.olderToken(roomId), expectedToken);
+    // Historical events that don't fit are not stored
+    QVERIFY(!store.appendOlder(roomId, eventId(10), events(9, 0),
+                               QStringLiteral("t0")));
+    QVERIFY(store.size(roomId) == 10);
+
+    // The dropped events don't come back from the file
+    store.close();
+    QVERIFY(store.open(storePath));
+    store.setMaxEventsPerRoom(15);
+    QVERIFY(store.size(roomId) == 10);
+    QCOMPARE(store.olderToken(roomId), expectedToken);
+    QCOMPARE(store.loadBefore(roomId, {}, 20).events, events(19, 10));
+
+    // With no batch starts within the limit, the newest one is used...
+    QVERIFY(store.appendNewer(roomId, eventId(19), events(20, 39), {}));
+    QVERIFY(store.size(roomId) == 25);
+    QCOMPARE(store.oldestEventId(roomId), eventId(15));
+    expectedToken = QStringLiteral("t15");
+    QCOMPARE(store.olderToken(roomId), expectedToken);
+    // ...and with none but the oldest event, the log is not cut
+    QVERIFY(store.appendNewer(roomId, eventId(39), events(40, 44), {}));
+    QVERIFY(store.size(roomId) == 30);
+}
+
+void TimelineStoreTest::compaction()
+{
+    TimelineStore store;
+    QVERIFY(store.open(storePath));
+    QVERIFY(store.appendNewer(roomId, {}, events(0, 9), QStringLiteral("t0")));
+    const auto fileName = QDir(storePath).entryInfoList(QDir::Files)
+                              .value(0).absoluteFilePath();
+    auto edited = event(5);
+    for (int i = 0; i < 50; ++i) {
+        edited["content"_ls] = QJsonObject {
+            { "body"_ls, QString(10000, QLatin1Char(char('a' + i % 26))) }
+        };
+        QVERIFY(store.replaceEvent(roomId, edited));
+    }
+    // Without compaction, the file would keep all 50 versions
+    QVERIFY(QFileInfo(fileName).size() < 200 * 1024);
+    QCOMPARE(store.loadEvent(roomId, eventId(5)), edited);
+    QCOMPARE(store.loadEvent(roomId, eventId(6)), event(6));
+
+    store.close();
+    QVERIFY(store.open(storePath));
+    QVERIFY(store.size(roomId) == 10);
+    QCOMPARE(store.loadEvent(roomId, eventId(5)), edited);
+    QCOMPARE(store.loadBefore(roomId, eventId(5), 5).events, events(4, 0));
+    const Omittable<QString> expectedToken = QStringLiteral("t0");
+    QCOMPARE(store.olderToken(roomId), expectedToken);
+    // New events still go after the compacted ones
+    QVERIFY(store.appendNewer(roomId, eventId(9), events(10, 11), {}));
+    QCOMPARE(store.loadBefore(roomId, {}, 3).events, events(11, 9));
+}
+
+QTEST_GUILESS_MAIN(TimelineStoreTest)
+#include "timelinestoretest.moc"
@@ -0,0 +1,143 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "connection.h"
+#include "room.h"
+#include "syncdata.h"
+#include "user.h"
+
+#include <QtTest/QtTest>
+
+using namespace Quotient;
+
+class UserCollectionTest : public QObject {
+    Q_OBJECT
+private Q_SLOTS:
+    void initTestCase();
+    void directChats();
+    void lazyLoadedRooms();
+
+private:
+    static constexpr auto RoomId = "!room:example.org"_ls;
+
+    //! \brief Write a state cache for \p c
+    //!
+    //! \p json goes to the top-level file, along with the cache version and
+    //! a sync token; \p roomState, if not empty, is cached as the full state
+    //! of RoomId.
+    static bool writeCache(const Connection& c, QJsonObject json,
+                           const QJsonObject& roomState = {});
+    static void deleteCollected()
+    {
+        QCoreApplication::sendPostedEvents(nullptr, QEvent::DeferredDelete);
+    }
+};
+
+void UserCollectionTest::initTestCase()
+{
+    QStandardPaths::setTestModeEnabled(true);
+}
+
+bool UserCollectionTest::writeCache(const Connection& c, QJsonObject json,
+                                    const QJsonObject& roomState)
+{
+    auto cacheDir = c.stateCacheDir();
+    cacheDir.removeRecursively();
+    if (!cacheDir.mkpath("."_ls))
+        return false;
+    json.insert("cache_version"_ls,
+                QJsonObject { { "major"_ls, SyncData::MajorCacheVersion } });
+    json.insert("next_batch"_ls, "s1"_ls);
+    QFile stateFile(cacheDir.filePath("state.json"_ls));
+    if (!stateFile.open(QIODevice::WriteOnly)
+        || stateFile.write(QJsonDocument(json).toJson()) < 0)
+        return false;
+    if (roomState.isEmpty())
+        return true;
+    QFile roomFile(cacheDir.filePath(SyncData::fileNameForRoom(RoomId)));
+    return roomFile.open(QIODevice::WriteOnly)
+           && roomFile.write(QJsonDocument(roomState).toJson()) >= 0;
+}
+
+void UserCollectionTest::directChats()
+{
+    const std::unique_ptr<Connection> c {
+        Connection::makeMockConnection("@dcowner:example.org"_ls)
+    };
+    // A direct chat known to the server, as it would come in account data
+    const QJsonObject directChatsJson {
+        { "@removed:example.org"_ls, QJsonArray { RoomId } }
+    };
+    const QJsonArray accountData { QJsonObject {
+        { TypeKey, "m.direct"_ls }, { ContentKey, directChatsJson } } };
+    QVERIFY(writeCache(
+        *c, { { "account_data"_ls,
+                QJsonObject { { "events"_ls, accountData } } } }));
+    c->loadState();
+    const QPointer<User> removed = c->users().value("@removed:example.org"_ls);
+    QVERIFY(removed);
+
+    // Local changes not sent to the server yet refer to user objects too
+    c->removeFromDirectChats(RoomId, removed);
+    Room localRoom(c.get(), "!local:example.org"_ls, JoinState::Join);
+    const QPointer<User> added = c->user("@added:example.org"_ls);
+    c->addToDirectChats(&localRoom, added);
+    const QPointer<User> stranger = c->user("@stranger:example.org"_ls);
+
+    QSignalSpy deleteSpy(c.get(), &Connection::aboutToDeleteUser);
+    QVERIFY(c->collectUnusedUsers() == 1);
+    QVERIFY(deleteSpy.size() == 1);
+    QVERIFY(deleteSpy.front().front().value<User*>() == stranger.data());
+    deleteCollected();
+    QVERIFY(!stranger);
+    QVERIFY(removed && added);
+    QVERIFY(c->users().contains("@removed:example.org"_ls));
+    QVERIFY(c->users().contains("@added:example.org"_ls));
+    QVERIFY(!c->users().contains("@stranger:example.org"_ls));
+    c->stateCacheDir().removeRecursively();
+}
+
+void UserCollectionTest::lazyLoadedRooms()
+{
+    const std::unique_ptr<Connection> c {
+        Connection::makeMockConnection("@lazy:example.org"_ls)
+    };
+    const QJsonObject memberEvent {
+        { TypeKey, "m.room.member"_ls },
+        { EventIdKey, "$member"_ls },
+        { SenderKey, "@member:example.org"_ls },
+        { StateKeyKey, "@member:example.org"_ls },
+        { "origin_server_ts"_ls, Q_INT64_C(1600000000000) },
+        { ContentKey, QJsonObject { { "membership"_ls, "join"_ls } } }
+    };
+    const QJsonObject roomState {
+        { "state"_ls,
+          QJsonObject { { "events"_ls, QJsonArray { memberEvent } } } }
+    };
+    const QJsonObject rooms {
+        { "join"_ls, QJsonObject { { RoomId, QJsonObject {} } } }
+    };
+    QVERIFY(writeCache(*c, { { "rooms"_ls, rooms } }, roomState));
+    c->setLazyRoomLoading(true);
+    c->loadState();
+    const QPointer<Room> room = c->room(RoomId);
+    QVERIFY(room);
+    QVERIFY(!room->isFullyLoaded());
+
+    // The members of the room are not known until its state is loaded
+    const QPointer<User> member = c->user("@member:example.org"_ls);
+    const QPointer<User> stranger = c->user("@stranger:example.org"_ls);
+    QVERIFY(c->collectUnusedUsers() == 0);
+    deleteCollected();
+    QVERIFY(member && stranger);
+
+    QTRY_VERIFY(room->isFullyLoaded());
+    QVERIFY(c->collectUnusedUsers() == 1);
+    deleteCollected();
+    QVERIFY(member);
+    QVERIFY(!stranger);
+    c->stateCacheDir().removeRecursively();
+}
+
+QTEST_GUILESS_MAIN(UserCollectionTest)
+#include "usercollectiontest.moc"
@@ -5,6 +5,8 @@
 #include "accountregistry.h"
 
 #include "connection.h"
+#include "startuptrace.h"
+
 #include <QtCore/QCoreApplication>
 
 using namespace Quotient;
@@ -91,10 +93,11 @@ void AccountRegistry::invokeLogin()
         if (account.homeserver().isEmpty())
             continue;
 
+        const auto keychainLoadStart = StartupTrace::clock::now();
         auto accessTokenLoadingJob =
             loadAccessTokenFromKeychain(account.userId());
         connect(accessTokenLoadingJob, &QKeychain::Job::finished, this,
-                [accountId, this, accessTokenLoadingJob]() {
+                [accountId, this, accessTokenLoadingJob, keychainLoadStart]() {
                     if (accessTokenLoadingJob->error()
                         != QKeychain::Error::NoError) {
                         emit keychainError(accessTokenLoadingJob->error());
@@ -103,6 +106,8 @@ void AccountRegistry::invokeLogin()
 
                     AccountSettings account { accountId };
                     auto connection = new Connection(account.homeserver());
+                    connection->startupTrace()->record(
+                        StartupTrace::KeychainLoad, keychainLoadStart);
                     connect(connection, &Connection::connected, this,
                             [connection, this, accountId] {
                                 connection->loadState();
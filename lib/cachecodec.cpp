@@ -0,0 +1,370 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "cachecodec.h"
+
+#include "logging.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+
+using namespace Quotient;
+
+// The container header: the magic bytes, the codec id, the size of
+// the uncompressed data and the checksum of the codec parameters; numbers
+// are little-endian. A cache file in JSON starts with '{' and one in CBOR
+// starts with a map; either way, it can't start with 'Q'.
+constexpr char Magic[] = "QCZ";
+constexpr auto MagicSize = 3;
+constexpr quint8 ZlibId = 1;
+constexpr quint8 DictionaryId = 2;
+//! In DictionaryCodec-encoded data, introduces a reference to
+//! a dictionary entry, or a literal EscapeByte if followed by one
+constexpr uchar EscapeByte = 0xFF;
+
+namespace {
+class ZlibCodec : public CacheCodec {
+public:
+    explicit ZlibCodec(quint8 id, int compressionLevel = -1)
+        : CacheCodec(id), compressionLevel(compressionLevel)
+    {}
+
+    QByteArray compress(const QByteArray& data) const override
+    {
+        return qCompress(data, compressionLevel);
+    }
+    QByteArray decompress(const QByteArray& data) const override
+    {
+        return qUncompress(data);
+    }
+
+private:
+    int compressionLevel;
+};
+
+struct Registry {
+    QReadWriteLock lock;
+    std::unordered_map<quint8, std::unique_ptr<CacheCodec>> codecs;
+
+    Registry()
+    {
+        codecs.emplace(ZlibId, std::make_unique<ZlibCodec>(ZlibId));
+        codecs.emplace(DictionaryId, std::make_unique<DictionaryCodec>(
+                                         DictionaryId,
+                                         DictionaryCodec::defaultDictionary()));
+    }
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+} // namespace
+
+CacheCodec::~CacheCodec() = default;
+
+const CacheCodec* CacheCodec::zlib() { return find(ZlibId); }
+
+const CacheCodec* CacheCodec::dictionary() { return find(DictionaryId); }
+
+const CacheCodec* CacheCodec::registerCodec(std::unique_ptr<CacheCodec> codec)
+{
+    Q_ASSERT(codec != nullptr);
+    auto& r = registry();
+    QWriteLocker locker(&r.lock);
+    const auto [it, inserted] = r.codecs.try_emplace(codec->id(),
+                                                     std::move(codec));
+    if (!inserted) {
+        qCWarning(MAIN) << "A cache codec with id" << int(it->first)
+                        << "is already registered";
+        return nullptr;
+    }
+    return it->second.get();
+}
+
+const CacheCodec* CacheCodec::find(quint8 id)
+{
+    auto& r = registry();
+    QReadLocker locker(&r.lock);
+    const auto it = r.codecs.find(id);
+    return it != r.codecs.end() ? it->second.get() : nullptr;
+}
+
+bool CacheCodec::isPacked(const QByteArray& data)
+{
+    return data.size() >= HeaderSize
+           && std::memcmp(data.constData(), Magic, MagicSize) == 0;
+}
+
+QByteArray CacheCodec::pack(const QByteArray& data, const CacheCodec* codec)
+{
+    if (!codec)
+        return data;
+    Q_ASSERT(qint64(data.size())
+             <= qint64(std::numeric_limits<quint32>::max()));
+    QByteArray result(HeaderSize, Qt::Uninitialized);
+    auto* p = result.data();
+    std::memcpy(p, Magic, MagicSize);
+    p[MagicSize] = char(codec->id());
+    qToLittleEndian(quint32(data.size()), p + 4);
+    qToLittleEndian(codec->parametersChecksum(), p + 8);
+    result.append(codec->compress(data));
+    return result;
+}
+
+QByteArray CacheCodec::unpack(const QByteArray& data)
+{
+    if (!isPacked(data))
+        return data;
+    const auto* p = data.constData();
+    const auto id = int(quint8(p[MagicSize]));
+    const auto* codec = find(quint8(id));
+    if (!codec) {
+        qCWarning(MAIN) << "Unknown cache codec" << id;
+        return {};
+    }
+    if (qFromLittleEndian<quint32>(p + 8) != codec->parametersChecksum()) {
+        qCWarning(MAIN) << "Cache data has been compressed with codec" << id
+                        << "using different parameters";
+        return {};
+    }
+    auto result = codec->decompress(data.mid(HeaderSize));
+    if (result.size() != qsizetype(qFromLittleEndian<quint32>(p + 4))) {
+        qCWarning(MAIN) << "Error decompressing cache data with codec" << id;
+        return {};
+    }
+    return result;
+}
+
+DictionaryCodec::DictionaryCodec(quint8 id, QList<QByteArray> dictionary,
+                                 int compressionLevel)
+    : CacheCodec(id)
+    , _dictionary(std::move(dictionary))
+    , _compressionLevel(compressionLevel)
+{
+    if (_dictionary.size() > MaxEntries) {
+        qCWarning(MAIN) << "Only the first" << MaxEntries
+                        << "dictionary entries will be used";
+        _dictionary.erase(_dictionary.begin() + MaxEntries, _dictionary.end());
+    }
+    _checksum = 0;
+    for (int i = 0; i < _dictionary.size(); ++i) {
+        const auto& entry = _dictionary[i];
+        _checksum = crc32(entry.constData(), entry.size(), _checksum);
+        _checksum = crc32("", 1, _checksum); // Include the separator
+        // A reference takes two bytes; shorter entries gain nothing
+        if (entry.size() > 2)
+            _candidates[uchar(entry.front())].push_back(quint8(i));
+    }
+    for (auto& indices : _candidates)
+        std::stable_sort(indices.begin(), indices.end(),
+                         [this](quint8 lhs, quint8 rhs) {
+                             return _dictionary[lhs].size()
+                                    > _dictionary[rhs].size();
+                         });
+}
+
+QByteArray DictionaryCodec::compress(const QByteArray& data) const
+{
+    QByteArray encoded;
+    encoded.reserve(data.size());
+    const auto* p = data.constData();
+    const auto size = data.size();
+    for (qsizetype i = 0; i < size;) {
+        const auto c = uchar(p[i]);
+        const auto& candidates = _candidates[c];
+        const auto it = std::find_if(
+            candidates.cbegin(), candidates.cend(), [&](quint8 index) {
+                const auto& entry = _dictionary[index];
+                return entry.size() <= size - i
+                       && std::memcmp(p + i, entry.constData(),
+                                      size_t(entry.size()))
+                              == 0;
+            });
+        if (it != candidates.cend()) {
+            encoded.append(char(EscapeByte)).append(char(*it));
+            i += _dictionary[*it].size();
+            continue;
+        }
+        if (c == EscapeByte)
+            encoded.append(char(EscapeByte));
+        encoded.append(char(c));
+        ++i;
+    }
+    return qCompress(encoded, _compressionLevel);
+}
+
+QByteArray DictionaryCodec::decompress(const QByteArray& data) const
+{
+    const auto encoded = qUncompress(data);
+    if (encoded.isEmpty())
+        return {};
+    QByteArray result;
+    result.reserve(encoded.size() * 2);
+    const auto* p = encoded.constData();
+    const auto size = encoded.size();
+    for (qsizetype i = 0; i < size; ++i) {
+        if (uchar(p[i]) != EscapeByte) {
+            result.append(p[i]);
+            continue;
+        }
+        if (++i == size)
+            return {};
+        if (const auto index = uchar(p[i]); index == EscapeByte)
+            result.append(char(EscapeByte));
+        else if (index < _dictionary.size())
+            result.append(_dictionary[index]);
+        else
+            return {};
+    }
+    return result;
+}
+
+QList<QByteArray> DictionaryCodec::defaultDictionary()
+{
+    // Fragments of typical room states saved in JSON, where QJsonDocument
+    // sorts the keys, so that the fragments come in a predictable order;
+    // the bare strings at the end help CBOR caches a bit
+    static const QList<QByteArray> dictionary {
+        R"({"content":{"avatar_url":"mxc://)",
+        R"({"content":{"displayname":")",
+        R"({"content":{"membership":")",
+        R"(","displayname":")",
+        R"(","membership":"join"},"event_id":"$)",
+        R"(","membership":"leave"},"event_id":"$)",
+        R"(","membership":"invite"},"event_id":"$)",
+        R"(","membership":"ban"},"event_id":"$)",
+        R"(","origin_server_ts":)",
+        R"(,"origin_server_ts":)",
+        R"(,"sender":"@)",
+        R"(","state_key":"@)",
+        R"(","state_key":"","type":"m.room.)",
+        R"(","type":"m.room.member","unsigned":{)",
+        R"(","type":"m.room.member"})",
+        R"(","type":"m.room.message")",
+        R"("unsigned":{"age":)",
+        R"("replaces_state":"$)",
+        R"("prev_content":{)",
+        R"("prev_sender":"@)",
+        R"("avatar_url":null)",
+        R"("avatar_url":"mxc://)",
+        R"("displayname":null)",
+        R"("is_direct":true)",
+        R"("membership":"join")",
+        R"("membership":"leave")",
+        R"("m.room.power_levels")",
+        R"("m.room.join_rules")",
+        R"("m.room.history_visibility")",
+        R"("m.room.canonical_alias")",
+        R"("m.room.create")",
+        R"("m.room.name")",
+        R"("m.room.topic")",
+        R"("m.room.avatar")",
+        R"("m.room.encryption")",
+        R"("m.room.guest_access")",
+        R"("m.room.server_acl")",
+        R"("m.room.pinned_events")",
+        R"("m.room.tombstone")",
+        R"("m.space.child")",
+        R"("m.space.parent")",
+        R"("join_rule":")",
+        R"("history_visibility":")",
+        R"("guest_access":")",
+        R"("algorithm":"m.megolm.v1.aes-sha2")",
+        R"("users_default":)",
+        R"("events_default":)",
+        R"("state_default":)",
+        R"("users":{)",
+        R"("state":{"events":[)",
+        R"("timeline":{"events":[)",
+        R"("account_data":{"events":[)",
+        R"("ephemeral":{"events":[)",
+        R"("summary":{)",
+        R"("m.joined_member_count":)",
+        R"("m.invited_member_count":)",
+        R"("m.heroes":[)",
+        R"("unread_notifications":{)",
+        R"("highlight_count":)",
+        R"("notification_count":)",
+        R"("m.fully_read")",
+        R"("m.direct")",
+        R"("m.tag")",
+        R"("content":{)",
+        R"("event_id":"$)",
+        R"("sender":"@)",
+        R"("state_key":")",
+        R"("type":")",
+        R"(:matrix.org")",
+        R"("mxc://matrix.org/)",
+        "m.room.member",
+        "membership",
+        "displayname",
+        "avatar_url",
+        "origin_server_ts",
+        "state_key",
+        "event_id",
+        "content",
+        "unsigned",
+    };
+    return dictionary;
+}
+
+QList<QByteArray> DictionaryCodec::train(const QList<QByteArray>& samples,
+                                         int maxEntries)
+{
+    static constexpr auto MinEntrySize = 4;
+    static constexpr auto MaxEntrySize = 255;
+    QHash<QByteArray, qint64> counts;
+    const auto addToken = [&counts](const char* begin, const char* end) {
+        if (const auto size = end - begin;
+            size >= MinEntrySize && size <= MaxEntrySize)
+            ++counts[QByteArray(begin, int(size))];
+    };
+    // Take runs of printable characters between JSON punctuation (and,
+    // in CBOR, between binary data)
+    static constexpr auto isTokenChar = [](char c) {
+        return c >= 0x20 && c < 0x7F && c != '{' && c != '}' && c != '['
+               && c != ']' && c != ',';
+    };
+    for (const auto& sample : samples) {
+        const auto* p = sample.constData();
+        const auto* const end = p + sample.size();
+        while (p != end) {
+            const auto* tokenEnd = std::find_if_not(p, end, isTokenChar);
+            if (tokenEnd != p) {
+                addToken(p, tokenEnd);
+                // Count keys and values of `"key":value` separately as well
+                if (const auto* colon = std::find(p, tokenEnd, ':');
+                    colon != tokenEnd && colon + 1 != tokenEnd) {
+                    addToken(p, colon + 1);
+                    addToken(colon + 1, tokenEnd);
+                }
+                p = tokenEnd;
+            } else
+                ++p;
+        }
+    }
+    std::vector<std::pair<qint64, QByteArray>> scored;
+    scored.reserve(size_t(counts.size()));
+    for (auto it = counts.cbegin(); it != counts.cend(); ++it)
+        if (it.value() > 1) // Each reference saves size - 2 bytes
+            scored.emplace_back((it.key().size() - 2) * it.value(), it.key());
+    const auto resultSize =
+        std::min(scored.size(), size_t(std::clamp(maxEntries, 0, MaxEntries)));
+    std::partial_sort(scored.begin(), scored.begin() + ptrdiff_t(resultSize),
+                      scored.end(), [](const auto& lhs, const auto& rhs) {
+                          return lhs.first > rhs.first;
+                      });
+    QList<QByteArray> result;
+    result.reserve(int(resultSize));
+    for (size_t i = 0; i < resultSize; ++i)
+        result.push_back(std::move(scored[i].second));
+    return result;
+}
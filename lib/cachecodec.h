@@ -0,0 +1,119 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+
+#include <array>
+#include <vector>
+
+namespace Quotient {
+
+//! \brief A compression method for cache files
+//!
+//! Compressed cache data (room states and the top-level cache file) is
+//! wrapped in a container: a header with the magic bytes `QCZ`, the codec
+//! id, the size of the uncompressed data and the checksum of the codec
+//! parameters (see parametersChecksum()), followed by whatever compress()
+//! returns. Data without the header is uncompressed JSON or CBOR, as
+//! written by the library before compression was introduced, or with
+//! compression disabled; unpack() returns such data as it is.
+//!
+//! Codecs are looked up by id when unpacking; the codecs provided by
+//! the library are always available, custom ones have to be registered
+//! with registerCodec() before loading the cache.
+//! \sa Connection::setCacheCodec
+class QUOTIENT_API CacheCodec {
+public:
+    //! The size of the container header, in bytes
+    static constexpr auto HeaderSize = 12;
+    //! Ids below this are reserved for codecs in the library
+    static constexpr quint8 FirstCustomId = 16;
+
+    explicit CacheCodec(quint8 id) : _id(id) {}
+    virtual ~CacheCodec();
+    Q_DISABLE_COPY_MOVE(CacheCodec)
+
+    quint8 id() const { return _id; }
+    //! \brief A checksum of the parameters data is compressed with
+    //!
+    //! Codecs that need extra data to decompress (e.g., a dictionary)
+    //! return a checksum of that data here, so that data compressed with
+    //! different parameters is detected instead of being decoded into
+    //! garbage.
+    virtual quint32 parametersChecksum() const { return 0; }
+    virtual QByteArray compress(const QByteArray& data) const = 0;
+    //! Decompress \p data; return a null QByteArray on error
+    virtual QByteArray decompress(const QByteArray& data) const = 0;
+
+    //! qCompress() with the given compression level
+    static const CacheCodec* zlib();
+    //! DictionaryCodec with DictionaryCodec::defaultDictionary()
+    static const CacheCodec* dictionary();
+
+    //! \brief Make \p codec available for unpack()
+    //!
+    //! \return the registered codec, or nullptr if there's already a codec
+    //!         with the same id
+    static const CacheCodec* registerCodec(std::unique_ptr<CacheCodec> codec);
+    static const CacheCodec* find(quint8 id);
+
+    //! Check whether \p data starts with the container header
+    static bool isPacked(const QByteArray& data);
+    //! Compress \p data with \p codec and wrap it in the container;
+    //! if \p codec is nullptr, \p data is returned as it is
+    static QByteArray pack(const QByteArray& data, const CacheCodec* codec);
+    //! \brief Get the uncompressed data from the container
+    //!
+    //! \return \p data as it is if it has no container header; a null
+    //!         QByteArray if the codec is unknown or decompression fails
+    static QByteArray unpack(const QByteArray& data);
+
+private:
+    quint8 _id;
+};
+
+//! \brief A codec that replaces frequent strings before compressing
+//!
+//! Room states are dominated by state events that repeat the same keys and
+//! values (`"type":"m.room.member"`, `"membership":"join"` and so on)
+//! in every event. This codec replaces entries of a dictionary with
+//! two-byte references before compressing the data with qCompress(); this
+//! helps deflate, which only sees 32 KiB back, and especially helps small
+//! room states that deflate doesn't get to learn the repetitions in.
+//! The default dictionary is made for JSON caches; a dictionary for CBOR
+//! caches or for a particular account can be made with train().
+class QUOTIENT_API DictionaryCodec : public CacheCodec {
+public:
+    //! The maximum number of entries in a dictionary
+    static constexpr auto MaxEntries = 255;
+
+    DictionaryCodec(quint8 id, QList<QByteArray> dictionary,
+                    int compressionLevel = -1);
+
+    const QList<QByteArray>& entries() const { return _dictionary; }
+    quint32 parametersChecksum() const override { return _checksum; }
+    QByteArray compress(const QByteArray& data) const override;
+    QByteArray decompress(const QByteArray& data) const override;
+
+    //! The dictionary used by CacheCodec::dictionary()
+    static QList<QByteArray> defaultDictionary();
+    //! \brief Make a dictionary from sample cache data
+    //!
+    //! Picks the strings that would save most when replaced in \p samples,
+    //! out of the runs of printable characters between JSON punctuation.
+    static QList<QByteArray> train(const QList<QByteArray>& samples,
+                                   int maxEntries = MaxEntries);
+
+private:
+    QList<QByteArray> _dictionary;
+    //! Dictionary indices by the first byte, the longest entries first
+    std::array<std::vector<quint8>, 256> _candidates;
+    quint32 _checksum;
+    int _compressionLevel;
+};
+} // namespace Quotient
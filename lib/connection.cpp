@@ -7,10 +7,17 @@
 #include "connection.h"
 
 #include "accountregistry.h"
+#include "cachecodec.h"
 #include "connectiondata.h"
 #include "qt_connection_util.h"
 #include "room.h"
+#include "roomupdatescheduler.h"
+#include "slidingsync.h"
 #include "settings.h"
+#include "startuptrace.h"
+#include "statestore.h"
+#include "stringpool.h"
+#include "timelinestore.h"
 #include "user.h"
 
 // NB: since Qt 6, moc_connection.cpp needs Room and User fully defined
@@ -31,6 +38,7 @@
 #include "jobs/downloadfilejob.h"
 #include "jobs/mediathumbnailjob.h"
 #include "jobs/syncjob.h"
+#include <deque>
 #include <variant>
 
 #ifdef Quotient_E2EE_ENABLED
@@ -51,14 +59,18 @@
 #    include <qt5keychain/keychain.h>
 #endif
 
+#include <QtCore/QCborStreamWriter>
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
 #include <QtCore/QElapsedTimer>
 #include <QtCore/QFile>
 #include <QtCore/QMimeDatabase>
 #include <QtCore/QRegularExpression>
+#include <QtCore/QSaveFile>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
+#include <QtCore/QThreadPool>
+#include <QtCore/QTimer>
 #include <QtNetwork/QDnsLookup>
 
 using namespace Quotient;
@@ -96,7 +108,53 @@ public:
     QHash<QString, QString> roomAliasMap;
     QVector<QString> roomIdsToForget;
     QVector<QString> pendingStateRoomIds;
-    QMap<QString, User*> userMap;
+    StringPool stringPool;
+    RoomUpdateScheduler roomUpdateScheduler;
+    StartupTrace startupTrace;
+    bool firstSyncRequested = false;
+    //! Set while the first /sync response is being applied to rooms
+    Omittable<StartupTrace::clock::time_point> firstSyncApplyStart;
+    StateStore stateStore;
+    bool stateStoreFailed = false;
+    TimelineStore timelineStore;
+    bool timelineStoreFailed = false;
+    //! Rooms which cached state couldn't be loaded, waiting to be fetched
+    //! from the server, see startRoomRecovery()
+    QStringList roomsToRecover;
+    QPointer<SyncJob> recoveryJob;
+    //! Rooms being fetched by recoveryJob
+    QStringList recoveryJobRooms;
+    //! \brief Rooms waiting for or being fetched by recovery, with sync data
+    //!        for them that arrived in the meantime
+    UnorderedMap<QString, std::vector<SyncRoomData>> recoveringRooms;
+    static constexpr std::chrono::milliseconds MinRecoveryRetryDelay { 1000 };
+    static constexpr std::chrono::milliseconds MaxRecoveryRetryDelay {
+        300'000
+    };
+    std::chrono::milliseconds recoveryRetryDelay = MinRecoveryRetryDelay;
+    QTimer recoveryRetryTimer;
+    //! Rooms with changes not saved to the cache yet, by room id
+    QHash<QString, QPointer<Room>> dirtyRooms;
+    QTimer cacheWriteTimer;
+    //! Serialises and writes the cache in the background, one task at
+    //! a time; it has to be destroyed (waiting for the tasks) before
+    //! stateStore
+    QThreadPool cacheWriter;
+    SlidingSync* slidingSync = nullptr;
+    //! Rooms created from the cache index, waiting for the background
+    //! loader to load their full cached state
+    std::deque<QPointer<Room>> roomsToLoad;
+    //! State versions from the cache index entries of roomsToLoad; the full
+    //! state in the store must be at least as new
+    QHash<QString, quint64> indexedStateVersions;
+    QTimer roomLoaderTimer;
+    bool loadingCacheIndex = false;
+    QHash<InternedString, User*> userMap;
+    //! The same users as in userMap, kept ready for users()
+    QMap<QString, User*> usersById;
+    //! The number of pinUser() calls not matched by unpinUser(), by user id
+    QHash<InternedString, int> userPins;
+    QTimer userCollectionTimer;
     DirectChatsMap directChats;
     DirectChatUsersMap directChatUsers;
     // The below two variables track local changes between sync completions.
@@ -108,9 +166,9 @@ public:
     int syncTimeout = -1;
 
 #ifdef Quotient_E2EE_ENABLED
-    QSet<QString> trackedUsers;
-    QSet<QString> outdatedUsers;
-    QHash<QString, QHash<QString, DeviceKeys>> deviceKeys;
+    QSet<InternedString> trackedUsers;
+    QSet<InternedString> outdatedUsers;
+    QHash<InternedString, QHash<QString, DeviceKeys>> deviceKeys;
     QueryKeysJob *currentQueryKeysJob = nullptr;
     bool encryptionUpdateRequired = false;
     Database *database = nullptr;
@@ -151,6 +209,25 @@ public:
                  SettingsGroup("libQMatrixClient").get<QString>("cache_type"))
         != "json";
     bool lazyLoading = false;
+    bool incrementalSyncParsing = false;
+    bool parallelRoomParsing = false;
+    bool pipelinedSync = false;
+    //! \brief The sync token to save to the cache
+    //!
+    //! Unlike data->lastEvent(), which is the since token of the next /sync
+    //! request and moves on as soon as a batch arrives, this one only moves
+    //! on once the room updates of all batches up to it have been applied.
+    QString cacheSinceToken;
+    qint64 syncBacklogByteLimit = 0;
+    qint64 syncBacklogEventLimit = 0;
+    bool syncThrottled = false;
+    bool lazyRoomLoading = false;
+    bool compactEventStorage = false;
+    bool storeTimelines = false;
+    const CacheCodec* cacheCodec = nullptr;
+    qint64 timelineEventLimit = 0;
+    int historyPrefetchDistance = 0;
+    QTimer timelineTrimTimer;
 
     /** \brief Check the homeserver and resolve it if needed, before connecting
      *
@@ -176,6 +253,36 @@ public:
     void removeRoom(const QString& roomId);
 
     void consumeRoomData(SyncDataList&& roomDataList, bool fromCache);
+    void consumeRoomData(SyncRoomData&& roomData, bool fromCache);
+    //! \brief Load the full cached state of \p r, if not loaded yet
+    //! \return false if the cached state is broken and the room has been
+    //!         queued for recovery instead
+    bool loadRoomFully(Room* r);
+    void loadNextRooms();
+    //! Finish startupTrace if the first /sync response has been applied
+    void checkFirstSyncApplied();
+    //! Catch up cacheSinceToken if no room updates are pending
+    void updateCacheSinceToken();
+    //! Evict the oldest events from rooms to fit in timelineEventLimit
+    void trimTimelines();
+    void scheduleTimelineTrim()
+    {
+        if (timelineEventLimit > 0 && !timelineTrimTimer.isActive())
+            timelineTrimTimer.start();
+    }
+    void recoverRooms(const QStringList& roomIds);
+    //! \brief Fetch rooms in roomsToRecover with a filtered initial sync
+    //!
+    //! The sync is only used to get the full state and recent timeline of
+    //! the rooms which cached state couldn't be loaded; its next_batch
+    //! token is dropped, as the sync loop goes on from the cached token.
+    //! Data for these rooms from the sync loop is held from the moment they
+    //! are passed to recoverRooms() until the recovered data is applied.
+    //! If the sync fails, the rooms are fetched again after a delay that
+    //! doubles with each failure in a row, up to MaxRecoveryRetryDelay;
+    //! their sync data is held all that time.
+    void startRoomRecovery();
+    void finishRoomRecovery(SyncDataList&& recoveredData);
     void consumeAccountData(Events&& accountDataEvents);
     void consumePresenceData(Events&& presenceData);
     void consumeToDeviceEvents(Events&& toDeviceEvents);
@@ -196,11 +303,78 @@ public:
         packAndSendAccountData(
             makeEvent<EventT>(std::forward<ContentT>(content)));
     }
+    //! Check whether sync data not applied yet exceeds \p fraction of
+    //! the backlog limits
+    bool syncBacklogAbove(double fraction) const
+    {
+        return (syncBacklogByteLimit > 0
+                && roomUpdateScheduler.pendingBytes()
+                       > syncBacklogByteLimit * fraction)
+               || (syncBacklogEventLimit > 0
+                   && roomUpdateScheduler.pendingEvents()
+                          > syncBacklogEventLimit * fraction);
+    }
+    void setSyncThrottled(bool throttled)
+    {
+        if (syncThrottled == throttled)
+            return;
+        syncThrottled = throttled;
+        qCDebug(MAIN).nospace()
+            << "Sync loop " << (throttled ? "paused" : "resumed") << ", "
+            << roomUpdateScheduler.pendingEvents() << " event(s)/"
+            << roomUpdateScheduler.pendingBytes() << " byte(s) pending";
+        emit q->syncThrottledChanged(throttled);
+    }
+
     QString topLevelStatePath() const
     {
         return q->stateCacheDir().filePath("state.json");
     }
 
+    StateStore* openStateStore()
+    {
+        if (!stateStore.isOpen() && !stateStoreFailed)
+            stateStoreFailed = !stateStore.open(
+                q->stateCacheDir().filePath(StateStore::DefaultFileName));
+        return stateStore.isOpen() ? &stateStore : nullptr;
+    }
+    TimelineStore* openTimelineStore()
+    {
+        if (!cacheState || !storeTimelines)
+            return nullptr;
+        if (!timelineStore.isOpen() && !timelineStoreFailed)
+            timelineStoreFailed = !timelineStore.open(
+                q->stateCacheDir().filePath(TimelineStore::DefaultDirName));
+        return timelineStore.isOpen() ? &timelineStore : nullptr;
+    }
+
+    //! Mark \p r to be saved by the next flushDirtyRooms() call
+    void markDirty(Room* r);
+    //! \brief Take snapshots of dirty rooms and pass them to the cache writer
+    //!
+    //! This is the only part of saving room states done on the main thread:
+    //! serialising the snapshots and writing them goes in the background.
+    void flushDirtyRooms();
+    //! Add versions of room records in \p store to room index entries
+    static void addStateVersions(QJsonObject& rootObj, const StateStore& store);
+    //! Serialise \p json in the cache format (JSON or CBOR), compressing
+    //! it with \p codec if it's not nullptr
+    static QByteArray serializeCache(const QJsonObject& json, bool binary,
+                                     const CacheCodec* codec);
+    //! Write \p json to \p fileName via a temporary file, replacing
+    //! the old file only once the new one is complete
+    static bool writeCacheFile(const QString& fileName, const QJsonObject& json,
+                               bool binary, const CacheCodec* codec);
+    //! \brief Serialise a room state snapshot in the cache format
+    //!
+    //! Unlike `serializeCache(snapshot.toJson(), ...)`, this streams
+    //! the binary format without building the room JSON tree.
+    static QByteArray serializeCache(const Room::CacheSnapshot& snapshot,
+                                     bool binary, const CacheCodec* codec);
+    static bool writeCacheFile(const QString& fileName,
+                               const Room::CacheSnapshot& snapshot,
+                               bool binary, const CacheCodec* codec);
+
 #ifdef Quotient_E2EE_ENABLED
     void saveOlmAccount();
 
@@ -435,6 +609,50 @@ Connection::Connection(const QUrl& server, QObject* parent)
     //connect(qApp, &QCoreApplication::aboutToQuit, this, &Connection::saveOlmAccount);
 #endif
     d->q = this; // All d initialization should occur before this line
+    d->cacheWriter.setMaxThreadCount(1);
+    d->cacheWriteTimer.setSingleShot(true);
+    d->cacheWriteTimer.setInterval(DefaultCacheWriteInterval);
+    connect(&d->cacheWriteTimer, &QTimer::timeout, this,
+            [this] { d->flushDirtyRooms(); });
+    d->roomLoaderTimer.setSingleShot(true);
+    d->roomLoaderTimer.setInterval(0);
+    connect(&d->roomLoaderTimer, &QTimer::timeout, this,
+            [this] { d->loadNextRooms(); });
+    d->recoveryRetryTimer.setSingleShot(true);
+    connect(&d->recoveryRetryTimer, &QTimer::timeout, this,
+            [this] { d->startRoomRecovery(); });
+    d->timelineTrimTimer.setSingleShot(true);
+    d->timelineTrimTimer.setInterval(DefaultCacheWriteInterval);
+    connect(&d->timelineTrimTimer, &QTimer::timeout, this,
+            [this] { d->trimTimelines(); });
+    connect(&d->userCollectionTimer, &QTimer::timeout, this,
+            [this] { collectUnusedUsers(); });
+    // Start loading rooms in the background once their index entries
+    // have been applied
+    connect(&d->roomUpdateScheduler, &RoomUpdateScheduler::drained, this,
+            [this] {
+                if (!d->roomsToLoad.empty())
+                    d->roomLoaderTimer.start();
+                d->updateCacheSinceToken();
+                d->checkFirstSyncApplied();
+            });
+    connect(&d->roomUpdateScheduler, &RoomUpdateScheduler::updatesApplied,
+            this, [this](int count) {
+                if (!d->startupTrace.isFinished())
+                    d->startupTrace.record(
+                        StartupTrace::RoomUpdate,
+                        StartupTrace::clock::now()
+                            - d->roomUpdateScheduler.metrics()
+                                  .lastSliceDuration,
+                        count);
+                // Resume once the backlog is well below the limits, so that
+                // the loop doesn't flip-flop around them
+                if (d->syncThrottled && !d->syncBacklogAbove(0.5)) {
+                    d->setSyncThrottled(false);
+                    if (d->syncLoopConnection)
+                        syncLoopIteration();
+                }
+            });
 }
 
 Connection::Connection(QObject* parent) : Connection({}, parent) {}
@@ -444,6 +662,9 @@ Connection::~Connection()
     qCDebug(MAIN) << "deconstructing connection object for" << userId();
     stopSync();
     Accounts.drop(this);
+    // Rooms are still there; save whatever has changed in them
+    d->flushDirtyRooms();
+    d->cacheWriter.waitForDone();
 }
 
 void Connection::resolveServer(const QString& mxid)
@@ -464,13 +685,16 @@ void Connection::resolveServer(const QString& mxid)
     const auto& oldBaseUrl = d->data->baseUrl();
     d->data->setBaseUrl(maybeBaseUrl); // Temporarily set it for this one call
     d->resolverJob = callApi<GetWellknownJob>();
+    const auto startedAt = StartupTrace::clock::now();
     // Connect to finished() to make sure baseUrl is restored in any case
-    connect(d->resolverJob, &BaseJob::finished, this, [this, maybeBaseUrl, oldBaseUrl] {
+    connect(d->resolverJob, &BaseJob::finished, this,
+            [this, maybeBaseUrl, oldBaseUrl, startedAt] {
         // Revert baseUrl so that setHomeserver() below triggers signals
         // in case the base URL actually changed
         d->data->setBaseUrl(oldBaseUrl);
         if (d->resolverJob->error() == BaseJob::Abandoned)
             return;
+        d->startupTrace.record(StartupTrace::WellKnownLookup, startedAt);
 
         if (d->resolverJob->error() != BaseJob::NotFound) {
             if (!d->resolverJob->status().good()) {
@@ -669,9 +893,14 @@ void Connection::Private::completeSetup(const QString& mxId)
                   << "from device" << data->deviceId();
     Accounts.add(q);
     connect(qApp, &QCoreApplication::aboutToQuit, q, &Connection::saveState);
+    // The application may exit right after aboutToQuit(); don't let it
+    // happen while the cache is being written
+    connect(qApp, &QCoreApplication::aboutToQuit, q,
+            [this] { cacheWriter.waitForDone(); });
 #ifndef Quotient_E2EE_ENABLED
     qCWarning(E2EE) << "End-to-end encryption (E2EE) support is turned off.";
 #else // Quotient_E2EE_ENABLED
+    const auto dbOpenStart = StartupTrace::clock::now();
     auto&& maybePicklingKey = setupPicklingKey(data->userId());
     if (!maybePicklingKey) {
         Q_ASSERT(maybePicklingKey.has_value());
@@ -686,11 +915,17 @@ void Connection::Private::completeSetup(const QString& mxId)
     olmAccount = std::make_unique<QOlmAccount>(data->userId(), data->deviceId(), q);
     connect(olmAccount.get(), &QOlmAccount::needsSave, q,
             [this] { saveOlmAccount(); });
+    startupTrace.record(StartupTrace::E2eeDatabaseOpen, dbOpenStart);
 
+    const auto sessionsLoadStart = StartupTrace::clock::now();
     loadSessions();
+    startupTrace.record(StartupTrace::E2eeSessionLoad, sessionsLoadStart,
+                        qint64(olmSessions.size()));
 
-    if (const auto outcome = database->setupOlmAccount(*olmAccount);
-        !outcome.has_value()) {
+    const auto accountSetupStart = StartupTrace::clock::now();
+    const auto outcome = database->setupOlmAccount(*olmAccount);
+    startupTrace.record(StartupTrace::E2eeDatabaseOpen, accountSetupStart, 0);
+    if (!outcome.has_value()) {
         // A new account has been created
         auto job = q->callApi<UploadKeysJob>(olmAccount->deviceKeys());
         connect(job, &BaseJob::failure, q, [job]{
@@ -783,6 +1018,7 @@ void Connection::sync(int timeout)
         return;
     }
 
+    d->startRoomRecovery(); // In case loadState() was called before login
     d->syncTimeout = timeout;
     Filter filter;
     filter.room.timeline.limit.emplace(100);
@@ -790,9 +1026,50 @@ void Connection::sync(int timeout)
     auto job = d->syncJob =
         callApi<SyncJob>(BackgroundRequest, d->data->lastEvent(), filter,
                          timeout);
-    connect(job, &SyncJob::success, this, [this, job] {
-        onSyncSuccess(job->takeData());
-        d->syncJob = nullptr;
+    const auto isFirstSync = !std::exchange(d->firstSyncRequested, true);
+    const auto requestedAt = StartupTrace::clock::now();
+    if (d->parallelRoomParsing)
+        job->setThreadPool(QThreadPool::globalInstance());
+    job->setStringPool(&d->stringPool);
+    // Rooms are only collected as they arrive and consumed in onSyncSuccess(),
+    // together with the rest of the batch: applying them earlier would put
+    // them before the account data and to-device events (with room keys)
+    // of the same batch, and would leave a half-applied batch if the job
+    // fails or retries midway
+    if (d->incrementalSyncParsing)
+        job->setIncrementalParsing();
+    connect(job, &SyncJob::success, this,
+            [this, job, isFirstSync, requestedAt] {
+        if (isFirstSync) {
+            d->startupTrace.record(StartupTrace::FirstSyncRequest, requestedAt);
+            d->firstSyncApplyStart = StartupTrace::clock::now();
+        }
+        if (d->pipelinedSync && d->syncLoopConnection) {
+            auto data = job->takeData();
+            d->syncJob = nullptr;
+            // Put the next long-poll in flight before processing this batch;
+            // its response can only be handled after this function returns,
+            // so batches are still consumed strictly in order. Only the token
+            // for requests moves on here; the one saved to the cache waits
+            // until the batch is applied (see updateCacheSinceToken()).
+            d->data->setLastEvent(data.nextBatch());
+            syncLoopIteration();
+            onSyncSuccess(std::move(data));
+            // The backlog check in syncLoopIteration() above didn't count
+            // this batch; if it's the one that pushed the backlog over
+            // the limits, take the request back. It will be repeated with
+            // the same since token once room updates catch up.
+            if (d->syncJob && d->syncBacklogAbove(1)) {
+                d->syncJob->abandon();
+                d->syncJob = nullptr;
+                d->setSyncThrottled(true);
+            }
+        } else {
+            onSyncSuccess(job->takeData());
+            d->syncJob = nullptr;
+        }
+        if (isFirstSync)
+            d->checkFirstSyncApplied(); // In case no room had updates
         emit syncDone();
     });
     connect(job, &SyncJob::retryScheduled, this,
@@ -800,7 +1077,9 @@ void Connection::sync(int timeout)
                 emit networkError(job->errorString(), job->rawDataSample(),
                                   retriesTaken, nextInMilliseconds);
             });
-    connect(job, &SyncJob::failure, this, [this, job] {
+    connect(job, &SyncJob::failure, this, [this, job, isFirstSync] {
+        if (isFirstSync) // Trace the next attempt instead
+            d->firstSyncRequested = false;
         // SyncJob persists with retries on transient errors; if it fails,
         // there's likely something serious enough to stop the loop.
         stopSync();
@@ -834,6 +1113,13 @@ void Connection::syncLoop(int timeout)
 
 void Connection::syncLoopIteration()
 {
+    if (d->pipelinedSync && d->syncJob)
+        return; // The next sync has been started already, see sync()
+    if (d->syncBacklogAbove(1)) {
+        // Room updates fall behind; the loop resumes once they catch up
+        d->setSyncThrottled(true);
+        return;
+    }
     if (isLoggedIn())
         sync(d->syncTimeout);
     else
@@ -882,6 +1168,7 @@ void Connection::onSyncSuccess(SyncData&& data, bool fromCache)
     d->consumeRoomData(data.takeRoomData(), fromCache);
     d->consumeAccountData(data.takeAccountData());
     d->consumePresenceData(data.takePresenceData());
+    d->updateCacheSinceToken(); // In case the batch had no room updates
 #ifdef Quotient_E2EE_ENABLED
     if(d->encryptionUpdateRequired) {
         d->loadOutdatedUserDevices();
@@ -893,32 +1180,214 @@ void Connection::onSyncSuccess(SyncData&& data, bool fromCache)
 void Connection::Private::consumeRoomData(SyncDataList&& roomDataList,
                                           bool fromCache)
 {
-    for (auto&& roomData: roomDataList) {
-        const auto forgetIdx = roomIdsToForget.indexOf(roomData.roomId);
-        if (forgetIdx != -1) {
-            roomIdsToForget.removeAt(forgetIdx);
-            if (roomData.joinState == JoinState::Leave) {
-                qDebug(MAIN)
-                    << "Room" << roomData.roomId
-                    << "has been forgotten, ignoring /sync response for it";
-                continue;
-            }
-            qWarning(MAIN) << "Room" << roomData.roomId
-                           << "has just been forgotten but /sync returned it in"
-                           << terse << roomData.joinState
-                           << "state - suspiciously fast turnaround";
+    for (auto&& roomData: roomDataList)
+        consumeRoomData(std::move(roomData), fromCache);
+}
+
+void Connection::Private::consumeRoomData(SyncRoomData&& roomData,
+                                          bool fromCache)
+{
+    const auto forgetIdx = roomIdsToForget.indexOf(roomData.roomId);
+    if (forgetIdx != -1) {
+        roomIdsToForget.removeAt(forgetIdx);
+        if (roomData.joinState == JoinState::Leave) {
+            qDebug(MAIN)
+                << "Room" << roomData.roomId
+                << "has been forgotten, ignoring /sync response for it";
+            return;
+        }
+        qWarning(MAIN) << "Room" << roomData.roomId
+                       << "has just been forgotten but /sync returned it in"
+                       << terse << roomData.joinState
+                       << "state - suspiciously fast turnaround";
+    }
+    if (!fromCache)
+        if (const auto it = recoveringRooms.find(roomData.roomId);
+            it != recoveringRooms.end()) {
+            // This must go after the recovered state
+            it->second.push_back(std::move(roomData));
+            return;
+        }
+    if (auto* r = q->provideRoom(roomData.roomId, roomData.joinState)) {
+        pendingStateRoomIds.removeOne(roomData.roomId);
+        if (loadingCacheIndex) {
+            r->setFullyLoaded(false);
+            roomsToLoad.emplace_back(r);
+            indexedStateVersions.insert(r->id(), roomData.cachedStateVersion);
+        } else if (!fromCache && !loadRoomFully(r)) {
+            // Cached state must go before newer data; with the cache broken,
+            // the recovered state has to, so hold this until it arrives
+            recoveringRooms[roomData.roomId].push_back(std::move(roomData));
+            return;
+        }
+        // Update rooms in time-budgeted slices, giving time to update the UI.
+        roomUpdateScheduler.enqueue(r, std::move(roomData), fromCache);
+    }
+}
+
+bool Connection::Private::loadRoomFully(Room* r)
+{
+    if (r->isFullyLoaded())
+        return true;
+    // The index entry, if still pending, must go first
+    roomUpdateScheduler.flush(r);
+    const auto parseStart = StartupTrace::clock::now();
+    if (auto roomData = SyncData::loadCachedRoom(
+            q->stateCachePath(), r->id(), r->joinState(), openStateStore(),
+            indexedStateVersions.take(r->id()))) {
+        roomData->internIds(stringPool);
+        const auto updateStart = StartupTrace::clock::now();
+        startupTrace.record(StartupTrace::RoomCacheParse, parseStart, 1,
+                            updateStart);
+        r->updateData(std::move(*roomData), true);
+        startupTrace.record(StartupTrace::RoomUpdate, updateStart);
+        r->setFullyLoaded(true);
+        return true;
+    }
+    recoverRooms({ r->id() });
+    r->setFullyLoaded(true);
+    return false;
+}
+
+void Connection::Private::checkFirstSyncApplied()
+{
+    if (!firstSyncApplyStart || roomUpdateScheduler.queueDepth() > 0)
+        return;
+    startupTrace.record(StartupTrace::FirstSyncApply, *firstSyncApplyStart);
+    firstSyncApplyStart = none;
+    startupTrace.finish();
+    qCDebug(PROFILER) << "*** Startup of" << q->objectName() << "took"
+                      << startupTrace.duration().count() / 1000 << "ms";
+    emit q->startupTraceFinished();
+}
+
+void Connection::Private::trimTimelines()
+{
+    // Not fewer than a screenful per room
+    static constexpr auto MinEventsPerRoom = 20;
+
+    QElapsedTimer et;
+    et.start();
+    qint64 totalEvents = 0;
+    std::vector<std::pair<int, QPointer<Room>>> candidates;
+    for (auto* r : std::as_const(roomMap)) {
+        totalEvents += r->timelineSize();
+        if (!r->displayed() && r->timelineSize() > MinEventsPerRoom)
+            candidates.emplace_back(r->timelineSize(), r);
+    }
+    if (totalEvents <= timelineEventLimit)
+        return;
+
+    std::sort(candidates.begin(), candidates.end(),
+              [](const auto& lhs, const auto& rhs) {
+                  return lhs.first > rhs.first;
+              });
+    qint64 evicted = 0;
+    for (const auto& [size, r] : candidates) {
+        if (totalEvents - evicted <= timelineEventLimit)
+            break;
+        if (r) // Signal handlers may delete rooms
+            evicted += r->evictOldestEvents(MinEventsPerRoom);
+    }
+    qCDebug(PROFILER) << "*** Evicted" << evicted << "of" << totalEvents
+                      << "timeline event(s) in" << et;
+    if (totalEvents - evicted > timelineEventLimit)
+        qCDebug(MAIN) << "Timelines still have" << totalEvents - evicted
+                      << "event(s), over the limit of" << timelineEventLimit;
+}
+
+void Connection::Private::recoverRooms(const QStringList& roomIds)
+{
+    for (const auto& roomId : roomIds)
+        // Hold sync data for the room from now on, even if it has to wait
+        // for the job in flight to finish before it is fetched itself
+        if (recoveringRooms.try_emplace(roomId).second)
+            roomsToRecover.push_back(roomId);
+    startRoomRecovery();
+}
+
+void Connection::Private::startRoomRecovery()
+{
+    if (roomsToRecover.isEmpty() || recoveryJob || !q->isLoggedIn()
+        || recoveryRetryTimer.isActive())
+        return;
+
+    qCInfo(MAIN) << "Fetching" << roomsToRecover.size()
+                 << "room(s) with broken or missing cache from the server";
+    Filter filter;
+    filter.room.rooms = roomsToRecover;
+    filter.room.timeline.limit.emplace(100);
+    filter.room.state.lazyLoadMembers.emplace(lazyLoading);
+    // The sync loop brings everything else
+    filter.presence.notTypes = QStringList { QStringLiteral("*") };
+    filter.accountData.notTypes = QStringList { QStringLiteral("*") };
+    recoveryJobRooms = std::exchange(roomsToRecover, {});
+
+    auto* job = recoveryJob =
+        q->callApi<SyncJob>(BackgroundRequest, QString(), filter, 0);
+    job->setStringPool(&stringPool);
+    connect(job, &BaseJob::success, q, [this, job] {
+        recoveryJob = nullptr;
+        recoveryRetryDelay = MinRecoveryRetryDelay;
+        auto data = job->takeData();
+        finishRoomRecovery(data.takeRoomData());
+    });
+    connect(job, &BaseJob::failure, q, [this, job] {
+        qCWarning(MAIN) << "Failed to fetch rooms with broken cache:"
+                        << job->errorString() << "- retrying in"
+                        << recoveryRetryDelay.count() << "ms";
+        recoveryJob = nullptr;
+        // The rooms stay in recoveringRooms, their sync data still held
+        roomsToRecover = std::exchange(recoveryJobRooms, {}) + roomsToRecover;
+        recoveryRetryTimer.start(recoveryRetryDelay);
+        recoveryRetryDelay =
+            std::min(recoveryRetryDelay * 2, MaxRecoveryRetryDelay);
+    });
+}
+
+void Connection::Private::finishRoomRecovery(SyncDataList&& recoveredData)
+{
+    SyncDataList heldData;
+    for (const auto& roomId : std::exchange(recoveryJobRooms, {}))
+        if (auto it = recoveringRooms.find(roomId);
+            it != recoveringRooms.end()) {
+            std::move(it->second.begin(), it->second.end(),
+                      std::back_inserter(heldData));
+            recoveringRooms.erase(it);
         }
-        if (auto* r = q->provideRoom(roomData.roomId, roomData.joinState)) {
-            pendingStateRoomIds.removeOne(roomData.roomId);
-            // Update rooms one by one, giving time to update the UI.
-            QMetaObject::invokeMethod(
-                r,
-                [r, rd = std::move(roomData), fromCache] () mutable {
-                    r->updateData(std::move(rd), fromCache);
-                },
-                Qt::QueuedConnection);
+    qCDebug(MAIN) << "Recovered" << recoveredData.size() << "room(s)";
+    consumeRoomData(std::move(recoveredData), false);
+    consumeRoomData(std::move(heldData), false);
+    // Rooms that have failed to load since the recovery has started
+    startRoomRecovery();
+}
+
+void Connection::Private::updateCacheSinceToken()
+{
+    if (roomUpdateScheduler.queueDepth() == 0)
+        cacheSinceToken = data->lastEvent();
+}
+
+void Connection::Private::loadNextRooms()
+{
+    QElapsedTimer et;
+    et.start();
+    int loaded = 0;
+    while (!roomsToLoad.empty()
+           && et.elapsed() < roomUpdateScheduler.timeBudget().count()) {
+        const QPointer<Room> r = roomsToLoad.front();
+        roomsToLoad.pop_front();
+        if (r && !r->isFullyLoaded()) {
+            loadRoomFully(r);
+            ++loaded;
         }
     }
+    if (!roomsToLoad.empty())
+        roomLoaderTimer.start();
+    if (loaded > 0 && et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "*** Loaded full cached state of" << loaded
+                          << "room(s) in" << et << "-" << roomsToLoad.size()
+                          << "room(s) to go";
 }
 
 void Connection::Private::consumeAccountData(Events&& accountDataEvents)
@@ -1029,8 +1498,9 @@ void Connection::Private::consumeToDeviceEvents(Events&& toDeviceEvents)
                     handleEncryptedToDeviceEvent(*event);
                     return;
                 }
-                trackedUsers += event->senderId();
-                outdatedUsers += event->senderId();
+                const auto senderId = stringPool.intern(event->senderId());
+                trackedUsers += senderId;
+                outdatedUsers += senderId;
                 encryptionUpdateRequired = true;
                 pendingEncryptedEvents.push_back(std::move(event));
             }
@@ -1095,15 +1565,18 @@ void Connection::Private::consumeDevicesList(DevicesList&& devicesList)
 #ifdef Quotient_E2EE_ENABLED
     bool hasNewOutdatedUser = false;
     for(const auto &changed : devicesList.changed) {
-        if(trackedUsers.contains(changed)) {
-            outdatedUsers += changed;
+        // Users that are not in the pool can't be tracked either
+        if (const auto userId = stringPool.find(changed);
+            trackedUsers.contains(userId)) {
+            outdatedUsers += userId;
             hasNewOutdatedUser = true;
         }
     }
     for(const auto &left : devicesList.left) {
-        trackedUsers -= left;
-        outdatedUsers -= left;
-        deviceKeys.remove(left);
+        const auto userId = stringPool.find(left);
+        trackedUsers -= userId;
+        outdatedUsers -= userId;
+        deviceKeys.remove(userId);
     }
     if(hasNewOutdatedUser) {
         loadOutdatedUserDevices();
@@ -1523,7 +1996,7 @@ User* Connection::user(const QString& uId)
 {
     if (uId.isEmpty())
         return nullptr;
-    if (const auto v = d->userMap.value(uId, nullptr))
+    if (const auto v = d->userMap.value(d->stringPool.find(uId), nullptr))
         return v;
     // Before creating a user object, check that the user id is well-formed
     // (it's faster to just do a lookup above before validation)
@@ -1531,15 +2004,17 @@ User* Connection::user(const QString& uId)
         qCCritical(MAIN) << "Malformed userId:" << uId;
         return nullptr;
     }
-    auto* user = userFactory()(this, uId);
-    d->userMap.insert(uId, user);
+    const auto pooledId = d->stringPool.intern(uId);
+    auto* user = userFactory()(this, pooledId);
+    d->userMap.insert(pooledId, user);
+    d->usersById.insert(pooledId, user);
     emit newUser(user);
     return user;
 }
 
 const User* Connection::user() const
 {
-    return d->userMap.value(userId(), nullptr);
+    return d->userMap.value(d->stringPool.find(userId()), nullptr);
 }
 
 User* Connection::user() { return user(userId()); }
@@ -1671,6 +2146,8 @@ DirectChatsMap Connection::directChats() const
 // Removes room with given id from roomMap
 void Connection::Private::removeRoom(const QString& roomId)
 {
+    q->updateTimelineStore(
+        [roomId](TimelineStore& store) { store.remove(roomId); });
     for (auto f : { false, true })
         if (auto r = roomMap.take({ roomId, f })) {
             qCDebug(MAIN) << "Room" << r->objectName() << "in state" << terse
@@ -1759,7 +2236,116 @@ void Connection::removeFromIgnoredUsers(const User* user)
     }
 }
 
-QMap<QString, User*> Connection::users() const { return d->userMap; }
+QMap<QString, User*> Connection::users() const { return d->usersById; }
+
+void Connection::pinUser(const User* user)
+{
+    if (user)
+        ++d->userPins[d->stringPool.intern(user->id())];
+}
+
+void Connection::unpinUser(const User* user)
+{
+    if (!user)
+        return;
+    if (const auto it = d->userPins.find(d->stringPool.find(user->id()));
+        it != d->userPins.end() && --*it <= 0)
+        d->userPins.erase(it);
+}
+
+inline bool keepsUser(Membership membership)
+{
+    return membership == Membership::Join || membership == Membership::Invite;
+}
+
+int Connection::collectUnusedUsers()
+{
+    if (std::any_of(d->roomMap.cbegin(), d->roomMap.cend(),
+                    [](const Room* r) { return !r->isFullyLoaded(); })) {
+        qCDebug(MAIN) << "Not collecting user objects before all rooms"
+                         " are fully loaded";
+        return 0;
+    }
+
+    QElapsedTimer et;
+    et.start();
+    const auto ignored = ignoredUsers();
+    const auto localUserId = d->stringPool.find(userId());
+    // Direct chat maps, including those pending to be sent to the server,
+    // refer to user objects by pointer
+    QSet<const User*> directChatUsers;
+    for (const auto* dcMap :
+         { &d->directChats, &d->dcLocalAdditions, &d->dcLocalRemovals })
+        for (auto it = dcMap->keyBegin(); it != dcMap->keyEnd(); ++it)
+            directChatUsers.insert(*it);
+    for (const auto* u : std::as_const(d->directChatUsers))
+        directChatUsers.insert(u);
+    QHash<InternedString, User*> unused;
+    for (auto it = d->userMap.cbegin(); it != d->userMap.cend(); ++it)
+        if (it.key() != localUserId && !d->userPins.contains(it.key())
+            && !ignored.contains(it.key())
+            && !directChatUsers.contains(it.value()))
+            unused.insert(it.key(), it.value());
+
+    for (auto* r : std::as_const(d->roomMap)) {
+        if (unused.isEmpty())
+            break;
+        for (auto* u : r->usersTyping())
+            unused.remove(d->stringPool.find(u->id()));
+        // Large rooms usually have many more members than there are user
+        // objects; go through whichever is smaller
+        const auto& members = r->memberTable();
+        if (members.size() < unused.size()) {
+            for (const auto& m : members)
+                if (keepsUser(m.membership))
+                    unused.remove(m.userId);
+        } else
+            for (auto it = unused.begin(); it != unused.end();) {
+                const auto* m = members.find(it.key());
+                if (m && keepsUser(m->membership))
+                    it = unused.erase(it);
+                else
+                    ++it;
+            }
+    }
+
+    for (auto it = unused.cbegin(); it != unused.cend(); ++it) {
+        d->userMap.remove(it.key());
+        d->usersById.remove(it.key());
+        emit aboutToDeleteUser(it.value());
+        it.value()->deleteLater();
+    }
+    // User objects deleted above still hold their ids until deleteLater()
+    // kicks in; those strings are reclaimed on the next collection
+    const auto stringsCollected =
+        d->stringPool.collect() + Event::typePool().collect();
+    qCDebug(PROFILER) << "*** Collected" << unused.size() << "of"
+                      << d->userMap.size() + unused.size()
+                      << "user object(s) and" << stringsCollected
+                      << "pooled string(s) in" << et;
+    return int(unused.size());
+}
+
+StringPool& Connection::stringPool() { return d->stringPool; }
+
+RoomUpdateScheduler* Connection::roomUpdateScheduler() const
+{
+    return &d->roomUpdateScheduler;
+}
+
+StartupTrace* Connection::startupTrace() const { return &d->startupTrace; }
+
+SlidingSync* Connection::slidingSync()
+{
+    if (!d->slidingSync)
+        d->slidingSync = new SlidingSync(this, this);
+    return d->slidingSync;
+}
+
+void Connection::consumeRoomData(SyncRoomData&& roomData)
+{
+    d->consumeRoomData(std::move(roomData), false);
+}
 
 const ConnectionData* Connection::connectionData() const
 {
@@ -1799,6 +2385,11 @@ Room* Connection::provideRoom(const QString& id, Omittable<JoinState> joinState)
         d->roomMap.insert(roomKey, room);
         connect(room, &Room::beforeDestruction, this,
                 &Connection::aboutToDeleteRoom);
+        connect(room, &Room::addedMessages, this,
+                [this] { d->scheduleTimelineTrim(); });
+        // History loaded while a room was displayed can go now
+        connect(room, &Room::displayedChanged, this,
+                [this] { d->scheduleTimelineTrim(); });
         connect(room, &Room::baseStateLoaded, this, [this, room] {
             emit loadedRoomState(room);
             if (d->capabilities.roomVersions)
@@ -1873,7 +2464,9 @@ void Connection::setHomeserver(const QUrl& url)
 
     // Whenever a homeserver is updated, retrieve available login flows from it
     d->loginFlowsJob = callApi<GetLoginFlowsJob>(BackgroundRequest);
-    connect(d->loginFlowsJob, &BaseJob::result, this, [this] {
+    const auto startedAt = StartupTrace::clock::now();
+    connect(d->loginFlowsJob, &BaseJob::result, this, [this, startedAt] {
+        d->startupTrace.record(StartupTrace::LoginFlowsLookup, startedAt);
         if (d->loginFlowsJob->status().good())
             d->loginFlows = d->loginFlowsJob->flows();
         else
@@ -1887,20 +2480,161 @@ void Connection::saveRoomState(Room* r) const
     Q_ASSERT(r);
     if (!d->cacheState)
         return;
+    if (!r->isFullyLoaded()) {
+        // The room only has its index data; saving it would overwrite
+        // the full state in the cache
+        qCDebug(MAIN) << "Not saving the state of" << r->objectName()
+                      << "before it's fully loaded";
+        return;
+    }
+    d->markDirty(r);
+}
 
-    QFile outRoomFile { stateCacheDir().filePath(
-        SyncData::fileNameForRoom(r->id())) };
-    if (outRoomFile.open(QFile::WriteOnly)) {
-        const auto data =
-            d->cacheToBinary
-                ? QCborValue::fromJsonValue(r->toJson()).toCbor()
-                : QJsonDocument(r->toJson()).toJson(QJsonDocument::Compact);
-        outRoomFile.write(data.data(), data.size());
-        qCDebug(MAIN) << "Room state cache saved to" << outRoomFile.fileName();
-    } else {
-        qCWarning(MAIN) << "Error opening" << outRoomFile.fileName() << ":"
-                        << outRoomFile.errorString();
+void Connection::Private::markDirty(Room* r)
+{
+    dirtyRooms.insert(r->id(), r);
+    // Don't restart the timer if it's running: a busy room would never
+    // get saved otherwise
+    if (!cacheWriteTimer.isActive())
+        cacheWriteTimer.start();
+}
+
+void Connection::Private::flushDirtyRooms()
+{
+    cacheWriteTimer.stop();
+    if (dirtyRooms.isEmpty())
+        return;
+
+    QElapsedTimer et;
+    et.start();
+    std::vector<std::pair<QString, Room::CacheSnapshot>> snapshots;
+    snapshots.reserve(size_t(dirtyRooms.size()));
+    for (const auto& r : std::as_const(dirtyRooms))
+        if (r && r->isFullyLoaded())
+            snapshots.emplace_back(r->id(), r->cacheSnapshot());
+    dirtyRooms.clear();
+    if (et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "Took snapshots of" << snapshots.size()
+                          << "room(s) in" << et;
+
+    cacheWriter.start([store = openStateStore(), cacheDir = q->stateCacheDir(),
+                       binary = cacheToBinary, codec = cacheCodec,
+                       snapshots = std::move(snapshots)] {
+        for (const auto& [roomId, snapshot] : snapshots) {
+            const auto legacyFileName =
+                cacheDir.filePath(SyncData::fileNameForRoom(roomId));
+            if (store) {
+                const auto migrating = !store->contains(roomId);
+                if (store->put(roomId,
+                               serializeCache(snapshot, binary, codec))) {
+                    if (migrating)
+                        QFile::remove(legacyFileName);
+                    continue;
+                }
+            }
+            // No state store; use a file per room as before
+            if (writeCacheFile(legacyFileName, snapshot, binary, codec))
+                qCDebug(MAIN) << "Room state cache saved to" << legacyFileName;
+        }
+        if (store)
+            qCDebug(MAIN) << "Saved" << snapshots.size() << "room state(s) to"
+                          << store->fileName();
+    });
+}
+
+void Connection::Private::addStateVersions(QJsonObject& rootObj,
+                                           const StateStore& store)
+{
+    auto roomsJson = rootObj.take("rooms"_ls).toObject();
+    for (auto joinStateIt = roomsJson.begin(); joinStateIt != roomsJson.end();
+         ++joinStateIt) {
+        auto rooms = joinStateIt.value().toObject();
+        for (auto it = rooms.begin(); it != rooms.end(); ++it) {
+            auto entry = it.value().toObject();
+            entry.insert(StateStore::VersionKey,
+                         qint64(store.version(it.key())));
+            it.value() = entry;
+        }
+        joinStateIt.value() = rooms;
     }
+    rootObj.insert("rooms"_ls, roomsJson);
+}
+
+QByteArray Connection::Private::serializeCache(const QJsonObject& json,
+                                               bool binary,
+                                               const CacheCodec* codec)
+{
+    if (!binary)
+        return CacheCodec::pack(QJsonDocument(json).toJson(
+                                    QJsonDocument::Compact),
+                                codec);
+    QByteArray data;
+    QCborStreamWriter writer(&data);
+    writeJsonAsCbor(writer, json);
+    return CacheCodec::pack(data, codec);
+}
+
+QByteArray Connection::Private::serializeCache(
+    const Room::CacheSnapshot& snapshot, bool binary, const CacheCodec* codec)
+{
+    if (!binary)
+        return serializeCache(snapshot.toJson(), binary, codec);
+    QByteArray data;
+    QCborStreamWriter writer(&data);
+    snapshot.writeCbor(writer);
+    return CacheCodec::pack(data, codec);
+}
+
+//! \brief Write a cache file via a temporary file
+//!
+//! The old file is only replaced once \p writeTo has written the new one
+//! completely.
+template <typename FnT>
+inline bool saveCacheFile(const QString& fileName, FnT&& writeTo)
+{
+    QSaveFile file { fileName };
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(MAIN) << "Error opening" << fileName << ":"
+                        << file.errorString();
+        return false;
+    }
+    writeTo(file);
+    if (!file.commit()) {
+        qCWarning(MAIN) << "Error writing" << fileName << ":"
+                        << file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool Connection::Private::writeCacheFile(const QString& fileName,
+                                         const QJsonObject& json, bool binary,
+                                         const CacheCodec* codec)
+{
+    return saveCacheFile(fileName, [&](QSaveFile& file) {
+        if (codec)
+            file.write(serializeCache(json, binary, codec));
+        else if (binary) {
+            // Stream CBOR right into the file; QCborValue::fromJsonValue()
+            // followed by toCbor() would hold the whole output in memory
+            QCborStreamWriter writer(&file);
+            writeJsonAsCbor(writer, json);
+        } else
+            file.write(QJsonDocument(json).toJson(QJsonDocument::Compact));
+    });
+}
+
+bool Connection::Private::writeCacheFile(const QString& fileName,
+                                         const Room::CacheSnapshot& snapshot,
+                                         bool binary, const CacheCodec* codec)
+{
+    return saveCacheFile(fileName, [&](QSaveFile& file) {
+        if (binary && !codec) {
+            QCborStreamWriter writer(&file);
+            snapshot.writeCbor(writer);
+        } else
+            file.write(serializeCache(snapshot, binary, codec));
+    });
 }
 
 void Connection::saveState() const
@@ -1908,18 +2642,17 @@ void Connection::saveState() const
     if (!d->cacheState)
         return;
 
+    // The sync token saved below covers every batch received so far; apply
+    // the room updates of those batches still queued, so that the saved
+    // rooms don't lag behind it
+    d->roomUpdateScheduler.flush();
+    d->updateCacheSinceToken();
+    // Room states go to the writer before the index that refers to them
+    d->flushDirtyRooms();
+
     QElapsedTimer et;
     et.start();
 
-    QFile outFile { d->topLevelStatePath() };
-    if (!outFile.open(QFile::WriteOnly)) {
-        qCWarning(MAIN) << "Error opening" << outFile.fileName() << ":"
-                        << outFile.errorString();
-        qCWarning(MAIN) << "Caching the rooms state disabled";
-        d->cacheState = false;
-        return;
-    }
-
     QJsonObject rootObj {
         { QStringLiteral("cache_version"),
           QJsonObject {
@@ -1933,7 +2666,7 @@ void Connection::saveState() const
             if (r->joinState() == JoinState::Leave)
                 continue;
             (r->joinState() == JoinState::Invite ? inviteRoomsJson : roomsJson)
-                .insert(r->id(), QJsonValue::Null);
+                .insert(r->id(), r->toIndexJson());
         }
 
         QJsonObject roomObj;
@@ -1942,7 +2675,7 @@ void Connection::saveState() const
         if (!inviteRoomsJson.isEmpty())
             roomObj.insert(QStringLiteral("invite"), inviteRoomsJson);
 
-        rootObj.insert(QStringLiteral("next_batch"), d->data->lastEvent());
+        rootObj.insert(QStringLiteral("next_batch"), d->cacheSinceToken);
         rootObj.insert(QStringLiteral("rooms"), roomObj);
     }
     {
@@ -1964,13 +2697,19 @@ void Connection::saveState() const
     }
 #endif
 
-    const auto data =
-        d->cacheToBinary ? QCborValue::fromJsonValue(rootObj).toCbor()
-                         : QJsonDocument(rootObj).toJson(QJsonDocument::Compact);
     qCDebug(PROFILER) << "Cache for" << userId() << "generated in" << et;
-
-    outFile.write(data.data(), data.size());
-    qCDebug(MAIN) << "State cache saved to" << outFile.fileName();
+    d->cacheWriter.start([store = d->openStateStore(),
+                          fileName = d->topLevelStatePath(),
+                          binary = d->cacheToBinary, codec = d->cacheCodec,
+                          rootObj]() mutable {
+        // Room states have been written by now; record their versions
+        if (store)
+            Private::addStateVersions(rootObj, *store);
+        if (Private::writeCacheFile(fileName, rootObj, binary, codec))
+            qCDebug(MAIN) << "State cache saved to" << fileName;
+        if (store)
+            store->commit();
+    });
 }
 
 void Connection::loadState()
@@ -1981,18 +2720,27 @@ void Connection::loadState()
     QElapsedTimer et;
     et.start();
 
-    SyncData sync { d->topLevelStatePath() };
+    auto sync = d->lazyRoomLoading
+                    ? SyncData::loadCacheIndex(d->topLevelStatePath(),
+                                               &d->stringPool,
+                                               &d->startupTrace)
+                    : SyncData(d->topLevelStatePath(),
+                               d->parallelRoomParsing
+                                   ? QThreadPool::globalInstance()
+                                   : nullptr,
+                               &d->stringPool, d->openStateStore(),
+                               &d->startupTrace);
     if (sync.nextBatch().isEmpty()) // No token means no cache by definition
         return;
 
-    if (!sync.unresolvedRooms().isEmpty()) {
-        qCWarning(MAIN) << "State cache incomplete, discarding";
-        return;
-    }
-    // TODO: to handle load failures, instead of the above block:
-    // 1. Do initial sync on failed rooms without saving the nextBatch token
-    // 2. Do the sync across all rooms as normal
+    // Load all rooms that are fine; the rest are fetched from the server
+    // while the sync loop goes on from the cached token
+    const auto unresolvedRooms = sync.unresolvedRooms();
+    d->loadingCacheIndex = d->lazyRoomLoading;
     onSyncSuccess(std::move(sync), true);
+    d->loadingCacheIndex = false;
+    if (!unresolvedRooms.isEmpty())
+        d->recoverRooms(unresolvedRooms);
     qCDebug(PROFILER) << "*** Cached state for" << userId() << "loaded in" << et;
 }
 
@@ -2028,6 +2776,148 @@ void Connection::setLazyLoading(bool newValue)
     }
 }
 
+bool Connection::incrementalSyncParsing() const
+{
+    return d->incrementalSyncParsing;
+}
+
+void Connection::setIncrementalSyncParsing(bool newValue)
+{
+    d->incrementalSyncParsing = newValue;
+}
+
+bool Connection::parallelRoomParsing() const
+{
+    return d->parallelRoomParsing;
+}
+
+void Connection::setParallelRoomParsing(bool newValue)
+{
+    d->parallelRoomParsing = newValue;
+}
+
+bool Connection::pipelinedSync() const { return d->pipelinedSync; }
+
+void Connection::setPipelinedSync(bool newValue)
+{
+    d->pipelinedSync = newValue;
+}
+
+qint64 Connection::syncBacklogByteLimit() const
+{
+    return d->syncBacklogByteLimit;
+}
+
+void Connection::setSyncBacklogByteLimit(qint64 newLimit)
+{
+    d->syncBacklogByteLimit = newLimit;
+}
+
+qint64 Connection::syncBacklogEventLimit() const
+{
+    return d->syncBacklogEventLimit;
+}
+
+void Connection::setSyncBacklogEventLimit(qint64 newLimit)
+{
+    d->syncBacklogEventLimit = newLimit;
+}
+
+bool Connection::isSyncThrottled() const { return d->syncThrottled; }
+
+bool Connection::lazyRoomLoading() const { return d->lazyRoomLoading; }
+
+void Connection::setLazyRoomLoading(bool newValue)
+{
+    d->lazyRoomLoading = newValue;
+}
+
+void Connection::loadRoomFully(Room* r) { d->loadRoomFully(r); }
+
+bool Connection::compactEventStorage() const
+{
+    return d->compactEventStorage;
+}
+
+void Connection::setCompactEventStorage(bool newValue)
+{
+    d->compactEventStorage = newValue;
+}
+
+const CacheCodec* Connection::cacheCodec() const { return d->cacheCodec; }
+
+void Connection::setCacheCodec(const CacheCodec* codec)
+{
+    d->cacheCodec = codec;
+}
+
+bool Connection::storeTimelines() const { return d->storeTimelines; }
+
+void Connection::setStoreTimelines(bool newValue)
+{
+    d->storeTimelines = newValue;
+}
+
+TimelineStore* Connection::timelineStore() const
+{
+    return d->openTimelineStore();
+}
+
+void Connection::updateTimelineStore(
+    std::function<void(TimelineStore&)> update) const
+{
+    if (auto* store = d->openTimelineStore())
+        d->cacheWriter.start(
+            [store, update = std::move(update)] { update(*store); });
+}
+
+qint64 Connection::timelineEventLimit() const
+{
+    return d->timelineEventLimit;
+}
+
+void Connection::setTimelineEventLimit(qint64 newLimit)
+{
+    d->timelineEventLimit = newLimit;
+    d->scheduleTimelineTrim();
+}
+
+int Connection::historyPrefetchDistance() const
+{
+    return d->historyPrefetchDistance;
+}
+
+void Connection::setHistoryPrefetchDistance(int newDistance)
+{
+    d->historyPrefetchDistance = newDistance;
+}
+
+std::chrono::milliseconds Connection::userCollectionInterval() const
+{
+    return d->userCollectionTimer.isActive()
+               ? d->userCollectionTimer.intervalAsDuration()
+               : std::chrono::milliseconds::zero();
+}
+
+void Connection::setUserCollectionInterval(
+    std::chrono::milliseconds newInterval)
+{
+    if (newInterval > std::chrono::milliseconds::zero())
+        d->userCollectionTimer.start(newInterval);
+    else
+        d->userCollectionTimer.stop();
+}
+
+std::chrono::milliseconds Connection::cacheWriteInterval() const
+{
+    return d->cacheWriteTimer.intervalAsDuration();
+}
+
+void Connection::setCacheWriteInterval(std::chrono::milliseconds newInterval)
+{
+    d->cacheWriteTimer.setInterval(newInterval);
+}
+
 BaseJob* Connection::run(BaseJob* job, RunningPolicy runningPolicy)
 {
     // Reparent to protect from #397, #398 and to prevent BaseJob* from being
@@ -2113,8 +3003,9 @@ void Connection::Private::handleQueryKeys(const QueryKeysJob* job)
 {
     const auto newDeviceKeys = job->deviceKeys();
     for (const auto& [user, keys] : asKeyValueRange(newDeviceKeys)) {
-        QHash<QString, Quotient::DeviceKeys> oldDevices = deviceKeys[user];
-        deviceKeys[user].clear();
+        const auto userId = stringPool.intern(user);
+        QHash<QString, Quotient::DeviceKeys> oldDevices = deviceKeys[userId];
+        deviceKeys[userId].clear();
         for(const auto &device : keys) {
             if(device.userId != user) {
                 qWarning(E2EE)
@@ -2143,9 +3034,9 @@ void Connection::Private::handleQueryKeys(const QueryKeysJob* job)
                     continue;
                 }
             }
-            deviceKeys[user][device.deviceId] = SLICE(device, DeviceKeys);
+            deviceKeys[userId][device.deviceId] = SLICE(device, DeviceKeys);
         }
-        outdatedUsers -= user;
+        outdatedUsers -= userId;
     }
     saveDevicesList();
 
@@ -2195,7 +3086,7 @@ void Connection::Private::saveDevicesList()
     query.prepare(QStringLiteral(
         "INSERT INTO tracked_users(matrixId) VALUES(:matrixId);"));
     for (const auto& user : trackedUsers) {
-        query.bindValue(":matrixId", user);
+        query.bindValue(":matrixId", user.toString());
         q->database()->execute(query);
     }
 
@@ -2204,7 +3095,7 @@ void Connection::Private::saveDevicesList()
     query.prepare(QStringLiteral(
         "INSERT INTO outdated_users(matrixId) VALUES(:matrixId);"));
     for (const auto& user : outdatedUsers) {
-        query.bindValue(":matrixId", user);
+        query.bindValue(":matrixId", user.toString());
         q->database()->execute(query);
     }
 
@@ -2219,7 +3110,7 @@ void Connection::Private::saveDevicesList()
             auto curveKeyId = keys[0].startsWith("curve"_ls) ? keys[0] : keys[1];
             auto edKeyId = keys[0].startsWith("ed"_ls) ? keys[0] : keys[1];
 
-            query.bindValue(":matrixId", user);
+            query.bindValue(":matrixId", user.toString());
             query.bindValue(":deviceId", device.deviceId);
             query.bindValue(":curveKeyId", curveKeyId);
             query.bindValue(":curveKey", device.keys[curveKeyId]);
@@ -2239,19 +3130,20 @@ void Connection::Private::loadDevicesList()
     auto query = q->database()->prepareQuery(QStringLiteral("SELECT * FROM tracked_users;"));
     q->database()->execute(query);
     while(query.next()) {
-        trackedUsers += query.value(0).toString();
+        trackedUsers += stringPool.intern(query.value(0).toString());
     }
 
     query = q->database()->prepareQuery(QStringLiteral("SELECT * FROM outdated_users;"));
     q->database()->execute(query);
     while(query.next()) {
-        outdatedUsers += query.value(0).toString();
+        outdatedUsers += stringPool.intern(query.value(0).toString());
     }
 
     query = q->database()->prepareQuery(QStringLiteral("SELECT * FROM tracked_devices;"));
     q->database()->execute(query);
     while(query.next()) {
-        deviceKeys[query.value("matrixId").toString()][query.value("deviceId").toString()] = DeviceKeys {
+        deviceKeys[stringPool.intern(query.value("matrixId").toString())]
+                  [query.value("deviceId").toString()] = DeviceKeys {
             query.value("matrixId").toString(),
             query.value("deviceId").toString(),
             { "m.olm.v1.curve25519-aes-sha2", "m.megolm.v1.aes-sha2"},
@@ -2263,17 +3155,29 @@ void Connection::Private::loadDevicesList()
 
 }
 
-void Connection::encryptionUpdate(const Room* room, const QList<User*>& invited)
+void Connection::encryptionUpdate(const Room* room,
+                                  const QStringList& invitedIds)
 {
-    for (const auto& user : room->users() + invited) {
-        if(!d->trackedUsers.contains(user->id())) {
-            d->trackedUsers += user->id();
-            d->outdatedUsers += user->id();
+    for (const auto& userId : room->memberIds() + invitedIds) {
+        if (const auto pooledId = d->stringPool.intern(userId);
+            !d->trackedUsers.contains(pooledId)) {
+            d->trackedUsers += pooledId;
+            d->outdatedUsers += pooledId;
             d->encryptionUpdateRequired = true;
         }
     }
 }
 
+void Connection::encryptionUpdate(const Room* room,
+                                  const QList<User*>& invited)
+{
+    QStringList invitedIds;
+    invitedIds.reserve(invited.size());
+    for (const auto* u : invited)
+        invitedIds << u->id();
+    encryptionUpdate(room, invitedIds);
+}
+
 void Connection::Private::saveOlmAccount()
 {
     qCDebug(E2EE) << "Saving olm account";
@@ -2298,7 +3202,11 @@ Database* Connection::database() const
 UnorderedMap<QString, QOlmInboundGroupSession>
 Connection::loadRoomMegolmSessions(const Room* room) const
 {
-    return database()->loadMegolmSessions(room->id());
+    const auto startedAt = StartupTrace::clock::now();
+    auto sessions = database()->loadMegolmSessions(room->id());
+    d->startupTrace.record(StartupTrace::E2eeSessionLoad, startedAt,
+                           qint64(sessions.size()));
+    return sessions;
 }
 
 void Connection::saveMegolmSession(const Room* room,
@@ -2309,19 +3217,23 @@ void Connection::saveMegolmSession(const Room* room,
 
 QStringList Connection::devicesForUser(const QString& userId) const
 {
-    return d->deviceKeys.value(userId).keys();
+    return d->deviceKeys.value(d->stringPool.find(userId)).keys();
 }
 
 QString Connection::Private::curveKeyForUserDevice(const QString& userId,
                                                    const QString& device) const
 {
-    return deviceKeys[userId][device].keys["curve25519:" % device];
+    return deviceKeys.value(stringPool.find(userId))
+        .value(device)
+        .keys.value("curve25519:" % device);
 }
 
 QString Connection::edKeyForUserDevice(const QString& userId,
                                        const QString& deviceId) const
 {
-    return d->deviceKeys[userId][deviceId].keys["ed25519:" % deviceId];
+    return d->deviceKeys.value(d->stringPool.find(userId))
+        .value(deviceId)
+        .keys.value("ed25519:" % deviceId);
 }
 
 bool Connection::Private::isKnownCurveKey(const QString& userId,
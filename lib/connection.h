@@ -19,6 +19,7 @@
 #include <QtCore/QSize>
 #include <QtCore/QUrl>
 
+#include <chrono>
 #include <functional>
 
 #ifdef Quotient_E2EE_ENABLED
@@ -39,6 +40,7 @@ class RoomEvent;
 
 class SyncJob;
 class SyncData;
+class SyncRoomData;
 class RoomMessagesJob;
 class PostReceiptJob;
 class ForgetRoomJob;
@@ -51,6 +53,12 @@ class SendToDeviceJob;
 class SendMessageJob;
 class LeaveRoomJob;
 class Database;
+class StringPool;
+class TimelineStore;
+class CacheCodec;
+class RoomUpdateScheduler;
+class StartupTrace;
+class SlidingSync;
 struct EncryptedFileMetadata;
 
 class QOlmAccount;
@@ -138,6 +146,10 @@ public:
         UnpublishRoom
     }; // FIXME: Should go inside CreateRoomJob
 
+    static constexpr std::chrono::milliseconds DefaultCacheWriteInterval {
+        1000
+    };
+
     explicit Connection(QObject* parent = nullptr);
     explicit Connection(const QUrl& server, QObject* parent = nullptr);
     ~Connection() override;
@@ -265,9 +277,89 @@ public:
     //! \sa ignoredUsersListChanged
     Q_INVOKABLE void removeFromIgnoredUsers(const Quotient::User* user);
 
-    //! Get the full list of users known to this account
+    //! \brief Get the full list of users known to this account
+    //!
+    //! The map doesn't include users already collected by
+    //! collectUnusedUsers().
     QMap<QString, User*> users() const;
 
+    //! \brief Keep the user object from being collected
+    //!
+    //! Pins are counted: the object stays until unpinUser() is called for it
+    //! as many times as pinUser(). Pin users whose objects are kept by
+    //! the client for longer than the rooms they are members of.
+    //! \sa collectUnusedUsers
+    Q_INVOKABLE void pinUser(const Quotient::User* user);
+    //! Remove one pin of the user object, see pinUser()
+    Q_INVOKABLE void unpinUser(const Quotient::User* user);
+
+    //! \brief Delete user objects that are no longer referenced
+    //!
+    //! A user object is kept if it's the local user, is pinned with pinUser(),
+    //! is ignored, has a direct chat with the local user (including direct
+    //! chat changes not sent to the server yet), is typing in a room or has
+    //! joined or been invited to a room of this connection (including
+    //! invitations). All other user objects are removed from users() and
+    //! deleted with QObject::deleteLater(), after emitting aboutToDeleteUser();
+    //! user() makes a new object for the same id if it's asked for later.
+    //! Strings in stringPool() that are no more used are dropped as well.
+    //!
+    //! Nothing is collected while some rooms haven't loaded their full cached
+    //! state yet (see lazyRoomLoading()), as their members are not known.
+    //! \return the number of collected user objects
+    //! \sa userCollectionInterval
+    int collectUnusedUsers();
+
+    //! \brief The pool of identifiers shared by this connection's objects
+    //!
+    //! User ids, room ids and sender ids of events coming from the server
+    //! are interned in this pool so that each distinct id is stored once
+    //! for the whole connection, no matter how many rooms, events and
+    //! receipts refer to it. The pool is trimmed by collectUnusedUsers().
+    StringPool& stringPool();
+
+    //! \brief The scheduler applying updates from sync batches to rooms
+    //!
+    //! Use it to tune the time budget of room updates and to monitor
+    //! the queue of room updates not applied yet.
+    RoomUpdateScheduler* roomUpdateScheduler() const;
+
+    //! \brief Timings of the phases of this connection's startup
+    //!
+    //! The trace covers loading the access token (when the connection is
+    //! made by AccountRegistry), resolving the homeserver, loading the cache,
+    //! setting up E2EE and the first sync; it's finished once the first
+    //! /sync response has been applied to rooms (see startupTraceFinished()).
+    //! Use StartupTrace::toJson() to save it, e.g. to compare startup times
+    //! across releases.
+    StartupTrace* startupTrace() const;
+
+    //! \brief The local store of room timelines
+    //!
+    //! \return the store in stateCacheDir(), or nullptr if timelines are
+    //!         not stored (see storeTimelines()) or the store can't be opened
+    TimelineStore* timelineStore() const;
+
+    //! \brief Change timelineStore() on the thread writing the cache
+    //!
+    //! \p update is called with the store after the cache writes and
+    //! the store updates queued before; reading the store in the meantime
+    //! doesn't see the changes made by \p update. Does nothing if timelines
+    //! are not stored.
+    void updateTimelineStore(std::function<void(TimelineStore&)> update) const;
+
+    //! \brief The sliding sync engine of this connection
+    //!
+    //! The engine is created on the first call and is not started; call
+    //! SlidingSync::start() to use it instead of syncLoop().
+    //! \warning Sliding sync only receives room data: to-device messages,
+    //!          E2EE data (device lists, one-time key counts) and account
+    //!          data are not requested. With E2EE, encrypted rooms don't get
+    //!          their keys; keep using syncLoop() for accounts relying on
+    //!          end-to-end encryption, or for account data such as direct
+    //!          chats and ignored users.
+    SlidingSync* slidingSync();
+
     //! Get the base URL of the homeserver to connect to
     QUrl homeserver() const;
     //! Get the domain name used for ids/aliases on the server
@@ -381,7 +473,10 @@ public:
 
     //! \brief Load room state from a previously saved file
     //!
-    //! Call this before first sync.
+    //! Call this before first sync. Rooms which cached state is missing,
+    //! broken (see StateStore) or outdated are fetched from the server with
+    //! a separate initial sync limited to these rooms; the rest of the cache
+    //! is used as usual.
     //! \sa saveState
     Q_INVOKABLE void loadState();
 
@@ -389,11 +484,25 @@ public:
     //!
     //! This method saves the current state of rooms (but not messages
     //! in them) to a local cache file, so that it could be loaded by
-    //! loadState() on a next run of the client.
+    //! loadState() on a next run of the client. The state is written
+    //! to the cache on a background thread; the thread is waited for
+    //! when the application is about to quit and when the connection
+    //! is destroyed. Room updates still queued in roomUpdateScheduler()
+    //! are applied first, disregarding its time budget, so that the saved
+    //! rooms match the saved sync token.
     //! \sa loadState
     Q_INVOKABLE void saveState() const;
 
-    //! This method saves the current state of a single room.
+    //! \brief Save the current state of a single room
+    //!
+    //! The room is only marked to be saved; the states of rooms marked
+    //! during cacheWriteInterval() are saved together, on a background
+    //! thread. saveState() saves marked rooms right away, along with
+    //! the top-level cache file.
+    //!
+    //! Room states are saved to a single StateStore file in stateCacheDir();
+    //! the room cache file from older versions, if any, is removed once
+    //! the room is saved to the store.
     void saveRoomState(Room* r) const;
 
     //! \brief Get the default directory path to save the room state to
@@ -420,6 +529,149 @@ public:
     bool lazyLoading() const;
     void setLazyLoading(bool newValue);
 
+    //! \brief Whether /sync responses are parsed while being received
+    //!
+    //! When enabled, sync jobs split the response into rooms on the fly
+    //! instead of reading and parsing the whole body at once; this saves
+    //! holding the whole raw response and its JSON tree in memory at the same
+    //! time, and parsing mostly finishes by the time the last byte arrives.
+    //! The parsed rooms are still only applied once the whole response has
+    //! arrived, after the account data and to-device events of the batch:
+    //! peak memory use is still that of all parsed events in the response,
+    //! only the latency of parsing goes down. Disabled by default.
+    //! \sa SyncJob::setIncrementalParsing
+    bool incrementalSyncParsing() const;
+    void setIncrementalSyncParsing(bool newValue);
+
+    //! \brief Whether rooms are parsed in parallel
+    //!
+    //! When enabled, room data from /sync responses and from the state
+    //! cache (including reading room cache files) is parsed using
+    //! QThreadPool::globalInstance(); the order in which rooms are then
+    //! processed stays the same. Disabled by default.
+    //! \sa SyncData::setThreadPool
+    bool parallelRoomParsing() const;
+    void setParallelRoomParsing(bool newValue);
+
+    //! \brief Whether the sync loop requests the next batch before
+    //!        processing the current one
+    //!
+    //! When enabled, the sync loop (see syncLoop()) starts the next /sync
+    //! request as soon as a response has been received and parsed, and only
+    //! then processes that response; this way, processing time doesn't add
+    //! up to the latency of the next batch. Batches are still processed
+    //! strictly in the order of arrival. syncDone() is emitted with the next
+    //! sync request already running. Disabled by default; has no effect on
+    //! single sync() calls.
+    bool pipelinedSync() const;
+    void setPipelinedSync(bool newValue);
+
+    //! \brief Limits on sync data received but not applied to rooms yet
+    //!
+    //! When room updates fall behind the sync loop (see
+    //! roomUpdateScheduler()) and the JSON size or the number of events
+    //! in pending room updates exceeds either of these limits, the sync loop
+    //! delays the next /sync request until the backlog shrinks to a half
+    //! of the limit; syncThrottledChanged() is emitted on pausing and
+    //! resuming. Zero (the default) means no limit.
+    //!
+    //! The byte count is an estimate: it is the size of the JSON that
+    //! the updates have been parsed from (see SyncRoomData::jsonSize), not
+    //! the memory taken by the parsed data, which is usually several times
+    //! larger. With pipelinedSync(), a request already sent when a batch
+    //! exceeds the limits is abandoned and repeated later.
+    //! \sa SyncRoomData::jsonSize
+    qint64 syncBacklogByteLimit() const;
+    void setSyncBacklogByteLimit(qint64 newLimit);
+    qint64 syncBacklogEventLimit() const;
+    void setSyncBacklogEventLimit(qint64 newLimit);
+    //! Whether the sync loop is paused because of the sync data backlog
+    bool isSyncThrottled() const;
+
+    //! \brief Whether loadState() loads rooms lazily
+    //!
+    //! When enabled, loadState() creates rooms from the index in the
+    //! top-level cache file, with only the data needed to show them in
+    //! the room list (name, avatar, summary, unread counts), and doesn't
+    //! read room cache files; the full cached state of each room is loaded
+    //! later, see Room::isFullyLoaded(). This makes startup time depend
+    //! on the number of rooms but not on the size of their state. Disabled
+    //! by default.
+    bool lazyRoomLoading() const;
+    void setLazyRoomLoading(bool newValue);
+
+    //! \brief Whether timeline events in rooms not displayed are kept compact
+    //!
+    //! When enabled, the JSON tree of each timeline event in a room that is
+    //! not displayed is released once the event is added to the timeline;
+    //! all timeline events of a room are released when it stops being
+    //! displayed. The trees are rebuilt on demand, see Event::releaseJson().
+    //! Disabled by default.
+    //! \sa Room::setDisplayed
+    bool compactEventStorage() const;
+    void setCompactEventStorage(bool newValue);
+
+    //! \brief The codec to compress cache files with
+    //!
+    //! Room states and the top-level cache file are compressed with this
+    //! codec when saved; nullptr (the default) means no compression. Cache
+    //! files are loaded regardless of the codec they were saved with, as
+    //! long as the codec is registered (see CacheCodec::registerCodec()).
+    //! \sa CacheCodec::zlib, CacheCodec::dictionary
+    const CacheCodec* cacheCodec() const;
+    void setCacheCodec(const CacheCodec* codec);
+
+    //! \brief Whether room timelines are stored locally
+    //!
+    //! When enabled (along with cacheState()), timeline events received
+    //! from the server are stored in timelineStore(). A room loaded from
+    //! the cache then shows its latest stored events right away, and
+    //! Room::getPreviousContent() loads older stored events before going
+    //! to the server. Disabled by default.
+    bool storeTimelines() const;
+    void setStoreTimelines(bool newValue);
+
+    //! \brief The number of timeline events to keep in memory in all rooms
+    //!
+    //! Timelines only grow as new events arrive and history is loaded;
+    //! once the timelines of all rooms together have more events than this,
+    //! the oldest events are dropped from rooms that are not displayed,
+    //! the longest timelines first (see Room::evictOldestEvents()), until
+    //! the total is within the limit or no more events can be dropped.
+    //! The dropped events can be loaded again with Room::getPreviousContent(),
+    //! from timelineStore() if timelines are stored. Zero (the default) means
+    //! no limit.
+    qint64 timelineEventLimit() const;
+    void setTimelineEventLimit(qint64 newLimit);
+
+    //! \brief How many events to keep loaded before the first displayed one
+    //!
+    //! When a displayed room has fewer events than this before
+    //! Room::firstDisplayedMarker(), older events are requested right away
+    //! instead of waiting for Room::getPreviousContent() calls. The faster
+    //! the user scrolls back, the larger the requested pages. Zero (the
+    //! default) disables prefetching.
+    int historyPrefetchDistance() const;
+    void setHistoryPrefetchDistance(int newDistance);
+
+    //! \brief How often to delete user objects that are no longer used
+    //!
+    //! Users seen in rooms are kept as User objects until the connection
+    //! is destroyed; with this option set, collectUnusedUsers() is called
+    //! at the given interval so that long-running clients don't accumulate
+    //! users of rooms they have left. Zero (the default) disables
+    //! the collection.
+    std::chrono::milliseconds userCollectionInterval() const;
+    void setUserCollectionInterval(std::chrono::milliseconds newInterval);
+
+    //! \brief How long room changes are collected before saving them
+    //!
+    //! The first saveRoomState() call after the room states have been saved
+    //! starts this interval; all rooms changed during it are saved together
+    //! when it ends. Defaults to DefaultCacheWriteInterval.
+    std::chrono::milliseconds cacheWriteInterval() const;
+    void setCacheWriteInterval(std::chrono::milliseconds newInterval);
+
     //! Start a pre-created job object on this connection
     Q_INVOKABLE BaseJob* run(BaseJob* job,
                              RunningPolicy runningPolicy = ForegroundRequest);
@@ -684,7 +936,10 @@ public Q_SLOTS:
     KeyVerificationSession* startKeyVerificationSession(const QString& userId,
                                                         const QString& deviceId);
 
-    void encryptionUpdate(const Room* room, const QList<User*>& invited = {});
+    void encryptionUpdate(const Room* room,
+                          const QStringList& invitedIds = {});
+    [[deprecated("Pass user ids of the invited users instead")]] //
+    void encryptionUpdate(const Room* room, const QList<User*>& invited);
 #endif
 
     static Connection* makeMockConnection(const QString& mxId);
@@ -732,8 +987,19 @@ Q_SIGNALS:
 
     void syncDone();
     void syncError(QString message, QString details);
+    //! \brief The sync loop has been paused or resumed
+    //! \sa syncBacklogByteLimit, syncBacklogEventLimit
+    void syncThrottledChanged(bool throttled);
+    //! The first /sync response has been applied, see startupTrace()
+    void startupTraceFinished();
 
     void newUser(Quotient::User* user);
+    //! \brief The user object is about to be deleted by collectUnusedUsers()
+    //!
+    //! The object is already removed from users() at this point and will be
+    //! deleted once the control returns to the event loop; drop any
+    //! pointers to it.
+    void aboutToDeleteUser(Quotient::User* user);
 
     //! \group Signals emitted on room transitions
     //!
@@ -880,6 +1146,13 @@ protected Q_SLOTS:
     void syncLoopIteration();
 
 private:
+    friend class SlidingSync;
+    friend class Room;
+    //! Feed room data obtained by means other than SyncJob
+    void consumeRoomData(SyncRoomData&& roomData);
+    //! Load the full cached state of a room created from the cache index
+    void loadRoomFully(Room* r);
+
     class Private;
     ImplPtr<Private> d;
 
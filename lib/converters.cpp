@@ -4,8 +4,12 @@
 #include "converters.h"
 #include "logging.h"
 
+#include <QtCore/QCborStreamReader>
+#include <QtCore/QCborStreamWriter>
 #include <QtCore/QVariant>
 
+#include <cmath>
+
 void Quotient::_impl::warnUnknownEnumValue(const QString& stringValue,
                                            const char* enumTypeName)
 {
@@ -39,3 +43,139 @@ QVariantHash Quotient::fromJson(const QJsonValue& jv)
 {
     return jv.toObject().toVariantHash();
 }
+
+namespace {
+QString readCborString(QCborStreamReader& reader)
+{
+    QString result;
+    auto chunk = reader.readString();
+    for (; chunk.status == QCborStreamReader::Ok; chunk = reader.readString())
+        result += chunk.data;
+    return result;
+}
+
+QByteArray readCborByteArray(QCborStreamReader& reader)
+{
+    QByteArray result;
+    auto chunk = reader.readByteArray();
+    for (; chunk.status == QCborStreamReader::Ok;
+         chunk = reader.readByteArray())
+        result += chunk.data;
+    return result;
+}
+
+QJsonValue finiteOrNull(double d)
+{
+    return std::isfinite(d) ? QJsonValue(d) : QJsonValue(QJsonValue::Null);
+}
+} // namespace
+
+QJsonValue Quotient::readCborAsJson(QCborStreamReader& reader)
+{
+    switch (reader.type()) {
+    case QCborStreamReader::UnsignedInteger:
+    case QCborStreamReader::NegativeInteger: {
+        const auto v = reader.toInteger();
+        reader.next();
+        return QJsonValue(v);
+    }
+    case QCborStreamReader::String:
+        return readCborString(reader);
+    case QCborStreamReader::ByteArray:
+        return QString::fromLatin1(readCborByteArray(reader).toBase64(
+            QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals));
+    case QCborStreamReader::Array: {
+        QJsonArray result;
+        reader.enterContainer();
+        while (reader.lastError() == QCborError::NoError && reader.hasNext())
+            result.append(readCborAsJson(reader));
+        if (reader.lastError() == QCborError::NoError)
+            reader.leaveContainer();
+        return result;
+    }
+    case QCborStreamReader::Map: {
+        QJsonObject result;
+        reader.enterContainer();
+        while (reader.lastError() == QCborError::NoError && reader.hasNext()) {
+            // Caches only have string keys; other keys are stringified
+            // in a simplistic way, enough to not lose the entry
+            const auto key = reader.isString()
+                                 ? readCborString(reader)
+                                 : readCborAsJson(reader).toVariant().toString();
+            result.insert(key, readCborAsJson(reader));
+        }
+        if (reader.lastError() == QCborError::NoError)
+            reader.leaveContainer();
+        return result;
+    }
+    case QCborStreamReader::Tag:
+        reader.next(); // Skip the tag, read the tagged value
+        return readCborAsJson(reader);
+    case QCborStreamReader::SimpleType: {
+        const auto v = reader.toSimpleType();
+        reader.next();
+        return v == QCborSimpleType::True    ? QJsonValue(true)
+               : v == QCborSimpleType::False ? QJsonValue(false)
+                                             : QJsonValue(QJsonValue::Null);
+    }
+    case QCborStreamReader::Float16: {
+        const auto v = float(reader.toFloat16());
+        reader.next();
+        return finiteOrNull(v);
+    }
+    case QCborStreamReader::Float: {
+        const auto v = reader.toFloat();
+        reader.next();
+        return finiteOrNull(v);
+    }
+    case QCborStreamReader::Double: {
+        const auto v = reader.toDouble();
+        reader.next();
+        return finiteOrNull(v);
+    }
+    case QCborStreamReader::Invalid:
+        break;
+    }
+    return {};
+}
+
+void Quotient::writeJsonAsCbor(QCborStreamWriter& writer, const QJsonValue& jv)
+{
+    switch (jv.type()) {
+    case QJsonValue::Bool:
+        writer.append(jv.toBool());
+        break;
+    case QJsonValue::Double: {
+        // Integral values are stored as integers, as QCborValue does
+        const auto d = jv.toDouble();
+        if (std::trunc(d) == d && std::abs(d) < 9.0e18)
+            writer.append(qint64(d));
+        else
+            writer.append(d);
+        break;
+    }
+    case QJsonValue::String:
+        writer.append(QStringView(jv.toString()));
+        break;
+    case QJsonValue::Array: {
+        const auto array = jv.toArray();
+        writer.startArray(quint64(array.size()));
+        for (const auto& item : array)
+            writeJsonAsCbor(writer, item);
+        writer.endArray();
+        break;
+    }
+    case QJsonValue::Object: {
+        const auto object = jv.toObject();
+        writer.startMap(quint64(object.size()));
+        for (auto it = object.begin(); it != object.end(); ++it) {
+            writer.append(QStringView(it.key()));
+            writeJsonAsCbor(writer, it.value());
+        }
+        writer.endMap();
+        break;
+    }
+    default: // Null and Undefined
+        writer.append(nullptr);
+    }
+}
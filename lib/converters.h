@@ -19,6 +19,8 @@
 #include <variant>
 
 class QVariant;
+class QCborStreamReader;
+class QCborStreamWriter;
 
 namespace Quotient {
 template <typename T>
@@ -526,6 +528,24 @@ inline void addParam(ContT& container, const QString& key, ValT&& value)
                                                     std::forward<ValT>(value));
 }
 
+//! \brief Read a CBOR data item from \p reader as a JSON value
+//!
+//! This is equivalent to QCborValue::fromCbor(reader).toJsonValue() for data
+//! that came from JSON (e.g., the binary state cache) but builds the JSON
+//! tree directly from the stream, without an intermediate QCborValue tree.
+//! Byte strings are converted to base64url strings, tags are dropped and
+//! simple values other than booleans and null become null, as
+//! QCborValue::toJsonValue() does. On a stream error the value read so far
+//! is returned; check \p reader's lastError() to detect that.
+QUOTIENT_API QJsonValue readCborAsJson(QCborStreamReader& reader);
+
+//! \brief Write a JSON value to \p writer as CBOR
+//!
+//! The output is the same as with QCborValue::fromJsonValue(jv).toCbor(),
+//! without building the intermediate QCborValue tree and the byte array.
+QUOTIENT_API void writeJsonAsCbor(QCborStreamWriter& writer,
+                                  const QJsonValue& jv);
+
 // This is a facility function to convert camelCase method/variable names
 // used throughout Quotient to snake_case JSON keys - see usage in
 // single_key_value.h and event.h (DEFINE_CONTENT_GETTER macro).
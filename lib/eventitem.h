@@ -91,6 +91,8 @@ public:
     index_t index() const { return idx; }
 
 private:
+    // Room renumbers older events when it inserts events into a gap
+    friend class Room;
     index_t idx;
 };
 
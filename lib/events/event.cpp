@@ -9,10 +9,53 @@
 
 #include <QtCore/QJsonDocument>
 
+#include <mutex>
+#include <thread>
+
 using namespace Quotient;
 
+struct AbstractEventMetaType::LookupIndex {
+    //! A candidate with its position in the order of the tree walk
+    struct Entry {
+        size_t order;
+        const AbstractEventMetaType* metaType;
+    };
+
+    int generation;
+    //! Specific event types below the indexed one, by Matrix type
+    QHash<QString, std::vector<Entry>> specificTypes{};
+    //! Base event types below the indexed one that have isValid() and
+    //! therefore produce generic events of their own
+    std::vector<Entry> validatingBaseTypes{};
+    //! The index replaced by this one after a late registration; it may
+    //! still be in use by other threads, and since that is very rare, it's
+    //! just kept around
+    std::unique_ptr<const LookupIndex> previous{};
+};
+
+namespace {
+// Bumped on every registration to invalidate existing lookup indices
+std::atomic<int> registrationGeneration { 0 };
+std::mutex lookupIndexMutex;
+} // namespace
+
 QString EventTypeRegistry::getMatrixType(event_type_t typeId) { return typeId; }
 
+AbstractEventMetaType::AbstractEventMetaType(const char* className,
+                                             AbstractEventMetaType* nearestBase,
+                                             const char* matrixId)
+    : className(className)
+    , baseType(nearestBase)
+    , matrixId(matrixId)
+    , internedMatrixId(
+          matrixId != nullptr
+              ? Event::typePool().intern(QString::fromLatin1(matrixId))
+              : InternedString())
+{
+    if (nearestBase)
+        nearestBase->addDerived(this);
+}
+
 void AbstractEventMetaType::addDerived(const AbstractEventMetaType* newType)
 {
     if (const auto existing =
@@ -41,14 +84,92 @@ void AbstractEventMetaType::addDerived(const AbstractEventMetaType* newType)
                "latter class will never be used";
     }
     derivedTypes.emplace_back(newType);
+    ++registrationGeneration;
     qDebug(EVENTS).nospace()
         << newType->matrixId << " -> " << newType->className << "; "
         << derivedTypes.size() << " derived type(s) registered for "
         << className;
 }
 
+AbstractEventMetaType::~AbstractEventMetaType()
+{
+    delete lookupIndex.load();
+}
+
+void AbstractEventMetaType::fillIndex(LookupIndex& index, size_t& order) const
+{
+    // Entries are numbered in the order in which doLoadFrom() would finish
+    // with them: a base type is only tried after its whole subtree
+    for (const auto* p : derivedTypes)
+        if (p->hasTypeId())
+            index.specificTypes[p->matrixId].push_back({ order++, p });
+        else {
+            p->fillIndex(index, order);
+            if (p->hasValidator())
+                index.validatingBaseTypes.push_back({ order++, p });
+        }
+}
+
+const AbstractEventMetaType::LookupIndex* AbstractEventMetaType::index() const
+{
+    const auto generation = registrationGeneration.load();
+    if (const auto* idx = lookupIndex.load();
+        Q_LIKELY(idx && idx->generation == generation))
+        return idx;
+
+    const std::lock_guard _(lookupIndexMutex);
+    const auto* oldIdx = lookupIndex.load();
+    if (oldIdx && oldIdx->generation == generation)
+        return oldIdx; // Another thread has just built it
+    auto* newIdx = new LookupIndex{ generation };
+    size_t order = 0;
+    fillIndex(*newIdx, order);
+    newIdx->previous.reset(oldIdx);
+    lookupIndex.store(newIdx);
+    return newIdx;
+}
+
+Event* AbstractEventMetaType::loadDerived(const QJsonObject& fullJson,
+                                          const QString& type) const
+{
+    const auto* idx = index();
+    const auto& bases = idx->validatingBaseTypes;
+    static const std::vector<LookupIndex::Entry> NoSpecificTypes;
+    const auto it = idx->specificTypes.constFind(type);
+    const auto& specifics =
+        it != idx->specificTypes.cend() ? *it : NoSpecificTypes;
+
+    // Merge the two lists of candidates back in the order of the tree walk
+    auto specificIt = specifics.cbegin();
+    auto baseIt = bases.cbegin();
+    while (specificIt != specifics.cend() || baseIt != bases.cend()) {
+        const auto& candidate =
+            baseIt == bases.cend()
+                    || (specificIt != specifics.cend()
+                        && specificIt->order < baseIt->order)
+                ? *specificIt++
+                : *baseIt++;
+        if (auto* event = candidate.metaType->createIfValid(fullJson))
+            return event;
+    }
+    return nullptr;
+}
+
+//! \brief Get the interned Matrix type of an event being constructed
+//!
+//! Known types come interned with their metatypes, found in the lock-free
+//! lookup index; the pool, with its lock, is only used for unknown ones.
+InternedString Event::internType(const QString& type)
+{
+    const auto* idx = BaseMetaType.index();
+    if (const auto it = idx->specificTypes.constFind(type);
+        it != idx->specificTypes.cend() && !it->empty())
+        return it->front().metaType->internedMatrixId;
+    return typePool().intern(type);
+}
+
 Event::Event(const QJsonObject& json)
-    : _json(json)
+    : _json(json), _matrixType(internType(json[TypeKeyL].toString()))
 {
     if (!json.contains(ContentKeyL)
         && !json.value(UnsignedKeyL).toObject().contains(RedactedCauseKeyL)) {
@@ -57,11 +178,72 @@ Event::Event(const QJsonObject& json)
     }
 }
 
+Event::Event(Event&& other) noexcept
+    : _json(std::move(other._json))
+    , _compactJson(std::move(other._compactJson))
+    , _matrixType(std::move(other._matrixType))
+    , _jsonState(other._jsonState.load())
+{}
+
 Event::~Event() = default;
 
-QString Event::matrixType() const { return fullJson()[TypeKeyL].toString(); }
+StringPool& Event::typePool()
+{
+    static StringPool pool;
+    return pool;
+}
+
+void Event::releaseJson() const
+{
+    // Not concurrent with readers (see the doc-comment), so no locking here
+    if (_jsonState.load(std::memory_order_relaxed) != JsonState::Tree)
+        return;
+    if (_compactJson.isEmpty())
+        _compactJson = QJsonDocument(_json).toJson(QJsonDocument::Compact);
+    _json = {};
+    _jsonState.store(JsonState::Released, std::memory_order_release);
+}
+
+bool Event::lockReleasedJson() const
+{
+    // Each event is its own lock, so threads working with different events
+    // never wait for each other; and the same event is only contended for
+    // as long as it takes to parse or copy its JSON once
+    auto expected = JsonState::Released;
+    while (!_jsonState.compare_exchange_weak(expected, JsonState::Busy,
+                                             std::memory_order_acquire)) {
+        if (expected == JsonState::Tree)
+            return false;
+        expected = JsonState::Released;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+void Event::restoreJson() const
+{
+    // Another thread might have rebuilt the tree in the meantime
+    if (!lockReleasedJson())
+        return;
+    _json = QJsonDocument::fromJson(_compactJson).object();
+    // Don't keep both forms; releasing the event again serialises it anew
+    _compactJson = {};
+    _jsonState.store(JsonState::Tree, std::memory_order_release);
+}
 
-QByteArray Event::originalJson() const { return QJsonDocument(_json).toJson(); }
+QByteArray Event::releasedJson() const
+{
+    if (!lockReleasedJson())
+        return {};
+    auto result = _compactJson;
+    _jsonState.store(JsonState::Released, std::memory_order_release);
+    return result;
+}
+
+QByteArray Event::originalJson() const
+{
+    return QJsonDocument(fullJson()).toJson();
+}
 
 const QJsonObject Event::contentJson() const
 {
@@ -6,6 +6,9 @@
 #include "converters.h"
 #include "function_traits.h"
 #include "single_key_value.h"
+#include "stringpool.h"
+
+#include <atomic>
 
 namespace Quotient {
 // === event_ptr_tt<> and basic type casting facilities ===
@@ -86,29 +89,52 @@ public:
 
     explicit AbstractEventMetaType(const char* className,
                                    AbstractEventMetaType* nearestBase = nullptr,
-                                   const char* matrixId = nullptr)
-        : className(className), baseType(nearestBase), matrixId(matrixId)
-    {
-        if (nearestBase)
-            nearestBase->addDerived(this);
-    }
+                                   const char* matrixId = nullptr);
 
     void addDerived(const AbstractEventMetaType* newType);
 
-    virtual ~AbstractEventMetaType() = default;
+    virtual ~AbstractEventMetaType();
 
 protected:
     // Allow template specialisations to call into one another
     template <class EventT>
     friend class EventMetaType;
 
+    //! \brief Find and create the most specific event type for \p type
+    //!
+    //! This looks up \p type in the index of event types derived (directly or
+    //! not) from this one, and tries the candidates in the same order as
+    //! doLoadFrom() would visit them walking the tree, until one of them
+    //! accepts \p fullJson. The index is built on first use and rebuilt if
+    //! more event types get registered afterwards.
+    //! \return an event of the found type; nullptr if nothing matched
+    Event* loadDerived(const QJsonObject& fullJson, const QString& type) const;
+
     // The returned value indicates whether a generic object has to be created
     // on the top level when `event` is empty, instead of returning nullptr
     virtual bool doLoadFrom(const QJsonObject& fullJson, const QString& type,
                             Event*& event) const = 0;
 
+    //! Whether this is a specific event type (as opposed to a base one)
+    virtual bool hasTypeId() const = 0;
+    //! Whether the event type has its own (or inherited) isValid() check
+    virtual bool hasValidator() const = 0;
+    //! Create an event of this type if \p fullJson passes isValid()
+    virtual Event* createIfValid(const QJsonObject& fullJson) const = 0;
+
 private:
+    friend class Event; // To intern types of events via the lookup index
+
+    struct LookupIndex;
+
+    //! matrixId interned in Event::typePool() once for all events of the type
+    InternedString internedMatrixId;
     std::vector<const AbstractEventMetaType*> derivedTypes{};
+    mutable std::atomic<const LookupIndex*> lookupIndex{ nullptr };
+
+    const LookupIndex* index() const;
+    void fillIndex(LookupIndex& index, size_t& order) const;
+
     Q_DISABLE_COPY_MOVE(AbstractEventMetaType)
 };
 
@@ -167,8 +193,39 @@ public:
     //!       (i.e., Event). If no matching type derived from RoomEvent is found,
     //!       the nested lookup returns nullptr rather than a generic RoomEvent,
     //!       so that other types derived from Event could be examined.
+    //!
+    //! The resolution is done by a single hash lookup of \p type in the index
+    //! of derived event types (see AbstractEventMetaType::loadDerived()),
+    //! the result being the same as that of the tree walk described above.
     event_ptr_tt<EventT> loadFrom(const QJsonObject& fullJson,
                                   const QString& type) const
+    {
+        if constexpr (requires { EventT::TypeId; }) {
+            if (EventT::TypeId != type)
+                return nullptr;
+            return event_ptr_tt<EventT>{ static_cast<EventT*>(
+                createIfValid(fullJson)) };
+        } else {
+            if (auto* event = loadDerived(fullJson, type)) {
+                Q_ASSERT(is<EventT>(*event));
+                return event_ptr_tt<EventT>{ static_cast<EventT*>(event) };
+            }
+            // Create a generic event object, if it's valid
+            return event_ptr_tt<EventT>{ static_cast<EventT*>(
+                createIfValid(fullJson)) };
+        }
+    }
+
+    //! \brief Load an event walking the tree of derived types
+    //! \internal
+    //!
+    //! This is the reference (and much slower) version of loadFrom() that
+    //! literally follows the algorithm described for it, comparing \p type
+    //! with every derived type on its way. It is only kept for the tests
+    //! checking loadFrom() against it; it is not a part of the API and can
+    //! change or go away without notice.
+    event_ptr_tt<EventT> loadFromByTreeWalk(const QJsonObject& fullJson,
+                                            const QString& type) const
     {
         Event* event = nullptr;
         const bool goodEnough = doLoadFrom(fullJson, type, event);
@@ -201,6 +258,23 @@ private:
         event = new EventT(fullJson);
         return false;
     }
+
+    bool hasTypeId() const override
+    {
+        return requires { EventT::TypeId; };
+    }
+    bool hasValidator() const override
+    {
+        return requires { EventT::isValid; };
+    }
+    Event* createIfValid(const QJsonObject& fullJson) const override
+    {
+        if constexpr (requires { EventT::isValid; }) {
+            if (!EventT::isValid(fullJson))
+                return nullptr;
+        }
+        return new EventT(fullJson);
+    }
 };
 
 // === Event creation facilities ===
@@ -272,7 +346,7 @@ public:
     }
 
     Q_DISABLE_COPY(Event)
-    Event(Event&&) noexcept = default;
+    Event(Event&& other) noexcept;
     Event& operator=(Event&&) = delete;
     virtual ~Event();
 
@@ -292,10 +366,18 @@ public:
 
     //! \brief Exact Matrix type stored in JSON
     //!
-    //! Coincides with the result of type() (but is slower) for events defined
-    //! in C++ (not necessarily in the library); for generic/unknown events
-    //! the returned value will be different.
-    QString matrixType() const;
+    //! Coincides with the result of type() for events defined in C++ (not
+    //! necessarily in the library); for generic/unknown events the returned
+    //! value will be different. The type is decoded once, at construction;
+    //! types of known events share the string interned by their metatype,
+    //! while unknown types are interned in typePool().
+    const QString& matrixType() const { return _matrixType; }
+
+    //! \brief The pool of Matrix types of all events in the process
+    //!
+    //! There are only so many event types, compared to the number of events;
+    //! interning them makes events of the same type share one string.
+    static StringPool& typePool();
 
     template <EventClass EventT>
     bool is() const
@@ -309,7 +391,45 @@ public:
     [[deprecated("Use fullJson() instead")]] //
     QJsonObject originalJsonObject() const { return fullJson(); }
 
-    const QJsonObject& fullJson() const { return _json; }
+    const QJsonObject& fullJson() const
+    {
+        if (Q_UNLIKELY(_jsonState.load(std::memory_order_acquire)
+                       != JsonState::Tree))
+            restoreJson();
+        return _json;
+    }
+
+    //! \brief Replace the JSON tree of the event with its compact form
+    //!
+    //! A parsed JSON tree takes several times more memory than serialised
+    //! JSON. For events that are kept around for a long time but are rarely
+    //! looked into (e.g., timeline events in rooms that are not displayed)
+    //! this function drops the tree, keeping the event JSON as compact UTF-8
+    //! along with the fields decoded from it at construction (such as
+    //! RoomEvent::id() or the content of state events). The tree is
+    //! transparently rebuilt on the next call to fullJson() (and, by
+    //! extension, contentJson(), unsignedJson() etc.) and can be released
+    //! again later. Rebuilding the tree drops the compact form, so that an
+    //! event never holds both; releasing it again serialises the tree anew.
+    //! Since the tree is rebuilt by anything that looks into the JSON, only
+    //! release events once they have been processed.
+    //!
+    //! Rebuilding the tree is thread-safe: several threads may read
+    //! a released event at once, synchronising on that event only. Releasing
+    //! is not: make sure no other thread is reading the event when calling
+    //! this function.
+    void releaseJson() const;
+    bool isJsonReleased() const
+    {
+        return _jsonState.load(std::memory_order_acquire) != JsonState::Tree;
+    }
+    //! \brief The compact JSON of the event, if it has been released
+    //!
+    //! This gives access to the JSON of a released event without rebuilding
+    //! and keeping the tree in the event (e.g., to parse a temporary copy
+    //! of it elsewhere). Returns an empty array if the JSON of the event is
+    //! not released.
+    QByteArray releasedJson() const;
 
     // According to the CS API spec, every event also has
     // a "content" object; but since its structure is different for
@@ -371,11 +491,25 @@ protected:
 
     explicit Event(const QJsonObject& json);
 
-    QJsonObject& editJson() { return _json; }
+    QJsonObject& editJson()
+    {
+        fullJson(); // Make sure the tree is in place
+        _compactJson.clear(); // ...and drop the copy that will become stale
+        return _json;
+    }
     virtual void dumpTo(QDebug dbg) const;
 
 private:
-    QJsonObject _json;
+    mutable QJsonObject _json;
+    mutable QByteArray _compactJson;
+    InternedString _matrixType;
+    enum class JsonState : quint8 { Tree, Released, Busy };
+    mutable std::atomic<JsonState> _jsonState = JsonState::Tree;
+
+    static InternedString internType(const QString& type);
+    //! Take the released JSON for exclusive use; false if it's not released
+    bool lockReleasedJson() const;
+    void restoreJson() const;
 };
 using EventPtr = event_ptr_tt<Event>;
 
@@ -5,10 +5,17 @@
 
 #include "logging.h"
 #include "redactionevent.h"
+#include "stringpool.h"
 
 using namespace Quotient;
 
-RoomEvent::RoomEvent(const QJsonObject& json) : Event(json)
+RoomEvent::RoomEvent(const QJsonObject& json)
+    : Event(json)
+    , _id(json[EventIdKeyL].toString())
+    , _roomId(json[RoomIdKeyL].toString())
+    , _senderId(json[SenderKeyL].toString())
+    , _stateKey(json[StateKeyKeyL].toString())
+    , _originTimestamp(fromJson<QDateTime>(json["origin_server_ts"_ls]))
 {
     if (const auto redaction = unsignedPart<QJsonObject>(RedactedCauseKeyL);
         !redaction.isEmpty())
@@ -17,23 +24,6 @@ RoomEvent::RoomEvent(const QJsonObject& json) : Event(json)
 
 RoomEvent::~RoomEvent() = default; // Let the smart pointer do its job
 
-QString RoomEvent::id() const { return fullJson()[EventIdKeyL].toString(); }
-
-QDateTime RoomEvent::originTimestamp() const
-{
-    return Quotient::fromJson<QDateTime>(fullJson()["origin_server_ts"_ls]);
-}
-
-QString RoomEvent::roomId() const
-{
-    return fullJson()[RoomIdKeyL].toString();
-}
-
-QString RoomEvent::senderId() const
-{
-    return fullJson()[SenderKeyL].toString();
-}
-
 QString RoomEvent::redactionReason() const
 {
     return isRedacted() ? _redactedBecause->reason() : QString {};
@@ -44,19 +34,25 @@ QString RoomEvent::transactionId() const
     return unsignedPart<QString>("transaction_id"_ls);
 }
 
-QString RoomEvent::stateKey() const
-{
-    return fullJson()[StateKeyKeyL].toString();
-}
-
 void RoomEvent::setRoomId(const QString& roomId)
 {
     editJson().insert(RoomIdKey, roomId);
+    _roomId = roomId;
 }
 
 void RoomEvent::setSender(const QString& senderId)
 {
     editJson().insert(SenderKey, senderId);
+    _senderId = senderId;
+}
+
+void RoomEvent::internIds(StringPool& pool)
+{
+    _roomId = pool.intern(_roomId);
+    _senderId = pool.intern(_senderId);
+    // State keys of member events (and several others) are user ids
+    if (_stateKey.startsWith(u'@'))
+        _stateKey = pool.intern(_stateKey);
 }
 
 void RoomEvent::setTransactionId(const QString& txnId)
@@ -72,6 +68,7 @@ void RoomEvent::addId(const QString& newId)
     Q_ASSERT(id().isEmpty());
     Q_ASSERT(!newId.isEmpty());
     editJson().insert(EventIdKey, newId);
+    _id = newId;
     qCDebug(EVENTS) << "Event txnId -> id:" << transactionId() << "->" << id();
     Q_ASSERT(id() == newId);
 }
@@ -9,6 +9,7 @@
 
 namespace Quotient {
 class RedactionEvent;
+class StringPool;
 
 // That check could look into Event and find most stuff already deleted...
 // NOLINTNEXTLINE(cppcoreguidelines-special-member-functions)
@@ -18,10 +19,14 @@ public:
 
     ~RoomEvent() override; // Don't inline this - see the private section
 
-    QString id() const;
-    QDateTime originTimestamp() const;
-    QString roomId() const;
-    QString senderId() const;
+    // The below getters are on the hot path of timeline processing; so
+    // instead of looking up the JSON on every call they return values
+    // decoded once, when the event is constructed.
+
+    const QString& id() const { return _id; }
+    QDateTime originTimestamp() const { return _originTimestamp; }
+    const QString& roomId() const { return _roomId; }
+    const QString& senderId() const { return _senderId; }
     bool isRedacted() const { return bool(_redactedBecause); }
     const event_ptr_tt<RedactionEvent>& redactedBecause() const
     {
@@ -29,7 +34,7 @@ public:
     }
     QString redactionReason() const;
     QString transactionId() const;
-    QString stateKey() const;
+    const QString& stateKey() const { return _stateKey; }
 
     //! \brief Fill the pending event object with the room id
     void setRoomId(const QString& roomId);
@@ -50,6 +55,13 @@ public:
     //! callback for that in RoomEvent.
     void addId(const QString& newId);
 
+    //! \brief Share the room id, the sender id and user ids in state keys
+    //!        with copies in \p pool
+    //!
+    //! This doesn't change the values, only makes the event reuse strings
+    //! already stored elsewhere instead of keeping its own copies.
+    void internIds(StringPool& pool);
+
 #ifdef Quotient_E2EE_ENABLED
     void setOriginalEvent(event_ptr_tt<RoomEvent>&& originalEvent);
     const RoomEvent* originalEvent() const { return _originalEvent.get(); }
@@ -61,6 +73,14 @@ protected:
     void dumpTo(QDebug dbg) const override;
 
 private:
+    // Frequently used fields, decoded from the JSON at construction and kept
+    // in sync with it by the setters above
+    QString _id;
+    QString _roomId;
+    QString _senderId;
+    QString _stateKey;
+    QDateTime _originTimestamp;
+
     // RedactionEvent is an incomplete type here so we cannot inline
     // constructors using it and also destructors (with 'using', in particular).
     event_ptr_tt<RedactionEvent> _redactedBecause;
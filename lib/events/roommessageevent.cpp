@@ -131,6 +131,7 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
     : RoomEvent(
         basicJson(TypeId, assembleContentJson(plainBody, jsonMsgType, content)))
     , _content(content)
+    , _msgtype(jsonToMsgType(jsonMsgType))
 {}
 
 RoomMessageEvent::RoomMessageEvent(const QString& plainBody, MsgType msgType,
@@ -177,9 +178,10 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
 RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
     : RoomEvent(obj), _content(nullptr)
 {
+    const QJsonObject content = contentJson();
+    _msgtype = jsonToMsgType(content[MsgTypeKey].toString());
     if (isRedacted())
         return;
-    const QJsonObject content = contentJson();
     if (content.contains(MsgTypeKey) && content.contains(BodyKeyL)) {
         auto msgtype = content[MsgTypeKey].toString();
         bool msgTypeFound = false;
@@ -202,7 +204,7 @@ RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
 
 RoomMessageEvent::MsgType RoomMessageEvent::msgtype() const
 {
-    return jsonToMsgType(rawMsgtype());
+    return _msgtype;
 }
 
 QString RoomMessageEvent::rawMsgtype() const
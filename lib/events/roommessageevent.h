@@ -95,6 +95,9 @@ public:
 
 private:
     QScopedPointer<EventContent::TypedBase> _content;
+    // Decoded at construction because Room::isEventNotable() checks it
+    // for every new event, including those with released JSON
+    MsgType _msgtype = MsgType::Unknown;
 
     // FIXME: should it really be static?
     static QJsonObject assembleContentJson(const QString& plainBody,
@@ -116,6 +116,7 @@ public:
     // content types against the known MIME type hierarchy; and at the same
     // type QMimeType is of little help with MIME type globs (`text/*` etc.)
     QByteArrayList expectedContentTypes { "application/json" };
+    bool parsesResponseJson = true;
 
     QByteArrayList expectedKeys;
 
@@ -256,6 +257,13 @@ void BaseJob::setExpectedContentTypes(const QByteArrayList& contentTypes)
     d->expectedContentTypes = contentTypes;
 }
 
+bool BaseJob::parsesResponseJson() const { return d->parsesResponseJson; }
+
+void BaseJob::setParsesResponseJson(bool parse)
+{
+    d->parsesResponseJson = parse;
+}
+
 QByteArrayList BaseJob::expectedKeys() const { return d->expectedKeys; }
 
 void BaseJob::addExpectedKey(const QByteArray& key) { d->expectedKeys << key; }
@@ -405,7 +413,7 @@ void BaseJob::gotReply()
 {
     // Defer actually updating the status until it's finalised
     auto statusSoFar = checkReply(reply());
-    if (statusSoFar.good()
+    if (statusSoFar.good() && d->parsesResponseJson
         && d->expectedContentTypes == QByteArrayList { "application/json" }) //
     {
         d->rawResponse = reply()->readAll();
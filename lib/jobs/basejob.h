@@ -349,6 +349,15 @@ protected:
     const QByteArrayList& expectedContentTypes() const;
     void addExpectedContentType(const QByteArray& contentType);
     void setExpectedContentTypes(const QByteArrayList& contentTypes);
+    //! \brief Whether the job reads and parses a JSON response body itself
+    //!
+    //! By default, a successful response with `application/json` content is
+    //! read in full and parsed as soon as it's finished, before
+    //! prepareResult() is called. Jobs that read the body on their own
+    //! (e.g., while it's being received) should turn this off; rawData()
+    //! and jsonData() stay empty then.
+    bool parsesResponseJson() const;
+    void setParsesResponseJson(bool parse);
     QByteArrayList expectedKeys() const;
     void addExpectedKey(const QByteArray &key);
     void setExpectedKeys(const QByteArrayList &keys);
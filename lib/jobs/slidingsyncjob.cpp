@@ -0,0 +1,29 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "slidingsyncjob.h"
+
+using namespace Quotient;
+
+static size_t jobId = 0;
+
+static auto queryToSlidingSync(const QString& pos, int timeout)
+{
+    QUrlQuery query;
+    addParam<IfNotEmpty>(query, QStringLiteral("pos"), pos);
+    if (timeout >= 0)
+        query.addQueryItem(QStringLiteral("timeout"), QString::number(timeout));
+    return query;
+}
+
+SlidingSyncJob::SlidingSyncJob(const QString& pos,
+                               const QJsonObject& requestBody, int timeout)
+    : BaseJob(HttpVerb::Post,
+              QStringLiteral("SlidingSyncJob-%1").arg(++jobId),
+              "_matrix/client/unstable/org.matrix.msc3575/sync",
+              queryToSlidingSync(pos, timeout), RequestData(requestBody))
+{
+    setLoggingCategory(SYNCJOB);
+    addExpectedKey("pos");
+    setMaxRetries(std::numeric_limits<int>::max());
+}
@@ -0,0 +1,31 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "basejob.h"
+
+namespace Quotient {
+//! \brief A request to the sliding sync endpoint (MSC3575)
+//!
+//! Unlike SyncJob, this job doesn't parse the response into SyncData;
+//! the response only makes sense together with the state of the lists kept
+//! on the client side, see SlidingSync.
+class QUOTIENT_API SlidingSyncJob : public BaseJob {
+public:
+    //! \param pos the position returned by the previous request, or empty
+    //!            to start a new session
+    //! \param requestBody lists and room subscriptions, as defined by MSC3575
+    //! \param timeout how long the server may hold the request, in ms;
+    //!                -1 to use the server's default
+    explicit SlidingSyncJob(const QString& pos, const QJsonObject& requestBody,
+                            int timeout = -1);
+
+    //! The position to pass to the next request
+    QString pos() const { return loadFromJson<QString>("pos"_ls); }
+    //! Updates to the lists, keyed by list name
+    QJsonObject lists() const { return loadFromJson<QJsonObject>("lists"_ls); }
+    //! Room data, keyed by room id
+    QJsonObject rooms() const { return loadFromJson<QJsonObject>("rooms"_ls); }
+};
+} // namespace Quotient
@@ -3,6 +3,8 @@
 
 #include "syncjob.h"
 
+#include <QtNetwork/QNetworkReply>
+
 using namespace Quotient;
 
 static size_t jobId = 0;
@@ -31,9 +33,60 @@ SyncJob::SyncJob(const QString& since, const Filter& filter, int timeout,
               timeout, presence)
 {}
 
+void SyncJob::setIncrementalParsing(RoomDataHandler roomDataHandler)
+{
+    parser = makeImpl<SyncResponseParser>(
+        [this, handler = std::move(roomDataHandler)](SyncRoomData&& roomData) {
+            if (auto* const stringPool = d.stringPool())
+                roomData.internIds(*stringPool);
+            if (handler)
+                handler(std::move(roomData));
+            else
+                d.addRoomData(std::move(roomData));
+        });
+    setParsesResponseJson(false);
+}
+
+void SyncJob::onSentRequest(QNetworkReply* reply)
+{
+    if (!parser)
+        return;
+
+    // Start over in case of a retry
+    auto* const threadPool = d.threadPool();
+    auto* const stringPool = d.stringPool();
+    d = SyncData();
+    d.setThreadPool(threadPool);
+    d.setStringPool(stringPool);
+    parser->reset();
+    connect(reply, &QIODevice::readyRead, this, [this, reply] {
+        // Leave the body of unsuccessful replies to prepareError()
+        if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()
+                / 100
+            != 2)
+            return;
+        parser->feed(reply->readAll());
+    });
+}
+
 BaseJob::Status SyncJob::prepareResult()
 {
+    if (parser) {
+        QElapsedTimer et;
+        et.start();
+        parser->feed(reply()->readAll());
+        const auto json = parser->finish();
+        if (!parser->errorString().isEmpty())
+            return { IncorrectResponse, parser->errorString() };
+        d.parseJson(json);
+        qCDebug(PROFILER) << "*** SyncJob: incrementally parsed"
+                          << parser->roomCount()
+                          << "room(s); the rest of the batch took" << et;
+        return Success;
+    }
+
     d.parseJson(jsonData());
+    d.estimateRoomJsonSizes(rawData().size());
     if (Q_LIKELY(d.unresolvedRooms().isEmpty()))
         return Success;
 
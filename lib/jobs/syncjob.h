@@ -6,21 +6,62 @@
 #include "../csapi/definitions/sync_filter.h"
 #include "../syncdata.h"
 #include "basejob.h"
+#include "syncresponseparser.h"
 
 namespace Quotient {
 class SyncJob : public BaseJob {
 public:
+    using RoomDataHandler = SyncResponseParser::RoomDataHandler;
+
     explicit SyncJob(const QString& since = {}, const QString& filter = {},
                      int timeout = -1, const QString& presence = {});
     explicit SyncJob(const QString& since, const Filter& filter,
                      int timeout = -1, const QString& presence = {});
 
+    //! \brief Parse the response while it is being received
+    //!
+    //! In this mode the job doesn't accumulate the whole response body;
+    //! instead, it scans the bytes as they arrive and parses each object in
+    //! `rooms.join/invite/leave` as soon as it is complete, so that parsing
+    //! overlaps with receiving and the raw bytes of a room are dropped once
+    //! it's parsed. The rest of the response (next_batch, account data,
+    //! to-device events etc.) is parsed once the reply is finished.
+    //!
+    //! If \p roomDataHandler is provided, it receives every room's data as
+    //! soon as it's parsed, and takeData() won't return those rooms;
+    //! otherwise rooms are collected in the order of arrival and can be
+    //! obtained with takeData() as usual. In the latter case, peak memory
+    //! use still includes the parsed data of all rooms in the response;
+    //! only a handler that consumes rooms right away bounds it by the largest
+    //! room in the batch. Note that the handler is called
+    //! before the job has succeeded: the rest of the batch (next_batch,
+    //! account data) is not known yet, the response may still turn out to
+    //! be broken, and, in case of retries, the handler can receive data for
+    //! the same room more than once. Only use it for data that can be
+    //! discarded or applied repeatedly.
+    //!
+    //! This must be called before the job sends its request, i.e. right
+    //! after it's been created by Connection::callApi().
+    //! \note rawData() and jsonData() are empty for successful replies
+    //!       in this mode
+    void setIncrementalParsing(RoomDataHandler roomDataHandler = {});
+
+    //! Parse rooms in parallel using \p pool
+    //! \sa SyncData::setThreadPool
+    void setThreadPool(QThreadPool* pool) { d.setThreadPool(pool); }
+
+    //! Intern ids in the parsed data using \p pool
+    //! \sa SyncData::setStringPool
+    void setStringPool(StringPool* pool) { d.setStringPool(pool); }
+
     SyncData takeData() { return std::move(d); }
 
 protected:
+    void onSentRequest(QNetworkReply* reply) override;
     Status prepareResult() override;
 
 private:
     SyncData d;
+    ImplPtr<SyncResponseParser> parser = ZeroImpl<SyncResponseParser>();
 };
 } // namespace Quotient
@@ -0,0 +1,203 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "syncresponseparser.h"
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+
+using namespace Quotient;
+
+void SyncResponseParser::reset()
+{
+    residual.clear();
+    roomBytes.clear();
+    keyBytes.clear();
+    containers.clear();
+    keys = {};
+    roomDepth = 0;
+    roomsParsed = 0;
+    inString = escaped = expectKey = trackingKey = inRoomList = complete =
+        false;
+    error.clear();
+}
+
+void SyncResponseParser::updateRoomListFlag()
+{
+    inRoomList = containers == "{{{" && keys[0] == "rooms"_ls
+                 && std::find(JoinStateStrings.begin(), JoinStateStrings.end(),
+                              keys[1])
+                        != JoinStateStrings.end();
+}
+
+void SyncResponseParser::finishKey()
+{
+    trackingKey = false;
+    const auto depth = containers.size();
+    if (depth == 0 || depth > int(keys.size()))
+        return;
+    // Keys with escape sequences are rare enough to afford the slow path
+    keys[size_t(depth - 1)] =
+        keyBytes.contains('\\')
+            ? QJsonDocument::fromJson('[' + keyBytes + ']')
+                  .array()
+                  .first()
+                  .toString()
+            : QString::fromUtf8(keyBytes.mid(1, keyBytes.size() - 2));
+}
+
+int SyncResponseParser::scanRoom(const char* data, int size)
+{
+    int i = 0;
+    for (; i < size && roomDepth > 0; ++i) {
+        const char c = data[i];
+        if (inString) {
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"')
+                inString = false;
+            continue;
+        }
+        switch (c) {
+        case '"':
+            inString = true;
+            break;
+        case '{':
+        case '[':
+            ++roomDepth;
+            break;
+        case '}':
+        case ']':
+            --roomDepth;
+            break;
+        default:;
+        }
+    }
+    roomBytes.append(data, i);
+    if (roomDepth > 0)
+        return i; // The room continues in the next chunk
+
+    QJsonParseError parseError;
+    const auto roomJson = QJsonDocument::fromJson(roomBytes, &parseError);
+    const auto roomJsonSize = roomBytes.size();
+    roomBytes.clear();
+    if (parseError.error != QJsonParseError::NoError) {
+        fail(QStringLiteral("Malformed data for room %1: %2")
+                 .arg(roomId, parseError.errorString()));
+        return size;
+    }
+    SyncRoomData roomData(roomId, roomJoinState, roomJson.object());
+    roomData.jsonSize = roomJsonSize;
+    sink(std::move(roomData));
+    ++roomsParsed;
+    return i;
+}
+
+void SyncResponseParser::feed(const QByteArray& chunk)
+{
+    const auto* const data = chunk.constData();
+    const auto size = chunk.size();
+    for (int i = 0; i < size && error.isEmpty(); ++i) {
+        if (roomDepth > 0) {
+            i += scanRoom(data + i, size - i) - 1;
+            continue;
+        }
+        const char c = data[i];
+        if (inString) {
+            if (trackingKey)
+                keyBytes += c;
+            if (!inRoomList)
+                residual += c;
+            if (escaped)
+                escaped = false;
+            else if (c == '\\')
+                escaped = true;
+            else if (c == '"') {
+                inString = false;
+                if (trackingKey)
+                    finishKey();
+            }
+            continue;
+        }
+        if (complete) {
+            if (!QChar::isSpace(uchar(c)))
+                fail(QStringLiteral("Unexpected data after the end of JSON"));
+            continue;
+        }
+        switch (c) {
+        case '"':
+            inString = true;
+            trackingKey = expectKey && containers.size() <= int(keys.size());
+            if (trackingKey)
+                keyBytes = QByteArray(1, c);
+            break;
+        case '{':
+        case '[':
+            if (inRoomList) {
+                if (c == '[') {
+                    fail(QStringLiteral("Unexpected array in a room list"));
+                    break;
+                }
+                roomId = keys.back();
+                // This assumes that JoinState values go over powers of 2
+                roomJoinState = JoinState(
+                    1U << size_t(std::find(JoinStateStrings.begin(),
+                                           JoinStateStrings.end(), keys[1])
+                                 - JoinStateStrings.begin()));
+                roomBytes = QByteArray(1, c);
+                roomDepth = 1;
+                continue;
+            }
+            containers += c;
+            expectKey = c == '{';
+            residual += c;
+            updateRoomListFlag();
+            continue;
+        case '}':
+        case ']':
+            if (containers.isEmpty()
+                || containers.back() != (c == '}' ? '{' : '[')) {
+                fail(QStringLiteral("Unbalanced brackets"));
+                break;
+            }
+            containers.chop(1);
+            if (containers.size() < int(keys.size()))
+                keys[size_t(containers.size())].clear();
+            expectKey = false;
+            residual += c; // Also closes the (empty) room list
+            updateRoomListFlag();
+            complete = containers.isEmpty();
+            continue;
+        case ':':
+            expectKey = false;
+            break;
+        case ',':
+            expectKey = !containers.isEmpty() && containers.back() == '{';
+            break;
+        default:;
+        }
+        // Anything inside a room list except room objects themselves
+        // (keys, separators, whitespace) is dropped
+        if (!inRoomList)
+            residual += c;
+    }
+}
+
+QJsonObject SyncResponseParser::finish()
+{
+    if (error.isEmpty() && (!complete || roomDepth > 0))
+        fail(QStringLiteral("The response ended prematurely"));
+    if (!error.isEmpty())
+        return {};
+
+    QJsonParseError parseError;
+    const auto json = QJsonDocument::fromJson(residual, &parseError);
+    residual.clear();
+    if (parseError.error != QJsonParseError::NoError) {
+        fail(parseError.errorString());
+        return {};
+    }
+    return json.object();
+}
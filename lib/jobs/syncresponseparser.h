@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "../syncdata.h"
+
+#include <array>
+#include <functional>
+
+namespace Quotient {
+
+//! \brief A streaming splitter of /sync responses
+//!
+//! This is not a complete JSON parser: it only tracks strings and nesting
+//! to find the boundaries of room objects in `rooms.join/invite/leave`.
+//! Each room object is cut out of the stream and parsed separately as soon
+//! as it's complete; everything else is accumulated in residual JSON (with
+//! room lists left empty) that is small enough to be parsed in one go
+//! when the response is over.
+class QUOTIENT_API SyncResponseParser {
+public:
+    using RoomDataHandler = std::function<void(SyncRoomData&&)>;
+
+    explicit SyncResponseParser(RoomDataHandler sink) : sink(std::move(sink))
+    {}
+
+    void reset();
+    //! Scan the next chunk of the response, passing rooms completed in it
+    //! to the sink
+    void feed(const QByteArray& chunk);
+    //! Check that the response is complete and return the residual JSON
+    QJsonObject finish();
+
+    QString errorString() const { return error; }
+    int roomCount() const { return roomsParsed; }
+
+private:
+    RoomDataHandler sink;
+    QByteArray residual;
+    QByteArray roomBytes;
+    QByteArray keyBytes;
+    //! Types of containers ('{' or '[') enclosing the current position,
+    //! outside of room objects
+    QByteArray containers;
+    //! The most recent keys seen at the top three levels of objects
+    std::array<QString, 3> keys;
+    QString roomId;
+    JoinState roomJoinState = JoinState::Join;
+    int roomDepth = 0; //< Nesting level inside the current room object
+    int roomsParsed = 0;
+    bool inString = false;
+    bool escaped = false;
+    bool expectKey = false;
+    bool trackingKey = false;
+    bool inRoomList = false;
+    bool complete = false;
+    QString error;
+
+    void fail(const QString& message)
+    {
+        if (error.isEmpty())
+            error = message;
+    }
+    void updateRoomListFlag();
+    int scanRoom(const char* data, int size);
+    void finishKey();
+};
+
+} // namespace Quotient
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "membertable.h"
+
+#include <bit>
+
+using namespace Quotient;
+
+//! The position of \p membership in MemberTable::counts
+inline size_t countIndex(Membership membership)
+{
+    return membership == Membership::Invalid
+               ? 0
+               : size_t(std::countr_zero(unsigned(membership))) + 1;
+}
+
+const MemberTable::Member* MemberTable::find(InternedString userId) const
+{
+    const auto it = rowIndex.constFind(userId);
+    return it != rowIndex.cend() ? &rows[size_t(*it)] : nullptr;
+}
+
+Omittable<MemberTable::Member> MemberTable::insert(Member member)
+{
+    Q_ASSERT(!member.userId.isNull());
+    const auto it = rowIndex.constFind(member.userId);
+    if (it == rowIndex.cend()) {
+        addToIndices(member);
+        rowIndex.insert(member.userId, size());
+        rows.push_back(std::move(member));
+        return none;
+    }
+    auto& row = rows[size_t(*it)];
+    removeFromIndices(row);
+    addToIndices(member);
+    return std::exchange(row, std::move(member));
+}
+
+void MemberTable::remove(InternedString userId)
+{
+    const auto it = rowIndex.find(userId);
+    if (it == rowIndex.end())
+        return;
+    const auto rowNumber = size_t(*it);
+    rowIndex.erase(it);
+    removeFromIndices(rows[rowNumber]);
+    // Keep the rows contiguous by moving the last one into the hole
+    if (rowNumber + 1 != rows.size()) {
+        rows[rowNumber] = std::move(rows.back());
+        rowIndex[rows[rowNumber].userId] = qsizetype(rowNumber);
+    }
+    rows.pop_back();
+}
+
+void MemberTable::clear()
+{
+    rows.clear();
+    rowIndex.clear();
+    joinedByName.clear();
+    counts = {};
+}
+
+qsizetype MemberTable::count(Membership membership) const
+{
+    return counts[countIndex(membership)];
+}
+
+QList<InternedString>
+MemberTable::joinedNamesakes(const QString& displayName) const
+{
+    return joinedByName.values(displayName);
+}
+
+void MemberTable::addToIndices(const Member& member)
+{
+    ++counts[countIndex(member.membership)];
+    if (member.membership == Membership::Join)
+        joinedByName.insert(member.displayName, member.userId);
+}
+
+void MemberTable::removeFromIndices(const Member& member)
+{
+    --counts[countIndex(member.membership)];
+    if (member.membership == Membership::Join)
+        joinedByName.remove(member.displayName, member.userId);
+}
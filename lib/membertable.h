@@ -0,0 +1,86 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "omittable.h"
+#include "quotient_common.h"
+#include "stringpool.h"
+
+#include <QtCore/QMultiHash>
+#include <QtCore/QUrl>
+
+#include <array>
+#include <vector>
+
+namespace Quotient {
+
+//! \brief A compact table of room members
+//!
+//! Room keeps a row here for each user that has a membership in the room,
+//! instead of a User object per member: in rooms with tens of thousands of
+//! members most of them are never shown, while a User, being a QObject with
+//! its own name and avatar, takes several hundred bytes in a handful of heap
+//! allocations. User objects are only made on demand (see Room::user()).
+//!
+//! Rows are kept contiguously, with a hash from the user id to the row;
+//! display names of joined members are indexed separately to disambiguate
+//! them. On a 64-bit platform this takes about 150 bytes per member with
+//! Qt 6 and about 100 bytes with Qt 5; the strings themselves are shared
+//! with the member events in the room state, and user ids with the string
+//! pool of the connection.
+//! \sa Room::memberTable
+class QUOTIENT_API MemberTable {
+public:
+    struct Member {
+        InternedString userId;
+        //! The display name; empty if the member has none
+        QString displayName;
+        QUrl avatarUrl;
+        int powerLevel = 0;
+        Membership membership = Membership::Leave;
+    };
+    using const_iterator = std::vector<Member>::const_iterator;
+
+    //! The row for \p userId; nullptr if there's none
+    const Member* find(InternedString userId) const;
+    //! \brief Add a row or replace the one with the same user id
+    //! \return the replaced row, if there was one
+    Omittable<Member> insert(Member member);
+    //! Remove the row for \p userId, if there's one
+    void remove(InternedString userId);
+    void clear();
+
+    const_iterator begin() const { return rows.cbegin(); }
+    const_iterator end() const { return rows.cend(); }
+    qsizetype size() const { return qsizetype(rows.size()); }
+    bool empty() const { return rows.empty(); }
+    //! The number of members with \p membership
+    qsizetype count(Membership membership) const;
+
+    //! Ids of joined members that have \p displayName
+    QList<InternedString> joinedNamesakes(const QString& displayName) const;
+
+    //! \brief Set the power level of each member
+    //!
+    //! \p powerLevelOf is called with each user id and should return
+    //! the power level of that user.
+    template <typename FnT>
+    void updatePowerLevels(FnT&& powerLevelOf)
+    {
+        for (auto& row : rows)
+            row.powerLevel = powerLevelOf(row.userId.toString());
+    }
+
+private:
+    std::vector<Member> rows;
+    QHash<InternedString, qsizetype> rowIndex;
+    QMultiHash<QString, InternedString> joinedByName;
+    //! Member counts by membership; Membership::Invalid goes first
+    std::array<qsizetype, MembershipStrings.size() + 1> counts {};
+
+    void addToIndices(const Member& member);
+    void removeFromIndices(const Member& member);
+};
+
+} // namespace Quotient
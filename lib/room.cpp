@@ -15,7 +15,10 @@
 #include "syncdata.h"
 #include "user.h"
 #include "eventstats.h"
+#include "membertable.h"
 #include "roomstateview.h"
+#include "stringpool.h"
+#include "timelinestore.h"
 #include "qt_connection_util.h"
 
 // NB: since Qt 6, moc_room.cpp needs User fully defined
@@ -23,6 +26,7 @@
 
 #include "csapi/account-data.h"
 #include "csapi/banning.h"
+#include "csapi/event_context.h"
 #include "csapi/inviting.h"
 #include "csapi/kicking.h"
 #include "csapi/leaving.h"
@@ -51,6 +55,7 @@
 #include "jobs/downloadfilejob.h"
 #include "jobs/mediathumbnailjob.h"
 
+#include <QtCore/QCborStreamWriter>
 #include <QtCore/QDir>
 #include <QtCore/QHash>
 #include <QtCore/QPointer>
@@ -59,8 +64,10 @@
 #include <QtCore/QTemporaryFile>
 
 #include <array>
+#include <map>
 #include <cmath>
 #include <functional>
+#include <ranges>
 
 #ifdef Quotient_E2EE_ENABLED
 #include "e2ee/e2ee_common.h"
@@ -81,10 +88,6 @@ enum EventsPlacement : int { Older = -1, Newer = 1 };
 
 class Room::Private {
 public:
-    /// Map of user names to users
-    /** User names potentially duplicate, hence QMultiHash. */
-    using members_map_t = QMultiHash<QString, User*>;
-
     Private(Connection* c, QString id_, JoinState initialJoinState)
         : connection(c)
         , id(std::move(id_))
@@ -122,15 +125,22 @@ public:
     // Starting up with estimate event statistics as there's zero knowledge
     // about the timeline.
     EventStats partiallyReadStats {}, unreadStats {};
-    members_map_t membersMap;
+    MemberTable members;
     QList<User*> usersTyping;
-    QHash<QString, QSet<QString>> eventIdReadUsers;
-    QList<User*> usersInvited;
-    QList<User*> membersLeft;
+    QHash<QString, QSet<InternedString>> eventIdReadUsers;
     bool displayed = false;
+    bool fullyLoaded = true;
     QString firstDisplayedEventId;
     QString lastDisplayedEventId;
-    QHash<QString, ReadReceipt> lastReadReceipts;
+    //! \brief How fast the first displayed event moves towards the history,
+    //!        in events per second
+    //!
+    //! This is averaged over the changes of the first displayed event and
+    //! used to size the pages that prefetchHistory() requests.
+    double scrollSpeed = 0;
+    Omittable<TimelineItem::index_t> scrollIndex;
+    QElapsedTimer scrollTimer;
+    QHash<InternedString, ReadReceipt> lastReadReceipts;
     QString fullyReadUntilEventId;
     TagsMap tags;
     UnorderedMap<QString, EventPtr> accountData;
@@ -143,7 +153,38 @@ public:
     //! reported that all events have been loaded and there's no point in
     //! requesting further historical batches.
     Omittable<QString> prevBatch = QString();
+    //! \brief Whether the timeline store may have events older than
+    //!        the timeline
+    //!
+    //! While this is true, prevBatch is not used; it is updated from
+    //! the store once the oldest stored event is loaded, or used as is if
+    //! the store no more has the events before the timeline.
+    bool storedHistory = false;
+    //! \brief Tokens to load history before timeline events, by the index
+    //!        of the event
+    //!
+    //! These are collected along with the timeline so that its oldest part
+    //! can be dropped and loaded again (see evictOldestEvents()); only while
+    //! Connection::timelineEventLimit() is set, as nothing else evicts events.
+    std::map<TimelineItem::index_t, QString> historyTokens;
+    void addHistoryToken(TimelineItem::index_t index, const QString& token)
+    {
+        if (connection->timelineEventLimit() > 0)
+            historyTokens.emplace(index, token);
+    }
+    //! \brief A place in the timeline where events may be missing
+    //!
+    //! Gaps come from `limited` syncs and from loading event contexts; each
+    //! one is stored by the index of the event right after it.
+    struct Gap {
+        //! The token to load events before the newer side of the gap
+        QString olderToken;
+        //! The token to load events after the older side of the gap
+        QString newerToken;
+    };
+    std::map<TimelineItem::index_t, Gap> gaps;
     QPointer<GetRoomEventsJob> eventsHistoryJob;
+    QPointer<GetRoomEventsJob> gapFillJob;
     QPointer<GetMembersByRoomJob> allMembersJob;
     //! Map from megolm sessionId to set of eventIds
     UnorderedMap<QString, QSet<QString>> undecryptedEvents;
@@ -197,8 +238,38 @@ public:
     Changes setSummary(RoomSummary&& newSummary);
 
     // void inviteUser(User* u); // We might get it at some point in time.
-    void insertMemberIntoMap(User* u);
-    void removeMemberFromMap(User* u);
+    //! Update the member table from the member event just applied
+    void updateMember(const RoomMemberEvent& evt);
+    int powerLevelOf(const QString& userId) const
+    {
+        const auto* plEvt = q->currentState().get<RoomPowerLevelsEvent>();
+        return plEvt ? plEvt->powerLevelForUser(userId) : 0;
+    }
+    //! Ids of members with one of \p memberships, as a lazy range
+    auto memberIds(MembershipMask memberships) const
+    {
+        return members
+               | std::views::filter(
+                   [memberships](const MemberTable::Member& m) {
+                       return memberships.testFlag(m.membership);
+                   })
+               | std::views::transform(
+                   [](const MemberTable::Member& m) -> const QString& {
+                       return m.userId;
+                   });
+    }
+    bool hasReceivers(auto signal) const
+    {
+        return q->isSignalConnected(QMetaMethod::fromSignal(signal));
+    }
+    //! \brief Get the User object for \p userId to emit \p signal with
+    //!
+    //! User objects for members are only made when needed; this returns
+    //! nullptr if nothing is connected to \p signal.
+    User* userForSignal(auto signal, const QString& userId) const
+    {
+        return hasReceivers(signal) ? q->user(userId) : nullptr;
+    }
 
     // This updates the room displayname field (which is the way a room
     // should be shown in the room list); called whenever the list of
@@ -212,6 +283,32 @@ public:
     Timeline::const_iterator syncEdge() const { return timeline.cend(); }
 
     void getPreviousContent(int limit = 10, const QString &filter = {});
+    //! \brief Load more history if there's not enough before the first
+    //!        displayed event
+    //! \sa Connection::historyPrefetchDistance
+    void prefetchHistory();
+    void updateScrollSpeed(TimelineItem::index_t firstDisplayedIndex);
+    //! Load the latest page of stored events into an empty timeline
+    void loadStoredTimeline();
+    //! \brief Load up to \p limit stored events older than the timeline
+    //! \return whether any events have been loaded
+    bool loadStoredHistory(int limit);
+    //! Replace the stored version of \p ti after it has been changed
+    void updateStoredEvent(const TimelineItem& ti);
+    //! Redact the stored event that is not in the timeline
+    bool redactStoredEvent(const RedactionEvent& redaction);
+    int evictOldestEvents(int keepCount);
+    void fillGap(TimelineItem::index_t index, int limit);
+    GetEventContextJob* loadEventContext(const QString& eventId, int limit);
+    //! \brief Put the events around a loaded event into the timeline
+    //!
+    //! \param events the events, from the oldest to the newest
+    //! \param olderToken the token to load events before \p events
+    //! \param newerToken the token to load events after \p events
+    void addEventContext(RoomEvents&& events, const QString& olderToken,
+                         const QString& newerToken);
+    //! Drop references to the timeline item about to be evicted
+    void forgetTimelineItem(TimelineItem& ti);
 
     const StateEvent* getCurrentState(const StateEventKey& evtKey) const
     {
@@ -259,19 +356,38 @@ public:
     }
     void addRelations(auto from, auto to)
     {
+        // A page of history may have many reactions to the same event;
+        // notify about each event only once
+        QSet<QString> updatedEventIds;
         for (auto it = from; it != to; ++it) {
             if (const auto* reaction = it->template viewAs<ReactionEvent>()) {
                 const auto& content = reaction->content().value;
                 // See ReactionEvent::isValid()
                 Q_ASSERT(content.type == EventRelation::AnnotationType);
                 relations[{ content.eventId, content.type }] << reaction;
-                emit q->updatedEvent(content.eventId);
+                updatedEventIds.insert(content.eventId);
             }
         }
+        for (const auto& eventId : std::as_const(updatedEventIds))
+            emit q->updatedEvent(eventId);
     }
 
-    Changes addNewMessageEvents(RoomEvents&& events);
-    void addHistoricalMessageEvents(RoomEvents&& events);
+    //! \brief Add new events to the timeline
+    //!
+    //! \param limited whether there may be a gap between the timeline and
+    //!                \p events, as in the `limited` flag of a sync response
+    //! \param olderToken the token to get events before \p events
+    Changes addNewMessageEvents(RoomEvents&& events, bool limited = false,
+                                const QString& olderToken = {});
+    void addHistoricalMessageEvents(RoomEvents&& events,
+                                    bool fromStore = false);
+    //! \brief Insert events right before the event with the given index
+    //!
+    //! The events should go from the oldest to the newest; events before
+    //! \p beforeIndex are renumbered to make place for them.
+    //! \return the number of inserted events
+    Timeline::size_type insertEvents(RoomEvents&& events,
+                                     TimelineItem::index_t beforeIndex);
 
     Changes updateStatsFromSyncData(const SyncRoomData &data, bool fromCache);
     void postprocessChanges(Changes changes, bool saveState = true);
@@ -287,6 +403,20 @@ public:
      */
     Timeline::size_type moveEventsToTimeline(RoomEventsRange events,
                                              EventsPlacement placement);
+    //! \brief Release the JSON of timeline events in [from, to)
+    //!
+    //! This only does anything if the room is not displayed and
+    //! the connection keeps events compact. Call it once the events have
+    //! been fully processed (state, relations, stats and notifications);
+    //! looking into the JSON after that rebuilds it.
+    void releaseEventsJson(Timeline::const_iterator from,
+                           Timeline::const_iterator to) const
+    {
+        if (!displayed && connection->compactEventStorage())
+            std::for_each(from, to, [](const TimelineItem& ti) {
+                ti->releaseJson();
+            });
+    }
 
     /**
      * Remove events from the passed container that are already in the timeline
@@ -356,7 +486,9 @@ public:
 
     void setTags(TagsMap&& newTags);
 
-    QJsonObject toJson() const;
+    CacheSnapshot cacheSnapshot() const;
+    QJsonObject toIndexJson() const;
+    void addUnreadCountsTo(QJsonObject& json) const;
 
     bool isLocalUser(const User* u) const { return u == q->localUser(); }
 
@@ -466,9 +598,10 @@ public:
     QMultiHash<QString, QString> getDevicesWithoutKey() const
     {
         QMultiHash<QString, QString> devices;
-        for (const auto& user : q->users() + usersInvited)
-            for (const auto& deviceId : connection->devicesForUser(user->id()))
-                devices.insert(user->id(), deviceId);
+        for (const auto& userId :
+             memberIds(Membership::Join | Membership::Invite))
+            for (const auto& deviceId : connection->devicesForUser(userId))
+                devices.insert(userId, deviceId);
 
         return connection->database()->devicesWithoutKey(
             id, devices, currentOutboundMegolmSession->sessionId());
@@ -477,9 +610,7 @@ public:
 
 private:
     using users_shortlist_t = std::array<User*, 3>;
-    template <typename ContT>
-    users_shortlist_t buildShortlist(const ContT& users) const;
-    users_shortlist_t buildShortlist(const QStringList& userIds) const;
+    users_shortlist_t buildShortlist(auto&& userIds) const;
 };
 
 decltype(Room::Private::baseState) Room::Private::stubbedState {};
@@ -498,7 +629,10 @@ Room::Room(Connection* connection, QString id, JoinState initialJoinState)
     });
     connect(this, &Room::memberListChanged, this, [this, connection] {
         if(usesEncryption()) {
-            connection->encryptionUpdate(this, d->usersInvited);
+            QStringList invitedIds;
+            for (const auto& userId : d->memberIds(Membership::Invite))
+                invitedIds.push_back(userId);
+            connection->encryptionUpdate(this, invitedIds);
         }
     });
     d->groupSessions = connection->loadRoomMegolmSessions(this);
@@ -579,7 +713,7 @@ const Room::PendingEvents& Room::pendingEvents() const
 
 bool Room::allHistoryLoaded() const
 {
-    return !d->prevBatch;
+    return !d->prevBatch && !d->storedHistory;
 }
 
 QString Room::name() const
@@ -666,8 +800,10 @@ User* Room::user(const QString& userId) const
 
 JoinState Room::memberJoinState(User* user) const
 {
-    return d->membersMap.contains(user->name(this), user) ? JoinState::Join
-                                                          : JoinState::Leave;
+    const auto* member =
+        d->members.find(connection()->stringPool().find(user->id()));
+    return member && member->membership == Membership::Join ? JoinState::Join
+                                                            : JoinState::Leave;
 }
 
 Membership Room::memberState(const QString& userId) const
@@ -719,8 +855,9 @@ Omittable<QString> Room::Private::setLastReadReceipt(const QString& userId,
         if (newReceipt.timestamp.isNull())
             newReceipt.timestamp = QDateTime::currentDateTime();
     }
+    const auto pooledUserId = connection->stringPool().intern(userId);
     auto& storedReceipt =
-            lastReadReceipts[userId]; // clazy:exclude=detaching-member
+        lastReadReceipts[pooledUserId]; // clazy:exclude=detaching-member
     const auto prevEventId = storedReceipt.eventId;
     // Check that either the new marker is actually "newer" than the current one
     // or, if both markers are at historyEdge(), event ids are different.
@@ -740,11 +877,11 @@ Omittable<QString> Room::Private::setLastReadReceipt(const QString& userId,
     auto oldEventReadUsersIt =
         eventIdReadUsers.find(prevEventId); // clazy:exclude=detaching-member
     if (oldEventReadUsersIt != eventIdReadUsers.end()) {
-        oldEventReadUsersIt->remove(userId);
+        oldEventReadUsersIt->remove(pooledUserId);
         if (oldEventReadUsersIt->isEmpty())
             eventIdReadUsers.erase(oldEventReadUsersIt);
     }
-    eventIdReadUsers[newReceipt.eventId].insert(userId);
+    eventIdReadUsers[newReceipt.eventId].insert(pooledUserId);
     storedReceipt = std::move(newReceipt);
 
     {
@@ -761,9 +898,13 @@ Omittable<QString> Room::Private::setLastReadReceipt(const QString& userId,
     // receipts arrive. It can be called thousands of times during an initial
     // sync, e.g.
     // TODO: remove in 0.8
-    if (const auto member = q->user(userId); !isLocalUser(member))
-        QT_IGNORE_DEPRECATIONS(emit q->readMarkerForUserMoved(
-            member, prevEventId, storedReceipt.eventId);)
+    // Only make a User object if anything still listens to it
+    if (userId != connection->userId())
+        QT_IGNORE_DEPRECATIONS(
+            if (auto* member =
+                    userForSignal(&Room::readMarkerForUserMoved, userId))
+                emit q->readMarkerForUserMoved(member, prevEventId,
+                                               storedReceipt.eventId);)
     return prevEventId;
 }
 
@@ -1090,7 +1231,8 @@ const RoomTombstoneEvent *Room::tombstone() const
 void Room::Private::getAllMembers()
 {
     // If already loaded or already loading, there's nothing to do here.
-    if (q->joinedCount() <= membersMap.size() || isJobPending(allMembersJob))
+    if (q->joinedCount() <= members.count(Membership::Join)
+        || isJobPending(allMembersJob))
         return;
 
     allMembersJob = connection->callApi<GetMembersByRoomJob>(
@@ -1120,8 +1262,36 @@ void Room::setDisplayed(bool displayed)
 
     d->displayed = displayed;
     emit displayedChanged(displayed);
-    if (displayed)
+    if (displayed) {
+        loadFully();
         d->getAllMembers();
+        d->prefetchHistory();
+    } else {
+        d->scrollSpeed = 0;
+        d->scrollIndex = none;
+        if (connection()->compactEventStorage())
+            for (const auto& ti : d->timeline)
+                ti->releaseJson();
+    }
+}
+
+bool Room::isFullyLoaded() const { return d->fullyLoaded; }
+
+void Room::loadFully()
+{
+    if (!d->fullyLoaded)
+        connection()->loadRoomFully(this);
+}
+
+void Room::setFullyLoaded(bool fullyLoaded)
+{
+    if (d->fullyLoaded == fullyLoaded)
+        return;
+    d->fullyLoaded = fullyLoaded;
+    if (fullyLoaded) {
+        d->loadStoredTimeline();
+        emit this->fullyLoaded();
+    }
 }
 
 QString Room::firstDisplayedEventId() const { return d->firstDisplayedEventId; }
@@ -1143,6 +1313,10 @@ void Room::setFirstDisplayedEventId(const QString& eventId)
 
     d->firstDisplayedEventId = eventId;
     emit firstDisplayedEventChanged();
+    if (const auto marker = firstDisplayedMarker(); marker != historyEdge()) {
+        d->updateScrollSpeed(marker->index());
+        d->prefetchHistory();
+    }
 }
 
 void Room::setFirstDisplayedEvent(TimelineItem::index_t index)
@@ -1191,12 +1365,13 @@ QString Room::readMarkerEventId() const { return lastFullyReadEventId(); }
 
 ReadReceipt Room::lastReadReceipt(const QString& userId) const
 {
-    return d->lastReadReceipts.value(userId);
+    // Lookups don't add to the pool; an id not in it has no receipt anyway
+    return d->lastReadReceipts.value(connection()->stringPool().find(userId));
 }
 
 ReadReceipt Room::lastLocalReadReceipt() const
 {
-    return d->lastReadReceipts.value(localUser()->id());
+    return lastReadReceipt(localUser()->id());
 }
 
 Room::rev_iter_t Room::localReadReceiptMarker() const
@@ -1213,7 +1388,12 @@ Room::rev_iter_t Room::fullyReadMarker() const
 
 QSet<QString> Room::userIdsAtEvent(const QString& eventId)
 {
-    return d->eventIdReadUsers.value(eventId);
+    const auto& pooledIds = d->eventIdReadUsers.value(eventId);
+    QSet<QString> userIds;
+    userIds.reserve(pooledIds.size());
+    for (const auto& uId : pooledIds)
+        userIds.insert(uId);
+    return userIds;
 }
 
 QSet<User*> Room::usersAtEventId(const QString& eventId)
@@ -1518,9 +1698,34 @@ QString Room::prettyPrint(const QString& plainText) const
 
 QList<User*> Room::usersTyping() const { return d->usersTyping; }
 
-QList<User*> Room::membersLeft() const { return d->membersLeft; }
+QList<User*> Room::membersLeft() const
+{
+    QList<User*> result;
+    for (const auto& userId : d->memberIds(Membership::Leave | Membership::Ban
+                                           | Membership::Knock))
+        result.push_back(user(userId));
+    return result;
+}
+
+QList<User*> Room::users() const
+{
+    QList<User*> result;
+    result.reserve(int(d->members.count(Membership::Join)));
+    for (const auto& userId : d->memberIds(Membership::Join))
+        result.push_back(user(userId));
+    return result;
+}
+
+QStringList Room::memberIds() const
+{
+    QStringList result;
+    result.reserve(int(d->members.count(Membership::Join)));
+    for (const auto& userId : d->memberIds(Membership::Join))
+        result.push_back(userId);
+    return result;
+}
 
-QList<User*> Room::users() const { return d->membersMap.values(); }
+const MemberTable& Room::memberTable() const { return d->members; }
 
 QStringList Room::memberNames() const
 {
@@ -1530,9 +1735,9 @@ QStringList Room::memberNames() const
 QStringList Room::safeMemberNames() const
 {
     QStringList res;
-    res.reserve(d->membersMap.size());
-    for (const auto* u: std::as_const(d->membersMap))
-        res.append(safeMemberName(u->id()));
+    res.reserve(int(d->members.count(Membership::Join)));
+    for (const auto& userId : d->memberIds(Membership::Join))
+        res.append(safeMemberName(userId));
 
     return res;
 }
@@ -1540,9 +1745,9 @@ QStringList Room::safeMemberNames() const
 QStringList Room::htmlSafeMemberNames() const
 {
     QStringList res;
-    res.reserve(d->membersMap.size());
-    for (const auto* u: std::as_const(d->membersMap))
-        res.append(htmlSafeMemberName(u->id()));
+    res.reserve(int(d->members.count(Membership::Join)));
+    for (const auto& userId : d->memberIds(Membership::Join))
+        res.append(htmlSafeMemberName(userId));
 
     return res;
 }
@@ -1641,14 +1846,14 @@ void Room::handleRoomKeyEvent(const RoomKeyEvent& roomKeyEvent,
 
 int Room::joinedCount() const
 {
-    return d->summary.joinedMemberCount.value_or(d->membersMap.size());
+    return d->summary.joinedMemberCount.value_or(
+        int(d->members.count(Membership::Join)));
 }
 
 int Room::invitedCount() const
 {
-    // TODO: Store invited users in Room too
-    Q_ASSERT(d->summary.invitedMemberCount.has_value());
-    return d->summary.invitedMemberCount.value_or(0);
+    return d->summary.invitedMemberCount.value_or(
+        int(d->members.count(Membership::Invite)));
 }
 
 int Room::totalMemberCount() const { return joinedCount() + invitedCount(); }
@@ -1664,79 +1869,6 @@ Room::Changes Room::Private::setSummary(RoomSummary&& newSummary)
     return Change::Summary;
 }
 
-void Room::Private::insertMemberIntoMap(User* u)
-{
-    const auto maybeUserName =
-        currentState.query(u->id(), &RoomMemberEvent::newDisplayName);
-    if (!maybeUserName)
-        qCWarning(MEMBERS) << "insertMemberIntoMap():" << u->id()
-                           << "has no name (even empty)";
-    const auto userName = maybeUserName.value_or(QString());
-    const auto namesakes = membersMap.values(userName);
-    qCDebug(MEMBERS) << "insertMemberIntoMap(), user" << u->id()
-                     << "with name" << userName << '-'
-                     << namesakes.size() << "namesake(s) found";
-
-    // Callers should make sure they are not adding an existing user once more
-    Q_ASSERT(!namesakes.contains(u));
-    if (namesakes.contains(u)) { // Release version whines but continues
-        qCCritical(MEMBERS) << "Trying to add a user" << u->id() << "to room"
-                            << q->objectName() << "but that's already in it";
-        return;
-    }
-
-    // If there is exactly one namesake of the added user, signal member
-    // renaming for that other one because the two should be disambiguated now
-    if (namesakes.size() == 1)
-        emit q->memberAboutToRename(namesakes.front(),
-                                    namesakes.front()->fullName(q));
-    membersMap.insert(userName, u);
-    if (namesakes.size() == 1)
-        emit q->memberRenamed(namesakes.front());
-}
-
-void Room::Private::removeMemberFromMap(User* u)
-{
-    const auto userName = currentState.queryOr(u->id(),
-                                               &RoomMemberEvent::newDisplayName,
-                                               QString());
-
-    qCDebug(MEMBERS) << "removeMemberFromMap(), username" << userName
-                     << "for user" << u->id();
-    User* namesake = nullptr;
-    auto namesakes = membersMap.values(userName);
-    // If there was one namesake besides the removed user, signal member
-    // renaming for it because it doesn't need to be disambiguated any more.
-    if (namesakes.size() == 2) {
-        namesake =
-            namesakes.front() == u ? namesakes.back() : namesakes.front();
-        Q_ASSERT_X(namesake != u, __FUNCTION__, "Room members list is broken");
-        emit q->memberAboutToRename(namesake, userName);
-    }
-    if (membersMap.remove(userName, u) == 0) {
-        qCDebug(MEMBERS) << "No entries removed; checking the whole list";
-        // Unless at the stage of initial filling, this no removed entries
-        // is suspicious; double-check that this user is not found in
-        // the whole map, and stop (for debug builds) or shout in the logs
-        // (for release builds) if there's one. That search is O(n), which
-        // may come rather expensive for larger rooms.
-        QElapsedTimer et;
-        auto it = std::find(membersMap.cbegin(), membersMap.cend(), u);
-        if (et.nsecsElapsed() > ProfilerMinNsecs / 10)
-            qCDebug(MEMBERS) << "...done in" << et;
-        if (it != membersMap.cend()) {
-            // The assert (still) does more harm than good, it seems
-//            Q_ASSERT_X(false, __FUNCTION__,
-//                       "Mismatched name in the room members list");
-            qCCritical(MEMBERS) << "Mismatched name in the room members list;"
-                                   " avoiding the list corruption";
-            membersMap.remove(it.key(), u);
-        }
-    }
-    if (namesake)
-        emit q->memberRenamed(namesake);
-}
-
 inline auto makeErrorStr(const Event& e, QByteArray msg)
 {
     return msg.append("; event dump follows:\n")
@@ -1816,21 +1948,68 @@ QString Room::disambiguatedMemberName(const QString& mxId) const
     if (username.isEmpty())
         return mxId;
 
-    auto namesakesIt = qAsConst(d->membersMap).find(username);
-
     // We expect a user to be a member of the room - but technically it is
     // possible to invoke this function even for non-members. In such case
     // we return the full name, just in case.
-    if (namesakesIt == d->membersMap.cend())
-        return makeFullUserName(username, mxId);
-
-    auto nextUserIt = namesakesIt;
-    if (++nextUserIt == d->membersMap.cend() || nextUserIt.key() != username)
+    const auto namesakes = d->members.joinedNamesakes(username);
+    if (namesakes.size() == 1
+        && namesakes.front() == connection()->stringPool().find(mxId))
         return username; // No disambiguation necessary
 
     return makeFullUserName(username, mxId); // Disambiguate fully
 }
 
+void Room::Private::updateMember(const RoomMemberEvent& evt)
+{
+    const auto userId = connection->stringPool().intern(evt.userId());
+    const auto* oldMember = members.find(userId);
+    const auto wasJoined =
+        oldMember && oldMember->membership == Membership::Join;
+    const auto oldName = oldMember ? oldMember->displayName : QString();
+    if (evt.membership() == Membership::Undefined) {
+        members.remove(userId);
+        return;
+    }
+    MemberTable::Member member { userId,
+                                 evt.newDisplayName().value_or(QString()),
+                                 evt.newAvatarUrl().value_or(QUrl()),
+                                 powerLevelOf(evt.userId()), evt.membership() };
+    const auto isJoined = member.membership == Membership::Join;
+    const auto nameChanged = oldName != member.displayName;
+
+    // If there was one namesake besides this member, it doesn't need to be
+    // disambiguated any more; if there's one under the new name, it needs to
+    InternedString formerNamesake;
+    if (wasJoined && (!isJoined || nameChanged))
+        if (const auto namesakes = members.joinedNamesakes(oldName);
+            namesakes.size() == 2)
+            formerNamesake = namesakes.front() == userId ? namesakes.back()
+                                                         : namesakes.front();
+    InternedString newNamesake;
+    if (isJoined && (!wasJoined || nameChanged))
+        if (const auto namesakes = members.joinedNamesakes(member.displayName);
+            namesakes.size() == 1)
+            newNamesake = namesakes.front();
+
+    const auto notifyRenames = hasReceivers(&Room::memberAboutToRename)
+                               || hasReceivers(&Room::memberRenamed);
+    auto* formerNamesakeUser = notifyRenames && !formerNamesake.isNull()
+                                   ? q->user(formerNamesake)
+                                   : nullptr;
+    auto* newNamesakeUser =
+        notifyRenames && !newNamesake.isNull() ? q->user(newNamesake) : nullptr;
+    if (formerNamesakeUser)
+        emit q->memberAboutToRename(formerNamesakeUser, oldName);
+    if (newNamesakeUser)
+        emit q->memberAboutToRename(
+            newNamesakeUser, makeFullUserName(member.displayName, newNamesake));
+    members.insert(std::move(member));
+    if (formerNamesakeUser)
+        emit q->memberRenamed(formerNamesakeUser);
+    if (newNamesakeUser)
+        emit q->memberRenamed(newNamesakeUser);
+}
+
 QString Room::safeMemberName(const QString& userId) const
 {
     return sanitized(disambiguatedMemberName(userId));
@@ -1924,7 +2103,10 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     qCDebug(MAIN) << "--- Updating room" << id() << "/" << objectName();
     bool firstUpdate = d->baseState.empty();
 
-    if (d->prevBatch && d->prevBatch->isEmpty())
+    // prevBatch belongs to the oldest event in the timeline; if the timeline
+    // already has events (e.g. loaded from the timeline store), the batch
+    // token is not about them
+    if (d->prevBatch && d->prevBatch->isEmpty() && d->timeline.empty())
         *d->prevBatch = data.timelinePrevBatch;
     setJoinState(data.joinState);
 
@@ -1932,7 +2114,9 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
     // The order of calculation is important - don't merge the lines!
     roomChanges |= d->updateStateFrom(std::move(data.state));
     roomChanges |= d->setSummary(std::move(data.summary));
-    roomChanges |= d->addNewMessageEvents(std::move(data.timeline));
+    roomChanges |= d->addNewMessageEvents(std::move(data.timeline),
+                                          data.timelineLimited,
+                                          data.timelinePrevBatch);
 
     for (auto&& ephemeralEvent : data.ephemeral)
         roomChanges |= processEphemeralEvent(std::move(ephemeralEvent));
@@ -1949,6 +2133,8 @@ void Room::updateData(SyncRoomData&& data, bool fromCache)
         emit namesChanged(this);
 
     d->postprocessChanges(roomChanges, !fromCache);
+    if (fromCache && d->fullyLoaded)
+        d->loadStoredTimeline();
     if (firstUpdate)
         emit baseStateLoaded();
     qCDebug(MAIN) << "--- Finished updating room" << id() << "/" << objectName();
@@ -2405,13 +2591,18 @@ void Room::getPreviousContent(int limit, const QString& filter)
 
 void Room::Private::getPreviousContent(int limit, const QString& filter)
 {
+    // If the store has nothing (anymore), go to the server right away
+    if (storedHistory && loadStoredHistory(limit))
+        return;
     if (!prevBatch || isJobPending(eventsHistoryJob))
         return;
 
     eventsHistoryJob = connection->callApi<GetRoomEventsJob>(id, "b", *prevBatch,
                                                              "", limit, filter);
     emit q->eventsHistoryJobChanged();
-    connect(eventsHistoryJob, &BaseJob::success, q, [this] {
+    connect(eventsHistoryJob, &BaseJob::success, q, [this, from = *prevBatch] {
+        if (!timeline.empty() && !from.isEmpty())
+            addHistoryToken(timeline.front().index(), from);
         if (const auto newPrevBatch = eventsHistoryJob->end();
             !newPrevBatch.isEmpty() && *prevBatch != newPrevBatch) //
         {
@@ -2423,11 +2614,393 @@ void Room::Private::getPreviousContent(int limit, const QString& filter)
         }
 
         addHistoricalMessageEvents(eventsHistoryJob->chunk());
+        prefetchHistory();
     });
     connect(eventsHistoryJob, &QObject::destroyed, q,
             &Room::eventsHistoryJobChanged);
 }
 
+void Room::Private::updateScrollSpeed(TimelineItem::index_t firstDisplayedIndex)
+{
+    if (scrollIndex && scrollTimer.isValid()) {
+        const auto elapsedMs = std::max(scrollTimer.restart(), qint64(1));
+        // Only scrolling towards the history needs prefetching
+        const auto eventsScrolled =
+            std::max(*scrollIndex - firstDisplayedIndex, 0);
+        scrollSpeed = (scrollSpeed + eventsScrolled * 1000.0 / elapsedMs) / 2;
+    } else
+        scrollTimer.start();
+    scrollIndex = firstDisplayedIndex;
+}
+
+void Room::Private::prefetchHistory()
+{
+    // The page should last long enough for the next one to arrive
+    static constexpr auto LookaheadSecs = 2.0;
+    static constexpr auto MinPageSize = 10;
+    static constexpr auto MaxPageSize = 200;
+
+    const auto distance = connection->historyPrefetchDistance();
+    if (!displayed || distance <= 0 || q->allHistoryLoaded()
+        || isJobPending(eventsHistoryJob))
+        return;
+    const auto marker = q->firstDisplayedMarker();
+    if (marker == historyEdge())
+        return;
+    const auto eventsAhead = marker->index() - timeline.front().index();
+    if (eventsAhead >= distance)
+        return;
+
+    const auto pageSize =
+        qBound(MinPageSize,
+               std::max(distance - eventsAhead,
+                        int(std::lround(scrollSpeed * LookaheadSecs))),
+               MaxPageSize);
+    qCDebug(MESSAGES).nospace()
+        << "Prefetching " << pageSize << " event(s) in " << q->objectName()
+        << ", " << eventsAhead << " event(s) before the first displayed one";
+    getPreviousContent(pageSize);
+}
+
+//! The JSON to store an event with; encrypted events are stored as received
+QJsonObject storedJson(const RoomEvent& evt)
+{
+    const auto* originalEvent = evt.originalEvent();
+    return (originalEvent ? *originalEvent : evt).fullJson();
+}
+
+void Room::Private::loadStoredTimeline()
+{
+    // Enough to fill the screen; the rest comes with getPreviousContent()
+    static constexpr auto InitialPageSize = 20;
+    if (!timeline.empty())
+        return;
+    if (auto* store = connection->timelineStore();
+        store && store->size(id) > 0) {
+        storedHistory = true;
+        loadStoredHistory(InitialPageSize);
+    }
+}
+
+bool Room::Private::loadStoredHistory(int limit)
+{
+    auto* store = connection->timelineStore();
+    if (!store) {
+        storedHistory = false;
+        return false;
+    }
+    QElapsedTimer et;
+    et.start();
+    auto page = store->loadBefore(
+        id, timeline.empty() ? QString() : timeline.front()->id(), limit);
+    // Without the oldest event in the timeline found in the store, the rest
+    // of the history can only come from the server, using the token saved
+    // when the events after it were evicted
+    storedHistory = !page.events.isEmpty() && !page.reachedOldest;
+    if (page.reachedOldest)
+        prevBatch = store->olderToken(id);
+    if (page.events.isEmpty())
+        return false;
+
+    RoomEvents events;
+    events.reserve(size_t(page.events.size()));
+    for (const auto& json : std::as_const(page.events))
+        events.push_back(loadEvent<RoomEvent>(json));
+    if (et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "Loaded" << events.size() << "stored event(s) for"
+                          << q->objectName() << "in" << et;
+    addHistoricalMessageEvents(std::move(events), true);
+    return true;
+}
+
+void Room::Private::updateStoredEvent(const TimelineItem& ti)
+{
+    if (connection->timelineStore())
+        connection->updateTimelineStore(
+            [roomId = id, json = storedJson(*ti)](TimelineStore& store) {
+                store.replaceEvent(roomId, json);
+            });
+}
+
+int Room::evictOldestEvents(int keepCount)
+{
+    return d->evictOldestEvents(keepCount);
+}
+
+int Room::Private::evictOldestEvents(int keepCount)
+{
+    if (timeline.empty() || displayed || isJobPending(eventsHistoryJob)
+        || isJobPending(gapFillJob))
+        return 0;
+
+    // Unread counters are calculated from the markers on, so keep them
+    auto keepFrom = timeline.back().index() - std::max(keepCount, 1) + 1;
+    for (const auto& marker :
+         { q->fullyReadMarker(), q->localReadReceiptMarker() })
+        if (marker != historyEdge())
+            keepFrom = std::min(keepFrom, marker->index());
+    const auto oldestIndex = timeline.front().index();
+    if (keepFrom <= oldestIndex)
+        return 0;
+
+    // Find the newest point before keepFrom to load the history again from
+    auto cutIndex = oldestIndex;
+    QString cutToken;
+    if (auto it = historyTokens.upper_bound(keepFrom);
+        it != historyTokens.begin()) {
+        --it;
+        cutIndex = it->first;
+        cutToken = it->second;
+    }
+    auto* store = connection->timelineStore();
+    const auto fromStore =
+        store && store->contains(id, (*q->findInTimeline(keepFrom))->id());
+    if (fromStore)
+        cutIndex = keepFrom;
+    if (cutIndex <= oldestIndex)
+        return 0;
+
+    emit q->aboutToEvictMessages(oldestIndex, cutIndex - 1);
+    QSet<QString> updatedEventIds;
+    while (timeline.front().index() < cutIndex) {
+        if (const auto* reaction = timeline.front().viewAs<ReactionEvent>())
+            updatedEventIds.insert(reaction->content().value.eventId);
+        forgetTimelineItem(timeline.front());
+        timeline.pop_front();
+    }
+    historyTokens.erase(historyTokens.begin(),
+                        historyTokens.lower_bound(cutIndex));
+    // A gap right before the new oldest event is covered by prevBatch
+    const auto gapsEnd = gaps.upper_bound(cutIndex);
+    const auto gapsEvicted = gapsEnd != gaps.begin();
+    gaps.erase(gaps.begin(), gapsEnd);
+    // Even with the events in the store, the token at the cut point is kept:
+    // should the store lose them (see addNewMessageEvents()), the history
+    // is loaded from the server from there, not from before the events
+    // that are gone
+    prevBatch = cutToken;
+    if (fromStore) // loadStoredHistory() takes the token from the store
+        storedHistory = true;
+    const auto evictedCount = cutIndex - oldestIndex;
+    qCDebug(MESSAGES) << "Evicted" << evictedCount << "event(s) from"
+                      << q->objectName() << (fromStore ? "to the store" : "");
+    emit q->evictedMessages(oldestIndex, cutIndex - 1);
+    if (gapsEvicted)
+        emit q->gapsChanged();
+    for (const auto& eventId : std::as_const(updatedEventIds))
+        if (eventsIndex.contains(eventId))
+            emit q->updatedEvent(eventId);
+    return evictedCount;
+}
+
+void Room::Private::forgetTimelineItem(TimelineItem& ti)
+{
+    const auto& eventId = ti->id();
+    eventsIndex.remove(eventId);
+    notifications.remove(eventId);
+    if (const auto* reaction = ti.viewAs<ReactionEvent>()) {
+        const auto& content = reaction->content().value;
+        if (auto it = relations.find({ content.eventId, content.type });
+            it != relations.end()) {
+            it->removeOne(reaction);
+            if (it->isEmpty())
+                relations.erase(it);
+        }
+    }
+    // The current state may still refer to the event; the event then goes
+    // to the base state, replacing an older one there
+    if (const auto* evt = ti.viewAs<StateEvent>()) {
+        StateEventKey evtKey { evt->matrixType(), evt->stateKey() };
+        if (currentState.value(evtKey, nullptr) == evt) {
+            auto eventPtr = ti.replaceEvent({});
+            baseState[evtKey].reset(
+                static_cast<StateEvent*>(eventPtr.release()));
+        }
+    }
+}
+
+QVector<TimelineItem::index_t> Room::timelineGaps() const
+{
+    QVector<TimelineItem::index_t> result;
+    result.reserve(int(d->gaps.size()));
+    for (const auto& gap : d->gaps)
+        result.push_back(gap.first);
+    return result;
+}
+
+void Room::fillGap(TimelineItem::index_t index, int limit)
+{
+    d->fillGap(index, limit);
+}
+
+void Room::Private::fillGap(TimelineItem::index_t index, int limit)
+{
+    const auto gapIt = gaps.find(index);
+    if (gapIt == gaps.end() || isJobPending(gapFillJob))
+        return;
+
+    // Newer events are usually looked at first, so go backwards if possible
+    const auto backwards = !gapIt->second.olderToken.isEmpty();
+    const auto token =
+        backwards ? gapIt->second.olderToken : gapIt->second.newerToken;
+    if (token.isEmpty()) {
+        qCWarning(MESSAGES) << "No token to fill the gap before event" << index
+                            << "in" << q->objectName();
+        return;
+    }
+    gapFillJob = connection->callApi<GetRoomEventsJob>(
+        id, backwards ? "b" : "f", token, "", limit);
+    // Events inserted before the gap in the meantime (e.g., by
+    // loadEventContext()) change its index; the event after the gap
+    // keeps its id
+    connect(gapFillJob, &BaseJob::success, q,
+            [this, eventId = (*q->findInTimeline(index))->id(), backwards,
+             token] {
+        const auto indexIt = eventsIndex.constFind(eventId);
+        if (indexIt == eventsIndex.cend())
+            return; // Evicted in the meantime
+        const auto index = *indexIt;
+        auto gapIt = gaps.find(index);
+        if (gapIt == gaps.end()
+            || (backwards ? gapIt->second.olderToken
+                          : gapIt->second.newerToken)
+                   != token)
+            return; // Filled or split in the meantime
+
+        auto events = gapFillJob->chunk();
+        const auto nextToken = gapFillJob->end();
+        // No more events in this direction means that the gap is closed
+        auto closed =
+            events.empty() || nextToken.isEmpty() || nextToken == token;
+        // Make the events go from the oldest to the newest; once the chunk
+        // reaches an event on the other side of the gap, the rest of it is
+        // already in the timeline
+        const auto isLoaded = [this](const RoomEventPtr& e) {
+            return eventsIndex.contains(e->id());
+        };
+        if (backwards) {
+            std::reverse(events.begin(), events.end());
+            if (const auto it =
+                    std::find_if(events.rbegin(), events.rend(), isLoaded);
+                it != events.rend()) {
+                events.erase(events.begin(), it.base());
+                closed = true;
+            }
+        } else if (const auto it =
+                       std::find_if(events.begin(), events.end(), isLoaded);
+                   it != events.end()) {
+            events.erase(it, events.end());
+            closed = true;
+        }
+
+        auto gap = std::move(gapIt->second);
+        gaps.erase(gapIt);
+        const auto insertedSize =
+            TimelineItem::index_t(insertEvents(std::move(events), index));
+        if (backwards)
+            addHistoryToken(index, token);
+        if (!closed) {
+            if (backwards) {
+                gap.olderToken = nextToken;
+                addHistoryToken(index - insertedSize, nextToken);
+                gaps.emplace(index - insertedSize, std::move(gap));
+            } else {
+                gap.newerToken = nextToken;
+                gaps.emplace(index, std::move(gap));
+            }
+        }
+        qCDebug(MESSAGES).nospace()
+            << "Filled " << insertedSize << " event(s) into the gap before "
+            << index << " in " << q->objectName()
+            << (closed ? "; the gap is closed" : "");
+        emit q->gapsChanged();
+    });
+}
+
+GetEventContextJob* Room::loadEventContext(const QString& eventId, int limit)
+{
+    return d->loadEventContext(eventId, limit);
+}
+
+GetEventContextJob* Room::Private::loadEventContext(const QString& eventId,
+                                                    int limit)
+{
+    if (eventsIndex.contains(eventId)) {
+        emit q->eventContextLoaded(eventId);
+        return nullptr;
+    }
+    auto* job = connection->callApi<GetEventContextJob>(id, eventId, limit);
+    connect(job, &BaseJob::success, q, [this, job, eventId] {
+        auto events = job->eventsBefore();
+        std::reverse(events.begin(), events.end());
+        events.push_back(job->event());
+        auto eventsAfter = job->eventsAfter();
+        std::move(eventsAfter.begin(), eventsAfter.end(),
+                  std::back_inserter(events));
+        addEventContext(std::move(events), job->begin(), job->end());
+        if (eventsIndex.contains(eventId))
+            emit q->eventContextLoaded(eventId);
+    });
+    return job;
+}
+
+void Room::Private::addEventContext(RoomEvents&& events,
+                                    const QString& olderToken,
+                                    const QString& newerToken)
+{
+    dropDuplicateEvents(events);
+    if (events.empty())
+        return;
+
+    // The server gives no ordering across the whole room; origin timestamps
+    // are the best guess of where the events belong
+    const auto oldestTs = events.front()->originTimestamp();
+    const auto newestTs = events.back()->originTimestamp();
+    if (timeline.empty() || newestTs <= timeline.front()->originTimestamp()) {
+        const auto frontIndex = timeline.empty() ? 0 : timeline.front().index();
+        const auto hadEvents = !timeline.empty();
+        Gap gap { storedHistory || !prevBatch ? QString() : *prevBatch,
+                  newerToken };
+        const auto insertedSize =
+            TimelineItem::index_t(insertEvents(std::move(events), frontIndex));
+        if (hadEvents) {
+            if (!gap.olderToken.isEmpty())
+                addHistoryToken(frontIndex, gap.olderToken);
+            gaps.emplace(frontIndex, std::move(gap));
+        }
+        // The store has no events adjacent to the new oldest ones
+        storedHistory = false;
+        prevBatch = olderToken;
+        if (!olderToken.isEmpty())
+            addHistoryToken(frontIndex - insertedSize, olderToken);
+        emit q->gapsChanged();
+        return;
+    }
+    for (auto gapIt = gaps.begin(); gapIt != gaps.end(); ++gapIt) {
+        const auto index = gapIt->first;
+        Q_ASSERT(index > timeline.front().index());
+        if ((*q->findInTimeline(index - 1))->originTimestamp() > oldestTs
+            || (*q->findInTimeline(index))->originTimestamp() < newestTs)
+            continue;
+
+        // Split the gap in two around the new events
+        auto gap = std::move(gapIt->second);
+        gaps.erase(gapIt);
+        const auto insertedSize =
+            TimelineItem::index_t(insertEvents(std::move(events), index));
+        gaps.emplace(index, Gap { gap.olderToken, newerToken });
+        gaps.emplace(index - insertedSize,
+                     Gap { olderToken, std::move(gap.newerToken) });
+        if (!olderToken.isEmpty())
+            addHistoryToken(index - insertedSize, olderToken);
+        emit q->gapsChanged();
+        return;
+    }
+    qCWarning(MESSAGES) << "Couldn't find a place in the timeline of"
+                        << q->objectName() << "for the events from"
+                        << oldestTs << "to" << newestTs;
+}
+
 void Room::inviteToRoom(const QString& memberId)
 {
     connection()->callApi<InviteUserJob>(id(), memberId);
@@ -2589,17 +3162,17 @@ void Room::Private::dropDuplicateEvents(RoomEvents& events) const
     if (events.empty())
         return;
 
-    // Multiple-remove (by different criteria), single-erase
-    // 1. Check for duplicates against the timeline.
-    auto dupsBegin =
+    // Drop events that are in the timeline already or earlier in the batch,
+    // in a single pass so that large pages of history don't take ages
+    QSet<QString> batchIds;
+    batchIds.reserve(int(events.size()));
+    const auto dupsBegin =
         remove_if(events.begin(), events.end(), [&](const RoomEventPtr& e) {
-            return eventsIndex.contains(e->id());
-        });
-
-    // 2. Check for duplicates within the batch if there are still events.
-    for (auto eIt = events.begin(); distance(eIt, dupsBegin) > 1; ++eIt)
-        dupsBegin = remove_if(eIt + 1, dupsBegin, [&](const RoomEventPtr& e) {
-            return e->id() == (*eIt)->id();
+            const auto& eId = e->id();
+            if (eventsIndex.contains(eId) || batchIds.contains(eId))
+                return true;
+            batchIds.insert(eId);
+            return false;
         });
     if (dupsBegin == events.end())
         return;
@@ -2692,6 +3265,26 @@ RoomEventPtr makeRedacted(const RoomEvent& target,
     return loadEvent<RoomEvent>(originalJson);
 }
 
+bool Room::Private::redactStoredEvent(const RedactionEvent& redaction)
+{
+    if (auto* store = connection->timelineStore();
+        !store || !store->contains(id, redaction.redactedEvent()))
+        return false;
+    qCDebug(EVENTS) << "Redacting stored event" << redaction.redactedEvent()
+                    << "with" << redaction.id();
+    connection->updateTimelineStore([roomId = id,
+                                     redactionJson = redaction.fullJson()](
+                                        TimelineStore& store) {
+        const auto r = loadEvent<RedactionEvent>(redactionJson);
+        const auto json = store.loadEvent(roomId, r->redactedEvent());
+        if (!json.isEmpty())
+            store.replaceEvent(
+                roomId, makeRedacted(*loadEvent<RoomEvent>(json), *r)
+                            ->fullJson());
+    });
+    return true;
+}
+
 bool Room::Private::processRedaction(const RedactionEvent& redaction)
 {
     // Can't use findInTimeline because it returns a const iterator, and
@@ -2713,6 +3306,7 @@ bool Room::Private::processRedaction(const RedactionEvent& redaction)
     // instead of the redacted one. oldEvent will be deleted on return.
     auto oldEvent = ti.replaceEvent(makeRedacted(*ti, redaction));
     qCDebug(EVENTS) << "Redacted" << oldEvent->id() << "with" << redaction.id();
+    updateStoredEvent(ti);
     if (oldEvent->isStateEvent()) {
         // Check whether the old event was a part of current state; if it was,
         // update the current state to the redacted event object.
@@ -2821,11 +3415,17 @@ inline bool isEditing(const RoomEventPtr& ep)
     return false;
 }
 
-Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
+Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events,
+                                                bool limited,
+                                                const QString& olderToken)
 {
+    const auto receivedSize = events.size();
     dropDuplicateEvents(events);
     if (events.empty())
         return Change::None;
+    // Events that are already in the timeline connect the batch to it
+    const auto hasGap = limited && !timeline.empty()
+                        && events.size() == receivedSize;
 
     decryptIncomingEvents(events);
 
@@ -2849,7 +3449,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
                             return ep->id() == id;
                         }); targetIt != events.end())
                     *targetIt = makeRedacted(**targetIt, *r);
-                else
+                else if (!redactStoredEvent(*r))
                     qCDebug(STATE)
                         << "Redaction" << r->id() << "ignored: target event"
                         << r->redactedEvent() << "is not found";
@@ -2876,6 +3476,26 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
         }
     }
 
+    if (connection->timelineStore()) {
+        // Without an anchor, the store drops the events it has and starts
+        // over: unlike the timeline, it has no place for gaps.
+        auto anchorId = hasGap || timeline.empty() ? QString()
+                                                   : timeline.back()->id();
+        QVector<QJsonObject> eventsJson;
+        eventsJson.reserve(int(events.size()));
+        for (const auto& eptr : events)
+            eventsJson.push_back(storedJson(*eptr));
+        connection->updateTimelineStore(
+            [roomId = id, anchorId = std::move(anchorId),
+             eventsJson = std::move(eventsJson),
+             olderToken](TimelineStore& store) {
+                store.appendNewer(roomId, anchorId, eventsJson, olderToken);
+            });
+        // ...along with any history evicted there from the timeline
+        if (hasGap)
+            storedHistory = false;
+    }
+
     // State changes arrive as a part of timeline; the current room state gets
     // updated before merging events to the timeline because that's what
     // clients historically expect. This may eventually change though if we
@@ -2943,6 +3563,12 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
 
     if (totalInserted > 0) {
         addRelations(from, syncEdge());
+        if (!olderToken.isEmpty())
+            addHistoryToken(from->index(), olderToken);
+        if (hasGap) {
+            gaps.emplace(from->index(), Gap { olderToken, {} });
+            emit q->gapsChanged();
+        }
 
         qCDebug(MESSAGES) << "Room" << q->objectName() << "received"
                        << totalInserted << "new events; the last event is now"
@@ -2958,6 +3584,7 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
             && q->fullyReadMarker().base() == from)
             roomChanges |=
                 setFullyReadMarker(q->lastReadReceipt(firstWriterId).eventId);
+        releaseEventsJson(from, syncEdge());
     }
 
     Q_ASSERT(timeline.size() == timelineSize + totalInserted);
@@ -2967,11 +3594,26 @@ Room::Changes Room::Private::addNewMessageEvents(RoomEvents&& events)
     return roomChanges;
 }
 
-void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
+void Room::Private::addHistoricalMessageEvents(RoomEvents&& events,
+                                               bool fromStore)
 {
     const auto timelineSize = timeline.size();
 
     dropDuplicateEvents(events);
+    // The token is stored even if there are no new events: it may say that
+    // the beginning of the room has been reached
+    if (connection->timelineStore() && !fromStore && !timeline.empty()) {
+        QVector<QJsonObject> eventsJson;
+        eventsJson.reserve(int(events.size()));
+        for (const auto& eptr : events)
+            eventsJson.push_back(storedJson(*eptr));
+        connection->updateTimelineStore(
+            [roomId = id, anchorId = timeline.front()->id(),
+             eventsJson = std::move(eventsJson),
+             olderToken = prevBatch](TimelineStore& store) {
+                store.appendOlder(roomId, anchorId, eventsJson, olderToken);
+            });
+    }
     if (events.empty())
         return;
 
@@ -3010,6 +3652,88 @@ void Room::Private::addHistoricalMessageEvents(RoomEvents&& events)
     changes |= updateStats(from, historyEdge());
     if (changes)
         postprocessChanges(changes);
+    releaseEventsJson(timeline.cbegin(), from.base());
+}
+
+//! Move the keys below \p bound by \p shift, keeping the rest in place
+template <typename MapT>
+inline void shiftKeysBelow(MapT& map, typename MapT::key_type bound, int shift)
+{
+    MapT shifted;
+    for (auto it = map.begin(); it != map.end() && it->first < bound;) {
+        auto node = map.extract(it++);
+        node.key() += shift;
+        shifted.insert(std::move(node));
+    }
+    map.merge(shifted);
+}
+
+Room::Timeline::size_type
+Room::Private::insertEvents(RoomEvents&& events,
+                            TimelineItem::index_t beforeIndex)
+{
+    dropDuplicateEvents(events);
+    if (events.empty())
+        return 0;
+
+    decryptIncomingEvents(events);
+
+    QElapsedTimer et;
+    et.start();
+    Changes changes {};
+    // Same as with historical events, only add to the state what's missing
+    for (const auto& eptr : events) {
+        const auto& e = *eptr;
+        if (e.isStateEvent()
+            && !currentState.contains(e.matrixType(), e.stateKey())) {
+            changes |= q->processStateEvent(e);
+        }
+    }
+
+    const auto insertedSize = TimelineItem::index_t(events.size());
+    const auto pos =
+        timeline.empty() ? 0 : beforeIndex - timeline.front().index();
+    Q_ASSERT(pos >= 0 && pos <= TimelineItem::index_t(timeline.size()));
+    emit q->aboutToInsertMessages(beforeIndex, events);
+
+    // Make place for the new events by moving the older ones down
+    for (auto it = timeline.begin(); it != timeline.begin() + pos; ++it) {
+        it->idx -= insertedSize;
+        eventsIndex.insert((*it)->id(), it->idx);
+    }
+    shiftKeysBelow(historyTokens, beforeIndex, -insertedSize);
+    shiftKeysBelow(gaps, beforeIndex, -insertedSize);
+
+    std::vector<TimelineItem> items;
+    items.reserve(events.size());
+    auto index = beforeIndex - insertedSize;
+    for (auto&& e : events)
+        items.emplace_back(std::move(e), index++);
+    const auto from = timeline.insert(timeline.begin() + pos,
+                                      std::make_move_iterator(items.begin()),
+                                      std::make_move_iterator(items.end()));
+    const auto to = from + insertedSize;
+    for (auto it = from; it != to; ++it) {
+        const auto& eId = (*it)->id();
+        Q_ASSERT_X(!eId.isEmpty(), __FUNCTION__,
+                   makeErrorStr(**it, "Event with empty id cannot be in the "
+                                      "timeline"));
+        eventsIndex.insert(eId, it->index());
+        if (auto n = q->checkForNotifications(*it);
+            n.type != Notification::None)
+            notifications.insert(eId, n);
+    }
+    emit q->addedMessages(from->index(), beforeIndex - 1);
+    addRelations(from, to);
+    if (insertedSize > 9 || et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "Inserted" << insertedSize << "event(s) into"
+                          << q->objectName() << "in" << et;
+
+    changes |= updateStats(rev_iter_t(to), rev_iter_t(from));
+    if (changes)
+        postprocessChanges(changes);
+    releaseEventsJson(from, to);
+    return Timeline::size_type(insertedSize);
 }
 
 Room::Changes Room::processStateEvent(const RoomEvent& e)
@@ -3017,64 +3741,43 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
     if (!e.isStateEvent())
         return Change::None;
 
-    // Find a value (create an empty one if necessary) and get a reference
-    // to it, anticipating a change further in the function.
-    auto& curStateEvent = d->currentState[{ e.matrixType(), e.stateKey() }];
+    const auto* const curStateEvent =
+        d->currentState.get(e.matrixType(), e.stateKey());
     // Prepare for the state change
     // clang-format off
     const bool proceed = switchOnType(e
         , [this, curStateEvent](const RoomMemberEvent& rme) {
             // clang-format on
             auto* oldRme = static_cast<const RoomMemberEvent*>(curStateEvent);
-            auto* u = user(rme.userId());
-            if (!u) { // Some terribly malformed user id?
-                qCCritical(MAIN) << "Could not get a user object for"
-                                 << rme.userId();
+            const auto& userId = rme.userId();
+            // Some terribly malformed user id?
+            if (!userId.startsWith('@') || serverPart(userId).isEmpty()) {
+                qCCritical(MAIN) << "Malformed user id in a member event:"
+                                 << userId;
                 return false; // Stay low and hope for the best...
             }
-            const auto prevMembership = oldRme ? oldRme->membership()
-                                               : Membership::Leave;
-            switch (prevMembership) {
-            case Membership::Invite:
-                if (rme.membership() != prevMembership) {
-                    d->usersInvited.removeOne(u);
-                    Q_ASSERT(!d->usersInvited.contains(u));
-                }
-                break;
-            case Membership::Join:
+            if (oldRme && oldRme->membership() == Membership::Join) {
                 if (rme.membership() == Membership::Join) {
                     // rename/avatar change or no-op
-                    if (rme.newDisplayName()) {
-                        emit memberAboutToRename(u, *rme.newDisplayName());
-                        d->removeMemberFromMap(u);
-                    }
                     if (!rme.newDisplayName() && !rme.newAvatarUrl()) {
                         qCWarning(MEMBERS)
-                            << "No-op membership event for" << rme.userId()
+                            << "No-op membership event for" << userId
                             << "- retaining the state";
                         qCWarning(MEMBERS) << "The event dump:" << rme;
                         return false;
                     }
+                    if (rme.newDisplayName())
+                        if (auto* u = d->userForSignal(
+                                &Room::memberAboutToRename, userId))
+                            emit memberAboutToRename(u, *rme.newDisplayName());
                 } else {
                     if (rme.membership() == Membership::Invite)
                         qCWarning(MAIN)
                             << "Membership change from Join to Invite:" << rme;
                     // whatever the new membership, it's no more Join
-                    d->removeMemberFromMap(u);
-                    emit userRemoved(u);
+                    if (auto* u = d->userForSignal(&Room::userRemoved, userId))
+                        emit userRemoved(u);
                 }
-                break;
-            case Membership::Ban:
-            case Membership::Knock:
-            case Membership::Leave:
-                if (rme.membership() == Membership::Invite
-                    || rme.membership() == Membership::Join) {
-                    d->membersLeft.removeOne(u);
-                    Q_ASSERT(!d->membersLeft.contains(u));
-                }
-                break;
-            case Membership::Undefined:
-                ; // A warning will be dropped in the post-processing block below
             }
             return true;
             // clang-format off
@@ -3100,15 +3803,13 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
         }
         , true); // By default, go forward with the state change
     // clang-format on
-    if (!proceed) {
-        if (!curStateEvent) // Remove the empty placeholder if one was created
-            d->currentState.remove({ e.matrixType(), e.stateKey() });
+    if (!proceed)
         return Change::None;
-    }
 
     // Change the state
     const auto* const oldStateEvent =
-        std::exchange(curStateEvent, static_cast<const StateEvent*>(&e));
+        d->currentState.setEvent(static_cast<const StateEvent&>(e));
+    Q_ASSERT(oldStateEvent == curStateEvent);
     Q_ASSERT(!oldStateEvent
              || (oldStateEvent->matrixType() == e.matrixType()
                  && oldStateEvent->stateKey() == e.stateKey()));
@@ -3159,37 +3860,36 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
         }
         , [this,oldStateEvent] (const RoomMemberEvent& evt) {
             // clang-format on
-            auto* u = user(evt.userId());
+            const auto& userId = evt.userId();
             const auto* oldMemberEvent =
                 static_cast<const RoomMemberEvent*>(oldStateEvent);
             const auto prevMembership = oldMemberEvent
                                             ? oldMemberEvent->membership()
                                             : Membership::Leave;
+            d->updateMember(evt);
             switch (evt.membership()) {
             case Membership::Join:
                 if (prevMembership != Membership::Join) {
-                    d->insertMemberIntoMap(u);
-                    emit userAdded(u);
+                    if (auto* u = d->userForSignal(&Room::userAdded, userId))
+                        emit userAdded(u);
                 } else {
-                    if (evt.newDisplayName()) {
-                        d->insertMemberIntoMap(u);
-                        emit memberRenamed(u);
-                    }
+                    if (evt.newDisplayName())
+                        if (auto* u = d->userForSignal(&Room::memberRenamed,
+                                                       userId))
+                            emit memberRenamed(u);
                     if (evt.newAvatarUrl())
-                        emit memberAvatarChanged(u);
+                        if (auto* u = d->userForSignal(
+                                &Room::memberAvatarChanged, userId))
+                            emit memberAvatarChanged(u);
                 }
                 break;
             case Membership::Invite:
-                if (!d->usersInvited.contains(u))
-                    d->usersInvited.push_back(u);
-                if (u == localUser() && evt.isDirect())
+                if (userId == connection()->userId() && evt.isDirect())
                     connection()->addToDirectChats(this, user(evt.senderId()));
                 break;
             case Membership::Knock:
             case Membership::Ban:
             case Membership::Leave:
-                if (!d->membersLeft.contains(u))
-                    d->membersLeft.append(u);
                 break;
             case Membership::Undefined:
                 qCWarning(MEMBERS) << "Ignored undefined membership type";
@@ -3197,6 +3897,12 @@ Room::Changes Room::processStateEvent(const RoomEvent& e)
             return Change::Members;
             // clang-format off
         }
+        , [this] (const RoomPowerLevelsEvent& evt) {
+            d->members.updatePowerLevels([&evt](const QString& userId) {
+                return evt.powerLevelForUser(userId);
+            });
+            return Change::Other;
+        }
         , [this] (const EncryptionEvent&) {
             // As encryption can only be switched on once, emit the signal here
             // instead of aggregating and emitting in updateData()
@@ -3323,36 +4029,29 @@ Room::Changes Room::processAccountDataEvent(EventPtr&& event)
     return changes;
 }
 
-template <typename ContT>
 Room::Private::users_shortlist_t
-Room::Private::buildShortlist(const ContT& users) const
+Room::Private::buildShortlist(auto&& userIds) const
 {
     // To calculate room display name the spec requires to sort users
     // lexicographically by state_key (user id) and use disambiguated
     // display names of two topmost users excluding the current one to render
     // the name of the room. The below code selects 3 topmost users,
-    // slightly extending the spec.
-    users_shortlist_t shortlist {}; // Prefill with nullptrs
-    std::partial_sort_copy(
-        users.begin(), users.end(), shortlist.begin(), shortlist.end(),
-        [this](const User* u1, const User* u2) {
-            // localUser(), if it's in the list, is sorted
+    // slightly extending the spec; User objects are only made for them.
+    std::array<QString, std::tuple_size_v<users_shortlist_t>> topIds;
+    const auto topIdsEnd = std::ranges::partial_sort_copy(
+        userIds, topIds,
+        [localUserId = connection->userId()](const QString& id1,
+                                             const QString& id2) {
+            // The local user, if it's in the list, is sorted
             // below all others
-            return isLocalUser(u2) || (!isLocalUser(u1) && u1->id() < u2->id());
-        });
+            return id2 == localUserId || (id1 != localUserId && id1 < id2);
+        }).out;
+    users_shortlist_t shortlist {}; // Prefill with nullptrs
+    std::transform(topIds.begin(), topIdsEnd, shortlist.begin(),
+                   [this](const QString& userId) { return q->user(userId); });
     return shortlist;
 }
 
-Room::Private::users_shortlist_t
-Room::Private::buildShortlist(const QStringList& userIds) const
-{
-    QList<User*> users;
-    users.reserve(userIds.size());
-    for (const auto& h : userIds)
-        users.push_back(q->user(h));
-    return buildShortlist(users);
-}
-
 QString Room::Private::calculateDisplayname() const
 {
     // CS spec, section 13.2.2.5 Calculating the display name for a room
@@ -3382,22 +4081,30 @@ QString Room::Private::calculateDisplayname() const
     // will be used to construct the room name. Takes into account MSC688's
     // "heroes" if available.
     const bool localUserIsIn = joinState == JoinState::Join;
+    const auto joinedCount = members.count(Membership::Join);
     const bool emptyRoom =
-        membersMap.isEmpty()
-        || (membersMap.size() == 1 && isLocalUser(*membersMap.cbegin()));
+        joinedCount == 0
+        || (joinedCount == 1 && q->isMember(connection->userId()));
     const bool nonEmptySummary = summary.heroes && !summary.heroes->empty();
-    auto shortlist = nonEmptySummary ? buildShortlist(*summary.heroes)
-                                     : !emptyRoom ? buildShortlist(membersMap)
-                                                  : users_shortlist_t {};
+    static constexpr auto LeftMemberships =
+        Membership::Leave | Membership::Ban | Membership::Knock;
+    auto shortlist =
+        nonEmptySummary ? buildShortlist(*summary.heroes)
+        : !emptyRoom    ? buildShortlist(memberIds(Membership::Join))
+                        : users_shortlist_t {};
 
     // When the heroes list is there, we can rely on it. If the heroes list is
     // missing, the below code gathers invited, or, if there are no invitees,
     // left members.
+    const auto invitedCount = members.count(Membership::Invite);
     if (!shortlist.front() && localUserIsIn)
-        shortlist = buildShortlist(usersInvited);
+        shortlist = buildShortlist(memberIds(Membership::Invite));
 
     if (!shortlist.front())
-        shortlist = buildShortlist(membersLeft);
+        shortlist = buildShortlist(memberIds(LeftMemberships));
+    const auto leftCount = members.count(Membership::Leave)
+                           + members.count(Membership::Ban)
+                           + members.count(Membership::Knock);
 
     QStringList names;
     for (const auto* u : shortlist) {
@@ -3410,9 +4117,9 @@ QString Room::Private::calculateDisplayname() const
     const auto usersCountExceptLocal =
         !emptyRoom
             ? q->joinedCount() - int(joinState == JoinState::Join)
-            : !usersInvited.empty()
-                  ? usersInvited.count()
-                  : membersLeft.size() - int(joinState == JoinState::Leave);
+            : invitedCount > 0
+                  ? int(invitedCount)
+                  : int(leftCount) - int(joinState == JoinState::Leave);
     if (usersCountExceptLocal > int(shortlist.size()))
         names << tr(
             "%Ln other(s)",
@@ -3425,11 +4132,11 @@ QString Room::Private::calculateDisplayname() const
         return namesList;
 
     // (Spec extension) Invited users
-    if (!usersInvited.empty())
+    if (invitedCount > 0)
         return tr("Empty room (invited: %1)").arg(namesList);
 
     // Users that previously left the room
-    if (!membersLeft.isEmpty())
+    if (leftCount > 0)
         return tr("Empty room (was: %1)").arg(namesList);
 
     // Fail miserably
@@ -3448,50 +4155,41 @@ void Room::Private::updateDisplayname()
     }
 }
 
-QJsonObject Room::Private::toJson() const
+Room::CacheSnapshot Room::Private::cacheSnapshot() const
 {
     QElapsedTimer et;
     et.start();
-    QJsonObject result;
-    addParam<IfNotEmpty>(result, QStringLiteral("summary"), summary);
-    {
-        QJsonArray stateEvents;
-
-        for (const auto* evt : currentState) {
-            Q_ASSERT(evt->isStateEvent());
-            if ((evt->isRedacted() && !is<RoomMemberEvent>(*evt))
-                || evt->contentJson().isEmpty())
-                continue;
-
-            auto json = evt->fullJson();
-            auto unsignedJson = evt->unsignedJson();
-            unsignedJson.remove(QStringLiteral("prev_content"));
-            json[UnsignedKeyL] = unsignedJson;
-            stateEvents.append(json);
+    CacheSnapshot result;
+    addParam<IfNotEmpty>(result.baseJson, QStringLiteral("summary"), summary);
+    result.invited = joinState == JoinState::Invite;
+
+    result.stateEvents.reserve(size_t(currentState.events().size()));
+    for (const auto* evt : currentState) {
+        Q_ASSERT(evt->isStateEvent());
+        if (evt->isRedacted() && !is<RoomMemberEvent>(*evt))
+            continue;
+        // Don't rebuild the JSON tree in the event just to save it; events
+        // with empty content are skipped by CacheSnapshot::toJson() then
+        if (auto compactJson = evt->releasedJson(); !compactJson.isEmpty()) {
+            result.releasedStateEvents.push_back(std::move(compactJson));
+            continue;
         }
-
-        const auto stateObjName = joinState == JoinState::Invite
-                                      ? QStringLiteral("invite_state")
-                                      : QStringLiteral("state");
-        result.insert(stateObjName,
-                      QJsonObject { { QStringLiteral("events"), stateEvents } });
+        if (evt->contentJson().isEmpty())
+            continue;
+        // Only the reference count is bumped here; CacheSnapshot::toJson()
+        // edits its own copy
+        result.stateEvents.push_back(evt->fullJson());
     }
 
-    if (!accountData.empty()) {
-        QJsonArray accountDataEvents;
-        for (const auto& e : accountData) {
-            if (!e.second->contentJson().isEmpty())
-                accountDataEvents.append(e.second->fullJson());
-        }
-        result.insert(QStringLiteral("account_data"),
-                      QJsonObject {
-                          { QStringLiteral("events"), accountDataEvents } });
-    }
+    result.accountDataEvents.reserve(accountData.size());
+    for (const auto& e : accountData)
+        if (!e.second->contentJson().isEmpty())
+            result.accountDataEvents.push_back(e.second->fullJson());
 
     if (const auto& readReceipt = q->lastReadReceipt(connection->userId());
         !readReceipt.eventId.isEmpty()) //
     {
-        result.insert(
+        result.baseJson.insert(
             QStringLiteral("ephemeral"),
             QJsonObject {
                 { QStringLiteral("events"),
@@ -3501,20 +4199,161 @@ QJsonObject Room::Private::toJson() const
                                    .fullJson() } } });
     }
 
-    result.insert(UnreadNotificationsKey,
-                  QJsonObject { { PartiallyReadCountKey,
-                                  countFromStats(partiallyReadStats) },
-                                { HighlightCountKey, serverHighlightCount } });
-    result.insert(NewUnreadCountKey, countFromStats(unreadStats));
+    addUnreadCountsTo(result.baseJson);
+
+    if (et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "Took a cache snapshot of" << q->objectName()
+                          << "in" << et;
+    return result;
+}
+
+//! Visit JSON of state events in \p snapshot as it should be cached
+template <typename FnT>
+inline void forEachCachedStateEvent(const Room::CacheSnapshot& snapshot,
+                                    FnT&& fn)
+{
+    const auto visit = [&fn](QJsonObject json) {
+        auto unsignedJson = json[UnsignedKeyL].toObject();
+        unsignedJson.remove(QStringLiteral("prev_content"));
+        json[UnsignedKeyL] = unsignedJson;
+        fn(json);
+    };
+    for (const auto& json : snapshot.stateEvents)
+        visit(json);
+    for (const auto& compactJson : snapshot.releasedStateEvents)
+        if (auto json = QJsonDocument::fromJson(compactJson).object();
+            !json[ContentKeyL].toObject().isEmpty())
+            visit(std::move(json));
+}
+
+inline QLatin1String stateKeyFor(const Room::CacheSnapshot& snapshot)
+{
+    return snapshot.invited ? "invite_state"_ls : "state"_ls;
+}
+
+QJsonObject Room::CacheSnapshot::toJson() const
+{
+    QElapsedTimer et;
+    et.start();
+    auto result = baseJson;
+    {
+        QJsonArray stateEventsJson;
+        forEachCachedStateEvent(*this, [&stateEventsJson](const auto& json) {
+            stateEventsJson.append(json);
+        });
+        result.insert(stateKeyFor(*this),
+                      QJsonObject {
+                          { QStringLiteral("events"), stateEventsJson } });
+    }
+
+    if (!accountDataEvents.empty()) {
+        QJsonArray accountDataJson;
+        for (const auto& json : accountDataEvents)
+            accountDataJson.append(json);
+        result.insert(QStringLiteral("account_data"),
+                      QJsonObject {
+                          { QStringLiteral("events"), accountDataJson } });
+    }
+
+    if (et.elapsed() > 30)
+        qCDebug(PROFILER) << "Room::CacheSnapshot::toJson() with"
+                          << stateEvents.size() << "state event(s) took" << et;
+    return result;
+}
+
+void Room::CacheSnapshot::writeCbor(QCborStreamWriter& writer) const
+{
+    QElapsedTimer et;
+    et.start();
+    const auto stateKey = stateKeyFor(*this);
+    const auto accountDataKey = QLatin1String("account_data");
+    const auto writeEvents = [&writer](QLatin1String key, auto&& forEach) {
+        writer.append(key);
+        writer.startMap(1);
+        writer.append("events"_ls);
+        writer.startArray();
+        forEach([&writer](const QJsonObject& json) {
+            writeJsonAsCbor(writer, json);
+        });
+        writer.endArray();
+        writer.endMap();
+    };
+
+    writer.startMap();
+    // Same as in toJson(), the below keys replace those in baseJson
+    for (auto it = baseJson.begin(); it != baseJson.end(); ++it)
+        if (it.key() != stateKey
+            && (accountDataEvents.empty() || it.key() != accountDataKey)) {
+            writer.append(it.key());
+            writeJsonAsCbor(writer, it.value());
+        }
+    writeEvents(stateKey, [this](const auto& fn) {
+        forEachCachedStateEvent(*this, fn);
+    });
+    if (!accountDataEvents.empty())
+        writeEvents(accountDataKey, [this](const auto& fn) {
+            for (const auto& json : accountDataEvents)
+                fn(json);
+        });
+    writer.endMap();
 
     if (et.elapsed() > 30)
-        qCDebug(PROFILER) << "Room::toJson() for" << q->objectName() << "took"
-                          << et;
+        qCDebug(PROFILER) << "Room::CacheSnapshot::writeCbor() with"
+                          << stateEvents.size() + releasedStateEvents.size()
+                          << "state event(s) took" << et;
+}
+
+void Room::Private::addUnreadCountsTo(QJsonObject& json) const
+{
+    json.insert(UnreadNotificationsKey,
+                QJsonObject { { PartiallyReadCountKey,
+                                countFromStats(partiallyReadStats) },
+                              { HighlightCountKey, serverHighlightCount } });
+    json.insert(NewUnreadCountKey, countFromStats(unreadStats));
+}
+
+QJsonObject Room::Private::toIndexJson() const
+{
+    QJsonObject result;
+    addParam<IfNotEmpty>(result, QStringLiteral("summary"), summary);
 
+    QJsonArray stateEvents;
+    const auto addState = [&stateEvents](const StateEvent* evt) {
+        if (!evt)
+            return;
+        // Parse a copy of released JSON instead of rebuilding it in the event
+        const auto compactJson = evt->releasedJson();
+        const auto json = compactJson.isEmpty()
+                              ? evt->fullJson()
+                              : QJsonDocument::fromJson(compactJson).object();
+        if (!json[ContentKeyL].toObject().isEmpty())
+            stateEvents.append(json);
+    };
+    addState(currentState.get<RoomCreateEvent>());
+    addState(currentState.get<RoomNameEvent>());
+    addState(currentState.get<RoomCanonicalAliasEvent>());
+    addState(currentState.get<RoomAvatarEvent>());
+    addState(currentState.get<RoomTombstoneEvent>());
+    addState(currentState.get<EncryptionEvent>());
+    // Heroes make the room name when there's no explicit one
+    for (const auto& heroId : summary.heroes.value_or(QStringList()))
+        addState(currentState.get<RoomMemberEvent>(heroId));
+    result.insert(joinState == JoinState::Invite ? QStringLiteral("invite_state")
+                                                 : QStringLiteral("state"),
+                  QJsonObject { { QStringLiteral("events"), stateEvents } });
+
+    addUnreadCountsTo(result);
     return result;
 }
 
-QJsonObject Room::toJson() const { return d->toJson(); }
+Room::CacheSnapshot Room::cacheSnapshot() const
+{
+    return d->cacheSnapshot();
+}
+
+QJsonObject Room::toJson() const { return cacheSnapshot().toJson(); }
+
+QJsonObject Room::toIndexJson() const { return d->toIndexJson(); }
 
 MemberSorter Room::memberSorter() const { return MemberSorter(this); }
 
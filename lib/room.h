@@ -38,9 +38,11 @@ class SyncRoomData;
 class RoomMemberEvent;
 class User;
 class MemberSorter;
+class MemberTable;
 class LeaveRoomJob;
 class SetRoomStateWithKeyJob;
 class RedactEventJob;
+class GetEventContextJob;
 
 /** The data structure used to expose file transfer information to views
  *
@@ -269,7 +271,18 @@ public:
     Q_INVOKABLE QList<Quotient::User*> usersTyping() const;
     QList<User*> membersLeft() const;
 
+    //! \brief Joined members of the room
+    //!
+    //! This makes a User object for each member that doesn't have one yet;
+    //! in large rooms, memberIds() or memberTable() are much cheaper.
     Q_INVOKABLE QList<Quotient::User*> users() const;
+    //! Ids of joined members of the room
+    Q_INVOKABLE QStringList memberIds() const;
+    //! \brief All users with a membership in the room
+    //!
+    //! Unlike User objects, the rows of this table are kept for every member,
+    //! including those that have left the room or have been invited.
+    const MemberTable& memberTable() const;
     Q_DECL_DEPRECATED_X("Use safeMemberNames() or htmlSafeMemberNames() instead") //
     QStringList memberNames() const;
     QStringList safeMemberNames() const;
@@ -365,6 +378,16 @@ public:
     //! \brief Get an avatar for the member with the given MXID
     QUrl memberAvatarUrl(const QString& mxId) const;
 
+    //! \brief The timeline of the room, from the oldest to the newest event
+    //!
+    //! Indices of timeline items go up by one from the oldest to the newest
+    //! event. New events get indices after the newest one and historical
+    //! events before the oldest one, leaving the indices of the events
+    //! already in the timeline intact. Events inserted into a gap (see
+    //! fillGap() and loadEventContext()) are an exception: the events before
+    //! the insertion point, and the gaps among them, get renumbered down by
+    //! the number of inserted events (see aboutToInsertMessages()). Use event
+    //! ids rather than indices to keep track of events across such calls.
     const Timeline& messageEvents() const;
     const PendingEvents& pendingEvents() const;
 
@@ -389,6 +412,13 @@ public:
     Q_INVOKABLE Quotient::TimelineItem::index_t maxTimelineIndex() const;
     Q_INVOKABLE bool
     isValidIndex(Quotient::TimelineItem::index_t timelineIndex) const;
+    //! \brief Indices of events that have a gap in the timeline before them
+    //!
+    //! The timeline may miss events between each of these events and
+    //! the one before it; such gaps come from `limited` sync responses and
+    //! from loadEventContext(), and are filled with fillGap().
+    //! \sa gapsChanged
+    Q_INVOKABLE QVector<Quotient::TimelineItem::index_t> timelineGaps() const;
 
     rev_iter_t findInTimeline(TimelineItem::index_t index) const;
     rev_iter_t findInTimeline(const QString& evtId) const;
@@ -412,6 +442,20 @@ public:
      * measure that "screen time".
      */
     void setDisplayed(bool displayed = true);
+
+    //! \brief Whether the cached state of the room has been fully loaded
+    //!
+    //! With Connection::lazyRoomLoading() enabled, rooms are created from
+    //! the cache index with only the data needed for the room list; their
+    //! full cached state is loaded when the room is displayed, when
+    //! loadFully() is called, when new data for the room arrives from
+    //! the server, or when the background loader of the connection gets to
+    //! it. Rooms are always fully loaded otherwise.
+    //! \sa fullyLoaded
+    bool isFullyLoaded() const;
+    //! Load the full cached state of the room now, if not loaded yet
+    void loadFully();
+
     QString firstDisplayedEventId() const;
     rev_iter_t firstDisplayedMarker() const;
     void setFirstDisplayedEventId(const QString& eventId);
@@ -845,7 +889,50 @@ public Q_SLOTS:
     /// You shouldn't normally call this method; it's here for debugging
     void refreshDisplayName();
 
+    //! \brief Load up to \p limit events older than the timeline
+    //!
+    //! If Connection::timelineStore() has events older than the oldest
+    //! event in the timeline, these are loaded from the store, synchronously;
+    //! otherwise the events are requested from the server, using \p filter.
     void getPreviousContent(int limit = 10, const QString &filter = {});
+    //! \brief Drop the oldest events from the timeline to save memory
+    //!
+    //! Events are only dropped up to a point from which getPreviousContent()
+    //! can load them again: the oldest event left is either in
+    //! Connection::timelineStore() or has a known pagination token before it.
+    //! Pagination tokens inside the timeline are only collected while
+    //! Connection::timelineEventLimit() is set; without it, only events
+    //! that are in the store can be dropped.
+    //! The newest \p keepCount events, as well as events at and after
+    //! the fully read marker and the local read receipt, are kept. Nothing is
+    //! dropped while the room is displayed or loads history.
+    //! \return the number of dropped events
+    //! \sa aboutToEvictMessages, evictedMessages,
+    //!     Connection::timelineEventLimit
+    int evictOldestEvents(int keepCount);
+    //! \brief Load up to \p limit events into the gap before \p index
+    //!
+    //! The events are requested from the server starting from the newer side
+    //! of the gap if possible, and from the older side otherwise. The gap is
+    //! removed once the loaded events meet the other side. The events are
+    //! inserted before the event at \p index, renumbering the events and
+    //! gaps before it (see messageEvents()). If, by the time the events
+    //! arrive, the gap is gone or has another token on the side they are
+    //! loaded from (e.g. after loadEventContext()), they are dropped.
+    //! \sa timelineGaps, aboutToInsertMessages
+    void fillGap(Quotient::TimelineItem::index_t index, int limit = 10);
+    //! \brief Load the event with \p eventId along with events around it
+    //!
+    //! Unlike getPreviousContent(), this takes a single request no matter how
+    //! far the event is from the timeline; the loaded events are separated
+    //! from the rest of the timeline by gaps. eventContextLoaded() is emitted
+    //! once the event is in the timeline, right away if it is there already.
+    //! Events loaded into an existing gap renumber the events and gaps before
+    //! it, see messageEvents().
+    //! \return the job loading the events; nullptr if the event is already
+    //!         in the timeline
+    GetEventContextJob* loadEventContext(const QString& eventId,
+                                         int limit = 10);
 
     void inviteToRoom(const QString& memberId);
     LeaveRoomJob* leaveRoom();
@@ -896,10 +983,32 @@ Q_SIGNALS:
      * \sa Connection::loadedRoomState
      */
     void baseStateLoaded();
+    //! The full cached state of the room has been loaded
+    //! \sa isFullyLoaded
+    void fullyLoaded();
     void eventsHistoryJobChanged();
     void aboutToAddHistoricalMessages(Quotient::RoomEventsRange events);
     void aboutToAddNewMessages(Quotient::RoomEventsRange events);
     void addedMessages(int fromIndex, int toIndex);
+    //! The oldest events, from \p fromIndex to \p toIndex, are about to be
+    //! dropped from the timeline
+    //! \sa evictOldestEvents
+    void aboutToEvictMessages(int fromIndex, int toIndex);
+    //! The oldest events, from \p fromIndex to \p toIndex, have been dropped
+    //! from the timeline
+    void evictedMessages(int fromIndex, int toIndex);
+    //! \brief Events are about to be inserted before the event with \p index
+    //!
+    //! Events at and after \p index keep their indices while those before it
+    //! are moved down by the number of \p events; addedMessages() follows
+    //! with the indices of the inserted events.
+    //! \sa fillGap, loadEventContext
+    void aboutToInsertMessages(int index, Quotient::RoomEventsRange events);
+    //! Gaps have been added to the timeline or (partially) filled
+    //! \sa timelineGaps
+    void gapsChanged();
+    //! The event requested with loadEventContext() is in the timeline now
+    void eventContextLoaded(QString eventId);
     /// The event is about to be appended to the list of pending events
     void pendingEventAboutToAdd(Quotient::RoomEvent* event);
     /// An event has been appended to the list of pending events
@@ -1030,16 +1139,61 @@ protected:
     virtual void onRedaction(const RoomEvent& /*prevEvent*/,
                              const RoomEvent& /*after*/)
     {}
+    //! \brief An immutable copy of the room data saved in the state cache
+    //!
+    //! Taking a snapshot (see cacheSnapshot()) copies nothing but implicitly
+    //! shared JSON objects of state and account data events, plus the summary
+    //! and unread counts; the room can be changed right after that. Building
+    //! the cache JSON out of the snapshot with toJson(), which takes time for
+    //! large rooms, can then be done in any thread. For the binary cache,
+    //! writeCbor() streams the same data without building the JSON tree.
+    struct QUOTIENT_API CacheSnapshot {
+        //! The summary, unread counts and the local user's read receipt
+        QJsonObject baseJson;
+        bool invited = false;
+        std::vector<QJsonObject> stateEvents;
+        //! Compact JSON of state events that have their JSON released (see
+        //! Event::releaseJson()); it is only parsed when the snapshot
+        //! is serialised, one event at a time
+        std::vector<QByteArray> releasedStateEvents;
+        std::vector<QJsonObject> accountDataEvents;
+
+        QJsonObject toJson() const;
+        //! \brief Write the same data as toJson() returns, in CBOR
+        //!
+        //! Events are written to \p writer as they are visited, so unlike
+        //! `writeJsonAsCbor(writer, toJson())` this never has the whole room
+        //! JSON in memory; compact JSON of released events is parsed one
+        //! event at a time.
+        void writeCbor(QCborStreamWriter& writer) const;
+    };
+    //! \brief Take a snapshot of the room data to save in the state cache
+    //!
+    //! The state cache is saved from snapshots in the background; toJson()
+    //! is the same as `cacheSnapshot().toJson()`.
+    CacheSnapshot cacheSnapshot() const;
     virtual QJsonObject toJson() const;
+    //! \brief The entry for the room in the state cache index
+    //!
+    //! This is a subset of toJson() needed to show the room in the room
+    //! list: the summary, unread counts and the state events that make
+    //! the room name and avatar.
+    //! \sa isFullyLoaded
+    QJsonObject toIndexJson() const;
     virtual void updateData(SyncRoomData&& data, bool fromCache = false);
     virtual Notification checkForNotifications(const TimelineItem& ti);
 
 private:
     friend class Connection;
+    friend class RoomUpdateScheduler;
 
     class Private;
     Private* d;
 
+    // Called from Connection when the room is created from the cache index
+    // and then when its full state is loaded
+    void setFullyLoaded(bool fullyLoaded);
+
     // This is called from Connection, reflecting a state change that
     // arrived from the server. Clients should use
     // Connection::joinRoom() and Room::leaveRoom() to change the state.
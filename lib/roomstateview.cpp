@@ -26,10 +26,21 @@ QJsonObject RoomStateView::contentJson(const QString& evtType,
 const QVector<const StateEvent*> RoomStateView::eventsOfType(
     const QString& evtType) const
 {
-    auto vals = QVector<const StateEvent*>();
-    for (auto it = cbegin(); it != cend(); ++it)
-        if (it.key().first == evtType)
-            vals.append(it.value());
+    const auto it = eventsByType.constFind(evtType);
+    return it != eventsByType.cend()
+               ? QVector<const StateEvent*>(it->cbegin(), it->cend())
+               : QVector<const StateEvent*>();
+}
 
-    return vals;
+qsizetype RoomStateView::countOfType(const QString& evtType) const
+{
+    const auto it = eventsByType.constFind(evtType);
+    return it != eventsByType.cend() ? it->size() : 0;
+}
+
+const StateEvent* RoomStateView::setEvent(const StateEvent& evt)
+{
+    eventsByType[evt.matrixType()].insert(evt.stateKey(), &evt);
+    return std::exchange(operator[]({ evt.matrixType(), evt.stateKey() }),
+                         &evt);
 }
@@ -6,6 +6,9 @@
 #include "events/stateevent.h"
 
 #include <QtCore/QHash>
+#include <QtCore/QMap>
+
+#include <ranges>
 
 namespace Quotient {
 
@@ -121,9 +124,36 @@ public:
     //! \brief Get all state events in the room of a certain type.
     //!
     //! This method returns all known state events that have occured in
-    //! the room of the given type.
+    //! the room of the given type, ordered by their state keys.
     const QVector<const StateEvent*> eventsOfType(const QString& evtType) const;
 
+    //! \brief Iterate over all state events of the given C++ type
+    //!
+    //! Unlike the overload above, this one doesn't copy anything: it returns
+    //! a view of `const EvT*` pointers, ordered by state keys, over the index
+    //! RoomStateView keeps for each event type. The view is only valid as
+    //! long as this RoomStateView object is alive and the room state doesn't
+    //! change. Calling it on a temporary, such as the result of
+    //! Room::currentState(), doesn't compile: store the temporary in
+    //! a variable first.
+    template <EventClass<StateEvent> EvT>
+    auto eventsOfType() const&
+    {
+        static const QMap<QString, const StateEvent*> Empty;
+        const auto it = eventsByType.constFind(EvT::TypeId);
+        const auto& events = it != eventsByType.cend() ? *it : Empty;
+        return std::ranges::subrange(events.cbegin(), events.cend())
+               | std::views::transform([](const StateEvent* evt) {
+                     Q_ASSERT(is<EvT>(*evt));
+                     return static_cast<const EvT*>(evt);
+                 });
+    }
+    template <EventClass<StateEvent> EvT>
+    auto eventsOfType() const&& = delete;
+
+    //! The number of state events of the given type
+    qsizetype countOfType(const QString& evtType) const;
+
     //! \brief Run a function on a state event with the given type and key
     //!
     //! Use this overload when there's no predefined event type or the event
@@ -207,5 +237,13 @@ public:
 
 private:
     friend class Room;
+
+    //! The events by type and then by state key; the maps are implicitly
+    //! shared, so copying RoomStateView doesn't copy the index
+    QHash<QString, QMap<QString, const StateEvent*>> eventsByType;
+
+    //! \brief Put \p evt in the state, replacing the event with the same key
+    //! \return the replaced event, or nullptr if there was none
+    const StateEvent* setEvent(const StateEvent& evt);
 };
 } // namespace Quotient
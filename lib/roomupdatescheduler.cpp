@@ -0,0 +1,251 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "roomupdatescheduler.h"
+
+#include "logging.h"
+#include "room.h"
+#include "syncdata.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QTimer>
+
+#include <algorithm>
+#include <deque>
+#include <list>
+
+using namespace Quotient;
+using namespace std::chrono;
+
+class RoomUpdateScheduler::Private {
+public:
+    using clock = steady_clock;
+
+    struct PendingUpdate {
+        SyncRoomData data;
+        bool fromCache;
+        clock::time_point enqueuedAt;
+        qint64 events;
+
+        qint64 bytes() const { return data.jsonSize; }
+    };
+    struct RoomQueue {
+        //! nullptr if the room has been destroyed while the queue was
+        //! being processed; such queues are dropped by runSlice()
+        Room* room;
+        std::deque<PendingUpdate> updates;
+        QMetaObject::Connection destroyedConnection;
+    };
+    using queue_iter_t = std::list<RoomQueue>::iterator;
+
+    explicit Private(RoomUpdateScheduler* q) : q(q)
+    {
+        timer.setSingleShot(true);
+        timer.setInterval(0);
+        QObject::connect(&timer, &QTimer::timeout, q,
+                         [this] { runSlice(false); });
+    }
+
+    RoomUpdateScheduler* q;
+    QTimer timer;
+    milliseconds timeBudget = DefaultTimeBudget;
+    //! Per-room queues in the order their first pending update arrived
+    std::list<RoomQueue> queues;
+    QHash<const Room*, queue_iter_t> queueIndex;
+    int queueDepth = 0;
+    qint64 pendingEvents = 0;
+    qint64 pendingBytes = 0;
+    Metrics stats;
+
+    static int priority(const RoomQueue& rq);
+    void runSlice(bool ignoreBudget);
+    void forgetRoom(const Room* room);
+};
+
+int RoomUpdateScheduler::Private::priority(const RoomQueue& rq)
+{
+    if (rq.room->displayed())
+        return 2;
+    if (rq.room->highlightCount() > 0
+        || std::any_of(rq.updates.cbegin(), rq.updates.cend(),
+                       [](const PendingUpdate& u) {
+                           return u.data.highlightCount.value_or(0) > 0;
+                       }))
+        return 1;
+    return 0;
+}
+
+void RoomUpdateScheduler::Private::runSlice(bool ignoreBudget)
+{
+    const auto sliceStart = clock::now();
+
+    std::vector<queue_iter_t> order;
+    order.reserve(queues.size());
+    for (auto it = queues.begin(); it != queues.end();)
+        if (!it->room) // The room is gone, see forgetRoom()
+            it = queues.erase(it);
+        else if (it->updates.empty()) { // Flushed, see flush(Room*)
+            QObject::disconnect(it->destroyedConnection);
+            queueIndex.remove(it->room);
+            it = queues.erase(it);
+        } else
+            order.push_back(it++);
+    // Stable sort keeps the arrival order within the same priority
+    std::stable_sort(order.begin(), order.end(),
+                     [](queue_iter_t lhs, queue_iter_t rhs) {
+                         return priority(*lhs) > priority(*rhs);
+                     });
+
+    int applied = 0;
+    bool outOfTime = false;
+    for (auto it : order) {
+        while (!outOfTime && it->room && !it->updates.empty()) {
+            auto update = std::move(it->updates.front());
+            it->updates.pop_front();
+            --queueDepth;
+            pendingEvents -= update.events;
+            pendingBytes -= update.bytes();
+            // Room::updateData() may indirectly destroy the room, and then
+            // forgetRoom() resets it->room
+            it->room->updateData(std::move(update.data), update.fromCache);
+
+            const auto now = clock::now();
+            stats.lastLag = duration_cast<milliseconds>(now - update.enqueuedAt);
+            stats.maxLag = std::max(stats.maxLag, stats.lastLag);
+            ++stats.appliedUpdates;
+            ++applied;
+            outOfTime = !ignoreBudget && now - sliceStart >= timeBudget;
+        }
+        if (!it->room || it->updates.empty()) {
+            if (it->room) {
+                QObject::disconnect(it->destroyedConnection);
+                queueIndex.remove(it->room);
+            }
+            queues.erase(it);
+        }
+        if (outOfTime)
+            break;
+    }
+
+    const auto sliceDuration = clock::now() - sliceStart;
+    stats.lastSliceDuration = duration_cast<milliseconds>(sliceDuration);
+    if (sliceDuration >= nanoseconds(ProfilerMinNsecs))
+        qCDebug(PROFILER) << "*** RoomUpdateScheduler: applied" << applied
+                          << "room update(s) in"
+                          << stats.lastSliceDuration.count() << "ms;"
+                          << queueDepth << "update(s) pending";
+    if (applied > 0)
+        emit q->updatesApplied(applied);
+    if (queueDepth > 0)
+        timer.start();
+    else
+        emit q->drained();
+}
+
+void RoomUpdateScheduler::Private::forgetRoom(const Room* room)
+{
+    const auto indexIt = queueIndex.find(room);
+    if (indexIt == queueIndex.end())
+        return;
+    auto& rq = **indexIt;
+    queueDepth -= int(rq.updates.size());
+    for (const auto& u : rq.updates) {
+        pendingEvents -= u.events;
+        pendingBytes -= u.bytes();
+    }
+    rq.updates.clear();
+    // Don't erase the queue: runSlice() may be iterating over it right now
+    rq.room = nullptr;
+    queueIndex.erase(indexIt);
+}
+
+RoomUpdateScheduler::RoomUpdateScheduler(QObject* parent)
+    : QObject(parent), d(makeImpl<Private>(this))
+{}
+
+RoomUpdateScheduler::~RoomUpdateScheduler() = default;
+
+void RoomUpdateScheduler::enqueue(Room* room, SyncRoomData&& data,
+                                  bool fromCache)
+{
+    Q_ASSERT(room != nullptr);
+    auto indexIt = d->queueIndex.find(room);
+    if (indexIt == d->queueIndex.end()) {
+        auto& rq = d->queues.emplace_back();
+        rq.room = room;
+        rq.destroyedConnection =
+            connect(room, &QObject::destroyed, this,
+                    [this, room] { d->forgetRoom(room); });
+        indexIt = d->queueIndex.insert(room, std::prev(d->queues.end()));
+    }
+    const auto events = qint64(data.state.size() + data.timeline.size()
+                               + data.ephemeral.size()
+                               + data.accountData.size());
+    d->pendingBytes += data.jsonSize;
+    d->pendingEvents += events;
+    (*indexIt)->updates.push_back(
+        { std::move(data), fromCache, Private::clock::now(), events });
+    ++d->queueDepth;
+    if (!d->timer.isActive())
+        d->timer.start();
+}
+
+void RoomUpdateScheduler::flush()
+{
+    d->timer.stop();
+    d->runSlice(true);
+}
+
+void RoomUpdateScheduler::flush(Room* room)
+{
+    const auto indexIt = d->queueIndex.constFind(room);
+    if (indexIt == d->queueIndex.cend())
+        return;
+    // The queue is left in place, even if emptied: a slice may be iterating
+    // over it right now; runSlice() drops it later
+    auto& updates = (*indexIt)->updates;
+    while (!updates.empty()) {
+        auto update = std::move(updates.front());
+        updates.pop_front();
+        --d->queueDepth;
+        d->pendingEvents -= update.events;
+        d->pendingBytes -= update.bytes();
+        room->updateData(std::move(update.data), update.fromCache);
+        ++d->stats.appliedUpdates;
+    }
+}
+
+RoomUpdateScheduler::milliseconds RoomUpdateScheduler::timeBudget() const
+{
+    return d->timeBudget;
+}
+
+void RoomUpdateScheduler::setTimeBudget(milliseconds newBudget)
+{
+    d->timeBudget = newBudget;
+}
+
+int RoomUpdateScheduler::queueDepth() const { return d->queueDepth; }
+
+qint64 RoomUpdateScheduler::pendingEvents() const { return d->pendingEvents; }
+
+qint64 RoomUpdateScheduler::pendingBytes() const { return d->pendingBytes; }
+
+RoomUpdateScheduler::Metrics RoomUpdateScheduler::metrics() const
+{
+    auto result = d->stats;
+    result.queueDepth = d->queueDepth;
+    result.pendingRooms = int(d->queueIndex.size());
+    result.pendingEvents = d->pendingEvents;
+    result.pendingBytes = d->pendingBytes;
+    const auto now = Private::clock::now();
+    for (const auto& rq : d->queues)
+        if (!rq.updates.empty())
+            result.currentLag = std::max(
+                result.currentLag,
+                duration_cast<milliseconds>(now
+                                            - rq.updates.front().enqueuedAt));
+    return result;
+}
+
+void RoomUpdateScheduler::resetMetrics() { d->stats = {}; }
@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QObject>
+
+#include <chrono>
+
+namespace Quotient {
+class Room;
+class SyncRoomData;
+
+//! \brief Applies room updates from sync batches in time-budgeted slices
+//!
+//! Instead of posting a separate queued call for every room in a sync batch,
+//! Connection hands room data over to this scheduler. The scheduler applies
+//! the updates (see Room::updateData()) from the event loop in slices, each
+//! slice taking no longer than timeBudget() (save for a single update that
+//! takes longer than that on its own), and yields to the event loop between
+//! the slices so that user input and rendering are not blocked by a large
+//! batch.
+//!
+//! Within a slice, rooms that are displayed go first, followed by rooms
+//! with highlights (either already known or coming in the update); other
+//! rooms are updated in the order their data arrived. Updates to the same
+//! room are always applied in the order of arrival.
+//! \sa Connection::roomUpdateScheduler
+class QUOTIENT_API RoomUpdateScheduler : public QObject {
+    Q_OBJECT
+public:
+    using milliseconds = std::chrono::milliseconds;
+    static constexpr milliseconds DefaultTimeBudget { 8 };
+
+    struct Metrics {
+        //! The number of updates waiting to be applied
+        int queueDepth = 0;
+        //! The number of rooms with updates waiting to be applied
+        int pendingRooms = 0;
+        //! The number of events in the updates waiting to be applied
+        qint64 pendingEvents = 0;
+        //! \brief The JSON size of the updates waiting to be applied, in bytes
+        //!
+        //! This is an estimate, see SyncRoomData::jsonSize.
+        qint64 pendingBytes = 0;
+        //! How long the oldest waiting update has been in the queue
+        milliseconds currentLag {};
+        //! The time between enqueueing and applying the last applied update
+        milliseconds lastLag {};
+        //! The longest time between enqueueing and applying an update
+        milliseconds maxLag {};
+        //! How long the last slice took
+        milliseconds lastSliceDuration {};
+        //! The number of updates applied
+        qint64 appliedUpdates = 0;
+    };
+
+    explicit RoomUpdateScheduler(QObject* parent = nullptr);
+    ~RoomUpdateScheduler() override;
+
+    //! \brief Queue \p data to be applied to \p room
+    //!
+    //! The update is applied asynchronously, not before control returns to
+    //! the event loop. Pending updates for a room are discarded if the room
+    //! object is destroyed.
+    void enqueue(Room* room, SyncRoomData&& data, bool fromCache = false);
+
+    //! Apply all pending updates right away, disregarding the time budget
+    void flush();
+    //! Apply pending updates for \p room right away
+    void flush(Room* room);
+
+    //! The maximum time spent on applying updates before yielding to
+    //! the event loop
+    milliseconds timeBudget() const;
+    void setTimeBudget(milliseconds newBudget);
+
+    //! The number of updates waiting to be applied
+    int queueDepth() const;
+    //! The number of events in the updates waiting to be applied
+    qint64 pendingEvents() const;
+    //! \brief The JSON size of the updates waiting to be applied, in bytes
+    //!
+    //! This is an estimate, see SyncRoomData::jsonSize; the parsed data
+    //! usually take several times more memory.
+    qint64 pendingBytes() const;
+
+    //! \brief Queue and timing statistics
+    //!
+    //! Lag values, appliedUpdates and lastSliceDuration accumulate since
+    //! the scheduler creation or the last resetMetrics() call.
+    Metrics metrics() const;
+    void resetMetrics();
+
+Q_SIGNALS:
+    //! Emitted after a slice that has left no pending updates
+    void drained();
+    //! Emitted after each slice that has applied any updates
+    void updatesApplied(int count);
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+} // namespace Quotient
@@ -0,0 +1,340 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "slidingsync.h"
+
+#include "connection.h"
+#include "logging.h"
+#include "stringpool.h"
+
+#include "jobs/slidingsyncjob.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonArray>
+#include <QtCore/QPointer>
+
+using namespace Quotient;
+
+constexpr auto ListName = "all"_ls;
+
+class SlidingSync::Private {
+public:
+    SlidingSync* q;
+    Connection* connection;
+    int windowSize = DefaultWindowSize;
+    int timelineLimit = DefaultTimelineLimit;
+    int pollTimeout = 30000;
+    bool running = false;
+    QString pos;
+    QStringList roomIds;
+    int totalCount = 0;
+    QStringList subscriptions;
+    QPointer<SlidingSyncJob> job;
+
+    void sendRequest();
+    //! Forget the position and the room list received in it
+    void resetSession();
+    bool applyListOps(const QJsonArray& ops);
+    void truncateWindow();
+};
+
+void SlidingSync::Private::sendRequest()
+{
+    // Requests are repeated with the same pos when parameters change;
+    // the previous request is not needed then
+    if (job)
+        job->abandon();
+    // The first request returns immediately anyway; later ones long-poll
+    job = connection->callApi<SlidingSyncJob>(BackgroundRequest, pos,
+                                              q->requestBody(),
+                                              pos.isEmpty() ? 0 : pollTimeout);
+    QObject::connect(job, &BaseJob::success, q, [this, j = job.data()] {
+        if (j != job)
+            return;
+        job = nullptr;
+        q->processResponse(j->jsonData());
+        // Handlers of the signals above may have sent a request already
+        if (running && !job)
+            sendRequest();
+    });
+    QObject::connect(job, &BaseJob::failure, q, [this, j = job.data()] {
+        if (j != job)
+            return;
+        job = nullptr;
+        // Servers expire positions routinely; start a new session then
+        if (j->jsonData().value("errcode"_ls).toString()
+            == "M_UNKNOWN_POS"_ls) {
+            qCInfo(SYNCJOB) << "Sliding sync position" << pos
+                            << "has expired, starting over";
+            resetSession();
+            if (running)
+                sendRequest();
+            return;
+        }
+        // Like SyncJob, this job retries on transient errors; other failures
+        // mean something serious enough to stop the loop
+        running = false;
+        emit q->syncError(j->errorString(), j->rawDataSample());
+    });
+}
+
+void SlidingSync::Private::resetSession()
+{
+    pos.clear();
+    // The new session sends the list anew, from scratch
+    if (!roomIds.isEmpty()) {
+        roomIds.clear();
+        emit q->roomListChanged();
+    }
+}
+
+bool SlidingSync::Private::applyListOps(const QJsonArray& ops)
+{
+    bool changed = false;
+    for (const auto& opValue : ops) {
+        const auto opJson = opValue.toObject();
+        const auto op = opJson.value("op"_ls).toString();
+        const auto range = opJson.value("range"_ls).toArray();
+        // Ranges are inclusive; anything beyond the window is ignored
+        const auto from = range.at(0).toInt();
+        const auto to = std::min(range.at(1).toInt(), windowSize - 1);
+        const auto index = opJson.value("index"_ls).toInt(-1);
+        if (op == "SYNC"_ls) {
+            const auto ids = opJson.value("room_ids"_ls).toArray();
+            while (roomIds.size() <= to)
+                roomIds.append(QString());
+            for (int i = from; i <= to && i - from < ids.size(); ++i)
+                roomIds[i] = ids[i - from].toString();
+        } else if (op == "INVALIDATE"_ls) {
+            for (int i = from; i <= to && i < roomIds.size(); ++i)
+                roomIds[i].clear();
+        } else if (op == "DELETE"_ls) {
+            if (index < 0 || index >= roomIds.size())
+                continue;
+            roomIds.removeAt(index);
+        } else if (op == "INSERT"_ls) {
+            if (index < 0 || index > roomIds.size() || index >= windowSize)
+                continue;
+            roomIds.insert(index, opJson.value("room_id"_ls).toString());
+            truncateWindow();
+        } else {
+            qCWarning(SYNCJOB) << "Unknown sliding sync list operation" << op;
+            continue;
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+void SlidingSync::Private::truncateWindow()
+{
+    while (roomIds.size() > windowSize)
+        roomIds.removeLast();
+}
+
+SlidingSync::SlidingSync(Connection* connection, QObject* parent)
+    : QObject(parent), d(makeImpl<Private>())
+{
+    d->q = this;
+    d->connection = connection;
+}
+
+SlidingSync::~SlidingSync() { stop(); }
+
+int SlidingSync::windowSize() const { return d->windowSize; }
+
+void SlidingSync::setWindowSize(int newSize)
+{
+    if (newSize < 1 || newSize == d->windowSize)
+        return;
+    d->windowSize = newSize;
+    if (d->roomIds.size() > newSize) {
+        d->truncateWindow();
+        emit roomListChanged();
+    }
+    if (d->running)
+        d->sendRequest();
+}
+
+void SlidingSync::extendWindow(int count)
+{
+    setWindowSize(d->windowSize + count);
+}
+
+int SlidingSync::timelineLimit() const { return d->timelineLimit; }
+
+void SlidingSync::setTimelineLimit(int newLimit)
+{
+    d->timelineLimit = newLimit;
+}
+
+QStringList SlidingSync::roomIds() const { return d->roomIds; }
+
+int SlidingSync::totalRoomCount() const { return d->totalCount; }
+
+void SlidingSync::subscribeToRoom(const QString& roomId)
+{
+    if (d->subscriptions.contains(roomId))
+        return;
+    d->subscriptions.append(roomId);
+    if (d->running)
+        d->sendRequest();
+}
+
+void SlidingSync::unsubscribeFromRoom(const QString& roomId)
+{
+    if (d->subscriptions.removeOne(roomId) && d->running)
+        d->sendRequest();
+}
+
+void SlidingSync::start(int pollTimeout)
+{
+    if (!d->connection) {
+        qCWarning(SYNCJOB) << "Can't start sliding sync without a connection";
+        return;
+    }
+    d->pollTimeout = pollTimeout;
+    d->running = true;
+    d->sendRequest();
+}
+
+void SlidingSync::stop()
+{
+    d->running = false;
+    if (d->job)
+        d->job->abandon();
+    d->job = nullptr;
+}
+
+bool SlidingSync::isRunning() const { return d->running; }
+
+QJsonObject SlidingSync::requestBody() const
+{
+    // Enough state to show a room in the list; members are only loaded
+    // for senders of the timeline events
+    const QJsonArray listState {
+        QJsonArray { "m.room.create"_ls, ""_ls },
+        QJsonArray { "m.room.name"_ls, ""_ls },
+        QJsonArray { "m.room.avatar"_ls, ""_ls },
+        QJsonArray { "m.room.canonical_alias"_ls, ""_ls },
+        QJsonArray { "m.room.topic"_ls, ""_ls },
+        QJsonArray { "m.room.encryption"_ls, ""_ls },
+        QJsonArray { "m.room.tombstone"_ls, ""_ls },
+        QJsonArray { "m.room.member"_ls, "$LAZY"_ls }
+    };
+    const QJsonObject list {
+        { "ranges"_ls, QJsonArray { QJsonArray { 0, d->windowSize - 1 } } },
+        { "sort"_ls, QJsonArray { "by_recency"_ls } },
+        { "timeline_limit"_ls, d->timelineLimit },
+        { "required_state"_ls, listState }
+    };
+    QJsonObject subscriptions;
+    for (const auto& roomId : std::as_const(d->subscriptions))
+        subscriptions.insert(
+            roomId, QJsonObject {
+                        { "timeline_limit"_ls, d->timelineLimit },
+                        { "required_state"_ls,
+                          QJsonArray { QJsonArray { "*"_ls, "*"_ls } } } });
+    return { { "lists"_ls, QJsonObject { { ListName, list } } },
+             { "room_subscriptions"_ls, subscriptions } };
+}
+
+void SlidingSync::processResponse(const QJsonObject& response)
+{
+    QElapsedTimer et;
+    et.start();
+
+    d->pos = response.value("pos"_ls).toString();
+    const auto listJson =
+        response.value("lists"_ls).toObject().value(ListName).toObject();
+    bool listChanged = false;
+    if (const auto count = listJson.value("count"_ls);
+        count.isDouble() && count.toInt() != d->totalCount) {
+        d->totalCount = count.toInt();
+        listChanged = true;
+    }
+    if (d->applyListOps(listJson.value("ops"_ls).toArray()))
+        listChanged = true;
+
+    const auto rooms = response.value("rooms"_ls).toObject();
+    if (d->connection)
+        for (auto it = rooms.begin(); it != rooms.end(); ++it) {
+            auto roomData = roomDataFromJson(it.key(), it->toObject(),
+                                             d->connection->userId());
+            roomData.internIds(d->connection->stringPool());
+            d->connection->consumeRoomData(std::move(roomData));
+        }
+    if (et.nsecsElapsed() >= ProfilerMinNsecs)
+        qCDebug(PROFILER) << "*** SlidingSync::processResponse():"
+                          << rooms.size() << "room(s) in" << et;
+
+    if (listChanged)
+        emit roomListChanged();
+    emit synced();
+}
+
+//! Find the membership of \p userId by the last member event in \p events
+static QString lastMembership(const QJsonArray& events, const QString& userId)
+{
+    for (auto it = events.crbegin(); it != events.crend(); ++it)
+        if (const auto json = it->toObject();
+            json.value(TypeKeyL).toString() == "m.room.member"_ls
+            && json.value(StateKeyKeyL).toString() == userId)
+            return json.value(ContentKeyL)["membership"_ls].toString();
+    return {};
+}
+
+SyncRoomData SlidingSync::roomDataFromJson(const QString& roomId,
+                                           const QJsonObject& roomJson,
+                                           const QString& localUserId)
+{
+    // Rearrange the room object into the /sync shape, so that SyncRoomData
+    // and Room::updateData() can take it as is
+    QJsonObject syncJson;
+    const auto inviteState = roomJson.value("invite_state"_ls);
+    auto joinState = inviteState.isArray() ? JoinState::Invite
+                                           : JoinState::Join;
+    if (joinState == JoinState::Invite)
+        syncJson.insert("invite_state"_ls,
+                        QJsonObject { { "events"_ls, inviteState } });
+    else {
+        const auto stateEvents = roomJson.value("required_state"_ls).toArray();
+        const auto timelineEvents = roomJson.value("timeline"_ls).toArray();
+        if (!localUserId.isEmpty()) {
+            auto membership = lastMembership(timelineEvents, localUserId);
+            if (membership.isEmpty())
+                membership = lastMembership(stateEvents, localUserId);
+            if (membership == "leave"_ls || membership == "ban"_ls)
+                joinState = JoinState::Leave;
+        }
+        syncJson.insert("state"_ls,
+                        QJsonObject { { "events"_ls, stateEvents } });
+        QJsonObject timeline { { "events"_ls, timelineEvents } };
+        for (const auto& key : { "limited"_ls, "prev_batch"_ls })
+            if (const auto v = roomJson.value(key); !v.isUndefined())
+                timeline.insert(key, v);
+        // An initial view of the room is sent without regard to what
+        // the client already has; it may not connect to the known timeline
+        if (roomJson.value("initial"_ls).toBool()
+            && !timeline.contains("limited"_ls))
+            timeline.insert("limited"_ls, true);
+        syncJson.insert("timeline"_ls, timeline);
+    }
+
+    QJsonObject unread;
+    for (const auto& key : { "notification_count"_ls, HighlightCountKey })
+        if (const auto v = roomJson.value(key); !v.isUndefined())
+            unread.insert(key, v);
+    if (!unread.isEmpty())
+        syncJson.insert(UnreadNotificationsKey, unread);
+
+    QJsonObject summary;
+    if (const auto v = roomJson.value("joined_count"_ls); !v.isUndefined())
+        summary.insert("m.joined_member_count"_ls, v);
+    if (const auto v = roomJson.value("invited_count"_ls); !v.isUndefined())
+        summary.insert("m.invited_member_count"_ls, v);
+    if (!summary.isEmpty())
+        syncJson.insert("summary"_ls, summary);
+
+    return { roomId, joinState, syncJson };
+}
@@ -0,0 +1,114 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "syncdata.h"
+
+#include <QtCore/QObject>
+
+namespace Quotient {
+class Connection;
+
+//! \brief A sliding sync (MSC3575) engine
+//!
+//! Instead of syncing all rooms of the account, as the classic /sync does,
+//! sliding sync only requests a window over the list of rooms sorted by
+//! recency, with a limited number of timeline events per room, so that
+//! the time to get the first usable room list doesn't depend on the number
+//! of rooms on the account. The window can be extended as the user scrolls
+//! the room list; rooms outside of the window can be subscribed to
+//! individually (e.g. to open a room found by search).
+//!
+//! Room data received from the server is fed to the same
+//! Room::updateData() path as with the classic sync. Only room lists and
+//! room subscriptions are supported; sliding sync extensions (to-device
+//! messages, E2EE, account data etc.) are not, so this engine is not
+//! suitable for accounts relying on end-to-end encryption yet.
+//!
+//! Use either this engine or Connection::syncLoop(), not both at once.
+//! \sa Connection::slidingSync
+class QUOTIENT_API SlidingSync : public QObject {
+    Q_OBJECT
+public:
+    static constexpr int DefaultWindowSize = 20;
+    static constexpr int DefaultTimelineLimit = 10;
+
+    //! \param connection the connection to run requests on and to feed room
+    //!        data to; if nullptr, the engine can only be used
+    //!        with processResponse()
+    explicit SlidingSync(Connection* connection, QObject* parent = nullptr);
+    ~SlidingSync() override;
+
+    //! The number of rooms at the top of the list that the server sends
+    int windowSize() const;
+    //! \brief Change the window size
+    //!
+    //! If the engine is running, the new window is requested right away,
+    //! without waiting for the current long-poll to end.
+    void setWindowSize(int newSize);
+    //! Grow the window by \p count rooms, e.g. when the room list is scrolled
+    void extendWindow(int count);
+
+    //! The number of timeline events requested for each room
+    int timelineLimit() const;
+    void setTimelineLimit(int newLimit);
+
+    //! \brief Ids of rooms in the window, most recent first
+    //!
+    //! Positions not known yet (e.g. right after the window has been
+    //! extended) hold empty strings.
+    QStringList roomIds() const;
+    //! The number of rooms in the whole list, as reported by the server
+    int totalRoomCount() const;
+
+    //! \brief Request full state and timeline of a given room
+    //!
+    //! Subscribed rooms are synced regardless of their position in
+    //! the list, until unsubscribeFromRoom() is called.
+    void subscribeToRoom(const QString& roomId);
+    void unsubscribeFromRoom(const QString& roomId);
+
+    //! \brief Start the sync loop
+    //!
+    //! \p pollTimeout is passed to the server, in ms. If the server has
+    //! expired the position (M_UNKNOWN_POS), the engine starts a new session
+    //! and receives the room list anew; other errors stop the loop with
+    //! syncError().
+    void start(int pollTimeout = 30000);
+    void stop();
+    bool isRunning() const;
+
+    //! The body of the next request to the server
+    QJsonObject requestBody() const;
+
+    //! \brief Apply a response from the server
+    //!
+    //! This is normally called internally; it is exposed to allow
+    //! testing the engine with canned responses.
+    void processResponse(const QJsonObject& response);
+
+    //! \brief Convert a room object of a sliding sync response to SyncRoomData
+    //!
+    //! Sliding sync doesn't sort rooms by membership the way /sync does;
+    //! rooms with `invite_state` are invites, and rooms where the last
+    //! membership event of \p localUserId is a leave or a ban are left.
+    //! A room sent with `initial` is treated as a fresh view that may not
+    //! connect to the timeline the client already has, unless the server
+    //! says explicitly that the timeline is not limited.
+    static SyncRoomData roomDataFromJson(const QString& roomId,
+                                         const QJsonObject& roomJson,
+                                         const QString& localUserId = {});
+
+Q_SIGNALS:
+    //! The list of rooms in the window or the total count have changed
+    void roomListChanged();
+    //! A response has been processed
+    void synced();
+    void syncError(QString message, QString details);
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+} // namespace Quotient
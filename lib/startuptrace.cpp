@@ -0,0 +1,150 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "startuptrace.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QJsonArray>
+#include <QtCore/QMutex>
+
+#include <algorithm>
+#include <array>
+
+using namespace Quotient;
+using namespace std::chrono;
+
+namespace {
+struct PhaseRecord {
+    StartupTrace::clock::time_point start;
+    StartupTrace::clock::time_point end;
+    StartupTrace::clock::duration busy {};
+    qint64 count = 0;
+    bool recorded = false;
+};
+} // namespace
+
+class StartupTrace::Private {
+public:
+    mutable QMutex lock;
+    std::array<PhaseRecord, PhaseCount> records;
+    clock::time_point origin;
+    clock::time_point latestEnd;
+    //! The wall clock time corresponding to origin
+    qint64 originMSecsSinceEpoch = 0;
+    bool empty = true;
+    bool finished = false;
+};
+
+StartupTrace::StartupTrace() : d(makeImpl<Private>()) {}
+
+StartupTrace::~StartupTrace() = default;
+
+QLatin1String StartupTrace::phaseName(PhaseId phase)
+{
+    static constexpr std::array<QLatin1String, PhaseCount> Names {
+        "keychain_load"_ls,      "well_known_lookup"_ls,
+        "login_flows_lookup"_ls, "cache_index_read"_ls,
+        "room_cache_parse"_ls,   "room_update"_ls,
+        "e2ee_database_open"_ls, "e2ee_session_load"_ls,
+        "first_sync_request"_ls, "first_sync_apply"_ls
+    };
+    return phase >= 0 && phase < PhaseCount ? Names[phase] : QLatin1String();
+}
+
+void StartupTrace::record(PhaseId phase, clock::time_point startedAt,
+                          qint64 count, clock::time_point finishedAt)
+{
+    Q_ASSERT(phase >= 0 && phase < PhaseCount);
+    QMutexLocker locker(&d->lock);
+    if (d->finished)
+        return;
+
+    auto& r = d->records[phase];
+    if (!r.recorded) {
+        r.start = startedAt;
+        r.end = finishedAt;
+        r.recorded = true;
+    } else {
+        r.start = std::min(r.start, startedAt);
+        r.end = std::max(r.end, finishedAt);
+    }
+    r.busy += finishedAt - startedAt;
+    r.count += count;
+
+    if (d->empty || startedAt < d->origin) {
+        d->origin = startedAt;
+        d->originMSecsSinceEpoch =
+            QDateTime::currentMSecsSinceEpoch()
+            - duration_cast<milliseconds>(clock::now() - startedAt).count();
+    }
+    if (d->empty || finishedAt > d->latestEnd)
+        d->latestEnd = finishedAt;
+    d->empty = false;
+}
+
+void StartupTrace::finish()
+{
+    QMutexLocker locker(&d->lock);
+    d->finished = true;
+}
+
+bool StartupTrace::isFinished() const
+{
+    QMutexLocker locker(&d->lock);
+    return d->finished;
+}
+
+void StartupTrace::reset()
+{
+    QMutexLocker locker(&d->lock);
+    d->records = {};
+    d->empty = true;
+    d->finished = false;
+}
+
+std::vector<StartupTrace::Phase> StartupTrace::phases() const
+{
+    QMutexLocker locker(&d->lock);
+    std::vector<Phase> result;
+    for (int i = 0; i < PhaseCount; ++i)
+        if (const auto& r = d->records[i]; r.recorded)
+            result.push_back({ PhaseId(i),
+                               duration_cast<microseconds>(r.start - d->origin),
+                               duration_cast<microseconds>(r.end - d->origin),
+                               duration_cast<microseconds>(r.busy), r.count });
+    // Keep the enum order for phases that started at the same time
+    std::stable_sort(result.begin(), result.end(),
+                     [](const Phase& lhs, const Phase& rhs) {
+                         return lhs.start < rhs.start;
+                     });
+    return result;
+}
+
+StartupTrace::microseconds StartupTrace::duration() const
+{
+    QMutexLocker locker(&d->lock);
+    return d->empty ? microseconds::zero()
+                    : duration_cast<microseconds>(d->latestEnd - d->origin);
+}
+
+inline double toMSecs(StartupTrace::microseconds us)
+{
+    return double(us.count()) / 1000;
+}
+
+QJsonObject StartupTrace::toJson() const
+{
+    QJsonArray phasesJson;
+    for (const auto& p : phases())
+        phasesJson.append(QJsonObject { { "name"_ls, phaseName(p.id) },
+                                        { "start_ms"_ls, toMSecs(p.start) },
+                                        { "end_ms"_ls, toMSecs(p.end) },
+                                        { "busy_ms"_ls, toMSecs(p.busy) },
+                                        { "count"_ls, p.count } });
+    const auto totalDuration = duration();
+    QMutexLocker locker(&d->lock);
+    return { { "started_at"_ls, d->originMSecsSinceEpoch },
+             { "duration_ms"_ls, toMSecs(totalDuration) },
+             { "finished"_ls, d->finished },
+             { "phases"_ls, phasesJson } };
+}
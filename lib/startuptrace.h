@@ -0,0 +1,94 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QJsonObject>
+
+#include <chrono>
+#include <vector>
+
+namespace Quotient {
+
+//! \brief Timings of the phases of Connection startup
+//!
+//! Connection records here how long it takes to get from the start (loading
+//! the access token, resolving the server, loading the cache) to applying
+//! the first sync response. Each phase may be recorded several times (e.g.,
+//! once for each room parsed from the cache); such records are merged into
+//! a single Phase that spans from the earliest start to the latest end and
+//! sums up the counts and the time spent in the individual records.
+//!
+//! The trace is finished once the first /sync response has been applied to
+//! rooms; records made after that are ignored. The trace is thread-safe.
+//! \sa Connection::startupTrace, Connection::startupTraceFinished
+class QUOTIENT_API StartupTrace {
+public:
+    using clock = std::chrono::steady_clock;
+    using microseconds = std::chrono::microseconds;
+
+    enum PhaseId {
+        KeychainLoad, //!< Reading the access token from the keychain
+        WellKnownLookup, //!< Resolving the homeserver via .well-known
+        LoginFlowsLookup, //!< The first request to the homeserver
+        CacheIndexRead, //!< Reading the top-level cache file
+        RoomCacheParse, //!< Loading cached states of rooms; per room
+        RoomUpdate, //!< Applying data to rooms (Room::updateData())
+        E2eeDatabaseOpen, //!< Opening the database and the Olm account
+        E2eeSessionLoad, //!< Loading Olm and Megolm sessions
+        FirstSyncRequest, //!< From sending /sync to having the response
+        FirstSyncApply, //!< Applying the response to rooms
+        PhaseCount
+    };
+
+    struct Phase {
+        PhaseId id;
+        //! The start and the end, from the earliest start in the trace
+        microseconds start {};
+        microseconds end {};
+        //! \brief The time spent in all records of the phase
+        //!
+        //! This is more than `end - start` when the records ran in parallel
+        //! and less when there were gaps between them.
+        microseconds busy {};
+        //! The number of items processed (rooms, sessions, requests)
+        qint64 count = 0;
+    };
+
+    StartupTrace();
+    ~StartupTrace();
+    Q_DISABLE_COPY_MOVE(StartupTrace)
+
+    //! The name of the phase as used in toJson()
+    static QLatin1String phaseName(PhaseId phase);
+
+    //! \brief Record that \p count items of \p phase took the given time
+    //!
+    //! Does nothing once the trace is finished.
+    void record(PhaseId phase, clock::time_point startedAt, qint64 count = 1,
+                clock::time_point finishedAt = clock::now());
+    //! Stop recording
+    void finish();
+    bool isFinished() const;
+    //! Drop all records and start over
+    void reset();
+
+    //! Phases that have been recorded, in the order of their start
+    std::vector<Phase> phases() const;
+    //! The time from the earliest start to the latest end in the trace
+    microseconds duration() const;
+    //! \brief The trace in JSON
+    //!
+    //! The object has `started_at` (the wall clock time of the earliest start,
+    //! in milliseconds since the epoch), `duration_ms`, `finished` and
+    //! `phases`, an array of objects with `name`, `start_ms`, `end_ms`,
+    //! `busy_ms` and `count`.
+    QJsonObject toJson() const;
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+} // namespace Quotient
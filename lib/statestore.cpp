@@ -0,0 +1,575 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "statestore.h"
+
+#include "cachecodec.h"
+#include "converters.h"
+#include "logging.h"
+
+#include <QtCore/QCborStreamReader>
+#include <QtCore/QCborStreamWriter>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QSaveFile>
+#include <QtCore/QtEndian>
+
+#include <algorithm>
+#include <cstring>
+#include <ranges>
+
+using namespace Quotient;
+
+// The data file starts with a header (the magic number and the format
+// version, 32 bits each), followed by records. A record has a header
+// (see RecordHeader), the room id in UTF-8 and a slot of `capacity` bytes,
+// the first `size` of which hold the room state. All numbers
+// are little-endian.
+constexpr quint32 FileMagic = 0x31535351; // "QSS1"
+constexpr quint32 FormatVersion = 2;
+constexpr qint64 FileHeaderSize = 8;
+constexpr quint32 LiveMagic = 0x4556494c; // "LIVE"
+constexpr quint32 DeadMagic = 0x44414544; // "DEAD"
+constexpr qint64 RecordHeaderSize = 32;
+//! Don't bother compacting the data file until this much space is wasted
+constexpr qint64 MinCompactionWaste = 1024 * 1024;
+
+namespace {
+struct RecordHeader {
+    quint32 magic = 0;
+    quint32 idSize = 0;
+    quint32 capacity = 0;
+    quint32 size = 0;
+    quint64 version = 0;
+    //! CRC-32 of the room id and the state
+    quint32 checksum = 0;
+    // 4 bytes reserved
+
+    qint64 recordSize() const
+    {
+        return RecordHeaderSize + qint64(idSize) + qint64(capacity);
+    }
+};
+
+RecordHeader parseHeader(const uchar* p)
+{
+    return { qFromLittleEndian<quint32>(p), qFromLittleEndian<quint32>(p + 4),
+             qFromLittleEndian<quint32>(p + 8),
+             qFromLittleEndian<quint32>(p + 12),
+             qFromLittleEndian<quint64>(p + 16),
+             qFromLittleEndian<quint32>(p + 24) };
+}
+
+QByteArray makeHeader(const RecordHeader& h)
+{
+    QByteArray result(RecordHeaderSize, Qt::Uninitialized);
+    auto* p = result.data();
+    qToLittleEndian(h.magic, p);
+    qToLittleEndian(h.idSize, p + 4);
+    qToLittleEndian(h.capacity, p + 8);
+    qToLittleEndian(h.size, p + 12);
+    qToLittleEndian(h.version, p + 16);
+    qToLittleEndian(h.checksum, p + 24);
+    qToLittleEndian(quint32(0), p + 28);
+    return result;
+}
+
+QByteArray makeFileHeader()
+{
+    QByteArray result(FileHeaderSize, Qt::Uninitialized);
+    qToLittleEndian(FileMagic, result.data());
+    qToLittleEndian(FormatVersion, result.data() + 4);
+    return result;
+}
+
+quint32 checksum(const QByteArray& id, const char* data, qint64 size)
+{
+    return crc32(data, size, crc32(id.constData(), id.size()));
+}
+
+//! Leave room for the state to grow a bit and still be updated in place
+quint32 capacityFor(qint64 size) { return quint32(size + size / 4); }
+
+QJsonObject parseStateData(const QByteArray& rawData)
+{
+    // Uncompressed data is returned as it is, still not copied
+    const auto data = CacheCodec::unpack(rawData);
+    if (data.startsWith('{'))
+        return QJsonDocument::fromJson(data).object();
+    QCborStreamReader reader(data);
+    auto json = readCborAsJson(reader).toObject();
+    return reader.lastError() == QCborError::NoError ? json : QJsonObject();
+}
+
+struct Record {
+    enum Status { NotFound, Found, Unmapped };
+
+    Status status = NotFound;
+    RecordHeader header {};
+    const char* data = nullptr;
+};
+} // namespace
+
+class StateStore::Private {
+public:
+    mutable QReadWriteLock lock;
+    QFile file;
+    qint64 fileSize = 0;
+    uchar* map = nullptr;
+    qint64 mappedSize = 0;
+    //! Room id to record offset
+    QHash<QString, qint64> index;
+    qint64 wastedBytes = 0;
+
+    QString indexFileName() const { return file.fileName() + ".idx"_ls; }
+
+    bool remap();
+    void unmap();
+    void closeFile();
+    Record findRecord(const QString& roomId) const;
+    Record findRecordRemapping(const QString& roomId);
+    static QJsonObject parseRecord(const QString& roomId, const Record& record);
+    RecordHeader readHeader(qint64 offset);
+    bool writeAt(qint64 offset, const QByteArray& data);
+    bool writeRecord(qint64 offset, const RecordHeader& header,
+                     const QByteArray& id, const QByteArray& data);
+    void markDead(qint64 offset);
+    void scan();
+    bool loadIndex();
+    bool saveIndex();
+    bool compact();
+};
+
+bool StateStore::Private::remap()
+{
+    unmap();
+    if (fileSize == 0)
+        return true;
+    map = file.map(0, fileSize);
+    if (!map) {
+        qCWarning(MAIN) << "Failed to map" << file.fileName() << ":"
+                        << file.errorString();
+        return false;
+    }
+    mappedSize = fileSize;
+    return true;
+}
+
+void StateStore::Private::unmap()
+{
+    if (map)
+        file.unmap(map);
+    map = nullptr;
+    mappedSize = 0;
+}
+
+void StateStore::Private::closeFile()
+{
+    unmap();
+    file.close();
+    fileSize = 0;
+    index.clear();
+    wastedBytes = 0;
+}
+
+Record StateStore::Private::findRecord(const QString& roomId) const
+{
+    const auto it = index.constFind(roomId);
+    if (it == index.cend())
+        return {};
+    const auto offset = *it;
+    if (offset + RecordHeaderSize > mappedSize)
+        return { Record::Unmapped };
+    const auto header = parseHeader(map + offset);
+    const auto recordEnd = offset + header.recordSize();
+    const auto id = roomId.toUtf8();
+    if (header.magic != LiveMagic || header.size > header.capacity
+        || recordEnd > fileSize || header.idSize != quint32(id.size())) {
+        qCWarning(MAIN) << "Broken state store record for" << roomId;
+        return {};
+    }
+    if (recordEnd > mappedSize)
+        return { Record::Unmapped };
+    const auto* const idData =
+        reinterpret_cast<const char*>(map + offset + RecordHeaderSize);
+    if (std::memcmp(idData, id.constData(), size_t(id.size())) != 0) {
+        qCWarning(MAIN) << "State store record for" << roomId
+                        << "belongs to another room";
+        return {};
+    }
+    return { Record::Found, header, idData + header.idSize };
+}
+
+Record StateStore::Private::findRecordRemapping(const QString& roomId)
+{
+    auto record = findRecord(roomId);
+    if (record.status == Record::Unmapped && remap())
+        record = findRecord(roomId);
+    return record;
+}
+
+QJsonObject StateStore::Private::parseRecord(const QString& roomId,
+                                             const Record& record)
+{
+    if (record.status != Record::Found)
+        return {};
+    if (checksum(roomId.toUtf8(), record.data, record.header.size)
+        != record.header.checksum) {
+        qCWarning(MAIN) << "Checksum mismatch in the state store record for"
+                        << roomId;
+        return {};
+    }
+    return parseStateData(
+        QByteArray::fromRawData(record.data, int(record.header.size)));
+}
+
+RecordHeader StateStore::Private::readHeader(qint64 offset)
+{
+    if (offset + RecordHeaderSize <= mappedSize)
+        return parseHeader(map + offset);
+    file.seek(offset);
+    const auto headerData = file.read(RecordHeaderSize);
+    if (headerData.size() < RecordHeaderSize)
+        return {};
+    return parseHeader(reinterpret_cast<const uchar*>(headerData.constData()));
+}
+
+bool StateStore::Private::writeAt(qint64 offset, const QByteArray& data)
+{
+    if (!file.seek(offset) || file.write(data) != data.size() || !file.flush()) {
+        qCWarning(MAIN) << "Error writing to" << file.fileName() << ":"
+                        << file.errorString();
+        return false;
+    }
+    fileSize = std::max(fileSize, offset + qint64(data.size()));
+    return true;
+}
+
+bool StateStore::Private::writeRecord(qint64 offset, const RecordHeader& header,
+                                      const QByteArray& id,
+                                      const QByteArray& data)
+{
+    return writeAt(offset, makeHeader(header) + id + data);
+}
+
+void StateStore::Private::markDead(qint64 offset)
+{
+    QByteArray magic(sizeof(DeadMagic), Qt::Uninitialized);
+    qToLittleEndian(DeadMagic, magic.data());
+    writeAt(offset, magic);
+}
+
+void StateStore::Private::scan()
+{
+    index.clear();
+    wastedBytes = 0;
+    auto offset = FileHeaderSize;
+    while (offset + RecordHeaderSize <= mappedSize) {
+        const auto header = parseHeader(map + offset);
+        const auto recordEnd = offset + header.recordSize();
+        if ((header.magic != LiveMagic && header.magic != DeadMagic)
+            || header.size > header.capacity || recordEnd > mappedSize)
+            break;
+        if (header.magic == LiveMagic) {
+            const auto roomId = QString::fromUtf8(
+                reinterpret_cast<const char*>(map + offset + RecordHeaderSize),
+                int(header.idSize));
+            // An interrupted put() may leave the previous record for the room
+            // live; the later one is the right one then
+            if (const auto it = index.find(roomId); it != index.end()) {
+                wastedBytes += parseHeader(map + *it).recordSize();
+                *it = offset;
+            } else
+                index.insert(roomId, offset);
+        } else
+            wastedBytes += header.recordSize();
+        offset = recordEnd;
+    }
+    if (offset < fileSize) {
+        qCWarning(MAIN) << "Discarding" << fileSize - offset
+                        << "byte(s) of broken data at the end of"
+                        << file.fileName();
+        unmap();
+        if (file.resize(offset))
+            fileSize = offset;
+        remap();
+    }
+}
+
+bool StateStore::Private::loadIndex()
+{
+    QFile indexFile { indexFileName() };
+    if (!indexFile.open(QIODevice::ReadOnly))
+        return false;
+    QCborStreamReader reader(&indexFile);
+    const auto json = readCborAsJson(reader).toObject();
+    if (reader.lastError() != QCborError::NoError
+        || qint64(json.value("data_size"_ls).toDouble()) != fileSize) {
+        qCDebug(MAIN) << "The index of" << file.fileName()
+                      << "is outdated, rebuilding";
+        return false;
+    }
+    const auto rooms = json.value("rooms"_ls).toObject();
+    index.clear();
+    index.reserve(rooms.size());
+    for (auto it = rooms.begin(); it != rooms.end(); ++it) {
+        const auto offset = qint64(it->toDouble());
+        if (offset < FileHeaderSize || offset + RecordHeaderSize > fileSize)
+            return false;
+        index.insert(it.key(), offset);
+    }
+    wastedBytes = qint64(json.value("wasted"_ls).toDouble());
+    return true;
+}
+
+bool StateStore::Private::saveIndex()
+{
+    QJsonObject rooms;
+    for (auto it = index.cbegin(); it != index.cend(); ++it)
+        rooms.insert(it.key(), *it);
+    QSaveFile indexFile { indexFileName() };
+    if (!indexFile.open(QIODevice::WriteOnly)) {
+        qCWarning(MAIN) << "Error opening" << indexFile.fileName() << ":"
+                        << indexFile.errorString();
+        return false;
+    }
+    QCborStreamWriter writer(&indexFile);
+    writeJsonAsCbor(writer, QJsonObject { { "data_size"_ls, fileSize },
+                                          { "wasted"_ls, wastedBytes },
+                                          { "rooms"_ls, rooms } });
+    return indexFile.commit();
+}
+
+bool StateStore::Private::compact()
+{
+    if (mappedSize < fileSize && !remap())
+        return false;
+
+    // Keep the records in the order they are in the file
+    std::vector<std::pair<qint64, QString>> records;
+    records.reserve(size_t(index.size()));
+    for (auto it = index.cbegin(); it != index.cend(); ++it)
+        records.emplace_back(*it, it.key());
+    std::sort(records.begin(), records.end());
+
+    QSaveFile newFile { file.fileName() };
+    if (!newFile.open(QIODevice::WriteOnly)) {
+        qCWarning(MAIN) << "Error opening" << newFile.fileName() << ":"
+                        << newFile.errorString();
+        return false;
+    }
+    newFile.write(makeFileHeader());
+    QHash<QString, qint64> newIndex;
+    newIndex.reserve(index.size());
+    auto newOffset = FileHeaderSize;
+    for (const auto& roomId : records | std::views::values) {
+        const auto record = findRecord(roomId);
+        if (record.status != Record::Found)
+            continue;
+        auto header = record.header;
+        header.capacity = capacityFor(header.size);
+        newFile.write(makeHeader(header));
+        newFile.write(record.data - header.idSize,
+                      qint64(header.idSize) + header.size);
+        newFile.write(QByteArray(int(header.capacity - header.size), '\0'));
+        newIndex.insert(roomId, newOffset);
+        newOffset += header.recordSize();
+    }
+
+    // QSaveFile replaces the data file; it must be closed for that on Windows
+    unmap();
+    file.close();
+    const auto committed = newFile.commit();
+    if (!committed)
+        qCWarning(MAIN) << "Failed to compact" << file.fileName() << ":"
+                        << newFile.errorString();
+    if (!file.open(QIODevice::ReadWrite)) {
+        qCWarning(MAIN) << "Error reopening" << file.fileName() << ":"
+                        << file.errorString();
+        closeFile();
+        return false;
+    }
+    fileSize = file.size();
+    remap();
+    if (!committed)
+        return false;
+    index = std::move(newIndex);
+    wastedBytes = 0;
+    return true;
+}
+
+StateStore::StateStore() : d(makeImpl<Private>()) {}
+
+StateStore::~StateStore() { close(); }
+
+bool StateStore::open(const QString& fileName)
+{
+    QWriteLocker locker(&d->lock);
+    d->closeFile();
+    d->file.setFileName(fileName);
+    if (!d->file.open(QIODevice::ReadWrite)) {
+        qCWarning(MAIN) << "Error opening" << fileName << ":"
+                        << d->file.errorString();
+        return false;
+    }
+    if (d->file.read(FileHeaderSize) != makeFileHeader()) {
+        if (d->file.size() > 0)
+            qCWarning(MAIN) << fileName
+                            << "is not a valid state store, discarding it";
+        if (!d->file.resize(0) || !d->writeAt(0, makeFileHeader())) {
+            d->closeFile();
+            return false;
+        }
+    }
+    d->fileSize = d->file.size();
+    if (!d->remap()) {
+        d->closeFile();
+        return false;
+    }
+    if (!d->loadIndex())
+        d->scan();
+    return true;
+}
+
+void StateStore::close()
+{
+    QWriteLocker locker(&d->lock);
+    d->closeFile();
+}
+
+bool StateStore::isOpen() const
+{
+    QReadLocker locker(&d->lock);
+    return d->file.isOpen();
+}
+
+QString StateStore::fileName() const
+{
+    QReadLocker locker(&d->lock);
+    return d->file.fileName();
+}
+
+bool StateStore::contains(const QString& roomId) const
+{
+    QReadLocker locker(&d->lock);
+    return d->index.contains(roomId);
+}
+
+QStringList StateStore::roomIds() const
+{
+    QReadLocker locker(&d->lock);
+    return d->index.keys();
+}
+
+quint64 StateStore::version(const QString& roomId) const
+{
+    {
+        QReadLocker locker(&d->lock);
+        if (const auto record = d->findRecord(roomId);
+            record.status != Record::Unmapped)
+            return record.header.version;
+    }
+    QWriteLocker locker(&d->lock);
+    return d->findRecordRemapping(roomId).header.version;
+}
+
+QJsonObject StateStore::loadJson(const QString& roomId) const
+{
+    // The record data is only valid while the lock is held: a write may
+    // overwrite it in place, and remap() invalidates the pointer
+    {
+        QReadLocker locker(&d->lock);
+        if (const auto record = d->findRecord(roomId);
+            record.status != Record::Unmapped)
+            return Private::parseRecord(roomId, record);
+    }
+    // The record has been appended after the file was mapped
+    QWriteLocker locker(&d->lock);
+    return Private::parseRecord(roomId, d->findRecordRemapping(roomId));
+}
+
+bool StateStore::put(const QString& roomId, const QByteArray& data)
+{
+    QWriteLocker locker(&d->lock);
+    if (!d->file.isOpen())
+        return false;
+    const auto id = roomId.toUtf8();
+    const auto it = d->index.find(roomId);
+    auto oldHeader = it != d->index.end() ? d->readHeader(*it) : RecordHeader();
+    if (oldHeader.magic != LiveMagic)
+        oldHeader = {};
+    RecordHeader header { LiveMagic,
+                          quint32(id.size()),
+                          oldHeader.capacity,
+                          quint32(data.size()),
+                          oldHeader.version + 1,
+                          checksum(id, data.constData(), data.size()) };
+    if (oldHeader.magic == LiveMagic && header.size <= oldHeader.capacity)
+        return d->writeRecord(*it, header, id, data);
+
+    const auto offset = d->fileSize;
+    header.capacity = capacityFor(data.size());
+    if (!d->writeRecord(offset, header, id, data))
+        return false;
+    if (!d->file.resize(offset + header.recordSize())) {
+        qCWarning(MAIN) << "Error resizing" << d->file.fileName() << ":"
+                        << d->file.errorString();
+        return false;
+    }
+    d->fileSize = offset + header.recordSize();
+    // Only mark the old record dead when the new one is complete
+    if (oldHeader.magic == LiveMagic) {
+        d->markDead(*it);
+        d->wastedBytes += oldHeader.recordSize();
+    }
+    if (it != d->index.end())
+        *it = offset;
+    else
+        d->index.insert(roomId, offset);
+    return true;
+}
+
+bool StateStore::remove(const QString& roomId)
+{
+    QWriteLocker locker(&d->lock);
+    const auto it = d->index.find(roomId);
+    if (it == d->index.end())
+        return false;
+    if (const auto header = d->readHeader(*it); header.magic == LiveMagic) {
+        d->markDead(*it);
+        d->wastedBytes += header.recordSize();
+    }
+    d->index.erase(it);
+    return true;
+}
+
+bool StateStore::commit()
+{
+    QWriteLocker locker(&d->lock);
+    if (!d->file.isOpen())
+        return false;
+    if (d->wastedBytes >= MinCompactionWaste
+        && d->wastedBytes * 2 > d->fileSize)
+        d->compact();
+    return d->file.isOpen() && d->saveIndex();
+}
+
+bool StateStore::compact()
+{
+    QWriteLocker locker(&d->lock);
+    return d->file.isOpen() && d->compact() && d->saveIndex();
+}
+
+qint64 StateStore::fileSize() const
+{
+    QReadLocker locker(&d->lock);
+    return d->fileSize;
+}
+
+qint64 StateStore::wastedBytes() const
+{
+    QReadLocker locker(&d->lock);
+    return d->wastedBytes;
+}
@@ -0,0 +1,93 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QJsonObject>
+#include <QtCore/QStringList>
+
+namespace Quotient {
+
+//! \brief A single-file store for cached room states
+//!
+//! Instead of a file per room, room states (as produced by Room::toJson(),
+//! in JSON or CBOR) are kept as records in one data file that is
+//! memory-mapped when the store is opened. Each record has a slot somewhat
+//! larger than the data in it: a new state that fits the slot overwrites
+//! the old one in place, otherwise the record is marked dead and the new
+//! state is appended to the file. Each record has a version, incremented
+//! with every update, and a checksum; a record that doesn't match its
+//! checksum (e.g. after a crash in the middle of an update) is not loaded.
+//! commit() saves the index of records (room id to offset) next to the data
+//! file, so that opening the store doesn't need to scan it, and compacts
+//! the data file when dead records take too much of it.
+//!
+//! The store is thread-safe; reads can go in parallel, writes are
+//! serialised with reads and with each other.
+//! \sa Connection::saveRoomState
+class QUOTIENT_API StateStore {
+public:
+    //! The name of the data file in the state cache directory
+    static constexpr auto DefaultFileName = "rooms.qss"_ls;
+    //! \brief The key for record versions in the top-level cache file
+    //!
+    //! Connection::saveState() stores the version of each room's record
+    //! under this key in the room's index entry, so that a room state older
+    //! than the index (e.g. from a store restored from a backup) can be
+    //! detected when loading.
+    static constexpr auto VersionKey = "org.quotient.state_version"_ls;
+
+    StateStore();
+    ~StateStore();
+    Q_DISABLE_COPY_MOVE(StateStore)
+
+    //! \brief Open or create the store in \p fileName
+    //!
+    //! A data file that is not a valid store is discarded. The index is
+    //! read from the file with the same name and the `.idx` suffix; if it
+    //! is missing or doesn't match the data file, the data file is scanned
+    //! to rebuild the index.
+    bool open(const QString& fileName);
+    void close();
+    bool isOpen() const;
+    QString fileName() const;
+
+    bool contains(const QString& roomId) const;
+    QStringList roomIds() const;
+    //! \brief The version of the record for \p roomId
+    //!
+    //! Versions start at 1 and increase with each put() for the room;
+    //! 0 means there's no record.
+    quint64 version(const QString& roomId) const;
+
+    //! \brief Parse the data stored for \p roomId
+    //!
+    //! The data is parsed straight from the mapped file, without copying it,
+    //! unless it has been compressed (see CacheCodec).
+    //! \return the room state, or an empty object if there's no record
+    //!         or it doesn't match its checksum
+    QJsonObject loadJson(const QString& roomId) const;
+    //! Store \p data for \p roomId, replacing the previous data if any
+    bool put(const QString& roomId, const QByteArray& data);
+    bool remove(const QString& roomId);
+
+    //! \brief Save the index, compacting the data file first if needed
+    //!
+    //! Records written after the last commit() are found again when
+    //! the store is opened, at the cost of scanning the data file.
+    bool commit();
+    //! Rewrite the data file with only the live records
+    bool compact();
+
+    //! The size of the data file, in bytes
+    qint64 fileSize() const;
+    //! The number of bytes in the data file taken by dead records
+    qint64 wastedBytes() const;
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+} // namespace Quotient
@@ -0,0 +1,42 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "stringpool.h"
+
+using namespace Quotient;
+
+InternedString StringPool::intern(const QString& s)
+{
+    if (s.isEmpty())
+        return {};
+    if (auto result = find(s); !result.isNull())
+        return result;
+
+    const QWriteLocker _(&lock);
+    return InternedString(*strings.insert(s).first);
+}
+
+InternedString StringPool::find(const QString& s) const
+{
+    if (s.isEmpty())
+        return {};
+
+    const QReadLocker _(&lock);
+    const auto it = strings.find(s);
+    return it != strings.cend() ? InternedString(*it) : InternedString();
+}
+
+size_t StringPool::collect()
+{
+    const QWriteLocker _(&lock);
+    // A detached string is only referenced by the pool itself; with the lock
+    // taken, nobody can obtain a new reference to it while it's checked
+    return std::erase_if(strings,
+                         [](const QString& s) { return s.isDetached(); });
+}
+
+size_t StringPool::size() const
+{
+    const QReadLocker _(&lock);
+    return strings.size();
+}
@@ -0,0 +1,102 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "util.h"
+
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QString>
+
+#include <unordered_set>
+
+namespace Quotient {
+
+// uint in Qt 5, size_t in Qt 6
+using qhash_result_t = decltype(qHash(0));
+
+//! \brief An interned string
+//!
+//! Interned strings are obtained from StringPool::intern(); two of them
+//! coming from the same pool are equal if and only if they share the pooled
+//! string data, making comparison and hashing O(1) regardless of the string
+//! length. This is meant for identifiers (user ids, room ids, event types)
+//! that are repeated across many objects and used as keys in large
+//! containers. A default-constructed InternedString is null and converts to
+//! an empty QString.
+//!
+//! An InternedString holds a reference to the pooled string, so the string
+//! stays in the pool as long as any InternedString (or a QString copy of it)
+//! is alive; see StringPool::collect().
+class QUOTIENT_API InternedString {
+public:
+    InternedString() = default;
+
+    const QString& toString() const { return s; }
+    QUO_IMPLICIT operator const QString&() const { return s; }
+
+    bool isNull() const { return s.isNull(); }
+
+    friend bool operator==(const InternedString& lhs,
+                           const InternedString& rhs)
+    {
+        return lhs.s.constData() == rhs.s.constData();
+    }
+    friend bool operator!=(const InternedString& lhs,
+                           const InternedString& rhs)
+    {
+        return !(lhs == rhs);
+    }
+    friend qhash_result_t qHash(const InternedString& is,
+                                qhash_result_t seed = 0) noexcept
+    {
+        return qHash(static_cast<const void*>(is.s.constData()), seed);
+    }
+
+private:
+    friend class StringPool;
+    explicit InternedString(const QString& pooled) : s(pooled) {}
+
+    QString s;
+};
+
+//! \brief A thread-safe pool of interned strings
+//!
+//! Each distinct string is stored in the pool exactly once; copies of QString
+//! returned by InternedString share the data with the pooled string.
+//! Connection owns a pool for identifiers coming from the server; SyncData
+//! can use it while parsing.
+//! \sa Connection::stringPool, SyncData::setStringPool
+class QUOTIENT_API StringPool {
+public:
+    StringPool() = default;
+    Q_DISABLE_COPY_MOVE(StringPool)
+
+    //! \brief Get the interned copy of \p s, adding it to the pool if needed
+    //!
+    //! An empty \p s gives a null InternedString.
+    InternedString intern(const QString& s);
+
+    //! \brief Find the interned copy of \p s without adding it to the pool
+    //!
+    //! Use this for lookups by strings that are not guaranteed to come from
+    //! the server, so that the pool doesn't grow with arbitrary strings.
+    //! \return the interned string, or a null one if \p s is not in the pool
+    InternedString find(const QString& s) const;
+
+    //! \brief Drop strings that are no more referenced outside the pool
+    //!
+    //! The pool only grows by itself; this removes strings that no
+    //! InternedString or QString copy refers to any more, e.g. ids of users
+    //! collected by Connection or of rooms that were forgotten.
+    //! \return the number of strings removed
+    size_t collect();
+
+    size_t size() const;
+
+private:
+    mutable QReadWriteLock lock;
+    std::unordered_set<QString, HashQ<QString>> strings;
+};
+
+} // namespace Quotient
@@ -3,10 +3,19 @@
 
 #include "syncdata.h"
 
+#include "cachecodec.h"
 #include "logging.h"
+#include "startuptrace.h"
+#include "statestore.h"
+#include "stringpool.h"
 
+#include <QtCore/QCborStreamReader>
 #include <QtCore/QFile>
 #include <QtCore/QFileInfo>
+#include <QtCore/QSemaphore>
+#include <QtCore/QThreadPool>
+
+#include <atomic>
 
 using namespace Quotient;
 
@@ -98,6 +107,8 @@ SyncRoomData::SyncRoomData(QString roomId_, JoinState joinState,
     if (!unreadCount.has_value())
         fromJson(unreadJson.value("notification_count"_ls), unreadCount);
     fromJson(unreadJson.value(HighlightCountKey), highlightCount);
+    cachedStateVersion =
+        quint64(roomJson.value(StateStore::VersionKey).toDouble());
 }
 
 QDebug Quotient::operator<<(QDebug dbg, const DevicesList& devicesList)
@@ -128,19 +139,109 @@ void JsonObjectConverter<DevicesList>::fillFrom(const QJsonObject& jo,
     fromJson(jo["left"_ls], rs.left);
 }
 
-SyncData::SyncData(const QString& cacheFileName)
+void SyncRoomData::internIds(StringPool& pool)
+{
+    roomId = pool.intern(roomId);
+    for (auto& e : state)
+        e->internIds(pool);
+    for (auto& e : timeline)
+        e->internIds(pool);
+}
+
+SyncData::SyncData(const QString& cacheFileName, QThreadPool* threadPool,
+                   StringPool* stringPool, const StateStore* stateStore,
+                   StartupTrace* trace)
+    : threadPool_(threadPool)
+    , stringPool_(stringPool)
+    , stateStore_(stateStore)
+    , trace_(trace)
 {
     QFileInfo cacheFileInfo { cacheFileName };
+    const auto startedAt = StartupTrace::clock::now();
+    const auto json = loadCacheJson(cacheFileName);
+    if (trace_)
+        trace_->record(StartupTrace::CacheIndexRead, startedAt);
+    if (!json.isEmpty())
+        parseJson(json, cacheFileInfo.absolutePath() + '/');
+    trace_ = nullptr; // Not needed beyond loading
+}
+
+SyncData SyncData::loadCacheIndex(const QString& cacheFileName,
+                                  StringPool* stringPool, StartupTrace* trace)
+{
+    const auto startedAt = StartupTrace::clock::now();
+    SyncData result;
+    result.setStringPool(stringPool);
+    // Without baseDir, parseJson() takes room objects from the top-level
+    // file, and these are index entries
+    if (const auto json = loadCacheJson(cacheFileName); !json.isEmpty())
+        result.parseJson(json);
+    if (trace)
+        trace->record(StartupTrace::CacheIndexRead, startedAt,
+                      qint64(result.roomData.size()));
+    return result;
+}
+
+Omittable<SyncRoomData> SyncData::loadCachedRoom(const QString& baseDir,
+                                                 const QString& roomId,
+                                                 JoinState joinState,
+                                                 const StateStore* stateStore,
+                                                 quint64 minVersion)
+{
+    const auto roomJson =
+        loadRoomJson(baseDir, roomId, stateStore, minVersion);
+    if (roomJson.isEmpty())
+        return none;
+    return SyncRoomData(roomId, joinState, roomJson);
+}
+
+QJsonObject SyncData::loadRoomJson(const QString& baseDir,
+                                   const QString& roomId,
+                                   const StateStore* stateStore,
+                                   quint64 minVersion)
+{
+    if (stateStore && stateStore->contains(roomId)) {
+        if (const auto version = stateStore->version(roomId);
+            version < minVersion) {
+            qCWarning(MAIN).nospace()
+                << "Cached state of " << roomId << " is outdated (version "
+                << version << ", expected " << minVersion << ")";
+            return {};
+        }
+        return stateStore->loadJson(roomId);
+    }
+    // Not migrated to the store yet
+    return loadJson(baseDir + fileNameForRoom(roomId));
+}
+
+QJsonObject SyncData::loadCacheJson(const QString& cacheFileName)
+{
     auto json = loadJson(cacheFileName);
     auto requiredVersion = MajorCacheVersion;
     auto actualVersion =
         json.value("cache_version"_ls).toObject().value("major"_ls).toInt();
     if (actualVersion == requiredVersion)
-        parseJson(json, cacheFileInfo.absolutePath() + '/');
-    else
-        qCWarning(MAIN) << "Major version of the cache file is" << actualVersion
-                        << "but" << requiredVersion
-                        << "is required; discarding the cache";
+        return json;
+
+    qCWarning(MAIN) << "Major version of the cache file is" << actualVersion
+                    << "but" << requiredVersion
+                    << "is required; discarding the cache";
+    return {};
+}
+
+void SyncData::addRoomData(SyncRoomData&& data)
+{
+    roomData.push_back(std::move(data));
+}
+
+void SyncData::estimateRoomJsonSizes(qsizetype totalSize)
+{
+    if (roomData.empty())
+        return;
+    const auto sizePerRoom = totalSize / qsizetype(roomData.size());
+    for (auto& r : roomData)
+        if (r.jsonSize == 0)
+            r.jsonSize = sizePerRoom;
 }
 
 SyncDataList SyncData::takeRoomData() { return std::move(roomData); }
@@ -159,7 +260,7 @@ Events SyncData::takeToDeviceEvents() { return std::move(toDeviceEvents); }
 
 std::pair<int, int> SyncData::cacheVersion()
 {
-    return { MajorCacheVersion, 2 };
+    return { MajorCacheVersion, 4 };
 }
 
 DevicesList SyncData::takeDevicesList() { return std::move(devicesList); }
@@ -176,11 +277,31 @@ QJsonObject SyncData::loadJson(const QString& fileName)
                         << roomFile.fileName();
         return {};
     }
-    auto data = roomFile.readAll();
-
-    const auto json = data.startsWith('{')
-                          ? QJsonDocument::fromJson(data).object()
-                          : QCborValue::fromCbor(data).toJsonValue().toObject();
+    QJsonObject json;
+    if (CacheCodec::isPacked(roomFile.peek(CacheCodec::HeaderSize))) {
+        const auto data = CacheCodec::unpack(roomFile.readAll());
+        if (data.startsWith('{'))
+            json = QJsonDocument::fromJson(data).object();
+        else if (!data.isEmpty()) {
+            QCborStreamReader reader(data);
+            json = readCborAsJson(reader).toObject();
+            if (reader.lastError() != QCborError::NoError)
+                json = {};
+        }
+    } else if (roomFile.peek(1).startsWith('{'))
+        json = QJsonDocument::fromJson(roomFile.readAll()).object();
+    else {
+        // Read CBOR straight from the file into a JSON tree, without
+        // buffering the file and building a QCborValue tree in between
+        QCborStreamReader reader(&roomFile);
+        json = readCborAsJson(reader).toObject();
+        if (const auto error = reader.lastError();
+            error != QCborError::NoError) {
+            qCWarning(MAIN) << "Error reading" << fileName << ":"
+                            << error.toString();
+            json = {};
+        }
+    }
     if (json.isEmpty()) {
         qCWarning(MAIN) << "State cache in" << fileName
                         << "is broken or empty, discarding";
@@ -205,34 +326,84 @@ void SyncData::parseJson(const QJsonObject& json, const QString& baseDir)
         fromJson(json.value("device_lists"), devicesList);
     }
 
-    auto rooms = json.value("rooms"_ls).toObject();
-    auto totalRooms = 0;
-    auto totalEvents = 0;
+    struct RoomToParse {
+        QString roomId;
+        JoinState joinState;
+        QJsonObject roomJson;
+    };
+    std::vector<RoomToParse> roomsToParse;
+    const auto rooms = json.value("rooms"_ls).toObject();
     for (size_t i = 0; i < JoinStateStrings.size(); ++i) {
         // This assumes that MemberState values go over powers of 2: 1,2,4,...
         const auto joinState = JoinState(1U << i);
         const auto rs = rooms.value(JoinStateStrings[i]).toObject();
         // We have a Qt container on the right and an STL one on the left
-        roomData.reserve(roomData.size() + static_cast<size_t>(rs.size()));
-        for (auto roomIt = rs.begin(); roomIt != rs.end(); ++roomIt) {
-            QJsonObject roomJson;
-            if (!baseDir.isEmpty()) {
-                // Loading data from the local cache, with room objects saved in
-                // individual files rather than inline
-                roomJson = loadJson(baseDir + fileNameForRoom(roomIt.key()));
-                if (roomJson.isEmpty()) {
-                    unresolvedRoomIds.push_back(roomIt.key());
-                    continue;
-                }
-            } else // When loading from /sync response, everything is inline
-                roomJson = roomIt->toObject();
-
-            roomData.emplace_back(roomIt.key(), joinState, roomJson);
-            const auto& r = roomData.back();
-            totalEvents += r.state.size() + r.ephemeral.size()
-                           + r.accountData.size() + r.timeline.size();
+        roomsToParse.reserve(roomsToParse.size() + static_cast<size_t>(rs.size()));
+        for (auto roomIt = rs.begin(); roomIt != rs.end(); ++roomIt)
+            roomsToParse.push_back({ roomIt.key(), joinState, roomIt->toObject() });
+    }
+
+    std::vector<Omittable<SyncRoomData>> parsedRooms(roomsToParse.size());
+    const auto parseRoom = [this, &baseDir, &roomsToParse,
+                            &parsedRooms](size_t i) {
+        const auto& [roomId, joinState, inlineJson] = roomsToParse[i];
+        if (baseDir.isEmpty()) {
+            // When loading from /sync response, everything is inline
+            parsedRooms[i].emplace(roomId, joinState, inlineJson);
+        } else {
+            // Loading data from the local cache, with room objects saved in
+            // the state store or individual files rather than inline
+            const auto startedAt = StartupTrace::clock::now();
+            const auto roomJson = loadRoomJson(
+                baseDir, roomId, stateStore_,
+                quint64(inlineJson.value(StateStore::VersionKey).toDouble()));
+            if (!roomJson.isEmpty())
+                parsedRooms[i].emplace(roomId, joinState, roomJson);
+            if (trace_) // StartupTrace is thread-safe too
+                trace_->record(StartupTrace::RoomCacheParse, startedAt);
+            if (!parsedRooms[i])
+                return;
+        }
+        if (stringPool_) // StringPool is thread-safe
+            parsedRooms[i]->internIds(*stringPool_);
+    };
+    if (threadPool_ && roomsToParse.size() > 1) {
+        // Each thread, including this one, picks the next unparsed room
+        // until there are none left; results land at the same index,
+        // preserving the order.
+        std::atomic<size_t> nextRoom { 0 };
+        const auto worker = [&nextRoom, &roomsToParse, &parseRoom] {
+            for (auto i = nextRoom++; i < roomsToParse.size(); i = nextRoom++)
+                parseRoom(i);
+        };
+        QSemaphore helpersDone;
+        int helpers = 0;
+        // Only take threads that are free right now: this thread will
+        // do the rest of the work anyway
+        while (size_t(helpers) < roomsToParse.size() - 1
+               && threadPool_->tryStart([&worker, &helpersDone] {
+                      worker();
+                      helpersDone.release();
+                  }))
+            ++helpers;
+        worker();
+        helpersDone.acquire(helpers);
+    } else
+        for (size_t i = 0; i < roomsToParse.size(); ++i)
+            parseRoom(i);
+
+    const auto totalRooms = roomsToParse.size();
+    auto totalEvents = 0;
+    roomData.reserve(roomData.size() + totalRooms);
+    for (size_t i = 0; i < totalRooms; ++i) {
+        if (!parsedRooms[i]) {
+            unresolvedRoomIds.push_back(roomsToParse[i].roomId);
+            continue;
         }
-        totalRooms += rs.size();
+        roomData.push_back(std::move(*parsedRooms[i]));
+        const auto& r = roomData.back();
+        totalEvents += r.state.size() + r.ephemeral.size()
+                       + r.accountData.size() + r.timeline.size();
     }
     if (!unresolvedRoomIds.empty())
         qCWarning(MAIN) << "Unresolved rooms:" << unresolvedRoomIds.join(',');
@@ -7,7 +7,12 @@
 
 #include "events/stateevent.h"
 
+class QThreadPool;
+
 namespace Quotient {
+class StringPool;
+class StateStore;
+class StartupTrace;
 
 constexpr auto UnreadNotificationsKey = "unread_notifications"_ls;
 constexpr auto PartiallyReadCountKey = "x-quotient.since_fully_read_count"_ls;
@@ -77,26 +82,79 @@ public:
     Omittable<int> partiallyReadCount;
     Omittable<int> unreadCount;
     Omittable<int> highlightCount;
+    //! \brief The size of the JSON the data has been parsed from, in bytes
+    //!
+    //! This is exact when the JSON for the room has been parsed on its own,
+    //! e.g. by SyncJob in the incremental mode, an estimate when the room
+    //! was a part of a bigger payload, or 0 if unknown.
+    qsizetype jsonSize = 0;
+    //! \brief The version of the room state in the store, as recorded
+    //!        in the cache index entry the data has been loaded from
+    //!
+    //! 0 for data that don't come from the cache index.
+    //! \sa StateStore::version
+    quint64 cachedStateVersion = 0;
 
     SyncRoomData(QString roomId, JoinState joinState,
                  const QJsonObject& roomJson);
     SyncRoomData(SyncRoomData&&) = default;
     SyncRoomData& operator=(SyncRoomData&&) = default;
+
+    //! Replace the room id and the ids in state and timeline events with
+    //! copies from \p pool
+    void internIds(StringPool& pool);
 };
 
 // QVector cannot work with non-copyable objects, std::vector can.
 using SyncDataList = std::vector<SyncRoomData>;
 
-class SyncData {
+class QUOTIENT_API SyncData {
 public:
     SyncData() = default;
-    explicit SyncData(const QString& cacheFileName);
+    //! \brief Load the state cache
+    //!
+    //! Room states are taken from \p stateStore if it's passed and has
+    //! them, otherwise from room cache files next to \p cacheFileName
+    //! (the layout used before StateStore). If \p trace is passed, reading
+    //! the cache file and parsing each room is recorded in it.
+    explicit SyncData(const QString& cacheFileName,
+                      QThreadPool* threadPool = nullptr,
+                      StringPool* stringPool = nullptr,
+                      const StateStore* stateStore = nullptr,
+                      StartupTrace* trace = nullptr);
     /** Parse sync response into room events
      * \param json response from /sync or a room state cache
      * \return the list of rooms with missing cache files; always
      *         empty when parsing response from /sync
      */
     void parseJson(const QJsonObject& json, const QString& baseDir = {});
+    //! \brief Add data for a room parsed separately from the rest of the batch
+    //!
+    //! Unlike parseJson(), this doesn't intern ids in \p data; call
+    //! SyncRoomData::internIds() before adding if needed.
+    void addRoomData(SyncRoomData&& data);
+    //! Spread \p totalSize evenly over rooms with unknown jsonSize
+    void estimateRoomJsonSizes(qsizetype totalSize);
+
+    //! \brief Parse rooms in parallel using the given thread pool
+    //!
+    //! Rooms are independent from each other, so parseJson() can build
+    //! SyncRoomData objects (and, when loading from the cache, read room
+    //! files) concurrently; the calling thread takes part in the work too.
+    //! The resulting room data list has the same order as with sequential
+    //! parsing. Passing nullptr (the default) makes parsing sequential.
+    void setThreadPool(QThreadPool* pool) { threadPool_ = pool; }
+    QThreadPool* threadPool() const { return threadPool_; }
+
+    //! \brief Intern room, user and event ids with the given pool
+    //!
+    //! When set, parseJson() shares the id strings of every parsed room
+    //! and its state and timeline events with copies stored in \p pool,
+    //! so that repeated ids (most notably senders and member state keys)
+    //! occupy memory only once. Passing nullptr (the default) disables that.
+    //! \sa Connection::stringPool
+    void setStringPool(StringPool* pool) { stringPool_ = pool; }
+    StringPool* stringPool() const { return stringPool_; }
 
     Events takePresenceData();
     Events takeAccountData();
@@ -110,12 +168,36 @@ public:
 
     QString nextBatch() const { return nextBatch_; }
 
+    //! \brief Rooms which cached state is missing, broken or outdated
+    //!
+    //! Always empty when parsing a response from /sync.
     QStringList unresolvedRooms() const { return unresolvedRoomIds; }
 
     static constexpr int MajorCacheVersion = 11;
     static std::pair<int, int> cacheVersion();
     static QString fileNameForRoom(QString roomId);
 
+    //! \brief Load the state cache without reading room cache files
+    //!
+    //! Since minor cache version 3, the top-level cache file stores, for each
+    //! room, an index entry with data enough to show the room in the room
+    //! list (see Room::toIndexJson()); this function builds room data from
+    //! those entries only. Rooms from older caches get empty data.
+    //! \sa loadCachedRoom
+    static SyncData loadCacheIndex(const QString& cacheFileName,
+                                   StringPool* stringPool = nullptr,
+                                   StartupTrace* trace = nullptr);
+    //! \brief Load the full cached data of a single room
+    //!
+    //! The data is taken from \p stateStore if it's passed and has
+    //! the room, otherwise from the room cache file in \p baseDir. A room
+    //! record in the store older than \p minVersion (normally taken from
+    //! the cache index, see SyncRoomData::cachedStateVersion) is treated
+    //! as broken, as if it were missing.
+    static Omittable<SyncRoomData> loadCachedRoom(
+        const QString& baseDir, const QString& roomId, JoinState joinState,
+        const StateStore* stateStore = nullptr, quint64 minVersion = 0);
+
 private:
     QString nextBatch_;
     Events presenceData;
@@ -125,7 +207,16 @@ private:
     QStringList unresolvedRoomIds;
     QHash<QString, int> deviceOneTimeKeysCount_;
     DevicesList devicesList;
+    QThreadPool* threadPool_ = nullptr;
+    StringPool* stringPool_ = nullptr;
+    const StateStore* stateStore_ = nullptr;
+    StartupTrace* trace_ = nullptr;
 
     static QJsonObject loadJson(const QString& fileName);
+    static QJsonObject loadRoomJson(const QString& baseDir,
+                                    const QString& roomId,
+                                    const StateStore* stateStore,
+                                    quint64 minVersion = 0);
+    static QJsonObject loadCacheJson(const QString& cacheFileName);
 };
 } // namespace Quotient
@@ -0,0 +1,663 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "timelinestore.h"
+
+#include "logging.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QMutex>
+#include <QtCore/QSaveFile>
+#include <QtCore/QtEndian>
+
+#include <deque>
+#include <map>
+
+using namespace Quotient;
+
+// A log file starts with a header (the magic number and the format version,
+// 32 bits each), followed by records. A record has a header (see
+// RecordHeader) and a payload of `size` bytes: for events, the event id
+// in UTF-8 (`idSize` bytes) followed by the event JSON; for tokens,
+// the token in UTF-8. Events are ordered by `seq`: a new event gets the seq
+// next to the newest stored one, a historical event - the one before
+// the oldest. An event record with the seq of an already stored event
+// replaces it. A token record for the oldest event holds the token to
+// continue from it; token records for other events mark the starts of
+// batches of new events. All numbers are little-endian.
+constexpr quint32 FileMagic = 0x314c5451; // "QTL1"
+constexpr quint32 FormatVersion = 1;
+constexpr qint64 FileHeaderSize = 8;
+constexpr quint32 EventMagic = 0x544e5645; // "EVNT"
+//! A token to continue from the event with the record's seq; an empty
+//! token means the token is unknown
+constexpr quint32 TokenMagic = 0x4e4b4f54; // "TOKN"
+//! The event with the record's seq is the beginning of the room
+constexpr quint32 BeginningMagic = 0x4e474542; // "BEGN"
+constexpr qint64 RecordHeaderSize = 24;
+//! Logs with less space taken by replaced records are not compacted
+constexpr qint64 MinWasteToCompact = 64 * 1024;
+
+namespace {
+struct RecordHeader {
+    quint32 magic = 0;
+    qint64 seq = 0;
+    quint32 size = 0;
+    quint32 idSize = 0;
+    //! CRC-32 of the payload
+    quint32 checksum = 0;
+};
+
+RecordHeader parseHeader(const char* p)
+{
+    return { qFromLittleEndian<quint32>(p), qFromLittleEndian<qint64>(p + 4),
+             qFromLittleEndian<quint32>(p + 12),
+             qFromLittleEndian<quint32>(p + 16),
+             qFromLittleEndian<quint32>(p + 20) };
+}
+
+void writeRecord(QByteArray& buffer, quint32 magic, qint64 seq,
+                 const QByteArray& id, const QByteArray& data)
+{
+    const auto headerPos = buffer.size();
+    buffer.resize(headerPos + RecordHeaderSize);
+    auto* p = buffer.data() + headerPos;
+    qToLittleEndian(magic, p);
+    qToLittleEndian(seq, p + 4);
+    qToLittleEndian(quint32(id.size() + data.size()), p + 12);
+    qToLittleEndian(quint32(id.size()), p + 16);
+    qToLittleEndian(crc32(data.constData(), data.size(),
+                          crc32(id.constData(), id.size())),
+                    p + 20);
+    buffer.append(id).append(data);
+}
+
+struct Entry {
+    QString eventId;
+    //! The position of the event JSON in the file
+    qint64 offset = 0;
+    quint32 size = 0;
+};
+
+struct Log {
+    QString fileName;
+    qint64 fileSize = 0;
+    //! The seq of entries.front()
+    qint64 firstSeq = 0;
+    std::deque<Entry> entries;
+    QHash<QString, qint64> seqs;
+    Omittable<QString> olderToken = QString();
+    //! \brief Tokens to continue from events that started batches of new
+    //!        events, by seq
+    //!
+    //! These are the places to trim the log at, see
+    //! TimelineStore::Private::trim().
+    std::map<qint64, QString> batchTokens;
+    //! The size of records in the file replaced by later ones
+    qint64 deadBytes = 0;
+
+    qint64 endSeq() const { return firstSeq + qint64(entries.size()); }
+    const Entry& at(qint64 seq) const
+    {
+        return entries[size_t(seq - firstSeq)];
+    }
+
+    //! Update the in-memory index with a record; returns false if the record
+    //! doesn't fit in the log
+    bool apply(const RecordHeader& header, const QByteArray& payload,
+               qint64 payloadOffset)
+    {
+        switch (header.magic) {
+        case EventMagic: {
+            const auto seq = header.seq;
+            if (!entries.empty() && seq >= firstSeq && seq < endSeq()) {
+                // A replacement of an event stored before
+                auto& entry = entries[size_t(seq - firstSeq)];
+                deadBytes += RecordHeaderSize + header.idSize + entry.size;
+                entry.offset = payloadOffset + header.idSize;
+                entry.size = header.size - header.idSize;
+                return true;
+            }
+            Entry entry { QString::fromUtf8(payload.left(int(header.idSize))),
+                          payloadOffset + header.idSize,
+                          header.size - header.idSize };
+            if (entries.empty() || seq == firstSeq - 1) {
+                firstSeq = seq;
+                // Until a token record for the new oldest event comes
+                olderToken = QString();
+                seqs.insert(entry.eventId, seq);
+                entries.push_front(std::move(entry));
+            } else if (seq == endSeq()) {
+                seqs.insert(entry.eventId, seq);
+                entries.push_back(std::move(entry));
+            } else
+                return false;
+            return true;
+        }
+        case TokenMagic: {
+            const auto token = QString::fromUtf8(payload);
+            if (header.seq == firstSeq)
+                olderToken = token;
+            if (!token.isEmpty() && header.seq >= firstSeq
+                && header.seq < endSeq())
+                batchTokens[header.seq] = token;
+            return true;
+        }
+        case BeginningMagic:
+            if (header.seq == firstSeq)
+                olderToken = none;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void clear()
+    {
+        firstSeq = 0;
+        entries.clear();
+        seqs.clear();
+        olderToken = QString();
+        batchTokens.clear();
+        deadBytes = 0;
+    }
+
+    bool needsCompaction() const
+    {
+        return deadBytes > std::max(fileSize / 2, MinWasteToCompact);
+    }
+};
+
+QByteArray tokenRecord(qint64 seq, const Omittable<QString>& token)
+{
+    QByteArray result;
+    if (token)
+        writeRecord(result, TokenMagic, seq, {}, token->toUtf8());
+    else
+        writeRecord(result, BeginningMagic, seq, {}, {});
+    return result;
+}
+
+QByteArray makeFileHeader()
+{
+    QByteArray result(FileHeaderSize, Qt::Uninitialized);
+    qToLittleEndian(FileMagic, result.data());
+    qToLittleEndian(FormatVersion, result.data() + 4);
+    return result;
+}
+} // namespace
+
+class TimelineStore::Private {
+public:
+    QString path;
+    bool isOpen = false;
+    int maxEventsPerRoom = DefaultMaxEventsPerRoom;
+    mutable QMutex lock;
+    mutable UnorderedMap<QString, Log> logs;
+
+    //! Find the log of \p roomId, reading it from the file if needed
+    Log& logFor(const QString& roomId) const;
+    static void readLog(Log& log);
+    //! \brief Append \p records to the log file
+    //!
+    //! \p records must contain whole records; offsets of event payloads
+    //! in the file are the offsets in \p records plus the returned value.
+    //! \return the position of \p records in the file, or -1 on error
+    static qint64 write(Log& log, const QByteArray& records);
+    //! Append \p events with seq from \p firstSeq, increasing or decreasing
+    //! depending on \p step, followed by \p token for the resulting log
+    static bool writeEvents(Log& log, const QVector<QJsonObject>& events,
+                            qint64 firstSeq, int step,
+                            const Omittable<QString>& token);
+    static QJsonObject readEvent(QFile& file, const Entry& entry);
+    static bool reset(Log& log);
+    //! \brief Drop the oldest events to keep no more than \p maxEvents
+    //!
+    //! The log is cut at the start of a batch, to have the token to continue
+    //! from the new oldest event: at the oldest start among those within
+    //! \p maxEvents from the newest event or, if there are none, at the newest
+    //! start. A log with no batch starts but the oldest event is not cut.
+    static bool trim(Log& log, qsizetype maxEvents);
+    //! Rewrite the log file with only the records in effect
+    static bool compact(Log& log);
+};
+
+Log& TimelineStore::Private::logFor(const QString& roomId) const
+{
+    if (const auto it = logs.find(roomId); it != logs.end())
+        return it->second;
+
+    auto fileName = roomId;
+    fileName.replace(':', '_');
+    auto& log = logs[roomId];
+    log.fileName = QDir(path).filePath(fileName + ".qtl"_ls);
+    readLog(log);
+    return log;
+}
+
+void TimelineStore::Private::readLog(Log& log)
+{
+    QFile file { log.fileName };
+    if (!file.exists())
+        return;
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(MAIN) << "Couldn't open" << log.fileName << ":"
+                        << file.errorString();
+        return;
+    }
+    const auto fileHeader = file.read(FileHeaderSize);
+    if (fileHeader.size() != FileHeaderSize
+        || qFromLittleEndian<quint32>(fileHeader.constData()) != FileMagic
+        || qFromLittleEndian<quint32>(fileHeader.constData() + 4)
+               != FormatVersion) {
+        qCWarning(MAIN) << log.fileName
+                        << "is not a valid timeline log, discarding it";
+        file.close();
+        QFile::remove(log.fileName);
+        return;
+    }
+    qint64 pos = FileHeaderSize;
+    while (!file.atEnd()) {
+        const auto headerData = file.read(RecordHeaderSize);
+        if (headerData.size() != RecordHeaderSize)
+            break;
+        const auto header = parseHeader(headerData.constData());
+        if (header.idSize > header.size)
+            break;
+        const auto payload = file.read(header.size);
+        if (payload.size() != qsizetype(header.size)
+            || crc32(payload.constData(), payload.size()) != header.checksum
+            || !log.apply(header, payload, pos + RecordHeaderSize))
+            break;
+        pos += RecordHeaderSize + header.size;
+    }
+    log.fileSize = pos;
+    if (pos < file.size()) {
+        qCWarning(MAIN) << "Timeline log" << log.fileName
+                        << "is broken at offset" << pos << "- truncating it";
+        file.close();
+        if (!QFile::resize(log.fileName, pos))
+            qCWarning(MAIN) << "Couldn't truncate" << log.fileName;
+    }
+}
+
+qint64 TimelineStore::Private::write(Log& log, const QByteArray& records)
+{
+    QFile file { log.fileName };
+    if (!file.open(QIODevice::ReadWrite)) {
+        qCWarning(MAIN) << "Couldn't open" << log.fileName << ":"
+                        << file.errorString();
+        return -1;
+    }
+    if (log.fileSize == 0) {
+        file.resize(0);
+        if (file.write(makeFileHeader()) != FileHeaderSize)
+            return -1;
+        log.fileSize = FileHeaderSize;
+    }
+    if (!file.seek(log.fileSize) || file.write(records) != records.size()) {
+        qCWarning(MAIN) << "Error writing" << log.fileName << ":"
+                        << file.errorString();
+        // Cut off whatever has been written, if anything
+        file.resize(log.fileSize);
+        return -1;
+    }
+    const auto result = log.fileSize;
+    log.fileSize += records.size();
+    return result;
+}
+
+bool TimelineStore::Private::writeEvents(Log& log,
+                                         const QVector<QJsonObject>& events,
+                                         qint64 firstSeq, int step,
+                                         const Omittable<QString>& token)
+{
+    // A new oldest event needs a token to continue from it; the start of
+    // a batch of new events gets one too if it's known, to trim the log at
+    const auto withToken =
+        step < 0 || log.entries.empty() || (token && !token->isEmpty());
+    QByteArray records;
+    std::vector<qsizetype> eventRecords;
+    eventRecords.reserve(size_t(events.size()));
+    auto seq = firstSeq;
+    for (const auto& e : events) {
+        const auto eventId = e.value("event_id"_ls).toString();
+        if (eventId.isEmpty() || log.seqs.contains(eventId))
+            continue;
+        eventRecords.push_back(records.size());
+        writeRecord(records, EventMagic, seq, eventId.toUtf8(),
+                    QJsonDocument(e).toJson(QJsonDocument::Compact));
+        seq += step;
+    }
+    if (eventRecords.empty())
+        return true;
+    const auto tokenSeq = step < 0 ? seq - step : firstSeq;
+    if (withToken)
+        records.append(tokenRecord(tokenSeq, token));
+
+    const auto base = write(log, records);
+    if (base < 0)
+        return false;
+    for (const auto recordPos : eventRecords) {
+        const auto* p = records.constData() + recordPos;
+        const auto header = parseHeader(p);
+        log.apply(header,
+                  QByteArray(p + RecordHeaderSize, int(header.idSize)),
+                  base + recordPos + RecordHeaderSize);
+    }
+    if (withToken) {
+        if (tokenSeq == log.firstSeq)
+            log.olderToken = token;
+        if (token && !token->isEmpty())
+            log.batchTokens[tokenSeq] = *token;
+    }
+    return true;
+}
+
+QJsonObject TimelineStore::Private::readEvent(QFile& file, const Entry& entry)
+{
+    if (!file.seek(entry.offset))
+        return {};
+    return QJsonDocument::fromJson(file.read(entry.size)).object();
+}
+
+bool TimelineStore::Private::reset(Log& log)
+{
+    log.clear();
+    log.fileSize = 0;
+    return !QFile::exists(log.fileName) || QFile::remove(log.fileName);
+}
+
+bool TimelineStore::Private::trim(Log& log, qsizetype maxEvents)
+{
+    auto it = log.batchTokens.lower_bound(log.endSeq() - maxEvents);
+    if (it == log.batchTokens.end()) {
+        if (it == log.batchTokens.begin())
+            return false;
+        --it;
+    }
+    const auto cutSeq = it->first;
+    if (cutSeq <= log.firstSeq)
+        return false;
+
+    qCDebug(MAIN) << "Dropping" << cutSeq - log.firstSeq
+                  << "oldest event(s) from" << log.fileName;
+    for (; log.firstSeq < cutSeq; ++log.firstSeq) {
+        log.seqs.remove(log.entries.front().eventId);
+        log.entries.pop_front();
+    }
+    log.olderToken = it->second;
+    log.batchTokens.erase(log.batchTokens.begin(), it);
+    // Otherwise the dropped events come back when the log is read again
+    return compact(log);
+}
+
+bool TimelineStore::Private::compact(Log& log)
+{
+    QFile file { log.fileName };
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(MAIN) << "Couldn't open" << log.fileName << ":"
+                        << file.errorString();
+        return false;
+    }
+    auto data = makeFileHeader();
+    std::vector<qint64> offsets;
+    offsets.reserve(log.entries.size());
+    auto seq = log.firstSeq;
+    for (const auto& entry : log.entries) {
+        const auto json =
+            file.seek(entry.offset) ? file.read(entry.size) : QByteArray();
+        if (json.size() != qsizetype(entry.size)) {
+            qCWarning(MAIN) << "Couldn't compact" << log.fileName << ":"
+                            << file.errorString();
+            return false;
+        }
+        const auto id = entry.eventId.toUtf8();
+        offsets.push_back(data.size() + RecordHeaderSize + id.size());
+        writeRecord(data, EventMagic, seq++, id, json);
+    }
+    file.close();
+    for (const auto& [tokenSeq, token] : log.batchTokens)
+        if (tokenSeq != log.firstSeq)
+            writeRecord(data, TokenMagic, tokenSeq, {}, token.toUtf8());
+    data.append(tokenRecord(log.firstSeq, log.olderToken));
+
+    QSaveFile newFile { log.fileName };
+    if (!newFile.open(QIODevice::WriteOnly)
+        || newFile.write(data) != data.size() || !newFile.commit()) {
+        qCWarning(MAIN) << "Couldn't compact" << log.fileName << ":"
+                        << newFile.errorString();
+        return false;
+    }
+    qCDebug(MAIN) << "Compacted" << log.fileName << "from" << log.fileSize
+                  << "to" << data.size() << "byte(s)";
+    for (size_t i = 0; i < offsets.size(); ++i)
+        log.entries[i].offset = offsets[i];
+    log.fileSize = data.size();
+    log.deadBytes = 0;
+    return true;
+}
+
+TimelineStore::TimelineStore() : d(makeImpl<Private>()) {}
+
+TimelineStore::~TimelineStore() = default;
+
+bool TimelineStore::open(const QString& path)
+{
+    QMutexLocker locker(&d->lock);
+    d->logs.clear();
+    d->path = path;
+    d->isOpen = QDir().mkpath(path);
+    if (!d->isOpen)
+        qCWarning(MAIN) << "Couldn't create the timeline store directory"
+                        << path;
+    return d->isOpen;
+}
+
+void TimelineStore::close()
+{
+    QMutexLocker locker(&d->lock);
+    d->logs.clear();
+    d->isOpen = false;
+}
+
+bool TimelineStore::isOpen() const
+{
+    QMutexLocker locker(&d->lock);
+    return d->isOpen;
+}
+
+QString TimelineStore::path() const
+{
+    QMutexLocker locker(&d->lock);
+    return d->path;
+}
+
+int TimelineStore::maxEventsPerRoom() const
+{
+    QMutexLocker locker(&d->lock);
+    return d->maxEventsPerRoom;
+}
+
+void TimelineStore::setMaxEventsPerRoom(int maxEvents)
+{
+    QMutexLocker locker(&d->lock);
+    d->maxEventsPerRoom = std::max(maxEvents, 1);
+}
+
+qsizetype TimelineStore::size(const QString& roomId) const
+{
+    QMutexLocker locker(&d->lock);
+    return d->isOpen ? qsizetype(d->logFor(roomId).entries.size()) : 0;
+}
+
+bool TimelineStore::contains(const QString& roomId,
+                             const QString& eventId) const
+{
+    QMutexLocker locker(&d->lock);
+    return d->isOpen && d->logFor(roomId).seqs.contains(eventId);
+}
+
+QString TimelineStore::oldestEventId(const QString& roomId) const
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return {};
+    const auto& log = d->logFor(roomId);
+    return log.entries.empty() ? QString() : log.entries.front().eventId;
+}
+
+QString TimelineStore::newestEventId(const QString& roomId) const
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return {};
+    const auto& log = d->logFor(roomId);
+    return log.entries.empty() ? QString() : log.entries.back().eventId;
+}
+
+Omittable<QString> TimelineStore::olderToken(const QString& roomId) const
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return QString();
+    return d->logFor(roomId).olderToken;
+}
+
+TimelineStore::Page TimelineStore::loadBefore(const QString& roomId,
+                                              const QString& eventId,
+                                              int limit) const
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return {};
+    const auto& log = d->logFor(roomId);
+    if (log.entries.empty())
+        return {};
+    auto endSeq = log.endSeq();
+    if (!eventId.isEmpty()) {
+        const auto it = log.seqs.constFind(eventId);
+        if (it == log.seqs.cend())
+            return {};
+        endSeq = *it;
+    }
+    const auto fromSeq = std::max(log.firstSeq, endSeq - limit);
+    Page page { {}, fromSeq == log.firstSeq };
+    if (fromSeq == endSeq)
+        return page;
+
+    QFile file { log.fileName };
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCWarning(MAIN) << "Couldn't open" << log.fileName << ":"
+                        << file.errorString();
+        return {};
+    }
+    page.events.reserve(int(endSeq - fromSeq));
+    for (auto seq = endSeq - 1; seq >= fromSeq; --seq) {
+        auto json = Private::readEvent(file, log.at(seq));
+        if (json.isEmpty()) {
+            qCWarning(MAIN) << "Couldn't read event" << log.at(seq).eventId
+                            << "from" << log.fileName;
+            page.reachedOldest = false;
+            break;
+        }
+        page.events.push_back(std::move(json));
+    }
+    return page;
+}
+
+QJsonObject TimelineStore::loadEvent(const QString& roomId,
+                                     const QString& eventId) const
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return {};
+    const auto& log = d->logFor(roomId);
+    const auto it = log.seqs.constFind(eventId);
+    if (it == log.seqs.cend())
+        return {};
+    QFile file { log.fileName };
+    return file.open(QIODevice::ReadOnly)
+               ? Private::readEvent(file, log.at(*it))
+               : QJsonObject();
+}
+
+bool TimelineStore::appendNewer(const QString& roomId, const QString& anchorId,
+                                const QVector<QJsonObject>& events,
+                                const Omittable<QString>& olderToken)
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen || events.isEmpty())
+        return false;
+    auto& log = d->logFor(roomId);
+    if (!log.entries.empty() && log.entries.back().eventId != anchorId) {
+        qCDebug(MAIN) << "The stored timeline of" << roomId
+                      << "is not continuous with new events, starting over";
+        if (!Private::reset(log))
+            return false;
+    }
+    if (!Private::writeEvents(log, events, log.endSeq(), 1, olderToken))
+        return false;
+    if (qsizetype(log.entries.size()) > d->maxEventsPerRoom)
+        Private::trim(log, d->maxEventsPerRoom);
+    return true;
+}
+
+bool TimelineStore::appendOlder(const QString& roomId, const QString& anchorId,
+                                const QVector<QJsonObject>& events,
+                                const Omittable<QString>& olderToken)
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return false;
+    auto& log = d->logFor(roomId);
+    if (log.entries.empty() || log.entries.front().eventId != anchorId)
+        return false;
+    if (events.isEmpty()) {
+        const auto records = tokenRecord(log.firstSeq, olderToken);
+        if (Private::write(log, records) < 0)
+            return false;
+        log.olderToken = olderToken;
+        return true;
+    }
+    // Trimming the log right away would drop these events again
+    if (qsizetype(log.entries.size()) + events.size() > d->maxEventsPerRoom)
+        return false;
+    return Private::writeEvents(log, events, log.firstSeq - 1, -1, olderToken);
+}
+
+bool TimelineStore::replaceEvent(const QString& roomId,
+                                 const QJsonObject& event)
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return false;
+    auto& log = d->logFor(roomId);
+    const auto eventId = event.value("event_id"_ls).toString();
+    const auto it = log.seqs.constFind(eventId);
+    if (it == log.seqs.cend())
+        return false;
+    const auto seq = *it;
+    const auto id = eventId.toUtf8();
+    QByteArray records;
+    writeRecord(records, EventMagic, seq, id,
+                QJsonDocument(event).toJson(QJsonDocument::Compact));
+    const auto base = Private::write(log, records);
+    if (base < 0)
+        return false;
+    log.apply(parseHeader(records.constData()), id, base + RecordHeaderSize);
+    if (log.needsCompaction())
+        Private::compact(log);
+    return true;
+}
+
+bool TimelineStore::remove(const QString& roomId)
+{
+    QMutexLocker locker(&d->lock);
+    if (!d->isOpen)
+        return false;
+    return Private::reset(d->logFor(roomId));
+}
@@ -0,0 +1,122 @@
+// SPDX-FileCopyrightText: 2022 The Quotient project
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include "omittable.h"
+#include "util.h"
+
+#include <QtCore/QJsonObject>
+#include <QtCore/QVector>
+
+namespace Quotient {
+
+//! \brief A persistent store of room timelines
+//!
+//! Timeline events of each room are kept in a separate log file in the store
+//! directory, so that a room can show its recent messages after
+//! a restart without going to the server, and page back through the stored
+//! history before resorting to /messages. The events of a room stored here
+//! always form a contiguous piece of the room timeline: new events are only
+//! accepted when they follow the newest stored event, historical ones when
+//! they precede the oldest stored event. Appending new events that don't
+//! follow the stored ones (e.g. after a limited sync) starts the log over.
+//!
+//! Each record in a log is checksummed; a log with a broken record (e.g.
+//! after a crash in the middle of a write) is truncated before that record.
+//! The log of a room is read when the room is first accessed; after that,
+//! only the positions of the events in the file and their ids are kept
+//! in memory.
+//!
+//! Records are appended to the log as events are stored or replaced; once
+//! replaced records take more than half of the file, it is rewritten with
+//! only the records in effect. The oldest events are dropped when there are
+//! more than maxEventsPerRoom() of them.
+//!
+//! The store is thread-safe; Connection makes the changes to it on the
+//! thread writing the cache, see Connection::updateTimelineStore().
+//! \sa Connection::timelineStore
+class QUOTIENT_API TimelineStore {
+public:
+    //! The name of the store directory in the state cache directory
+    static constexpr auto DefaultDirName = "timeline"_ls;
+    static constexpr int DefaultMaxEventsPerRoom = 5000;
+
+    struct Page {
+        //! Event JSON objects, the newest first
+        QVector<QJsonObject> events;
+        //! Whether the page ends with the oldest stored event
+        bool reachedOldest = false;
+    };
+
+    TimelineStore();
+    ~TimelineStore();
+    Q_DISABLE_COPY_MOVE(TimelineStore)
+
+    //! Open or create the store in the directory \p path
+    bool open(const QString& path);
+    void close();
+    bool isOpen() const;
+    QString path() const;
+
+    //! \brief The number of events to keep for each room
+    //!
+    //! When new events make the stored timeline of a room longer than this,
+    //! the oldest events are dropped, down to the start of a stored batch
+    //! of new events where the token to continue from is known; so the room
+    //! may keep a bit more events than this. Historical events that would
+    //! make the stored timeline longer than this are not stored. The default
+    //! is DefaultMaxEventsPerRoom.
+    int maxEventsPerRoom() const;
+    void setMaxEventsPerRoom(int maxEvents);
+
+    //! The number of events stored for \p roomId
+    qsizetype size(const QString& roomId) const;
+    bool contains(const QString& roomId, const QString& eventId) const;
+    QString oldestEventId(const QString& roomId) const;
+    QString newestEventId(const QString& roomId) const;
+
+    //! \brief The pagination token to continue from the oldest stored event
+    //!
+    //! The semantics is the same as that of `Room::Private::prevBatch`:
+    //! `none` means that the oldest stored event is the beginning of the room,
+    //! an empty string means that the token is not known.
+    Omittable<QString> olderToken(const QString& roomId) const;
+
+    //! \brief Load up to \p limit events preceding \p eventId
+    //!
+    //! If \p eventId is empty, the newest events are loaded. If \p eventId is
+    //! not in the store, the returned page is empty and its `reachedOldest`
+    //! is false.
+    Page loadBefore(const QString& roomId, const QString& eventId,
+                    int limit) const;
+    //! Load a single event; returns an empty object if it's not in the store
+    QJsonObject loadEvent(const QString& roomId, const QString& eventId) const;
+
+    //! \brief Store new events, in chronological order
+    //!
+    //! If the newest stored event is not \p anchorId, the events stored
+    //! so far are dropped; the new events then start the log, with
+    //! \p olderToken to continue from them. Otherwise \p olderToken, if
+    //! known, is kept as a place to drop older events at.
+    bool appendNewer(const QString& roomId, const QString& anchorId,
+                     const QVector<QJsonObject>& events,
+                     const Omittable<QString>& olderToken);
+    //! \brief Store historical events, the newest first
+    //!
+    //! The events are only stored if \p anchorId is the oldest stored event
+    //! and they fit in maxEventsPerRoom(); \p olderToken becomes the token to
+    //! continue from the oldest event.
+    bool appendOlder(const QString& roomId, const QString& anchorId,
+                     const QVector<QJsonObject>& events,
+                     const Omittable<QString>& olderToken);
+    //! Replace a stored event (e.g. with its redacted version)
+    bool replaceEvent(const QString& roomId, const QJsonObject& event);
+    //! Drop all events stored for \p roomId
+    bool remove(const QString& roomId);
+
+private:
+    class Private;
+    ImplPtr<Private> d;
+};
+} // namespace Quotient
@@ -12,6 +12,8 @@
 #include <QtCore/QStringBuilder>
 #include <QtCore/QtEndian>
 
+#include <array>
+
 static const auto RegExpOptions =
     QRegularExpression::CaseInsensitiveOption
     | QRegularExpression::UseUnicodePropertiesOption;
@@ -116,6 +118,24 @@ QString Quotient::serverPart(const QString& mxId)
     return parser.match(mxId).captured(1);
 }
 
+quint32 Quotient::crc32(const char* data, qint64 size, quint32 crc)
+{
+    static const auto table = [] {
+        std::array<quint32, 256> t {};
+        for (quint32 i = 0; i < 256; ++i) {
+            auto c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) != 0 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (qint64 i = 0; i < size; ++i)
+        crc = table[(crc ^ uchar(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
 QString Quotient::versionString()
 {
     return QStringLiteral(Quotient_VERSION_STRING);
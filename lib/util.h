@@ -278,6 +278,13 @@ QUOTIENT_API qreal stringToHueF(const QString& s);
 /** Extract the serverpart from MXID */
 QUOTIENT_API QString serverPart(const QString& mxId);
 
+/** CRC-32 (as in zlib) of \p size bytes at \p data
+ *
+ * Pass the result of a previous call in \p crc to continue the checksum
+ * over several pieces of data.
+ */
+QUOTIENT_API quint32 crc32(const char* data, qint64 size, quint32 crc = 0);
+
 QUOTIENT_API QString versionString();
 QUOTIENT_API int majorVersion();
 QUOTIENT_API int minorVersion();